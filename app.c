@@ -277,6 +277,93 @@ int ast_app_messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 	return 0;
 }
 
+/* A watcher of mailbox message counts */
+struct mwi_cb {
+	void *data;
+	ast_mwi_cb_type callback;
+	AST_LIST_ENTRY(mwi_cb) list;
+};
+
+static AST_LIST_HEAD_STATIC(mwi_cbs, mwi_cb);
+
+int ast_mwi_add(ast_mwi_cb_type callback, void *data)
+{
+	struct mwi_cb *cb;
+
+	if (!callback)
+		return -1;
+
+	cb = calloc(1, sizeof(*cb));
+	if (!cb)
+		return -1;
+
+	cb->data = data;
+	cb->callback = callback;
+
+	AST_LIST_LOCK(&mwi_cbs);
+	AST_LIST_INSERT_HEAD(&mwi_cbs, cb, list);
+	AST_LIST_UNLOCK(&mwi_cbs);
+
+	return 0;
+}
+
+void ast_mwi_del(ast_mwi_cb_type callback, void *data)
+{
+	struct mwi_cb *cb;
+
+	AST_LIST_LOCK(&mwi_cbs);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&mwi_cbs, cb, list) {
+		if ((cb->callback == callback) && (cb->data == data)) {
+			AST_LIST_REMOVE_CURRENT(&mwi_cbs, list);
+			free(cb);
+			break;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	AST_LIST_UNLOCK(&mwi_cbs);
+}
+
+void ast_mwi_changed(const char *mailbox, int newmsgs, int oldmsgs)
+{
+	struct mwi_cb *cb;
+
+	if (option_debug > 2) {
+		if (mailbox)
+			ast_log(LOG_DEBUG, "Mailbox %s now has %d new and %d old messages\n", mailbox, newmsgs, oldmsgs);
+		else
+			ast_log(LOG_DEBUG, "Any mailbox may have changed\n");
+	}
+
+	AST_LIST_LOCK(&mwi_cbs);
+	AST_LIST_TRAVERSE(&mwi_cbs, cb, list)
+		cb->callback(mailbox, newmsgs, oldmsgs, cb->data);
+	AST_LIST_UNLOCK(&mwi_cbs);
+}
+
+int ast_mwi_mailbox_in(const char *mailboxes, const char *mailbox)
+{
+	char *list, *cur, *context;
+	const char *at;
+	int len;
+
+	if (ast_strlen_zero(mailboxes))
+		return 0;
+	at = strchr(mailbox, '@');
+	len = at ? at - mailbox : strlen(mailbox);
+	list = ast_strdupa(mailboxes);
+	while ((cur = strsep(&list, ", "))) {
+		if (ast_strlen_zero(cur))
+			continue;
+		if ((context = strchr(cur, '@')))
+			*context++ = '\0';
+		else
+			context = "default";
+		if ((strlen(cur) == len) && !strncmp(cur, mailbox, len) && !strcmp(context, at ? at + 1 : "default"))
+			return 1;
+	}
+	return 0;
+}
+
 int ast_dtmf_stream(struct ast_channel *chan,struct ast_channel *peer,char *digits,int between) 
 {
 	char *ptr;
@@ -502,6 +502,11 @@ static void *changethread(void *data)
 		return NULL;
         }
 
+	/* These threads may run in any order, so take the state the device is
+	   in now, which the device state engine has cached, rather than the one
+	   it was in when this thread was started */
+	sc->state = ast_device_state(sc->dev);
+
 	if (option_debug)
 		ast_log(LOG_DEBUG, "Device '%s/%s' changed to state '%d' (%s)\n", technology, loc, sc->state, devstate2str(sc->state));
 	ast_mutex_lock(&qlock);
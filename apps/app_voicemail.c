@@ -49,6 +49,10 @@
 #include <sys/mman.h>
 #include <time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "asterisk.h"
 #include "ast_template.h"
@@ -71,6 +75,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 75748 $")
 #include "asterisk/localtime.h"
 #include "asterisk/cli.h"
 #include "asterisk/utils.h"
+#include "asterisk/astobj.h"
 #ifdef USE_ODBC_STORAGE
 #include "asterisk/res_odbc.h"
 #endif
@@ -278,6 +283,7 @@ static char odbc_table[80];
 #define RENAME(a,b,c,d,e,f,g,h) (rename_file(a,b,c,d,e,f))
 #define COPY(a,b,c,d,e,f,g,h) (copy_file(a,b,c,d,e,f))
 #define DELETE(a,b,c) (delete_file(a,b))
+#define CHANGED(a,b) (mailbox_changed(a,b))
 #else
 #define RETRIEVE(a,b)
 #define DISPOSE(a,b)
@@ -286,6 +292,7 @@ static char odbc_table[80];
 #define RENAME(a,b,c,d,e,f,g,h) (rename_file(g,h));
 #define COPY(a,b,c,d,e,f,g,h) (copy_file(g,h));
 #define DELETE(a,b,c) (vm_delete(c))
+#define CHANGED(a,b) (vm_count_changed(a,b))
 #endif
 
 static char VM_SPOOL_DIR[AST_CONFIG_MAX_PATH];
@@ -393,6 +400,7 @@ static int vmmaxmessage;
 static int maxgreet;
 static int skipms;
 static int maxlogins;
+static int countcachetime;
 
 static struct ast_flags globalflags = {0};
 
@@ -2301,8 +2309,405 @@ yuck:
 		return 0;
 }
 
+/*! \brief We changed the messages of a mailbox, tell the channel drivers */
+static void mailbox_changed(const char *context, const char *mailbox)
+{
+	char box[256];
+	int newmsgs, oldmsgs;
+
+	snprintf(box, sizeof(box), "%s@%s", mailbox, context);
+	messagecount(box, &newmsgs, &oldmsgs);
+	ast_mwi_changed(box, newmsgs, oldmsgs);
+}
+
 #else
 
+/* Message counts of the mailboxes asked about, so that MWI polls of every
+   mailbox do not read the INBOX and Old directories each time.  A mailbox
+   is counted again when we change it ourselves, when inotify tells us that
+   somebody else did (Linux, local disks only), and when its counts are
+   older than countcachetime seconds (for writers we cannot see, e.g. other
+   hosts on NFS). */
+struct vm_count {
+	struct vm_count *next;		/* Next in the vm_counts bucket */
+	unsigned int hash;
+	unsigned int generation;	/* Bumped on each change */
+	int valid;
+	int newmsgs;
+	int oldmsgs;
+	int reportednew;		/* Counts we last reported, or -1 */
+	int reportedold;
+	int dirty;			/* Changed by somebody else, to be counted */
+	time_t counted;
+	int wd[2];			/* inotify watches of INBOX and Old, or -1 */
+	char mailbox[1];		/* mailbox@context */
+};
+
+#define VM_COUNT_BUCKETS 4096
+
+static struct vm_count *vm_counts[VM_COUNT_BUCKETS];
+AST_MUTEX_DEFINE_STATIC(vm_count_lock);
+
+#ifdef __linux__
+/* Maps inotify watches back to their mailbox */
+struct vm_watch {
+	struct vm_watch *next;
+	int wd;
+	struct vm_count *count;
+};
+
+#define VM_WATCH_BUCKETS 1024
+/* How long to gather changes, from the first one, before counting and notifying */
+#define VM_WATCH_BATCH 250
+
+static struct vm_watch *vm_watches[VM_WATCH_BUCKETS];
+static int vm_inotify = -1;
+static int vm_watch_stop;
+static pthread_t vm_watch_thread = AST_PTHREADT_NULL;
+#endif
+
+static int count_folder(const char *context, const char *mailbox, const char *folder)
+{
+	DIR *dir;
+	struct dirent *de;
+	char fn[PATH_MAX];
+	int count = 0;
+
+	snprintf(fn, sizeof(fn), "%s/%s/%s/%s", VM_SPOOL_DIR, context, mailbox, folder);
+	dir = opendir(fn);
+	if (dir) {
+		while ((de = readdir(dir))) {
+			if ((strlen(de->d_name) > 3) && !strncasecmp(de->d_name, "msg", 3) &&
+				!strcasecmp(de->d_name + strlen(de->d_name) - 3, "txt"))
+					count++;
+		}
+		closedir(dir);
+	}
+	return count;
+}
+
+/* Call with vm_count_lock held */
+static struct vm_count *vm_count_find(const char *box, unsigned int hash)
+{
+	struct vm_count *count;
+
+	for (count = vm_counts[hash % VM_COUNT_BUCKETS]; count; count = count->next) {
+		if ((count->hash == hash) && !strcmp(count->mailbox, box))
+			break;
+	}
+	return count;
+}
+
+#ifdef __linux__
+/* Call with vm_count_lock held */
+static void vm_watch_add(struct vm_count *count, const char *context, const char *mailbox)
+{
+	static const char *folders[2] = { "INBOX", "Old" };
+	struct vm_watch *watch;
+	char fn[PATH_MAX];
+	int x;
+
+	if (vm_inotify < 0)
+		return;
+	for (x = 0; x < 2; x++) {
+		if (count->wd[x] > -1)
+			continue;
+		snprintf(fn, sizeof(fn), "%s/%s/%s/%s", VM_SPOOL_DIR, context, mailbox, folders[x]);
+		/* Fails if the folder does not exist yet; we will know when
+		   we create it, and try again when we count it again */
+		count->wd[x] = inotify_add_watch(vm_inotify, fn, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		if (count->wd[x] < 0)
+			continue;
+		/* Already watched for another name of the mailbox */
+		for (watch = vm_watches[count->wd[x] % VM_WATCH_BUCKETS]; watch; watch = watch->next) {
+			if (watch->wd == count->wd[x])
+				break;
+		}
+		if (watch)
+			continue;
+		if (!(watch = calloc(1, sizeof(*watch)))) {
+			inotify_rm_watch(vm_inotify, count->wd[x]);
+			count->wd[x] = -1;
+			continue;
+		}
+		watch->wd = count->wd[x];
+		watch->count = count;
+		watch->next = vm_watches[watch->wd % VM_WATCH_BUCKETS];
+		vm_watches[watch->wd % VM_WATCH_BUCKETS] = watch;
+	}
+}
+#endif
+
+/*! \brief Count the messages of a mailbox again, and remember the counts */
+static struct vm_count *vm_count_update(const char *context, const char *mailbox, int *newmsgs, int *oldmsgs)
+{
+	struct vm_count *count;
+	char box[256];
+	unsigned int hash, generation;
+	int new, old;
+
+	snprintf(box, sizeof(box), "%s@%s", mailbox, context);
+	hash = ast_strhash(box);
+
+	ast_mutex_lock(&vm_count_lock);
+	count = vm_count_find(box, hash);
+	if (!count && (count = calloc(1, sizeof(*count) + strlen(box)))) {
+		strcpy(count->mailbox, box);
+		count->hash = hash;
+		count->wd[0] = count->wd[1] = -1;
+		count->reportednew = count->reportedold = -1;
+		count->next = vm_counts[hash % VM_COUNT_BUCKETS];
+		vm_counts[hash % VM_COUNT_BUCKETS] = count;
+	}
+	generation = count ? count->generation : 0;
+#ifdef __linux__
+	/* Watch before counting, so we do not miss a change in between */
+	if (count)
+		vm_watch_add(count, context, mailbox);
+#endif
+	ast_mutex_unlock(&vm_count_lock);
+
+	new = count_folder(context, mailbox, "INBOX");
+	old = count_folder(context, mailbox, "Old");
+
+	if (count) {
+		ast_mutex_lock(&vm_count_lock);
+		count->newmsgs = new;
+		count->oldmsgs = old;
+		count->counted = time(NULL);
+		/* If it changed while we counted, count again next time */
+		count->valid = (count->generation == generation);
+		ast_mutex_unlock(&vm_count_lock);
+	}
+
+	if (newmsgs)
+		*newmsgs = new;
+	if (oldmsgs)
+		*oldmsgs = old;
+	return count;
+}
+
+/*! \brief Message counts of a mailbox, from the cache if they are current */
+static void vm_count_get(const char *context, const char *mailbox, int *newmsgs, int *oldmsgs)
+{
+	struct vm_count *count;
+	char box[256];
+
+	snprintf(box, sizeof(box), "%s@%s", mailbox, context);
+	ast_mutex_lock(&vm_count_lock);
+	count = vm_count_find(box, ast_strhash(box));
+	if (count && count->valid && (time(NULL) - count->counted < countcachetime)) {
+		if (newmsgs)
+			*newmsgs = count->newmsgs;
+		if (oldmsgs)
+			*oldmsgs = count->oldmsgs;
+		ast_mutex_unlock(&vm_count_lock);
+		return;
+	}
+	ast_mutex_unlock(&vm_count_lock);
+
+	vm_count_update(context, mailbox, newmsgs, oldmsgs);
+}
+
+/*! \brief Count the messages of a mailbox again, and tell the channel
+ * drivers if the counts are not the ones we told them last.
+ * \return Nonzero if we told them */
+static int vm_count_report(const char *context, const char *mailbox, int *newmsgs, int *oldmsgs)
+{
+	struct vm_count *count;
+	char box[256];
+	int new, old, report;
+
+	if (!(count = vm_count_update(context, mailbox, &new, &old)))
+		return 0;
+	ast_mutex_lock(&vm_count_lock);
+	report = (count->reportednew != new) || (count->reportedold != old);
+	count->reportednew = new;
+	count->reportedold = old;
+	ast_mutex_unlock(&vm_count_lock);
+	if (report) {
+		snprintf(box, sizeof(box), "%s@%s", mailbox, context);
+		ast_mwi_changed(box, new, old);
+	}
+	if (newmsgs)
+		*newmsgs = new;
+	if (oldmsgs)
+		*oldmsgs = old;
+	return report;
+}
+
+/*! \brief We changed the messages of a mailbox */
+static void vm_count_changed(const char *context, const char *mailbox)
+{
+	struct vm_count *count;
+	char box[256];
+
+	snprintf(box, sizeof(box), "%s@%s", mailbox, context);
+	ast_mutex_lock(&vm_count_lock);
+	if ((count = vm_count_find(box, ast_strhash(box)))) {
+		count->generation++;
+		count->valid = 0;
+	}
+	ast_mutex_unlock(&vm_count_lock);
+
+	vm_count_report(context, mailbox, NULL, NULL);
+}
+
+#ifdef __linux__
+/*! \brief Count the mailboxes somebody else changed, and tell the channel
+ * drivers and the managers about those whose counts are different now.  Changes are gathered for
+ * VM_WATCH_BATCH ms from the first one, so a message (several files) is counted once, and a busy
+ * spool is still counted that often. */
+static void *vm_watch_changes(void *data)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	struct vm_watch *watch, **prev;
+	struct vm_count *count, **dirty = NULL;
+	int ndirty = 0, maxdirty = 0;
+	struct pollfd pfd = { vm_inotify, POLLIN, 0 };
+	char box[256], *context, *mailbox;
+	int len, x, newmsgs, oldmsgs, timeout;
+	struct timeval deadline = { 0, 0 };
+	char *ptr;
+
+	while (!vm_watch_stop) {
+		timeout = 1000;
+		if (ndirty && ((timeout = ast_tvdiff_ms(deadline, ast_tvnow())) <= 0)) {
+			/* The batch is complete */
+			for (x = 0; x < ndirty; x++) {
+				ast_mutex_lock(&vm_count_lock);
+				dirty[x]->dirty = 0;
+				ast_copy_string(box, dirty[x]->mailbox, sizeof(box));
+				ast_mutex_unlock(&vm_count_lock);
+				context = box;
+				mailbox = strsep(&context, "@");
+				if (vm_count_report(context, mailbox, &newmsgs, &oldmsgs))
+					manager_event(EVENT_FLAG_CALL, "MessageWaiting", "Mailbox: %s@%s\r\nWaiting: %d\r\nNew: %d\r\nOld: %d\r\n", mailbox, context, newmsgs ? 1 : 0, newmsgs, oldmsgs);
+			}
+			ndirty = 0;
+			continue;
+		}
+		/* Wait for a change, or for the end of the batch */
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ast_log(LOG_WARNING, "Unable to watch the voicemail spool: %s\n", strerror(errno));
+			break;
+		}
+		if (!(pfd.revents & POLLIN))
+			continue;
+		if ((len = read(vm_inotify, buf, sizeof(buf))) <= 0)
+			continue;
+		ast_mutex_lock(&vm_count_lock);
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(*event) + event->len) {
+			event = (struct inotify_event *) ptr;
+			if (event->mask & IN_Q_OVERFLOW) {
+				/* We lost changes, so trust no counts */
+				for (x = 0; x < VM_COUNT_BUCKETS; x++) {
+					for (count = vm_counts[x]; count; count = count->next) {
+						count->generation++;
+						count->valid = 0;
+					}
+				}
+				continue;
+			}
+			if (event->len && (strncasecmp(event->name, "msg", 3) || (strlen(event->name) < 4) ||
+				strcasecmp(event->name + strlen(event->name) - 3, "txt")))
+				/* Lock files, sound files; the .txt is what we count */
+				continue;
+			for (prev = &vm_watches[event->wd % VM_WATCH_BUCKETS]; (watch = *prev); prev = &watch->next) {
+				if (watch->wd == event->wd)
+					break;
+			}
+			if (!watch)
+				continue;
+			count = watch->count;
+			if (event->mask & IN_IGNORED) {
+				/* The folder is gone; watch it again when we count it again */
+				for (x = 0; x < 2; x++) {
+					if (count->wd[x] == event->wd)
+						count->wd[x] = -1;
+				}
+				*prev = watch->next;
+				free(watch);
+			}
+			count->generation++;
+			count->valid = 0;
+			if (count->dirty)
+				continue;
+			if (ndirty == maxdirty) {
+				struct vm_count **tmp = realloc(dirty, (maxdirty + 64) * sizeof(*dirty));
+				if (!tmp)
+					continue;
+				dirty = tmp;
+				maxdirty += 64;
+			}
+			if (!ndirty)
+				deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(VM_WATCH_BATCH, 1000));
+			count->dirty = 1;
+			dirty[ndirty++] = count;
+		}
+		ast_mutex_unlock(&vm_count_lock);
+	}
+	free(dirty);
+
+	return NULL;
+}
+#endif
+
+static void vm_count_init(void)
+{
+#ifdef __linux__
+	if ((vm_inotify = inotify_init()) < 0) {
+		ast_log(LOG_WARNING, "Unable to watch the voicemail spool, message counts of changes by other programs may be %d seconds late: %s\n", countcachetime, strerror(errno));
+		return;
+	}
+	fcntl(vm_inotify, F_SETFL, fcntl(vm_inotify, F_GETFL) | O_NONBLOCK);
+	vm_watch_stop = 0;
+	if (ast_pthread_create(&vm_watch_thread, NULL, vm_watch_changes, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start the voicemail spool watch thread\n");
+		close(vm_inotify);
+		vm_inotify = -1;
+	}
+#endif
+}
+
+static void vm_count_destroy(void)
+{
+	struct vm_count *count;
+	int x;
+
+#ifdef __linux__
+	struct vm_watch *watch;
+
+	if (vm_watch_thread != AST_PTHREADT_NULL) {
+		vm_watch_stop = 1;
+		pthread_join(vm_watch_thread, NULL);
+		vm_watch_thread = AST_PTHREADT_NULL;
+	}
+	for (x = 0; x < VM_WATCH_BUCKETS; x++) {
+		while ((watch = vm_watches[x])) {
+			vm_watches[x] = watch->next;
+			free(watch);
+		}
+	}
+	if (vm_inotify > -1) {
+		/* Removes the watches too */
+		close(vm_inotify);
+		vm_inotify = -1;
+	}
+#endif
+	ast_mutex_lock(&vm_count_lock);
+	for (x = 0; x < VM_COUNT_BUCKETS; x++) {
+		while ((count = vm_counts[x])) {
+			vm_counts[x] = count->next;
+			free(count);
+		}
+	}
+	ast_mutex_unlock(&vm_count_lock);
+}
+
 static int has_voicemail(const char *mailbox, const char *folder)
 {
 	DIR *dir;
@@ -2336,6 +2741,12 @@ static int has_voicemail(const char *mailbox, const char *folder)
 		context++;
 	} else
 		context = "default";
+	if (countcachetime && !strcmp(folder, "INBOX")) {
+		int newmsgs;
+
+		vm_count_get(context, tmp, &newmsgs, NULL);
+		return newmsgs ? 1 : 0;
+	}
 	snprintf(fn, sizeof(fn), "%s/%s/%s/%s", VM_SPOOL_DIR, context, tmp, folder);
 	dir = opendir(fn);
 	if (!dir)
@@ -2353,9 +2764,6 @@ static int has_voicemail(const char *mailbox, const char *folder)
 
 static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 {
-	DIR *dir;
-	struct dirent *de;
-	char fn[PATH_MAX];
 	char tmp[PATH_MAX] = "";
 	char *mb, *cur;
 	char *context;
@@ -2393,31 +2801,13 @@ static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 		context++;
 	} else
 		context = "default";
-	if (newmsgs) {
-		snprintf(fn, sizeof(fn), "%s/%s/%s/INBOX", VM_SPOOL_DIR, context, tmp);
-		dir = opendir(fn);
-		if (dir) {
-			while ((de = readdir(dir))) {
-				if ((strlen(de->d_name) > 3) && !strncasecmp(de->d_name, "msg", 3) &&
-					!strcasecmp(de->d_name + strlen(de->d_name) - 3, "txt"))
-						(*newmsgs)++;
-					
-			}
-			closedir(dir);
-		}
-	}
-	if (oldmsgs) {
-		snprintf(fn, sizeof(fn), "%s/%s/%s/Old", VM_SPOOL_DIR, context, tmp);
-		dir = opendir(fn);
-		if (dir) {
-			while ((de = readdir(dir))) {
-				if ((strlen(de->d_name) > 3) && !strncasecmp(de->d_name, "msg", 3) &&
-					!strcasecmp(de->d_name + strlen(de->d_name) - 3, "txt"))
-						(*oldmsgs)++;
-					
-			}
-			closedir(dir);
-		}
+	if (countcachetime)
+		vm_count_get(context, tmp, newmsgs, oldmsgs);
+	else {
+		if (newmsgs)
+			*newmsgs = count_folder(context, tmp, "INBOX");
+		if (oldmsgs)
+			*oldmsgs = count_folder(context, tmp, "Old");
 	}
 	return 0;
 }
@@ -2885,6 +3275,7 @@ static int save_to_folder(struct ast_vm_user *vmu, char *dir, int msg, char *con
 		COPY(dir, msg, ddir, x, username, context, sfn, dfn);
 	}
 	ast_unlock_path(ddir);
+	CHANGED(context, username);
 	
 	return 0;
 }
@@ -3558,6 +3949,8 @@ static int notify_new_message(struct ast_channel *chan, struct ast_vm_user *vmu,
 		DELETE(todir, msgnum, fn);
 	}
 
+	CHANGED(vmu->context, vmu->mailbox);
+
 	/* Leave voicemail for someone */
 	if (ast_app_has_voicemail(ext_context, NULL)) {
 		ast_app_messagecount(ext_context, &newmsgs, &oldmsgs);
@@ -4083,6 +4476,7 @@ static int close_mailbox(struct vm_state *vms, struct ast_vm_user *vmu)
 			DELETE(vms->curdir, x, vms->fn);
 	}
 	ast_unlock_path(vms->curdir);
+	CHANGED(vmu->context, vms->username);
 
 done:
 	if (vms->deleted)
@@ -6187,6 +6581,15 @@ static int load_config(void)
 			}
 		}
 
+		countcachetime = 60;
+		if ((s = ast_variable_retrieve(cfg, "general", "countcachetime"))) {
+			if ((sscanf(s, "%d", &x) == 1) && (x >= 0)) {
+				countcachetime = x;
+			} else {
+				ast_log(LOG_WARNING, "Invalid countcachetime value\n");
+			}
+		}
+
 		maxlogins = 3;
 		if ((s = ast_variable_retrieve(cfg, "general", "maxlogins"))) {
 			if (sscanf(s, "%d", &x) == 1) {
@@ -6475,6 +6878,9 @@ int unload_module(void)
 	res |= ast_cli_unregister(&show_voicemail_users_cli);
 	res |= ast_cli_unregister(&show_voicemail_zones_cli);
 	ast_uninstall_vm_functions();
+#ifndef USE_ODBC_STORAGE
+	vm_count_destroy();
+#endif
 	
 	STANDARD_HANGUP_LOCALUSERS;
 
@@ -6501,7 +6907,12 @@ int load_module(void)
 	/* compute the location of the voicemail spool directory */
 	snprintf(VM_SPOOL_DIR, sizeof(VM_SPOOL_DIR), "%s/voicemail/", ast_config_AST_SPOOL_DIR);
 
+#ifndef USE_ODBC_STORAGE
+	vm_count_init();
+#endif
 	ast_install_vm_functions(has_voicemail, messagecount);
+	/* Whatever the channel drivers asked before we were here was wrong */
+	ast_mwi_changed(NULL, 0, 0);
 
 #if defined(USE_ODBC_STORAGE) && !defined(EXTENDED_ODBC_STORAGE)
 	ast_log(LOG_WARNING, "The current ODBC storage table format will be changed soon."
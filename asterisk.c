@@ -98,6 +98,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 72373 $")
 #include "asterisk/channel.h"
 #include "asterisk/ulaw.h"
 #include "asterisk/alaw.h"
+#include "asterisk/simd.h"
 #include "asterisk/callerid.h"
 #include "asterisk/module.h"
 #include "asterisk/image.h"
@@ -169,6 +170,10 @@ int option_reconnect = 0;			/*!< */
 int option_transcode_slin = 1;			/*!< */
 int option_maxcalls = 0;			/*!< */
 double option_maxload = 0.0;			/*!< Max load avg on system */
+int option_pbxthreads = 0;			/*!< Max pooled PBX threads, 0 for one thread per call */
+int option_pbxidlethreads = 0;			/*!< Pooled PBX threads kept waiting for calls */
+int option_threadstacksize = 0;			/*!< Thread stack size in KB, 0 for AST_STACKSIZE */
+int option_iobackend = AST_IO_BACKEND_POLL;	/*!< Backend for new I/O contexts */
 int option_dontwarn = 0;			/*!< */
 int option_priority_jumping = 1;		/*!< Enable priority jumping as result value for apps */
 int option_transmit_silence_during_record = 0;	/*!< Transmit silence during record() app */
@@ -1998,6 +2003,28 @@ static void ast_readconfig(void) {
 			if ((sscanf(v->value, "%d", &option_maxcalls) != 1) || (option_maxcalls < 0)) {
 				option_maxcalls = 0;
 			}
+		} else if (!strcasecmp(v->name, "pbxthreads")) {
+			if ((sscanf(v->value, "%d", &option_pbxthreads) != 1) || (option_pbxthreads < 0)) {
+				option_pbxthreads = 0;
+			}
+		} else if (!strcasecmp(v->name, "pbxidlethreads")) {
+			if ((sscanf(v->value, "%d", &option_pbxidlethreads) != 1) || (option_pbxidlethreads < 0)) {
+				option_pbxidlethreads = 0;
+			}
+		} else if (!strcasecmp(v->name, "threadstacksize")) {
+			if ((sscanf(v->value, "%d", &option_threadstacksize) != 1) || (option_threadstacksize < 0)) {
+				option_threadstacksize = 0;
+			} else if (option_threadstacksize && (option_threadstacksize < 64)) {
+				ast_log(LOG_WARNING, "threadstacksize of %d KB is too small, using 64 KB\n", option_threadstacksize);
+				option_threadstacksize = 64;
+			}
+		} else if (!strcasecmp(v->name, "iobackend")) {
+			if (!strcasecmp(v->value, "epoll"))
+				option_iobackend = AST_IO_BACKEND_EPOLL;
+			else if (!strcasecmp(v->value, "poll"))
+				option_iobackend = AST_IO_BACKEND_POLL;
+			else
+				ast_log(LOG_WARNING, "Unknown iobackend '%s', using poll\n", v->value);
 		} else if (!strcasecmp(v->name, "maxload")) {
 			double test[1];
 
@@ -2073,6 +2100,7 @@ int main(int argc, char *argv[])
 	ast_mainpid = getpid();
 	ast_ulaw_init();
 	ast_alaw_init();
+	ast_simd_init(AST_SIMD_AVX2);
 	callerid_init();
 	ast_utils_init();
 	tdd_init();
@@ -2376,6 +2404,7 @@ int main(int argc, char *argv[])
 		printf(term_quit());
 		exit(1);
 	}
+	ast_sched_init();
 	if (dnsmgr_init()) {
 		printf(term_quit());
 		exit(1);
@@ -34,6 +34,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "asterisk.h"
 
@@ -57,15 +61,51 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 70948 $")
 int ast_default_amaflags = AST_CDR_DOCUMENTATION;
 char ast_default_accountcode[AST_MAX_ACCOUNT_CODE] = "";
 
+/*! \brief A batched CDR, shared by the queues of all the backends */
+struct cdr_post {
+	struct ast_cdr *cdr;		/*!< The CDR, and any chained to it */
+	int refs;			/*!< Queues still holding it */
+	struct timeval queued;		/*!< When it was queued, for the lag */
+};
+
+struct cdr_queue_item {
+	struct cdr_post *post;
+	struct cdr_queue_item *next;
+};
+
 struct ast_cdr_beitem {
 	char name[20];
 	char desc[80];
 	ast_cdrbe be;
+	ast_cdrbe_batch batch;		/*!< Optional, for posting several records at once */
 	AST_LIST_ENTRY(ast_cdr_beitem) list;
+	/* Batched CDRs waiting for this backend, and the thread posting them */
+	ast_mutex_t lock;
+	ast_cond_t cond;		/*!< Signalled when there is work, or the thread should stop */
+	ast_cond_t idle;		/*!< Signalled when the thread has finished posting something */
+	pthread_t thread;
+	struct cdr_queue_item *head;
+	struct cdr_queue_item *tail;
+	struct cdr_queue_item *inflight;	/*!< Being posted right now */
+	int queued;			/*!< Records waiting in memory */
+	int journaled;			/*!< Records waiting in the journal */
+	int stop;
+	time_t retry;			/*!< After a failure, don't post again before this */
+	unsigned long posted;
+	unsigned long failed;
+	unsigned long spilled;
+	unsigned long deadletters;	/*!< Journaled records given up on */
+	off_t stuck;			/*!< Journal offset of the record that failed last */
+	int attempts;			/*!< How many times that record failed on its own */
+	int single;			/*!< Replay one record at a time, to find the one failing */
+	long long busy;			/*!< Microseconds spent posting */
 };
 
 static AST_LIST_HEAD_STATIC(be_list, ast_cdr_beitem);
 
+/* Protects the reference counts of struct cdr_post */
+AST_MUTEX_DEFINE_STATIC(cdr_post_lock);
+
 struct ast_cdr_batch_item {
 	struct ast_cdr *cdr;
 	struct ast_cdr_batch_item *next;
@@ -83,15 +123,19 @@ static pthread_t cdr_thread = AST_PTHREADT_NULL;
 
 #define BATCH_SIZE_DEFAULT 100
 #define BATCH_TIME_DEFAULT 300
-#define BATCH_SCHEDULER_ONLY_DEFAULT 0
 #define BATCH_SAFE_SHUTDOWN_DEFAULT 1
+#define QUEUE_SIZE_DEFAULT 1000
+#define RETRY_INTERVAL_DEFAULT 30
+#define MAX_RETRIES_DEFAULT 10
 
 static int enabled;
 static int batchmode;
 static int batchsize;
 static int batchtime;
-static int batchscheduleronly;
 static int batchsafeshutdown;
+static int queuesize = QUEUE_SIZE_DEFAULT;
+static int retryinterval = RETRY_INTERVAL_DEFAULT;
+static int maxretries = MAX_RETRIES_DEFAULT;
 
 AST_MUTEX_DEFINE_STATIC(cdr_batch_lock);
 
@@ -100,10 +144,20 @@ AST_MUTEX_DEFINE_STATIC(cdr_pending_lock);
 static ast_cond_t cdr_pending_cond;
 
 
+static void *cdr_backend_thread(void *data);
+static int cdr_journal_count(struct ast_cdr_beitem *i);
+static void cdr_backend_flush(struct ast_cdr_beitem *i, int wait);
+
 /*! Register a CDR driver. Each registered CDR driver generates a CDR 
 	\return 0 on success, -1 on failure 
 */
 int ast_cdr_register(char *name, char *desc, ast_cdrbe be)
+{
+	return ast_cdr_register_batch(name, desc, be, NULL);
+}
+
+
+int ast_cdr_register_batch(char *name, char *desc, ast_cdrbe be, ast_cdrbe_batch batch)
 {
 	struct ast_cdr_beitem *i;
 
@@ -132,8 +186,24 @@ int ast_cdr_register(char *name, char *desc, ast_cdrbe be)
 
 	memset(i, 0, sizeof(*i));
 	i->be = be;
+	i->batch = batch;
 	ast_copy_string(i->name, name, sizeof(i->name));
 	ast_copy_string(i->desc, desc, sizeof(i->desc));
+	ast_mutex_init(&i->lock);
+	ast_cond_init(&i->cond, NULL);
+	ast_cond_init(&i->idle, NULL);
+	/* Whatever a previous run could not post is replayed first */
+	i->journaled = cdr_journal_count(i);
+	if (i->journaled && option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "CDR backend '%s' has %d journaled record%s to replay\n", name, i->journaled, (i->journaled == 1) ? "" : "s");
+	if (ast_pthread_create(&i->thread, NULL, cdr_backend_thread, i)) {
+		ast_log(LOG_WARNING, "Unable to start the posting thread of CDR backend '%s'\n", name);
+		ast_cond_destroy(&i->idle);
+		ast_cond_destroy(&i->cond);
+		ast_mutex_destroy(&i->lock);
+		free(i);
+		return -1;
+	}
 
 	AST_LIST_LOCK(&be_list);
 	AST_LIST_INSERT_HEAD(&be_list, i, list);
@@ -151,14 +221,29 @@ void ast_cdr_unregister(char *name)
 	AST_LIST_TRAVERSE_SAFE_BEGIN(&be_list, i, list) {
 		if (!strcasecmp(name, i->name)) {
 			AST_LIST_REMOVE_CURRENT(&be_list, list);
-			if (option_verbose > 1)
-				ast_verbose(VERBOSE_PREFIX_2 "Unregistered '%s' CDR backend\n", name);
-			free(i);
 			break;
 		}
 	}
 	AST_LIST_TRAVERSE_SAFE_END;
 	AST_LIST_UNLOCK(&be_list);
+
+	if (!i)
+		return;
+
+	/* The module is going away, so stop calling it, and keep what it
+	   has not posted yet for when it comes back */
+	ast_mutex_lock(&i->lock);
+	i->stop = 1;
+	ast_cond_signal(&i->cond);
+	ast_mutex_unlock(&i->lock);
+	pthread_join(i->thread, NULL);
+	cdr_backend_flush(i, 0);
+	if (option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "Unregistered '%s' CDR backend\n", name);
+	ast_cond_destroy(&i->idle);
+	ast_cond_destroy(&i->cond);
+	ast_mutex_destroy(&i->lock);
+	free(i);
 }
 
 /*! Duplicate a CDR record 
@@ -819,10 +904,10 @@ int ast_cdr_amaflags2int(const char *flag)
 	return -1;
 }
 
-static void post_cdr(struct ast_cdr *cdr)
+/*! \brief Work out the durations of CDRs about to be posted, and mark them posted */
+static void prepare_cdr(struct ast_cdr *cdr)
 {
 	char *chan;
-	struct ast_cdr_beitem *i;
 
 	while (cdr) {
 		chan = !ast_strlen_zero(cdr->channel) ? cdr->channel : "<unknown>";
@@ -840,6 +925,16 @@ static void post_cdr(struct ast_cdr *cdr)
 		else
 			cdr->billsec = 0;
 		ast_set_flag(cdr, AST_CDR_FLAG_POSTED);
+		cdr = cdr->next;
+	}
+}
+
+static void post_cdr(struct ast_cdr *cdr)
+{
+	struct ast_cdr_beitem *i;
+
+	prepare_cdr(cdr);
+	while (cdr) {
 		AST_LIST_LOCK(&be_list);
 		AST_LIST_TRAVERSE(&be_list, i, list) {
 			i->be(cdr);
@@ -928,28 +1023,631 @@ static int init_batch(void)
 	return 0;
 }
 
-static void *do_batch_backend_process(void *data)
+/*! \brief Drop a queue's reference to a batched CDR, freeing it after the last one */
+static void cdr_post_release(struct cdr_post *post)
+{
+	int refs;
+
+	ast_mutex_lock(&cdr_post_lock);
+	refs = --post->refs;
+	ast_mutex_unlock(&cdr_post_lock);
+	if (!refs) {
+		ast_cdr_free(post->cdr);
+		free(post);
+	}
+}
+
+static void cdr_journal_name(struct ast_cdr_beitem *i, const char *ext, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/cdr/%s.%s", ast_config_AST_SPOOL_DIR, i->name, ext);
+}
+
+static void journal_put(FILE *f, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+		case '\\':
+			fputs("\\\\", f);
+			break;
+		case '\t':
+			fputs("\\t", f);
+			break;
+		case '\n':
+			fputs("\\n", f);
+			break;
+		case '\r':
+			fputs("\\r", f);
+			break;
+		default:
+			fputc(*s, f);
+		}
+	}
+}
+
+/*! \brief Write one CDR as a line of tab separated fields.  The line starts
+    with a space, which replay overwrites with a '#' once it is posted. */
+static void journal_write(FILE *f, struct ast_cdr *cdr)
+{
+	struct ast_var_t *var;
+
+	fputc(' ', f);
+	journal_put(f, cdr->clid);
+	fputc('\t', f);
+	journal_put(f, cdr->src);
+	fputc('\t', f);
+	journal_put(f, cdr->dst);
+	fputc('\t', f);
+	journal_put(f, cdr->dcontext);
+	fputc('\t', f);
+	journal_put(f, cdr->channel);
+	fputc('\t', f);
+	journal_put(f, cdr->dstchannel);
+	fputc('\t', f);
+	journal_put(f, cdr->lastapp);
+	fputc('\t', f);
+	journal_put(f, cdr->lastdata);
+	fprintf(f, "\t%ld.%06ld\t%ld.%06ld\t%ld.%06ld\t%ld\t%ld\t%ld\t%ld\t",
+		(long) cdr->start.tv_sec, (long) cdr->start.tv_usec,
+		(long) cdr->answer.tv_sec, (long) cdr->answer.tv_usec,
+		(long) cdr->end.tv_sec, (long) cdr->end.tv_usec,
+		cdr->duration, cdr->billsec, cdr->disposition, cdr->amaflags);
+	journal_put(f, cdr->accountcode);
+	fprintf(f, "\t%u\t", cdr->flags);
+	journal_put(f, cdr->uniqueid);
+	fputc('\t', f);
+	journal_put(f, cdr->userfield);
+	AST_LIST_TRAVERSE(&cdr->varshead, var, entries) {
+		fputc('\t', f);
+		journal_put(f, ast_var_name(var));
+		fputc('=', f);
+		journal_put(f, ast_var_value(var));
+	}
+	fputc('\n', f);
+}
+
+/*! \brief Split off and unescape the next field of a journal line, in place */
+static char *journal_field(char **s)
+{
+	char *start = *s, *src, *dst;
+
+	if (!start)
+		return NULL;
+	for (src = dst = start; *src && (*src != '\t'); src++) {
+		if ((*src == '\\') && src[1]) {
+			switch (*++src) {
+			case 't':
+				*dst++ = '\t';
+				break;
+			case 'n':
+				*dst++ = '\n';
+				break;
+			case 'r':
+				*dst++ = '\r';
+				break;
+			default:
+				*dst++ = *src;
+			}
+		} else
+			*dst++ = *src;
+	}
+	*s = *src ? src + 1 : NULL;
+	*dst = '\0';
+	return start;
+}
+
+#define JOURNAL_FIELDS 19
+
+/*! \brief Turn a journal line, without its marker, back into a CDR */
+static struct ast_cdr *journal_read(char *line)
+{
+	struct ast_cdr *cdr;
+	struct ast_var_t *var;
+	char *f[JOURNAL_FIELDS], *name, *value;
+	long sec[3], usec[3];
+	int x;
+
+	for (x = 0; x < JOURNAL_FIELDS; x++) {
+		if (!(f[x] = journal_field(&line)))
+			return NULL;
+	}
+	for (x = 0; x < 3; x++) {
+		if (sscanf(f[8 + x], "%ld.%ld", &sec[x], &usec[x]) != 2)
+			return NULL;
+	}
+	if (!(cdr = ast_cdr_alloc()))
+		return NULL;
+	ast_copy_string(cdr->clid, f[0], sizeof(cdr->clid));
+	ast_copy_string(cdr->src, f[1], sizeof(cdr->src));
+	ast_copy_string(cdr->dst, f[2], sizeof(cdr->dst));
+	ast_copy_string(cdr->dcontext, f[3], sizeof(cdr->dcontext));
+	ast_copy_string(cdr->channel, f[4], sizeof(cdr->channel));
+	ast_copy_string(cdr->dstchannel, f[5], sizeof(cdr->dstchannel));
+	ast_copy_string(cdr->lastapp, f[6], sizeof(cdr->lastapp));
+	ast_copy_string(cdr->lastdata, f[7], sizeof(cdr->lastdata));
+	cdr->start.tv_sec = sec[0];
+	cdr->start.tv_usec = usec[0];
+	cdr->answer.tv_sec = sec[1];
+	cdr->answer.tv_usec = usec[1];
+	cdr->end.tv_sec = sec[2];
+	cdr->end.tv_usec = usec[2];
+	cdr->duration = strtol(f[11], NULL, 10);
+	cdr->billsec = strtol(f[12], NULL, 10);
+	cdr->disposition = strtol(f[13], NULL, 10);
+	cdr->amaflags = strtol(f[14], NULL, 10);
+	ast_copy_string(cdr->accountcode, f[15], sizeof(cdr->accountcode));
+	cdr->flags = strtoul(f[16], NULL, 10);
+	ast_copy_string(cdr->uniqueid, f[17], sizeof(cdr->uniqueid));
+	ast_copy_string(cdr->userfield, f[18], sizeof(cdr->userfield));
+	while ((name = journal_field(&line))) {
+		if (!(value = strchr(name, '=')))
+			continue;
+		*value++ = '\0';
+		if ((var = ast_var_assign(name, value)))
+			AST_LIST_INSERT_TAIL(&cdr->varshead, var, entries);
+	}
+	ast_set_flag(cdr, AST_CDR_FLAG_POSTED);
+
+	return cdr;
+}
+
+/*! \brief Count the records of a journal file not posted yet */
+static int journal_pending(const char *fn)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	int count = 0;
+
+	if (!(f = fopen(fn, "r")))
+		return 0;
+	while (getline(&line, &len, f) > 0) {
+		if (line[0] == ' ')
+			count++;
+	}
+	free(line);
+	fclose(f);
+
+	return count;
+}
+
+static int cdr_journal_count(struct ast_cdr_beitem *i)
+{
+	char fn[AST_CONFIG_MAX_PATH + 40];
+	int count;
+
+	cdr_journal_name(i, "replay", fn, sizeof(fn));
+	count = journal_pending(fn);
+	cdr_journal_name(i, "journal", fn, sizeof(fn));
+	return count + journal_pending(fn);
+}
+
+/*! \brief Save records to the backend's journal, either a CDR and those
+    chained to it, or count CDRs from a list
+ * \note Don't call without the backend's lock
+ * \return The number of records saved, -1 if they could not be
+ */
+static int cdr_journal_append(struct ast_cdr_beitem *i, struct ast_cdr *cdr, struct ast_cdr **cdrs, int count)
+{
+	char fn[AST_CONFIG_MAX_PATH + 40];
+	FILE *f;
+	int x;
+
+	snprintf(fn, sizeof(fn), "%s/cdr", ast_config_AST_SPOOL_DIR);
+	mkdir(fn, 0755);
+	cdr_journal_name(i, "journal", fn, sizeof(fn));
+	if (!(f = fopen(fn, "a"))) {
+		ast_log(LOG_ERROR, "Unable to open CDR journal '%s': %s, records of backend '%s' lost\n", fn, strerror(errno), i->name);
+		return -1;
+	}
+	if (cdr) {
+		for (count = 0; cdr; cdr = cdr->next, count++)
+			journal_write(f, cdr);
+	} else {
+		for (x = 0; x < count; x++)
+			journal_write(f, cdrs[x]);
+	}
+	if (fclose(f)) {
+		ast_log(LOG_ERROR, "Unable to write CDR journal '%s': %s\n", fn, strerror(errno));
+		return -1;
+	}
+	i->journaled += count;
+
+	return count;
+}
+
+/*! \note Don't call without the backend's lock */
+static void cdr_backend_stall(struct ast_cdr_beitem *i)
+{
+	i->retry = time(NULL) + retryinterval;
+	ast_log(LOG_WARNING, "CDR backend '%s' failed to post a record, will retry in %d second%s\n",
+		i->name, retryinterval, (retryinterval != 1) ? "s" : "");
+}
+
+/*! \brief Call the backend for a list of records, all at once if it can,
+    keeping the statistics
+ * \return How many of the records, from the first, were posted
+ */
+static int cdr_backend_post(struct ast_cdr_beitem *i, struct ast_cdr **cdrs, int count)
+{
+	struct timeval start = ast_tvnow(), used;
+	int posted;
+
+	if (i->batch && (count > 1)) {
+		posted = i->batch(cdrs, count) ? 0 : count;
+	} else {
+		for (posted = 0; posted < count; posted++) {
+			if (i->be(cdrs[posted]))
+				break;
+		}
+	}
+	used = ast_tvsub(ast_tvnow(), start);
+	ast_mutex_lock(&i->lock);
+	i->busy += (long long) used.tv_sec * 1000000 + used.tv_usec;
+	i->posted += posted;
+	if (posted < count)
+		i->failed++;
+	ast_mutex_unlock(&i->lock);
+
+	return posted;
+}
+
+/*! \brief How many records a backend is handed at once */
+static int cdr_post_size(struct ast_cdr_beitem *i)
+{
+	return (i->batch && (batchsize > 1)) ? batchsize : 1;
+}
+
+/*! \brief Mark a journaled record posted, or skipped */
+static void cdr_journal_mark(struct ast_cdr_beitem *i, FILE *f, off_t offset, const char *fn)
+{
+	if (pwrite(fileno(f), "#", 1, offset) != 1)
+		ast_log(LOG_WARNING, "Unable to mark record posted in CDR journal '%s': %s\n", fn, strerror(errno));
+	ast_mutex_lock(&i->lock);
+	if (i->journaled > 0)
+		i->journaled--;
+	ast_mutex_unlock(&i->lock);
+}
+
+/*! \brief Count a failed attempt at posting a journaled record, and give up
+    on it once it failed maxretries times, moving it to the backend's dead
+    letter file.  A failed batch does not tell which of its records was
+    refused, so it only makes the replay post them one at a time, up to the
+    last one of the batch, given by offset.
+ * \return 1 if the record was given up on, 0 to try it again later
+ */
+static int cdr_journal_failed(struct ast_cdr_beitem *i, struct ast_cdr *cdr, off_t offset, int alone)
+{
+	char fn[AST_CONFIG_MAX_PATH + 40];
+	FILE *f;
+	int attempts;
+
+	ast_mutex_lock(&i->lock);
+	if (!alone || !i->single || (i->stuck != offset)) {
+		i->stuck = offset;
+		i->attempts = 0;
+		i->single = 1;
+	}
+	if (!alone || (++i->attempts < maxretries)) {
+		ast_mutex_unlock(&i->lock);
+		return 0;
+	}
+	attempts = i->attempts;
+	i->attempts = 0;
+	i->single = 0;
+	i->deadletters++;
+	ast_mutex_unlock(&i->lock);
+
+	cdr_journal_name(i, "failed", fn, sizeof(fn));
+	if ((f = fopen(fn, "a"))) {
+		journal_write(f, cdr);
+		if (fclose(f))
+			f = NULL;
+	}
+	if (f)
+		ast_log(LOG_ERROR, "CDR backend '%s' failed to post a record %d times, moved it to '%s'\n", i->name, attempts, fn);
+	else
+		ast_log(LOG_ERROR, "CDR backend '%s' failed to post a record %d times, and it could not be saved to '%s': %s, record lost\n",
+			i->name, attempts, fn, strerror(errno));
+	return 1;
+}
+
+/*! \brief Post the backend's journal, oldest record first.  Records are
+    marked in the file as they are posted, so they are not posted twice if
+    we are interrupted.
+ * \return 0 once it has all been posted, -1 if the backend failed or is stopping
+ */
+static int cdr_journal_replay(struct ast_cdr_beitem *i)
+{
+	char fn[AST_CONFIG_MAX_PATH + 40], replay[AST_CONFIG_MAX_PATH + 40];
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t linelen;
+	off_t *offsets;
+	struct ast_cdr **cdrs;
+	FILE *f;
+	int maxsize, size, count, posted, skip, x, eof = 0;
+	int res = 0;
+
+	cdr_journal_name(i, "journal", fn, sizeof(fn));
+	cdr_journal_name(i, "replay", replay, sizeof(replay));
+
+	/* Finish an interrupted replay before starting on the journal */
+	ast_mutex_lock(&i->lock);
+	if (access(replay, F_OK) && rename(fn, replay) && (errno != ENOENT))
+		ast_log(LOG_WARNING, "Unable to rename CDR journal '%s': %s\n", fn, strerror(errno));
+	if (!(f = fopen(replay, "r+"))) {
+		i->journaled = 0;
+		ast_mutex_unlock(&i->lock);
+		return 0;
+	}
+	ast_mutex_unlock(&i->lock);
+
+	maxsize = cdr_post_size(i);
+	cdrs = malloc(maxsize * sizeof(*cdrs));
+	offsets = malloc(maxsize * sizeof(*offsets));
+	if (!cdrs || !offsets) {
+		ast_log(LOG_WARNING, "CDR: out of memory while replaying the journal of backend '%s'\n", i->name);
+		free(cdrs);
+		free(offsets);
+		fclose(f);
+		return -1;
+	}
+
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Replaying journaled records of CDR backend '%s'\n", i->name);
+
+	while (!eof) {
+		size = i->single ? 1 : maxsize;
+		for (count = 0; count < size; ) {
+			offsets[count] = ftello(f);
+			if ((linelen = getline(&line, &len, f)) <= 0) {
+				eof = 1;
+				break;
+			}
+			if (line[0] != ' ')
+				continue;
+			if (line[linelen - 1] == '\n')
+				line[linelen - 1] = '\0';
+			if (!(cdrs[count] = journal_read(line + 1))) {
+				ast_log(LOG_WARNING, "Skipping damaged record in CDR journal '%s'\n", replay);
+				cdr_journal_mark(i, f, offsets[count], replay);
+				continue;
+			}
+			count++;
+		}
+		if (!count)
+			break;
+		posted = i->stop ? 0 : cdr_backend_post(i, cdrs, count);
+		skip = 0;
+		if (posted < count) {
+			if (!i->stop && (!i->batch || (count == 1)))
+				skip = cdr_journal_failed(i, cdrs[posted], offsets[posted], 1);
+			else if (!i->stop)
+				cdr_journal_failed(i, cdrs[posted], offsets[count - 1], 0);
+		} else if (i->single && (offsets[0] >= i->stuck)) {
+			/* Past the records that failed, back to batches */
+			ast_mutex_lock(&i->lock);
+			i->single = 0;
+			ast_mutex_unlock(&i->lock);
+		}
+		for (x = 0; x < count; x++) {
+			if ((x < posted) || ((x == posted) && skip))
+				cdr_journal_mark(i, f, offsets[x], replay);
+			ast_cdr_free(cdrs[x]);
+		}
+		if (!skip && (posted < count)) {
+			res = -1;
+			break;
+		}
+	}
+	free(offsets);
+	free(cdrs);
+	free(line);
+	fclose(f);
+
+	if (!res) {
+		ast_mutex_lock(&i->lock);
+		unlink(replay);
+		i->single = 0;
+		/* Only what was spilled while we were replaying is left */
+		i->journaled = cdr_journal_count(i);
+		ast_mutex_unlock(&i->lock);
+	}
+
+	return res;
+}
+
+/*! \brief Each backend has a thread posting its queue, so a slow or broken
+    backend only ever holds up its own records */
+static void *cdr_backend_thread(void *data)
+{
+	struct ast_cdr_beitem *i = data;
+	struct cdr_queue_item *item, *first;
+	struct ast_cdr *cdr, **cdrs;
+	struct timespec ts;
+	int res, size, count, posted, x;
+
+	ast_mutex_lock(&i->lock);
+	while (!i->stop) {
+		if (i->retry) {
+			if (time(NULL) < i->retry) {
+				ts.tv_sec = i->retry;
+				ts.tv_nsec = 0;
+				ast_cond_timedwait(&i->cond, &i->lock, &ts);
+				continue;
+			}
+			i->retry = 0;
+		}
+		if (i->journaled) {
+			ast_mutex_unlock(&i->lock);
+			res = cdr_journal_replay(i);
+			ast_mutex_lock(&i->lock);
+			if (res && !i->stop)
+				cdr_backend_stall(i);
+			ast_cond_broadcast(&i->idle);
+			continue;
+		}
+		if (!(item = i->head)) {
+			ast_cond_wait(&i->cond, &i->lock);
+			continue;
+		}
+		/* Take as many records as the backend can post at once */
+		size = cdr_post_size(i);
+		first = item;
+		count = 0;
+		for (;;) {
+			for (cdr = item->post->cdr; cdr; cdr = cdr->next)
+				count++;
+			i->queued--;
+			if ((count >= size) || !item->next)
+				break;
+			item = item->next;
+		}
+		i->head = item->next;
+		if (!i->head)
+			i->tail = NULL;
+		item->next = NULL;
+		i->inflight = first;
+		ast_mutex_unlock(&i->lock);
+
+		if ((cdrs = malloc(count * sizeof(*cdrs)))) {
+			x = 0;
+			for (item = first; item; item = item->next) {
+				for (cdr = item->post->cdr; cdr; cdr = cdr->next)
+					cdrs[x++] = cdr;
+			}
+			posted = cdr_backend_post(i, cdrs, count);
+			if (posted < count) {
+				/* Keep the ones that were not posted for later */
+				ast_mutex_lock(&i->lock);
+				cdr_journal_append(i, NULL, cdrs + posted, count - posted);
+				cdr_backend_stall(i);
+				ast_mutex_unlock(&i->lock);
+			}
+			free(cdrs);
+		} else {
+			ast_log(LOG_WARNING, "CDR: out of memory while posting to backend '%s', journaling the records instead\n", i->name);
+			ast_mutex_lock(&i->lock);
+			for (item = first; item; item = item->next)
+				cdr_journal_append(i, item->post->cdr, NULL, 0);
+			ast_mutex_unlock(&i->lock);
+		}
+
+		ast_mutex_lock(&i->lock);
+		i->inflight = NULL;
+		while ((item = first)) {
+			first = item->next;
+			cdr_post_release(item->post);
+			free(item);
+		}
+		ast_cond_broadcast(&i->idle);
+	}
+	ast_mutex_unlock(&i->lock);
+
+	return NULL;
+}
+
+/*! \brief Queue a batched CDR for one backend, or journal it if the backend
+    already has as many queued as it may */
+static void cdr_backend_enqueue(struct ast_cdr_beitem *i, struct cdr_post *post)
+{
+	struct cdr_queue_item *item = NULL;
+	int res;
+
+	ast_mutex_lock(&i->lock);
+	if ((i->queued >= queuesize) || !(item = malloc(sizeof(*item)))) {
+		if ((res = cdr_journal_append(i, post->cdr, NULL, 0)) > 0)
+			i->spilled += res;
+		ast_mutex_unlock(&i->lock);
+		cdr_post_release(post);
+		return;
+	}
+	item->post = post;
+	item->next = NULL;
+	if (i->tail)
+		i->tail->next = item;
+	else
+		i->head = item;
+	i->tail = item;
+	i->queued++;
+	ast_cond_signal(&i->cond);
+	ast_mutex_unlock(&i->lock);
+}
+
+/*! \brief Wait for a backend to post everything it has, if asked to and it
+    is able to, then journal whatever it still has queued */
+static void cdr_backend_flush(struct ast_cdr_beitem *i, int wait)
+{
+	struct cdr_queue_item *item;
+
+	ast_mutex_lock(&i->lock);
+	while (wait && !i->stop && !i->retry && (i->head || i->inflight || i->journaled))
+		ast_cond_wait(&i->idle, &i->lock);
+	while ((item = i->head)) {
+		i->head = item->next;
+		i->queued--;
+		cdr_journal_append(i, item->post->cdr, NULL, 0);
+		cdr_post_release(item->post);
+		free(item);
+	}
+	i->tail = NULL;
+	ast_mutex_unlock(&i->lock);
+}
+
+static void cdr_flush_backends(int wait)
+{
+	struct ast_cdr_beitem *i;
+
+	AST_LIST_LOCK(&be_list);
+	AST_LIST_TRAVERSE(&be_list, i, list) {
+		cdr_backend_flush(i, wait);
+	}
+	AST_LIST_UNLOCK(&be_list);
+}
+
+/*! \brief Hand a list of batched CDRs to the queues of all the backends */
+static void cdr_queue_batch(struct ast_cdr_batch_item *batchitem)
 {
 	struct ast_cdr_batch_item *processeditem;
-	struct ast_cdr_batch_item *batchitem = data;
+	struct ast_cdr_beitem *i;
+	struct cdr_post *post;
+	int backends = 0;
 
-	/* Push each CDR into storage mechanism(s) and free all the memory */
+	AST_LIST_LOCK(&be_list);
+	AST_LIST_TRAVERSE(&be_list, i, list) {
+		backends++;
+	}
 	while (batchitem) {
-		post_cdr(batchitem->cdr);
-		ast_cdr_free(batchitem->cdr);
+		prepare_cdr(batchitem->cdr);
+		if (!backends) {
+			ast_cdr_free(batchitem->cdr);
+		} else if (!(post = malloc(sizeof(*post)))) {
+			ast_log(LOG_WARNING, "CDR: out of memory while queueing a record, posting it now instead\n");
+			AST_LIST_TRAVERSE(&be_list, i, list) {
+				struct ast_cdr *cdr;
+
+				for (cdr = batchitem->cdr; cdr; cdr = cdr->next)
+					cdr_backend_post(i, &cdr, 1);
+			}
+			ast_cdr_free(batchitem->cdr);
+		} else {
+			post->cdr = batchitem->cdr;
+			post->refs = backends;
+			post->queued = ast_tvnow();
+			AST_LIST_TRAVERSE(&be_list, i, list) {
+				cdr_backend_enqueue(i, post);
+			}
+		}
 		processeditem = batchitem;
 		batchitem = batchitem->next;
 		free(processeditem);
 	}
-
-	return NULL;
+	AST_LIST_UNLOCK(&be_list);
 }
 
 void ast_cdr_submit_batch(int shutdown)
 {
 	struct ast_cdr_batch_item *oldbatchitems = NULL;
-	pthread_attr_t attr;
-	pthread_t batch_post_thread = AST_PTHREADT_NULL;
 
 	/* if there's no batch, or no CDRs in the batch, then there's nothing to do */
 	if (!batch || !batch->head)
@@ -961,24 +1659,11 @@ void ast_cdr_submit_batch(int shutdown)
 	reset_batch();
 	ast_mutex_unlock(&cdr_batch_lock);
 
-	/* if configured, spawn a new thread to post these CDRs,
-	   also try to save as much as possible if we are shutting down safely */
-	if (batchscheduleronly || shutdown) {
-		if (option_debug)
-			ast_log(LOG_DEBUG, "CDR single-threaded batch processing begins now\n");
-		do_batch_backend_process(oldbatchitems);
-	} else {
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-		if (ast_pthread_create(&batch_post_thread, &attr, do_batch_backend_process, oldbatchitems)) {
-			ast_log(LOG_WARNING, "CDR processing thread could not detach, now trying in this thread\n");
-			do_batch_backend_process(oldbatchitems);
-		} else {
-			if (option_debug)
-				ast_log(LOG_DEBUG, "CDR multi-threaded batch processing begins now\n");
-		}
-		pthread_attr_destroy(&attr);
-	}
+	cdr_queue_batch(oldbatchitems);
+
+	/* if we are shutting down safely, wait for the backends to post them */
+	if (shutdown)
+		cdr_flush_backends(1);
 }
 
 static int submit_scheduled_batch(void *data)
@@ -1091,6 +1776,11 @@ static int handle_cli_status(int fd, int argc, char *argv[])
 	struct ast_cdr_beitem *beitem=NULL;
 	int cnt=0;
 	long nextbatchtime=0;
+	struct timeval now;
+	struct cdr_post *oldest;
+	char lag[32];
+	char rate[32];
+	char stalled[48];
 
 	if (argc > 2)
 		return RESULT_SHOWUSAGE;
@@ -1104,7 +1794,9 @@ static int handle_cli_status(int fd, int argc, char *argv[])
 			if (cdr_sched > -1)
 				nextbatchtime = ast_sched_when(sched, cdr_sched);
 			ast_cli(fd, "CDR safe shut down: %s\n", batchsafeshutdown ? "enabled" : "disabled");
-			ast_cli(fd, "CDR batch threading model: %s\n", batchscheduleronly ? "scheduler only" : "scheduler plus separate threads");
+			ast_cli(fd, "CDR backend queue size: %d record%s\n", queuesize, (queuesize != 1) ? "s" : "");
+			ast_cli(fd, "CDR backend retry interval: %d second%s\n", retryinterval, (retryinterval != 1) ? "s" : "");
+			ast_cli(fd, "CDR backend retries per journaled record: %d\n", maxretries);
 			ast_cli(fd, "CDR current batch size: %d record%s\n", cnt, (cnt != 1) ? "s" : "");
 			ast_cli(fd, "CDR maximum batch size: %d record%s\n", batchsize, (batchsize != 1) ? "s" : "");
 			ast_cli(fd, "CDR maximum batch time: %d second%s\n", batchtime, (batchtime != 1) ? "s" : "");
@@ -1112,7 +1804,28 @@ static int handle_cli_status(int fd, int argc, char *argv[])
 		}
 		AST_LIST_LOCK(&be_list);
 		AST_LIST_TRAVERSE(&be_list, beitem, list) {
-			ast_cli(fd, "CDR registered backend: %s\n", beitem->name);
+			ast_cli(fd, "CDR registered backend: %s%s\n", beitem->name, beitem->batch ? " (bulk posting)" : "");
+			if (!batchmode)
+				continue;
+			now = ast_tvnow();
+			ast_mutex_lock(&beitem->lock);
+			oldest = beitem->inflight ? beitem->inflight->post : (beitem->head ? beitem->head->post : NULL);
+			if (oldest)
+				snprintf(lag, sizeof(lag), "%.1fs", ast_tvdiff_ms(now, oldest->queued) / 1000.0);
+			else
+				ast_copy_string(lag, "none", sizeof(lag));
+			if (beitem->busy)
+				snprintf(rate, sizeof(rate), "%.1f/s", beitem->posted * 1000000.0 / beitem->busy);
+			else
+				ast_copy_string(rate, "-", sizeof(rate));
+			if (beitem->retry)
+				snprintf(stalled, sizeof(stalled), ", stalled, retry in %lds", (long) (beitem->retry - now.tv_sec));
+			else
+				stalled[0] = '\0';
+			ast_cli(fd, "    queued %d, journaled %d, lag %s, posted %lu (%s), failed %lu, spilled %lu, given up %lu%s\n",
+				beitem->queued, beitem->journaled, lag, beitem->posted, rate,
+				beitem->failed, beitem->spilled, beitem->deadletters, stalled);
+			ast_mutex_unlock(&beitem->lock);
 		}
 		AST_LIST_UNLOCK(&be_list);
 	}
@@ -1154,7 +1867,9 @@ static int do_reload(void)
 	struct ast_config *config;
 	const char *enabled_value;
 	const char *batched_value;
-	const char *scheduleronly_value;
+	const char *queuesize_value;
+	const char *retryinterval_value;
+	const char *maxretries_value;
 	const char *batchsafeshutdown_value;
 	const char *size_value;
 	const char *time_value;
@@ -1168,7 +1883,9 @@ static int do_reload(void)
 
 	batchsize = BATCH_SIZE_DEFAULT;
 	batchtime = BATCH_TIME_DEFAULT;
-	batchscheduleronly = BATCH_SCHEDULER_ONLY_DEFAULT;
+	queuesize = QUEUE_SIZE_DEFAULT;
+	retryinterval = RETRY_INTERVAL_DEFAULT;
+	maxretries = MAX_RETRIES_DEFAULT;
 	batchsafeshutdown = BATCH_SAFE_SHUTDOWN_DEFAULT;
 	was_enabled = enabled;
 	was_batchmode = batchmode;
@@ -1186,9 +1903,26 @@ static int do_reload(void)
 		if ((batched_value = ast_variable_retrieve(config, "general", "batch"))) {
 			batchmode = ast_true(batched_value);
 		}
-		if ((scheduleronly_value = ast_variable_retrieve(config, "general", "scheduleronly"))) {
-			batchscheduleronly = ast_true(scheduleronly_value);
+		if ((queuesize_value = ast_variable_retrieve(config, "general", "queuesize"))) {
+			if ((sscanf(queuesize_value, "%d", &cfg_size) < 1) || (cfg_size < 1))
+				ast_log(LOG_WARNING, "Invalid backend queue size '%s' specified, using default\n", queuesize_value);
+			else
+				queuesize = cfg_size;
+		}
+		if ((retryinterval_value = ast_variable_retrieve(config, "general", "retryinterval"))) {
+			if ((sscanf(retryinterval_value, "%d", &cfg_time) < 1) || (cfg_time < 1))
+				ast_log(LOG_WARNING, "Invalid backend retry interval '%s' specified, using default\n", retryinterval_value);
+			else
+				retryinterval = cfg_time;
 		}
+		if ((maxretries_value = ast_variable_retrieve(config, "general", "maxretries"))) {
+			if ((sscanf(maxretries_value, "%d", &cfg_size) < 1) || (cfg_size < 1))
+				ast_log(LOG_WARNING, "Invalid backend retry count '%s' specified, using default\n", maxretries_value);
+			else
+				maxretries = cfg_size;
+		}
+		if (ast_variable_retrieve(config, "general", "scheduleronly"))
+			ast_log(LOG_NOTICE, "The CDR 'scheduleronly' option is obsolete and ignored, every backend posts from a thread of its own\n");
 		if ((batchsafeshutdown_value = ast_variable_retrieve(config, "general", "safeshutdown"))) {
 			batchsafeshutdown = ast_true(batchsafeshutdown_value);
 		}
@@ -1243,10 +1977,10 @@ static int do_reload(void)
 		ast_cli_unregister(&cli_submit);
 		ast_unregister_atexit(ast_cdr_engine_term);
 		res = 0;
-		/* if leaving batch mode, then post the CDRs in the batch,
+		/* if leaving batch mode, then queue the CDRs in the batch,
 		   and don't reschedule, since we are stopping CDR logging */
 		if (!batchmode && was_batchmode) {
-			ast_cdr_engine_term();
+			ast_cdr_submit_batch(0);
 		}
 	} else {
 		res = 0;
@@ -1267,6 +2001,7 @@ int ast_cdr_engine_init(void)
 		ast_log(LOG_ERROR, "Unable to create schedule context.\n");
 		return -1;
 	}
+	ast_sched_set_name(sched, "cdr");
 
 	ast_cli_register(&cli_status);
 
@@ -1284,7 +2019,9 @@ int ast_cdr_engine_init(void)
    hanging up channels, and then again, after the channel hangup timeout expires */
 void ast_cdr_engine_term(void)
 {
-	ast_cdr_submit_batch(batchsafeshutdown);
+	ast_cdr_submit_batch(0);
+	/* whatever the backends don't get to post is journaled, for the next run */
+	cdr_flush_backends(batchsafeshutdown);
 }
 
 void ast_cdr_engine_reload(void)
@@ -57,6 +57,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 59301 $")
 #include "asterisk/cdr.h"
 #include "asterisk/module.h"
 #include "asterisk/logger.h"
+#include "asterisk/utils.h"
 
 #define DATE_FORMAT "%Y-%m-%d %T"
 
@@ -71,7 +72,7 @@ static int connected = 0;
 
 AST_MUTEX_DEFINE_STATIC(odbc_lock);
 
-static int odbc_do_query(void);
+static int odbc_do_query(SQLUSMALLINT *status, int count);
 static int odbc_init(void);
 
 static SQLHENV	ODBC_env = SQL_NULL_HANDLE;	/* global ODBC Environment */
@@ -86,21 +87,22 @@ static void odbc_disconnect(void)
 	connected = 0;
 }
 
-static int odbc_log(struct ast_cdr *cdr)
-{
-	int ODBC_res;
-	char sqlcmd[2048] = "", timestr[128];
-	int res = 0;
-	struct tm tm;
+/*! \brief The parameters of one row of an INSERT.  Rows are bound row-wise,
+    so a whole batch of them can be sent with a single SQLExecute(). */
+struct odbc_row {
+	struct ast_cdr cdr;
+	char timestr[128];
+	char disposition[16];
+};
 
-	if (usegmtime) 
-		gmtime_r(&cdr->start.tv_sec,&tm);
-	else
-		localtime_r(&cdr->start.tv_sec,&tm);
+/*! \note Don't call without odbc_lock, and a connection */
+static int odbc_insert(struct odbc_row *rows, int count)
+{
+	int ODBC_res, res;
+	char sqlcmd[2048] = "";
+	struct odbc_row *row = rows;
+	SQLUSMALLINT *status = NULL;
 
-	ast_mutex_lock(&odbc_lock);
-	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
-	memset(sqlcmd,0,2048);
 	if (loguniqueid) {
 		snprintf(sqlcmd,sizeof(sqlcmd),"INSERT INTO %s "
 		"(calldate,clid,src,dst,dcontext,channel,dstchannel,lastapp,"
@@ -113,15 +115,6 @@ static int odbc_log(struct ast_cdr *cdr)
 		"VALUES (?,?,?,?,?,?,?,?,?,?,?,?,?,?)", table);
 	}
 
-	if (!connected) {
-		res = odbc_init();
-		if (res < 0) {
-			odbc_disconnect();
-			ast_mutex_unlock(&odbc_lock);
-			return 0;
-		}				
-	}
-
 	ODBC_res = SQLAllocHandle(SQL_HANDLE_STMT, ODBC_con, &ODBC_stmt);
 
 	if ((ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO)) {
@@ -129,8 +122,7 @@ static int odbc_log(struct ast_cdr *cdr)
 			ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Failure in AllocStatement %d\n", ODBC_res);
 		SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
 		odbc_disconnect();
-		ast_mutex_unlock(&odbc_lock);
-		return 0;
+		return -1;
 	}
 
 	/* We really should only have to do this once.  But for some
@@ -144,63 +136,138 @@ static int odbc_log(struct ast_cdr *cdr)
 			ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Error in PREPARE %d\n", ODBC_res);
 		SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
 		odbc_disconnect();
-		ast_mutex_unlock(&odbc_lock);
-		return 0;
+		return -1;
 	}
 
-	SQLBindParameter(ODBC_stmt, 1, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(timestr), 0, &timestr, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 2, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->clid), 0, cdr->clid, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 3, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->src), 0, cdr->src, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 4, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dst), 0, cdr->dst, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 5, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dcontext), 0, cdr->dcontext, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 6, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->channel), 0, cdr->channel, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 7, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->dstchannel), 0, cdr->dstchannel, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 8, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->lastapp), 0, cdr->lastapp, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 9, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->lastdata), 0, cdr->lastdata, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 10, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->duration, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 11, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->billsec, 0, NULL);
+	/* The parameters below are those of the first row, the driver finds
+	   those of the others sizeof(struct odbc_row) apart */
+	SQLSetStmtAttr(ODBC_stmt, SQL_ATTR_PARAM_BIND_TYPE, (SQLPOINTER) sizeof(struct odbc_row), 0);
+	SQLSetStmtAttr(ODBC_stmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER) (long) count, 0);
+
+	SQLBindParameter(ODBC_stmt, 1, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->timestr), 0, row->timestr, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 2, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.clid), 0, row->cdr.clid, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 3, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.src), 0, row->cdr.src, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 4, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.dst), 0, row->cdr.dst, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 5, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.dcontext), 0, row->cdr.dcontext, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 6, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.channel), 0, row->cdr.channel, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 7, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.dstchannel), 0, row->cdr.dstchannel, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 8, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.lastapp), 0, row->cdr.lastapp, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 9, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.lastdata), 0, row->cdr.lastdata, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 10, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &row->cdr.duration, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 11, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &row->cdr.billsec, 0, NULL);
 	if (dispositionstring)
-		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, strlen(ast_cdr_disp2str(cdr->disposition)) + 1, 0, ast_cdr_disp2str(cdr->disposition), 0, NULL);
+		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->disposition), 0, row->disposition, 0, NULL);
 	else
-		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->disposition, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 13, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &cdr->amaflags, 0, NULL);
-	SQLBindParameter(ODBC_stmt, 14, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->accountcode), 0, cdr->accountcode, 0, NULL);
+		SQLBindParameter(ODBC_stmt, 12, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &row->cdr.disposition, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 13, SQL_PARAM_INPUT, SQL_C_SLONG, SQL_INTEGER, 0, 0, &row->cdr.amaflags, 0, NULL);
+	SQLBindParameter(ODBC_stmt, 14, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.accountcode), 0, row->cdr.accountcode, 0, NULL);
 
 	if (loguniqueid) {
-		SQLBindParameter(ODBC_stmt, 15, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->uniqueid), 0, cdr->uniqueid, 0, NULL);
-		SQLBindParameter(ODBC_stmt, 16, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(cdr->userfield), 0, cdr->userfield, 0, NULL);
+		SQLBindParameter(ODBC_stmt, 15, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.uniqueid), 0, row->cdr.uniqueid, 0, NULL);
+		SQLBindParameter(ODBC_stmt, 16, SQL_PARAM_INPUT, SQL_C_CHAR, SQL_CHAR, sizeof(row->cdr.userfield), 0, row->cdr.userfield, 0, NULL);
 	}
 
-	if (connected) {
-		res = odbc_do_query();
+	if (count > 1) {
+		/* Every row goes in one transaction, so the batch is posted
+		   whole or not at all, whatever the driver does with the rows
+		   behind a failed one */
+		if (!(status = calloc(count, sizeof(*status)))) {
+			ast_log(LOG_ERROR, "cdr_odbc: Out of memory error.\n");
+			SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
+			return -1;
+		}
+		SQLSetStmtAttr(ODBC_stmt, SQL_ATTR_PARAM_STATUS_PTR, status, 0);
+		ODBC_res = SQLSetConnectAttr(ODBC_con, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER) SQL_AUTOCOMMIT_OFF, 0);
+		if ((ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO)) {
+			ast_log(LOG_WARNING, "cdr_odbc: Unable to start a transaction for %d records\n", count);
+			free(status);
+			SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
+			odbc_disconnect();
+			return -1;
+		}
+	}
+
+	res = odbc_do_query(status, count);
+
+	if (count > 1) {
+		ODBC_res = SQLEndTran(SQL_HANDLE_DBC, ODBC_con, res ? SQL_ROLLBACK : SQL_COMMIT);
+		if (!res && (ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO)) {
+			if (option_verbose > 10)
+				ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Error in COMMIT %d\n", ODBC_res);
+			res = -1;
+		}
+		SQLSetConnectAttr(ODBC_con, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER) SQL_AUTOCOMMIT_ON, 0);
+		free(status);
+	}
+
+	SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
+	if (res < 0)
+		odbc_disconnect();
+	return res;
+}
+
+static int odbc_log_batch(struct ast_cdr **cdrs, int count)
+{
+	struct odbc_row *rows;
+	struct tm tm;
+	int res = 0;
+	int x;
+
+	if (!(rows = calloc(count, sizeof(*rows)))) {
+		ast_log(LOG_ERROR, "cdr_odbc: Out of memory error.\n");
+		return -1;
+	}
+	for (x = 0; x < count; x++) {
+		memcpy(&rows[x].cdr, cdrs[x], sizeof(rows[x].cdr));
+		if (usegmtime) 
+			gmtime_r(&cdrs[x]->start.tv_sec,&tm);
+		else
+			localtime_r(&cdrs[x]->start.tv_sec,&tm);
+		strftime(rows[x].timestr, sizeof(rows[x].timestr), DATE_FORMAT, &tm);
+		ast_copy_string(rows[x].disposition, ast_cdr_disp2str(cdrs[x]->disposition), sizeof(rows[x].disposition));
+	}
+
+	ast_mutex_lock(&odbc_lock);
+
+	if (!connected) {
+		res = odbc_init();
+		if (res < 0) {
+			odbc_disconnect();
+			ast_mutex_unlock(&odbc_lock);
+			free(rows);
+			return -1;
+		}				
+	}
+
+	res = odbc_insert(rows, count);
+	if (res < 0) {
+		if (option_verbose > 10)		
+			ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Query FAILED Call not logged!\n");
+		if (option_verbose > 10)
+			ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Reconnecting to dsn %s\n", dsn);
+		res = odbc_init();
 		if (res < 0) {
-			if (option_verbose > 10)		
-				ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Query FAILED Call not logged!\n");
 			if (option_verbose > 10)
-				ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Reconnecting to dsn %s\n", dsn);
-			SQLDisconnect(ODBC_con);
-			res = odbc_init();
+				ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: %s has gone away!\n", dsn);
+			odbc_disconnect();
+		} else {
+			if (option_verbose > 10)
+				ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Trying Query again!\n");
+			res = odbc_insert(rows, count);
 			if (res < 0) {
 				if (option_verbose > 10)
-					ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: %s has gone away!\n", dsn);
-				odbc_disconnect();
-			} else {
-				if (option_verbose > 10)
-					ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Trying Query again!\n");
-				res = odbc_do_query();
-				if (res < 0) {
-					if (option_verbose > 10)
-						ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Query FAILED Call not logged!\n");
-				}
+					ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Query FAILED Call not logged!\n");
 			}
 		}
-	} else {
-		if (option_verbose > 10)
-			ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Query FAILED Call not logged!\n");
 	}
-	SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
 	ast_mutex_unlock(&odbc_lock);
-	return 0;
+	free(rows);
+	return res;
+}
+
+static int odbc_log(struct ast_cdr *cdr)
+{
+	return odbc_log_batch(&cdr, 1);
 }
 
 char *description(void)
@@ -210,6 +277,9 @@ char *description(void)
 
 static int odbc_unload_module(void)
 {
+	/* Stop the core posting to us before the connection goes away.  Not
+	   under odbc_lock, as that waits for a posting in progress. */
+	ast_cdr_unregister(name);
 	ast_mutex_lock(&odbc_lock);
 	if (connected) {
 		if (option_verbose > 10)
@@ -238,7 +308,6 @@ static int odbc_unload_module(void)
 		free(table);
 	}
 
-	ast_cdr_unregister(name);
 	ast_mutex_unlock(&odbc_lock);
 	return 0;
 }
@@ -360,7 +429,7 @@ static int odbc_load_module(void)
 			ast_verbose( VERBOSE_PREFIX_3 "cdr_odbc: Unable to connect to datasource: %s\n", dsn);
 		}
 	}
-	res = ast_cdr_register(name, desc, odbc_log);
+	res = ast_cdr_register_batch(name, desc, odbc_log, odbc_log_batch);
 	if (res) {
 		ast_log(LOG_ERROR, "cdr_odbc: Unable to register ODBC CDR handling\n");
 	}
@@ -371,22 +440,31 @@ out:
 	return res;
 }
 
-static int odbc_do_query(void)
+/*! \brief Run the prepared INSERT.  With several rows, status holds the
+    outcome of each, and any failed row fails the whole batch.  The caller
+    cleans up the statement and connection. */
+static int odbc_do_query(SQLUSMALLINT *status, int count)
 {
 	SQLINTEGER ODBC_err;
 	int ODBC_res;
 	short int ODBC_mlen;
 	char ODBC_msg[200], ODBC_stat[10];
+	int x;
 	
 	ODBC_res = SQLExecute(ODBC_stmt);
 	
 	if ((ODBC_res != SQL_SUCCESS) && (ODBC_res != SQL_SUCCESS_WITH_INFO)) {
 		if (option_verbose > 10)
 			ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Error in Query %d\n", ODBC_res);
-		SQLFreeHandle(SQL_HANDLE_STMT, ODBC_stmt);
-		odbc_disconnect();
 		return -1;
 	} else {
+		for (x = 0; status && (x < count); x++) {
+			if (status[x] == SQL_PARAM_ERROR) {
+				if (option_verbose > 10)
+					ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Error in Query for record %d of %d\n", x + 1, count);
+				return -1;
+			}
+		}
 		if (option_verbose > 10)
 			ast_verbose( VERBOSE_PREFIX_4 "cdr_odbc: Query Successful!\n");
 		connected = 1;
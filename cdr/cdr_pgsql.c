@@ -67,19 +67,16 @@ AST_MUTEX_DEFINE_STATIC(pgsql_lock);
 PGconn		*conn = NULL;
 PGresult	*result = NULL;
 
-static int pgsql_log(struct ast_cdr *cdr)
+/*! \brief Make sure we are connected to the database, reconnecting if need be
+ * \note Don't call without pgsql_lock
+ */
+static int pgsql_connect(void)
 {
-	struct tm tm;
-	char sqlcmd[2048] = "", timestr[128];
 	char *pgerror;
-	int pgerr;
-
-	ast_mutex_lock(&pgsql_lock);
-
-	localtime_r(&cdr->start.tv_sec,&tm);
-	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
 
 	if ((!connected) && pghostname && pgdbuser && pgpassword && pgdbname) {
+		if (conn)
+			PQfinish(conn);
 		conn = PQsetdbLogin(pghostname, pgdbport, NULL, NULL, pgdbname, pgdbuser, pgpassword);
 		if (PQstatus(conn) != CONNECTION_BAD) {
 			connected = 1;
@@ -90,95 +87,157 @@ static int pgsql_log(struct ast_cdr *cdr)
 		}
 	}
 
-	if (connected) {
-		char *clid=NULL, *dcontext=NULL, *channel=NULL, *dstchannel=NULL, *lastapp=NULL, *lastdata=NULL;
-		char *uniqueid=NULL, *userfield=NULL, *src=NULL, *dst=NULL;
-
-		/* Maximum space needed would be if all characters needed to be escaped, plus a trailing NULL */
-		if ((clid = alloca(strlen(cdr->clid) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, clid, cdr->clid, strlen(cdr->clid), &pgerr);
-		if ((dcontext = alloca(strlen(cdr->dcontext) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, dcontext, cdr->dcontext, strlen(cdr->dcontext), &pgerr);
-		if ((channel = alloca(strlen(cdr->channel) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, channel, cdr->channel, strlen(cdr->channel), &pgerr);
-		if ((dstchannel = alloca(strlen(cdr->dstchannel) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, dstchannel, cdr->dstchannel, strlen(cdr->dstchannel), &pgerr);
-		if ((lastapp = alloca(strlen(cdr->lastapp) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, lastapp, cdr->lastapp, strlen(cdr->lastapp), &pgerr);
-		if ((lastdata = alloca(strlen(cdr->lastdata) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, lastdata, cdr->lastdata, strlen(cdr->lastdata), &pgerr);
-		if ((uniqueid = alloca(strlen(cdr->uniqueid) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, uniqueid, cdr->uniqueid, strlen(cdr->uniqueid), &pgerr);
-		if ((userfield = alloca(strlen(cdr->userfield) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, userfield, cdr->userfield, strlen(cdr->userfield), &pgerr);
-		if ((src = alloca(strlen(cdr->src) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, src, cdr->src, strlen(cdr->src), &pgerr);
-		if ((dst = alloca(strlen(cdr->dst) * 2 + 1)) != NULL)
-			PQescapeStringConn(conn, dst, cdr->dst, strlen(cdr->dst), &pgerr);
-
-		/* Check for all alloca failures above at once */
-		if ((!clid) || (!dcontext) || (!channel) || (!dstchannel) || (!lastapp) || (!lastdata) || (!uniqueid) || (!userfield) || (!src) || (!dst)) {
-			ast_log(LOG_ERROR, "cdr_pgsql:  Out of memory error (insert fails)\n");
-			ast_mutex_unlock(&pgsql_lock);
-			return -1;
-		}
+	if (!connected)
+		return -1;
 
-		ast_log(LOG_DEBUG,"cdr_pgsql: inserting a CDR record.\n");
-
-		snprintf(sqlcmd,sizeof(sqlcmd),"INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
-				 "lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES"
-				 " ('%s','%s','%s','%s','%s', '%s','%s','%s','%s',%ld,%ld,'%s',%ld,'%s','%s','%s')",
-				 table, timestr, clid, src, dst, dcontext,channel, dstchannel, lastapp, lastdata,
-				 cdr->duration,cdr->billsec,ast_cdr_disp2str(cdr->disposition),cdr->amaflags, cdr->accountcode, uniqueid, userfield);
-		
-		ast_log(LOG_DEBUG,"cdr_pgsql: SQL command executed:  %s\n",sqlcmd);
-		
-		/* Test to be sure we're still connected... */
-		/* If we're connected, and connection is working, good. */
-		/* Otherwise, attempt reconnect.  If it fails... sorry... */
+	/* Test to be sure we're still connected... */
+	/* If we're connected, and connection is working, good. */
+	/* Otherwise, attempt reconnect.  If it fails... sorry... */
+	if (PQstatus(conn) == CONNECTION_OK) {
+		connected = 1;
+	} else {
+		ast_log(LOG_ERROR, "cdr_pgsql: Connection was lost... attempting to reconnect.\n");
+		PQreset(conn);
 		if (PQstatus(conn) == CONNECTION_OK) {
+			ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
 			connected = 1;
 		} else {
-			ast_log(LOG_ERROR, "cdr_pgsql: Connection was lost... attempting to reconnect.\n");
-			PQreset(conn);
-			if (PQstatus(conn) == CONNECTION_OK) {
-				ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
-				connected = 1;
-			} else {
-				pgerror = PQerrorMessage(conn);
-				ast_log(LOG_ERROR, "cdr_pgsql: Unable to reconnect to database server %s. Calls will not be logged!\n", pghostname);
-				ast_log(LOG_ERROR, "cdr_pgsql: Reason: %s\n", pgerror);
-				connected = 0;
-				ast_mutex_unlock(&pgsql_lock);
-				return -1;
-			}
+			pgerror = PQerrorMessage(conn);
+			ast_log(LOG_ERROR, "cdr_pgsql: Unable to reconnect to database server %s. Calls will not be logged!\n", pghostname);
+			ast_log(LOG_ERROR, "cdr_pgsql: Reason: %s\n", pgerror);
+			connected = 0;
+			return -1;
 		}
-		result = PQexec(conn, sqlcmd);
-		if ( PQresultStatus(result) != PGRES_COMMAND_OK) {
-                        pgerror = PQresultErrorMessage(result);
-			ast_log(LOG_ERROR,"cdr_pgsql: Failed to insert call detail record into database!\n");
-                        ast_log(LOG_ERROR,"cdr_pgsql: Reason: %s\n", pgerror);
-			ast_log(LOG_ERROR,"cdr_pgsql: Connection may have been lost... attempting to reconnect.\n");
-			PQreset(conn);
-			if (PQstatus(conn) == CONNECTION_OK) {
-				ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
-				connected = 1;
-				result = PQexec(conn, sqlcmd);
-				if ( PQresultStatus(result) != PGRES_COMMAND_OK)
-				{
-					pgerror = PQresultErrorMessage(result);
-					ast_log(LOG_ERROR,"cdr_pgsql: HARD ERROR!  Attempted reconnection failed.  DROPPING CALL RECORD!\n");
-					ast_log(LOG_ERROR,"cdr_pgsql: Reason: %s\n", pgerror);
-				}
+	}
+	return 0;
+}
+
+/*! \brief Worst case length of the VALUES tuple of a CDR, if all characters needed to be escaped */
+static size_t pgsql_row_size(struct ast_cdr *cdr)
+{
+	return 2 * (strlen(cdr->clid) + strlen(cdr->src) + strlen(cdr->dst) + strlen(cdr->dcontext) +
+		strlen(cdr->channel) + strlen(cdr->dstchannel) + strlen(cdr->lastapp) + strlen(cdr->lastdata) +
+		strlen(cdr->accountcode) + strlen(cdr->uniqueid) + strlen(cdr->userfield)) + 256;
+}
+
+/*! \brief Append a quoted and escaped string, and a comma */
+static char *pgsql_escape(char *buf, const char *s)
+{
+	int pgerr;
+
+	*buf++ = '\'';
+	buf += PQescapeStringConn(conn, buf, s, strlen(s), &pgerr);
+	*buf++ = '\'';
+	*buf++ = ',';
+	return buf;
+}
+
+/*! \brief Append the VALUES tuple of a CDR */
+static char *pgsql_row(char *buf, struct ast_cdr *cdr)
+{
+	struct tm tm;
+	char timestr[128];
+
+	localtime_r(&cdr->start.tv_sec,&tm);
+	strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
+
+	buf += sprintf(buf, "('%s',", timestr);
+	buf = pgsql_escape(buf, cdr->clid);
+	buf = pgsql_escape(buf, cdr->src);
+	buf = pgsql_escape(buf, cdr->dst);
+	buf = pgsql_escape(buf, cdr->dcontext);
+	buf = pgsql_escape(buf, cdr->channel);
+	buf = pgsql_escape(buf, cdr->dstchannel);
+	buf = pgsql_escape(buf, cdr->lastapp);
+	buf = pgsql_escape(buf, cdr->lastdata);
+	buf += sprintf(buf, "%ld,%ld,'%s',%ld,", cdr->duration, cdr->billsec, ast_cdr_disp2str(cdr->disposition), cdr->amaflags);
+	buf = pgsql_escape(buf, cdr->accountcode);
+	buf = pgsql_escape(buf, cdr->uniqueid);
+	buf = pgsql_escape(buf, cdr->userfield);
+	/* Replace the last comma */
+	buf[-1] = ')';
+	*buf = '\0';
+	return buf;
+}
+
+/*! \brief Insert CDRs with a single, multi-row, INSERT, so they are either all
+    stored or none of them are, at the cost of a single round trip
+ * \note Don't call without pgsql_lock, and a connection
+ */
+static int pgsql_insert(struct ast_cdr **cdrs, int count)
+{
+	char *sqlcmd, *buf;
+	char *pgerror;
+	size_t len;
+	int x;
+
+	len = strlen(table) + 256;
+	for (x = 0; x < count; x++)
+		len += pgsql_row_size(cdrs[x]);
+	if (!(sqlcmd = malloc(len))) {
+		ast_log(LOG_ERROR, "cdr_pgsql:  Out of memory error (insert fails)\n");
+		return -1;
+	}
+
+	ast_log(LOG_DEBUG,"cdr_pgsql: inserting %d CDR record%s.\n", count, (count == 1) ? "" : "s");
+
+	buf = sqlcmd + sprintf(sqlcmd, "INSERT INTO %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
+			 "lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) VALUES ",
+			 table);
+	for (x = 0; x < count; x++) {
+		if (x)
+			*buf++ = ',';
+		buf = pgsql_row(buf, cdrs[x]);
+	}
+
+	ast_log(LOG_DEBUG,"cdr_pgsql: SQL command executed:  %s\n",sqlcmd);
+
+	result = PQexec(conn, sqlcmd);
+	if ( PQresultStatus(result) != PGRES_COMMAND_OK) {
+                pgerror = PQresultErrorMessage(result);
+		ast_log(LOG_ERROR,"cdr_pgsql: Failed to insert call detail record into database!\n");
+                ast_log(LOG_ERROR,"cdr_pgsql: Reason: %s\n", pgerror);
+		ast_log(LOG_ERROR,"cdr_pgsql: Connection may have been lost... attempting to reconnect.\n");
+		PQclear(result);
+		PQreset(conn);
+		if (PQstatus(conn) == CONNECTION_OK) {
+			ast_log(LOG_ERROR, "cdr_pgsql: Connection reestablished.\n");
+			connected = 1;
+			result = PQexec(conn, sqlcmd);
+			if ( PQresultStatus(result) == PGRES_COMMAND_OK) {
+				PQclear(result);
+				free(sqlcmd);
+				return 0;
 			}
-			ast_mutex_unlock(&pgsql_lock);
-			return -1;
+			pgerror = PQresultErrorMessage(result);
+			ast_log(LOG_ERROR,"cdr_pgsql: HARD ERROR!  Attempted reconnection failed.\n");
+			ast_log(LOG_ERROR,"cdr_pgsql: Reason: %s\n", pgerror);
+			PQclear(result);
 		}
+		free(sqlcmd);
+		return -1;
 	}
-	ast_mutex_unlock(&pgsql_lock);
+	PQclear(result);
+	free(sqlcmd);
 	return 0;
 }
 
+static int pgsql_log_batch(struct ast_cdr **cdrs, int count)
+{
+	int res = -1;
+
+	ast_mutex_lock(&pgsql_lock);
+	if (!pgsql_connect())
+		res = pgsql_insert(cdrs, count);
+	ast_mutex_unlock(&pgsql_lock);
+	return res;
+}
+
+static int pgsql_log(struct ast_cdr *cdr)
+{
+	return pgsql_log_batch(&cdr, 1);
+}
+
 char *description(void)
 {
 	return desc;
@@ -186,8 +245,12 @@ char *description(void)
 
 static int my_unload_module(void)
 { 
+	/* Stop the core posting to us before the connection goes away */
+	ast_cdr_unregister(name);
 	if (conn)
 		PQfinish(conn);
+	conn = NULL;
+	connected = 0;
 	if (pghostname)
 		free(pghostname);
 	if (pgdbname)
@@ -202,7 +265,6 @@ static int my_unload_module(void)
 		free(pgdbport);
 	if (table)
 		free(table);
-	ast_cdr_unregister(name);
 	return 0;
 }
 
@@ -305,7 +367,7 @@ static int process_my_load_module(struct ast_config *cfg)
 		connected = 0;
 	}
 
-	res = ast_cdr_register(name, desc, pgsql_log);
+	res = ast_cdr_register_batch(name, desc, pgsql_log, pgsql_log_batch);
 	if (res) {
 		ast_log(LOG_ERROR, "Unable to register PGSQL CDR handling\n");
 	}
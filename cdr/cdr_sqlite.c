@@ -88,7 +88,32 @@ static char sql_create_table[] = "CREATE TABLE cdr ("
 #endif
 ");";
 
-static int sqlite_log(struct ast_cdr *cdr)
+/*! \brief Run a statement, trying again for a while if the database is busy
+ * \note Don't call without sqlite_lock
+ */
+static int sqlite_run(const char *sql)
+{
+	int res = 0;
+	char *zErr = 0;
+	int count;
+
+	for(count=0; count<5; count++) {
+		res = sqlite_exec(db, sql, NULL, NULL, &zErr);
+		if (res != SQLITE_BUSY && res != SQLITE_LOCKED)
+			break;
+		usleep(200);
+	}
+
+	if (zErr) {
+		ast_log(LOG_ERROR, "cdr_sqlite: %s\n", zErr);
+		free(zErr);
+	}
+
+	return res;
+}
+
+/*! \note Don't call without sqlite_lock */
+static int sqlite_insert(struct ast_cdr *cdr)
 {
 	int res = 0;
 	char *zErr = 0;
@@ -97,8 +122,6 @@ static int sqlite_log(struct ast_cdr *cdr)
 	char startstr[80], answerstr[80], endstr[80];
 	int count;
 
-	ast_mutex_lock(&sqlite_lock);
-
 	t = cdr->start.tv_sec;
 	localtime_r(&t, &tm);
 	strftime(startstr, sizeof(startstr), DATE_FORMAT, &tm);
@@ -160,10 +183,38 @@ static int sqlite_log(struct ast_cdr *cdr)
 		free(zErr);
 	}
 
+	return res;
+}
+
+static int sqlite_log(struct ast_cdr *cdr)
+{
+	int res;
+
+	ast_mutex_lock(&sqlite_lock);
+	res = sqlite_insert(cdr);
 	ast_mutex_unlock(&sqlite_lock);
 	return res;
 }
 
+/*! \brief Insert several records in a single transaction, which saves a
+    journal sync of the database file for every record but one */
+static int sqlite_log_batch(struct ast_cdr **cdrs, int count)
+{
+	int res;
+	int x;
+
+	ast_mutex_lock(&sqlite_lock);
+	res = sqlite_run("BEGIN;");
+	for (x = 0; !res && (x < count); x++)
+		res = sqlite_insert(cdrs[x]);
+	if (!res)
+		res = sqlite_run("COMMIT;");
+	if (res)
+		sqlite_run("ROLLBACK;");
+	ast_mutex_unlock(&sqlite_lock);
+	return res ? -1 : 0;
+}
+
 
 char *description(void)
 {
@@ -172,9 +223,10 @@ char *description(void)
 
 int unload_module(void)
 {
+	/* Stop the core posting to us before the database goes away */
+	ast_cdr_unregister(name);
 	if (db)
 		sqlite_close(db);
-	ast_cdr_unregister(name);
 	return 0;
 }
 
@@ -206,7 +258,7 @@ int load_module(void)
 		/* TODO: here we should probably create an index */
 	}
 	
-	res = ast_cdr_register(name, desc, sqlite_log);
+	res = ast_cdr_register_batch(name, desc, sqlite_log, sqlite_log_batch);
 	if (res) {
 		ast_log(LOG_ERROR, "Unable to register SQLite CDR handling\n");
 		return -1;
@@ -409,10 +409,11 @@ connect_fail:
 
 static int tds_unload_module(void)
 {
-	mssql_disconnect();
-
+	/* Stop the core posting to us before the connection goes away */
 	ast_cdr_unregister(name);
 
+	mssql_disconnect();
+
 	if (hostname) free(hostname);
 	if (dbname) free(dbname);
 	if (dbuser) free(dbuser);
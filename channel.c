@@ -71,6 +71,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 73349 $")
 #include "asterisk/app.h"
 #include "asterisk/transcap.h"
 #include "asterisk/devicestate.h"
+#include "asterisk/astobj.h"
 
 struct channel_spy_trans {
 	int last_format;
@@ -113,6 +114,27 @@ static struct chanlist *backends = NULL;
  */
 static struct ast_channel *channels = NULL;
 
+/*
+ * the same channels, hashed for the lookups that would otherwise walk the
+ * list.  Channel drivers write the name straight into the channel after
+ * ast_channel_alloc(), so new channels wait on channels_unnamed until
+ * ast_setstate() (or a lookup that misses) finds them named.  The pbx
+ * writes exten and macroexten directly too, and refiles the channel
+ * before running each application.  Every hit is checked against the
+ * channel itself.
+ */
+#define CHANNEL_BUCKETS 1024
+enum {
+	CHANNEL_BY_NAME,	/*!< Full name */
+	CHANNEL_BY_DEVICE,	/*!< Name up to its last '-', for device state */
+	CHANNEL_BY_EXTEN,	/*!< exten, for directed pickup */
+	CHANNEL_BY_MACROEXTEN,	/*!< macroexten, ditto */
+};
+#define CHANNEL_FILED(index)	(1 << (index))
+#define CHANNEL_UNNAMED		"**Unknown**"
+static struct ast_channel *channel_hash[AST_CHANNEL_INDEXES][CHANNEL_BUCKETS];
+static struct ast_channel *channels_unnamed = NULL;
+
 /* Protect the channel list, both backends and channels.
  */
 AST_MUTEX_DEFINE_STATIC(chlock);
@@ -515,6 +537,207 @@ static const struct ast_channel_tech null_tech = {
 	.description = "Null channel (should not see this)",
 };
 
+/*! \brief Hash of the device part of a channel name: everything up to and
+    including its last '-', which is what device state looks channels up by */
+static unsigned int channel_device_hash(const char *name)
+{
+	char device[AST_CHANNEL_NAME];
+	char *dash;
+
+	ast_copy_string(device, name, sizeof(device));
+	if ((dash = strrchr(device, '-')))
+		dash[1] = '\0';
+	return ast_strhash(device);
+}
+
+/*! \brief Work out which lookup hashes a channel belongs in, and under
+    which keys.  Returns a mask of CHANNEL_FILED() bits. */
+static unsigned int channel_hash_keys(struct ast_channel *c, unsigned int *keys)
+{
+	unsigned int wanted = 0;
+
+	if (strcmp(c->name, CHANNEL_UNNAMED)) {
+		keys[CHANNEL_BY_NAME] = ast_strhash(c->name);
+		keys[CHANNEL_BY_DEVICE] = channel_device_hash(c->name);
+		wanted |= CHANNEL_FILED(CHANNEL_BY_NAME) | CHANNEL_FILED(CHANNEL_BY_DEVICE);
+	}
+	/* Most channels have no macroexten, don't pile them all up in one bucket */
+	if (!ast_strlen_zero(c->exten)) {
+		keys[CHANNEL_BY_EXTEN] = ast_strhash(c->exten);
+		wanted |= CHANNEL_FILED(CHANNEL_BY_EXTEN);
+	}
+	if (!ast_strlen_zero(c->macroexten)) {
+		keys[CHANNEL_BY_MACROEXTEN] = ast_strhash(c->macroexten);
+		wanted |= CHANNEL_FILED(CHANNEL_BY_MACROEXTEN);
+	}
+	return wanted;
+}
+
+/*! \brief File a channel in one lookup hash.  Call with chlock held. */
+static void channel_hash_link(struct ast_channel *c, int index, unsigned int key)
+{
+	struct ast_channel **bucket = &channel_hash[index][key % CHANNEL_BUCKETS];
+
+	c->hashkey[index] = key;
+	c->hashnext[index] = *bucket;
+	*bucket = c;
+	c->hashfiled |= CHANNEL_FILED(index);
+}
+
+/*! \brief Take a channel out of one lookup hash.  Call with chlock held. */
+static void channel_hash_unlink(struct ast_channel *c, int index)
+{
+	struct ast_channel **cur;
+
+	for (cur = &channel_hash[index][c->hashkey[index] % CHANNEL_BUCKETS]; *cur; cur = &(*cur)->hashnext[index]) {
+		if (*cur == c) {
+			*cur = c->hashnext[index];
+			break;
+		}
+	}
+	c->hashnext[index] = NULL;
+	c->hashfiled &= ~CHANNEL_FILED(index);
+}
+
+/*! \brief Take a channel off the list of unnamed ones.  Call with chlock held. */
+static void channel_unnamed_unlink(struct ast_channel *c)
+{
+	struct ast_channel **cur;
+
+	for (cur = &channels_unnamed; *cur; cur = &(*cur)->hashnext[CHANNEL_BY_NAME]) {
+		if (*cur == c) {
+			*cur = c->hashnext[CHANNEL_BY_NAME];
+			break;
+		}
+	}
+	c->hashnext[CHANNEL_BY_NAME] = NULL;
+	c->hashnamed = 1;
+}
+
+/*! \brief Refile a channel under the keys it has now.  Call with chlock held. */
+static void channel_hash_update(struct ast_channel *c, unsigned int wanted, unsigned int *keys)
+{
+	int x;
+
+	/* The name hash link doubles as the link of the unnamed list */
+	if (!c->hashnamed && (wanted & CHANNEL_FILED(CHANNEL_BY_NAME)))
+		channel_unnamed_unlink(c);
+	for (x = 0; x < AST_CHANNEL_INDEXES; x++) {
+		if ((c->hashfiled & CHANNEL_FILED(x)) &&
+		    (!(wanted & CHANNEL_FILED(x)) || (keys[x] != c->hashkey[x])))
+			channel_hash_unlink(c, x);
+		if ((wanted & CHANNEL_FILED(x)) && !(c->hashfiled & CHANNEL_FILED(x)))
+			channel_hash_link(c, x, keys[x]);
+	}
+}
+
+/*! \brief Refile a channel whose name or extension may have changed.  Call with chlock held. */
+static void channel_hash_refile(struct ast_channel *c)
+{
+	unsigned int keys[AST_CHANNEL_INDEXES];
+
+	channel_hash_update(c, channel_hash_keys(c, keys), keys);
+}
+
+/*! \brief Take a channel out of every lookup hash.  Call with chlock held. */
+static void channel_hash_remove(struct ast_channel *c)
+{
+	int x;
+
+	if (!c->hashnamed)
+		channel_unnamed_unlink(c);
+	for (x = 0; x < AST_CHANNEL_INDEXES; x++) {
+		if (c->hashfiled & CHANNEL_FILED(x))
+			channel_hash_unlink(c, x);
+	}
+}
+
+void ast_channel_refile(struct ast_channel *chan)
+{
+	unsigned int keys[AST_CHANNEL_INDEXES];
+	unsigned int wanted;
+	int x;
+
+	wanted = channel_hash_keys(chan, keys);
+	/* Usually nothing moved, and then chlock isn't needed */
+	if ((wanted == chan->hashfiled) && (chan->hashnamed || !(wanted & CHANNEL_FILED(CHANNEL_BY_NAME)))) {
+		for (x = 0; x < AST_CHANNEL_INDEXES; x++) {
+			if ((wanted & CHANNEL_FILED(x)) && (keys[x] != chan->hashkey[x]))
+				break;
+		}
+		if (x == AST_CHANNEL_INDEXES)
+			return;
+	}
+	ast_mutex_lock(&chlock);
+	channel_hash_update(chan, wanted, keys);
+	ast_mutex_unlock(&chlock);
+}
+
+/*! \brief File the channels that were named since they were allocated, for
+    drivers that have not set their state yet.  Call with chlock held. */
+static void channel_hash_name_new(void)
+{
+	struct ast_channel *c, *next;
+
+	for (c = channels_unnamed; c; c = next) {
+		next = c->hashnext[CHANNEL_BY_NAME];
+		if (strcmp(c->name, CHANNEL_UNNAMED))
+			channel_hash_refile(c);
+	}
+}
+
+/*! \brief Find a channel in the lookup hashes: a full name in the name
+    hash, a prefix ending in '-' in the device hash, an exten in the exten
+    and macroexten hashes.  Call with chlock held. */
+static struct ast_channel *channel_hash_find(const char *name, const int namelen,
+					     const char *context, const char *exten)
+{
+	struct ast_channel *c;
+	char device[AST_CHANNEL_NAME];
+	unsigned int key;
+	int pass;
+
+	if (exten) {
+		key = ast_strhash(exten);
+		for (c = channel_hash[CHANNEL_BY_EXTEN][key % CHANNEL_BUCKETS]; c; c = c->hashnext[CHANNEL_BY_EXTEN]) {
+			if ((c->hashkey[CHANNEL_BY_EXTEN] == key) && !strcasecmp(c->exten, exten) &&
+			    (!context || !strcasecmp(c->context, context) || !strcasecmp(c->macrocontext, context)))
+				return c;
+		}
+		for (c = channel_hash[CHANNEL_BY_MACROEXTEN][key % CHANNEL_BUCKETS]; c; c = c->hashnext[CHANNEL_BY_MACROEXTEN]) {
+			if ((c->hashkey[CHANNEL_BY_MACROEXTEN] == key) && !strcasecmp(c->macroexten, exten) &&
+			    (!context || !strcasecmp(c->context, context) || !strcasecmp(c->macrocontext, context)))
+				return c;
+		}
+		return NULL;
+	}
+
+	if (namelen) {
+		ast_copy_string(device, name, (namelen < sizeof(device)) ? namelen + 1 : sizeof(device));
+		key = ast_strhash(device);
+	} else
+		key = ast_strhash(name);
+	for (pass = 0; pass < 2; pass++) {
+		if (namelen) {
+			for (c = channel_hash[CHANNEL_BY_DEVICE][key % CHANNEL_BUCKETS]; c; c = c->hashnext[CHANNEL_BY_DEVICE]) {
+				if ((c->hashkey[CHANNEL_BY_DEVICE] == key) && !strncasecmp(c->name, name, namelen) &&
+				    !strchr(c->name + namelen, '-'))
+					return c;
+			}
+		} else {
+			for (c = channel_hash[CHANNEL_BY_NAME][key % CHANNEL_BUCKETS]; c; c = c->hashnext[CHANNEL_BY_NAME]) {
+				if ((c->hashkey[CHANNEL_BY_NAME] == key) && !strcasecmp(c->name, name))
+					return c;
+			}
+		}
+		if (pass || !channels_unnamed)
+			break;
+		/* Not there, maybe because it was named after it was allocated */
+		channel_hash_name_new();
+	}
+	return NULL;
+}
+
 /*--- ast_channel_alloc: Create a new channel structure */
 struct ast_channel *ast_channel_alloc(int needqueue)
 {
@@ -579,7 +802,7 @@ struct ast_channel *ast_channel_alloc(int needqueue)
 	tmp->fds[AST_MAX_FDS-1] = tmp->alertpipe[0];
 	/* And timing pipe */
 	tmp->fds[AST_MAX_FDS-2] = tmp->timingfd;
-	strcpy(tmp->name, "**Unknown**");
+	strcpy(tmp->name, CHANNEL_UNNAMED);
 	/* Initial state */
 	tmp->_state = AST_STATE_DOWN;
 	tmp->streamid = -1;
@@ -605,6 +828,10 @@ struct ast_channel *ast_channel_alloc(int needqueue)
 	ast_mutex_lock(&chlock);
 	tmp->next = channels;
 	channels = tmp;
+	/* Not named yet, the name hash link keeps it on channels_unnamed */
+	tmp->hashnext[CHANNEL_BY_NAME] = channels_unnamed;
+	channels_unnamed = tmp;
+	channel_hash_refile(tmp);
 
 	ast_mutex_unlock(&chlock);
 	return tmp;
@@ -720,8 +947,9 @@ void ast_channel_undefer_dtmf(struct ast_channel *chan)
  * It returns with the channel's lock held. If getting the individual lock fails,
  * unlock and retry quickly up to 10 times, then give up.
  * 
- * XXX Note that this code has cost O(N) because of the need to verify
- * that the object is still on the global list.
+ * Full names, prefixes ending in '-' (device names) and extens are looked
+ * up in the hashes, which only hold channels still on the global list.
+ * Walks and other prefixes cost O(N), because they have to walk the list.
  *
  * XXX also note that accessing fields (e.g. c->name in ast_log())
  * can only be done with the lock held or someone could delete the
@@ -742,7 +970,9 @@ static struct ast_channel *channel_find_locked(const struct ast_channel *prev,
 		int done;
 
 		ast_mutex_lock(&chlock);
-		for (c = channels; c; c = c->next) {
+		if (!prev && ((name && (!namelen || (name[namelen - 1] == '-'))) || (!name && exten)))
+			c = channel_hash_find(name, namelen, context, exten);
+		else for (c = channels; c; c = c->next) {
 			if (prev) {	/* look for next item */
 				if (c != prev)	/* not this one */
 					continue;
@@ -912,6 +1142,7 @@ void ast_channel_free(struct ast_channel *chan)
 		ast_log(LOG_ERROR, "Unable to find channel in list to free. Assuming it has already been done.\n");
 		return;
 	}
+	channel_hash_remove(cur);
 
 	/* Lock and unlock the channel just to be sure nobody
 	   has it locked still */
@@ -2888,7 +3119,10 @@ void ast_change_name(struct ast_channel *chan, char *newname)
 	char tmp[256];
 	ast_copy_string(tmp, chan->name, sizeof(tmp));
 	ast_copy_string(chan->name, newname, sizeof(chan->name));
+	ast_channel_refile(chan);
 	manager_event(EVENT_FLAG_CALL, "Rename", "Oldname: %s\r\nNewname: %s\r\nUniqueid: %s\r\n", tmp, chan->name, chan->uniqueid);
+	ast_device_state_changed_literal(tmp);
+	ast_device_state_changed_literal(chan->name);
 }
 
 void ast_channel_inherit_variables(const struct ast_channel *parent, struct ast_channel *child)
@@ -3122,6 +3356,10 @@ int ast_do_masquerade(struct ast_channel *original)
 	/* Mangle the name of the clone channel */
 	ast_copy_string(clone->name, zombn, sizeof(clone->name));
 	manager_event(EVENT_FLAG_CALL, "Rename", "Oldname: %s\r\nNewname: %s\r\nUniqueid: %s\r\n", masqn, zombn, clone->uniqueid);
+	ast_mutex_lock(&chlock);
+	channel_hash_refile(original);
+	channel_hash_refile(clone);
+	ast_mutex_unlock(&chlock);
 
 	/* Update the type. */
 	original->type = clone->type;
@@ -3271,6 +3509,8 @@ int ast_setstate(struct ast_channel *chan, int state)
 {
 	int oldstate = chan->_state;
 
+	/* Drivers name their new channels before setting the first state */
+	ast_channel_refile(chan);
 	if (oldstate == state)
 		return 0;
 
@@ -0,0 +1,55 @@
+/* busy.h: Generated from frequencies 480 and 620 
+   by gentone.  400 samples  */
+static short busy[400] = {
+	    0, 13697, 24766, 31109, 31585, 26222, 16198,  3569, 
+	-9162, -19575, -25812, -26935, -23069, -15322, -5493,  4339, 
+	12277, 16985, 17934, 15440, 10519,  4585,  -908, -4827, 
+	-6592, -6269, -4489, -2220,  -467,    30,  -983, -3203, 
+	-5839, -7844, -8215, -6301, -2035,  3975, 10543, 16141, 
+	19260, 18787, 14322,  6338, -3845, -14296, -22858, -27611, 
+	-27309, -21691, -11585,  1213, 14285, 25068, 31388, 31915, 
+	26457, 16010,  2568, -11282, -22885, -30054, -31509, -27120, 
+	-17908, -5805,  6760, 17379, 24147, 26028, 23020, 16094, 
+	 6931, -2478, -10279, -15136, -16474, -14538, -10253, -4949, 
+	    0,  3515,  5052,  4688,  3045,  1069,  -268,  -272, 
+	 1269,  3996,  7067,  9381,  9889,  7910,  3365, -3123, 
+	-10320, -16622, -20424, -20510, -16384, -8448,  2006, 13026, 
+	22383, 28040, 28613, 23696, 13996,  1232, -12193, -23670, 
+	-30918, -32459, -27935, -18190, -5103,  8795, 20838, 28764, 
+	31164, 27753, 19395,  7893, -4412, -15136, -22342, -24909, 
+	-22717, -16609, -8143,   780,  8361, 13272, 14909, 13455, 
+	 9758,  5067,   678, -2387, -3624, -3133, -1538,   224, 
+	 1209,   751, -1315, -4580, -8145, -10848, -11585, -9628, 
+	-4878,  2038,  9844, 16867, 21403, 22124, 18429, 10638, 
+	    0, -11524, -21643, -28211, -29702, -25561, -16364, -3737, 
+	 9946, 22044, 30180, 32733, 29182, 20210,  7573, -6269, 
+	-18655, -27259, -30558, -28117, -20645, -9807,  2148, 12878, 
+	20426, 23599, 22173, 16865,  9117,   731, -6552, -11426, 
+	-13269, -12216, -9050, -4941, -1118,  1460,  2335,  1635, 
+	    0, -1635, -2335, -1460,  1118,  4941,  9050, 12216, 
+	13269, 11426,  6552,  -731, -9117, -16865, -22173, -23599, 
+	-20426, -12878, -2148,  9807, 20645, 28117, 30558, 27259, 
+	18655,  6269, -7573, -20210, -29182, -32733, -30180, -22044, 
+	-9946,  3737, 16364, 25561, 29702, 28211, 21643, 11524, 
+	    0, -10638, -18429, -22124, -21403, -16867, -9844, -2038, 
+	 4878,  9628, 11585, 10848,  8145,  4580,  1315,  -751, 
+	-1209,  -224,  1538,  3133,  3624,  2387,  -678, -5067, 
+	-9758, -13455, -14909, -13272, -8361,  -780,  8143, 16609, 
+	22717, 24909, 22342, 15136,  4412, -7893, -19395, -27753, 
+	-31164, -28764, -20838, -8795,  5103, 18190, 27935, 32459, 
+	30918, 23670, 12193, -1232, -13996, -23696, -28613, -28040, 
+	-22383, -13026, -2006,  8448, 16384, 20510, 20424, 16622, 
+	10320,  3123, -3365, -7910, -9889, -9381, -7067, -3996, 
+	-1269,   272,   268, -1069, -3045, -4688, -5052, -3515, 
+	    0,  4949, 10253, 14538, 16474, 15136, 10279,  2478, 
+	-6931, -16094, -23020, -26028, -24147, -17379, -6760,  5805, 
+	17908, 27120, 31509, 30054, 22885, 11282, -2568, -16010, 
+	-26457, -31915, -31388, -25068, -14285, -1213, 11585, 21691, 
+	27309, 27611, 22858, 14296,  3845, -6338, -14322, -18787, 
+	-19260, -16141, -10543, -3975,  2035,  6301,  8215,  7844, 
+	 5839,  3203,   983,   -30,   467,  2220,  4489,  6269, 
+	 6592,  4827,   908, -4585, -10519, -15440, -17934, -16985, 
+	-12277, -4339,  5493, 15322, 23069, 26935, 25812, 19575, 
+	 9162, -3569, -16198, -26222, -31585, -31109, -24766, -13697, 
+	
+};
@@ -2320,7 +2320,8 @@ int load_module()
 	sched = sched_context_create();
 	if (!sched) {
 		ast_log(LOG_WARNING, "Unable to create schedule context\n");
-	}
+	} else
+		ast_sched_set_name(sched, "chan_h323");
 	io = io_context_create();
 	if (!io) {
 		ast_log(LOG_WARNING, "Unable to create I/O context\n");
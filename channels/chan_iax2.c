@@ -47,6 +47,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <regex.h>
+#include <ctype.h>
 #ifdef IAX_TRUNKING
 #include <sys/ioctl.h>
 #ifdef __linux__
@@ -89,6 +90,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 94255 $")
 #include "asterisk/dnsmgr.h"
 #include "asterisk/devicestate.h"
 #include "asterisk/netsock.h"
+#include "asterisk/astobj.h"
 
 #include "iax2.h"
 #include "iax2-parser.h"
@@ -348,6 +350,7 @@ struct iax2_peer {
 	
 	struct ast_ha *ha;
 	struct iax2_peer *next;
+	struct iax2_peer *hashnext;			/*!< Next peer in the same bucket of the name hash */
 };
 
 #define IAX2_TRUNK_PREFACE (sizeof(struct iax_frame) + sizeof(struct ast_iax2_meta_hdr) + sizeof(struct ast_iax2_meta_trunk_hdr))
@@ -611,6 +614,12 @@ struct chan_iax2_pvt {
 	int frames_dropped;
 	/*! received frame count: (just for stats) */
 	int frames_received;
+	/*! Next call in the same peercalls bucket */
+	struct chan_iax2_pvt *hashnext;
+	/*! Bucket we are in, if hashed is set */
+	unsigned int hashbucket;
+	/*! Are we in the peercalls hash? */
+	int hashed;
 };
 
 static struct ast_iax2_queue {
@@ -625,8 +634,11 @@ static struct ast_user_list {
 	ast_mutex_t lock;
 } userl;
 
+#define IAX_PEER_BUCKETS	4093
+
 static struct ast_peer_list {
 	struct iax2_peer *peers;
+	struct iax2_peer *hash[IAX_PEER_BUCKETS];	/*!< The same peers, by name */
 	ast_mutex_t lock;
 } peerl;
 
@@ -736,6 +748,14 @@ static struct chan_iax2_pvt *iaxs[IAX_MAX_CALLS];
 static ast_mutex_t iaxsl[IAX_MAX_CALLS];
 static struct timeval lastused[IAX_MAX_CALLS];
 
+/*! Number of buckets in the peercalls hash */
+#define IAX_PEERCALL_BUCKETS	2053
+
+/*! Calls hashed by the remote address, port and call number, so that
+    find_callno() does not have to look at every call */
+static struct chan_iax2_pvt *peercalls[IAX_PEERCALL_BUCKETS];
+AST_MUTEX_DEFINE_STATIC(peercallslock);
+
 
 static int send_command(struct chan_iax2_pvt *, char, int, unsigned int, const unsigned char *, int, int);
 static int send_command_locked(unsigned short callno, char, int, unsigned int, const unsigned char *, int, int);
@@ -866,11 +886,43 @@ static int uncompress_subclass(unsigned char csub)
 		return csub;
 }
 
+/*! \brief Bucket of the peer name hash a name belongs in */
+static struct iax2_peer **peer_bucket(const char *name)
+{
+	return &peerl.hash[ast_strhash(name) % IAX_PEER_BUCKETS];
+}
+
+/*! \brief Add a peer to the peer list.  Call with peerl.lock held. */
+static void link_peer(struct iax2_peer *peer)
+{
+	struct iax2_peer **bucket = peer_bucket(peer->name);
+
+	peer->next = peerl.peers;
+	peerl.peers = peer;
+	peer->hashnext = *bucket;
+	*bucket = peer;
+}
+
+/*! \brief Take a peer out of the name hash, after it has been taken out of
+    the peer list.  Call with peerl.lock held. */
+static void unhash_peer(struct iax2_peer *peer)
+{
+	struct iax2_peer **cur;
+
+	for (cur = peer_bucket(peer->name); *cur; cur = &(*cur)->hashnext) {
+		if (*cur == peer) {
+			*cur = peer->hashnext;
+			break;
+		}
+	}
+	peer->hashnext = NULL;
+}
+
 static struct iax2_peer *find_peer(const char *name, int realtime) 
 {
 	struct iax2_peer *peer;
 	ast_mutex_lock(&peerl.lock);
-	for(peer = peerl.peers; peer; peer = peer->next) {
+	for(peer = *peer_bucket(name); peer; peer = peer->hashnext) {
 		if (!strcasecmp(peer->name, name)) {
 			break;
 		}
@@ -987,6 +1039,91 @@ static int match(struct sockaddr_in *sin, unsigned short callno, unsigned short
 	return 0;
 }
 
+static unsigned int peercall_hash(const struct sockaddr_in *sin, unsigned short peercallno)
+{
+	unsigned int hash = ntohl(sin->sin_addr.s_addr);
+
+	hash = hash * 31 + ntohs(sin->sin_port);
+	hash = hash * 31 + peercallno;
+	return hash % IAX_PEERCALL_BUCKETS;
+}
+
+/*! \brief Take a call out of the peercalls hash */
+static void peercall_unlink(struct chan_iax2_pvt *pvt)
+{
+	struct chan_iax2_pvt **cur;
+
+	ast_mutex_lock(&peercallslock);
+	if (pvt->hashed) {
+		for (cur = &peercalls[pvt->hashbucket]; *cur; cur = &(*cur)->hashnext) {
+			if (*cur == pvt) {
+				*cur = pvt->hashnext;
+				break;
+			}
+		}
+		pvt->hashnext = NULL;
+		pvt->hashed = 0;
+	}
+	ast_mutex_unlock(&peercallslock);
+}
+
+/*! \brief (Re)hash a call under its current address and peer call number.
+    Must be called whenever either of them changes. */
+static void peercall_link(struct chan_iax2_pvt *pvt)
+{
+	peercall_unlink(pvt);
+	ast_mutex_lock(&peercallslock);
+	pvt->hashbucket = peercall_hash(&pvt->addr, pvt->peercallno);
+	pvt->hashnext = peercalls[pvt->hashbucket];
+	peercalls[pvt->hashbucket] = pvt;
+	pvt->hashed = 1;
+	ast_mutex_unlock(&peercallslock);
+}
+
+/*! \brief Find an existing call matching an incoming frame.  Returns the
+    call number (with its lock not held) or 0. */
+static int peercall_find(struct sockaddr_in *sin, unsigned short callno, unsigned short dcallno)
+{
+	struct chan_iax2_pvt *pvt;
+	int x, tries;
+
+	/* Frames carrying our call number can be checked directly; this covers
+	   calls the peer has not given us its number for yet, and transfers */
+	if (dcallno && (dcallno < IAX_MAX_CALLS)) {
+		ast_mutex_lock(&iaxsl[dcallno]);
+		if (iaxs[dcallno] && match(sin, callno, dcallno, iaxs[dcallno])) {
+			ast_mutex_unlock(&iaxsl[dcallno]);
+			return dcallno;
+		}
+		ast_mutex_unlock(&iaxsl[dcallno]);
+	}
+
+	/* The call may be moved by make_trunk() or destroyed while we are not
+	   holding its lock, so check again once we have it */
+	for (tries = 0; tries < 3; tries++) {
+		x = 0;
+		ast_mutex_lock(&peercallslock);
+		for (pvt = peercalls[peercall_hash(sin, callno)]; pvt; pvt = pvt->hashnext) {
+			if ((pvt->peercallno == callno) &&
+			    (pvt->addr.sin_addr.s_addr == sin->sin_addr.s_addr) &&
+			    (pvt->addr.sin_port == sin->sin_port)) {
+				x = pvt->callno;
+				break;
+			}
+		}
+		ast_mutex_unlock(&peercallslock);
+		if (!x)
+			return 0;
+		ast_mutex_lock(&iaxsl[x]);
+		if (iaxs[x] && match(sin, callno, dcallno, iaxs[x])) {
+			ast_mutex_unlock(&iaxsl[x]);
+			return x;
+		}
+		ast_mutex_unlock(&iaxsl[x]);
+	}
+	return 0;
+}
+
 static void update_max_trunk(void)
 {
 	int max = TRUNK_CALL_START;
@@ -1033,7 +1170,10 @@ static int make_trunk(unsigned short callno, int locked)
 		ast_mutex_lock(&iaxsl[x]);
 		if (!iaxs[x] && ((now.tv_sec - lastused[x].tv_sec) > MIN_REUSE_TIME)) {
 			iaxs[x] = iaxs[callno];
+			/* The hash entry stays, but now has to lead to the new call number */
+			ast_mutex_lock(&peercallslock);
 			iaxs[x]->callno = x;
+			ast_mutex_unlock(&peercallslock);
 			iaxs[callno] = NULL;
 			/* Update the two timers that should have been started */
 			if (iaxs[x]->pingid > -1)
@@ -1071,26 +1211,7 @@ static int find_callno(unsigned short callno, unsigned short dcallno, struct soc
 	char host[80];
 	if (new <= NEW_ALLOW) {
 		/* Look for an existing connection first */
-		for (x=1;(res < 1) && (x<maxnontrunkcall);x++) {
-			ast_mutex_lock(&iaxsl[x]);
-			if (iaxs[x]) {
-				/* Look for an exact match */
-				if (match(sin, callno, dcallno, iaxs[x])) {
-					res = x;
-				}
-			}
-			ast_mutex_unlock(&iaxsl[x]);
-		}
-		for (x=TRUNK_CALL_START;(res < 1) && (x<maxtrunkcall);x++) {
-			ast_mutex_lock(&iaxsl[x]);
-			if (iaxs[x]) {
-				/* Look for an exact match */
-				if (match(sin, callno, dcallno, iaxs[x])) {
-					res = x;
-				}
-			}
-			ast_mutex_unlock(&iaxsl[x]);
-		}
+		res = peercall_find(sin, callno, dcallno);
 	}
 	if ((res < 1) && (new >= NEW_ALLOW)) {
 		/* It may seem odd that we look through the peer list for a name for
@@ -1124,6 +1245,7 @@ static int find_callno(unsigned short callno, unsigned short dcallno, struct soc
 			iaxs[x]->addr.sin_addr.s_addr = sin->sin_addr.s_addr;
 			iaxs[x]->peercallno = callno;
 			iaxs[x]->callno = x;
+			peercall_link(iaxs[x]);
 			iaxs[x]->pingtime = DEFAULT_RETRY_TIME;
 			iaxs[x]->expiry = min_reg_expire;
 			iaxs[x]->pingid = ast_sched_add(sched, ping_time * 1000, send_ping, (void *)(long)x);
@@ -1649,8 +1771,10 @@ retry:
 	if (!owner)
 		iaxs[callno] = NULL;
 	if (pvt) {
-		if (!owner)
+		if (!owner) {
 			pvt->owner = NULL;
+			peercall_unlink(pvt);
+		}
 		if (ast_test_flag(pvt, IAX_MAXAUTHREQ)) {
 			ast_mutex_lock(&userl.lock);
 			user = userl.users;
@@ -2717,8 +2841,7 @@ static struct iax2_peer *realtime_peer(const char *peername, struct sockaddr_in
 			peer->expire = ast_sched_add(sched, (global_rtautoclear) * 1000, expire_registry, peer);
 		}
 		ast_mutex_lock(&peerl.lock);
-		peer->next = peerl.peers;
-		peerl.peers = peer;
+		link_peer(peer);
 		ast_mutex_unlock(&peerl.lock);
 		if (ast_test_flag(peer, IAX_DYNAMIC))
 			reg_source_db(peer);
@@ -5562,6 +5685,7 @@ static int complete_transfer(int callno, struct iax_ies *ies)
 	pvt->iseqno = 0;
 	pvt->aseqno = 0;
 	pvt->peercallno = peercallno;
+	peercall_link(pvt);
 	pvt->transferring = TRANSFER_NONE;
 	pvt->svoiceformat = -1;
 	pvt->voiceformat = 0;
@@ -6721,8 +6845,13 @@ static int socket_read(int *id, int fd, short events, void *cbdata)
 
 	if (!inaddrcmp(&sin, &iaxs[fr->callno]->addr) && !minivid &&
 		f.subclass != IAX_COMMAND_TXCNT &&		/* for attended transfer */
-		f.subclass != IAX_COMMAND_TXACC)		/* for attended transfer */
-		iaxs[fr->callno]->peercallno = (unsigned short)(ntohs(mh->callno) & ~IAX_FLAG_FULL);
+		f.subclass != IAX_COMMAND_TXACC) {	/* for attended transfer */
+		unsigned short new_peercallno = (unsigned short)(ntohs(mh->callno) & ~IAX_FLAG_FULL);
+		if (iaxs[fr->callno]->peercallno != new_peercallno) {
+			iaxs[fr->callno]->peercallno = new_peercallno;
+			peercall_link(iaxs[fr->callno]);
+		}
+	}
 	if (ntohs(mh->callno) & IAX_FLAG_FULL) {
 		if (option_debug  && iaxdebug)
 			ast_log(LOG_DEBUG, "Received packet %d, (%d, %d)\n", fh->oseqno, f.frametype, f.subclass);
@@ -8404,6 +8533,7 @@ static struct iax2_peer *build_peer(const char *name, struct ast_variable *v, in
 		} else {
 			peerl.peers = peer->next;
 		}
+		unhash_peer(peer);
 		ast_mutex_unlock(&peerl.lock);
  	} else {
 		ast_mutex_unlock(&peerl.lock);
@@ -8842,6 +8972,7 @@ static void prune_peers(void){
 	for (peer=peerl.peers;peer;) {
 		peernext = peer->next;
 		if (ast_test_flag(peer, IAX_DELME)) {
+			unhash_peer(peer);
 			destroy_peer(peer);
 			if (peerlast)
 				peerlast->next = peernext;
@@ -9121,8 +9252,7 @@ static int set_config(char *config_file, int reload)
 					peer = build_peer(cat, ast_variable_browse(cfg, cat), 0);
 					if (peer) {
 						ast_mutex_lock(&peerl.lock);
-						peer->next = peerl.peers;
-						peerl.peers = peer;
+						link_peer(peer);
 						ast_mutex_unlock(&peerl.lock);
 						if (ast_test_flag(peer, IAX_DYNAMIC))
 							reg_source_db(peer);
@@ -9890,6 +10020,7 @@ int load_module(void)
 		ast_log(LOG_ERROR, "Out of memory\n");
 		return -1;
 	}
+	ast_sched_set_name(sched, "chan_iax2");
 
 	netsock = ast_netsock_list_alloc();
 	if (!netsock) {
@@ -4253,6 +4253,7 @@ int load_module()
 		ast_log(LOG_WARNING, "Unable to create schedule context\n");
 		return -1;
 	}
+	ast_sched_set_name(sched, "chan_mgcp");
 	io = io_context_create();
 	if (!io) {
 		ast_log(LOG_WARNING, "Unable to create I/O context\n");
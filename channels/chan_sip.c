@@ -107,6 +107,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 109391 $")
 #define DEFAULT_REGISTRATION_TIMEOUT	20
 #define DEFAULT_MAX_FORWARDS	"70"
 
+#define SIP_OBJ_BUCKETS		8191	/* Hash buckets for the peer and user lists */
+
 /* guard limit must be larger than guard secs */
 /* guard min must be < 1000, and should be >= 250 */
 #define EXPIRY_GUARD_SECS	15	/* How long before expiry do we reregister */
@@ -387,8 +389,29 @@ static int regobjs = 0;
 
 static int global_allowguest = 1;    /*!< allow unauthenticated users/peers to connect? */
 
-#define DEFAULT_MWITIME 10
-static int global_mwitime = DEFAULT_MWITIME;	/*!< Time between MWI checks for peers */
+#define DEFAULT_MWITIME 300
+static int global_mwitime = DEFAULT_MWITIME;	/*!< Time between MWI checks for peers, 0 for none */
+
+/*! \brief A mailbox whose message counts changed, see sip_mwi_changed() */
+struct sip_mwi_change {
+	struct sip_mwi_change *next;
+	unsigned int hash;
+	char mailbox[1];
+};
+
+#define MWI_CHANGE_BUCKETS 256
+/*! How many peers do_monitor() sends MWI to before it looks at the network again */
+#define MWI_PEERS_PER_PASS 10
+
+static struct sip_mwi_change *mwi_changes[MWI_CHANGE_BUCKETS];	/*!< Changed since the last MWI sweep */
+static int mwi_changed;
+static int mwi_changed_all;		/*!< Any mailbox may have changed */
+AST_MUTEX_DEFINE_STATIC(mwi_lock);
+
+static struct sip_peer **mwi_due;	/*!< Peers found by the last MWI sweep */
+static int mwi_ndue, mwi_maxdue, mwi_next;
+
+static int global_workerthreads = 0;	/*!< SIP worker threads, 0 to handle everything in the monitor thread */
 
 static int usecnt =0;
 AST_MUTEX_DEFINE_STATIC(usecnt_lock);
@@ -398,6 +421,9 @@ AST_MUTEX_DEFINE_STATIC(rand_lock);
 /*! \brief Protect the interface list (of sip_pvt's) */
 AST_MUTEX_DEFINE_STATIC(iflock);
 
+/*! \brief Protect the queue of dialogs waiting to be destroyed by do_monitor */
+AST_MUTEX_DEFINE_STATIC(destroylock);
+
 /*! \brief Protect the monitoring thread, so only one process can kill or start it, and not
    when it's doing something critical. */
 AST_MUTEX_DEFINE_STATIC(netlock);
@@ -682,6 +708,7 @@ static struct sip_pvt {
 	int maxtime;				/*!< Max time for first response */
 	int initid;				/*!< Auto-congest ID if appropriate */
 	int autokillid;				/*!< Auto-kill ID */
+	int autokillstale;			/*!< Autodestructs cancelled while already running */
 	time_t lastrtprx;			/*!< Last RTP received */
 	time_t lastrtptx;			/*!< Last RTP sent */
 	int rtptimeout;				/*!< RTP timeout time */
@@ -699,14 +726,165 @@ static struct sip_pvt {
 	struct ast_rtp *rtp;			/*!< RTP Session */
 	struct ast_rtp *vrtp;			/*!< Video RTP session */
 	struct sip_pkt *packets;		/*!< Packets scheduled for re-transmission */
+	struct sip_pkt *deadpackets;		/*!< Acked packets whose retransmit is already running */
 	struct sip_history *history;		/*!< History of this SIP dialog */
 	struct ast_variable *chanvars;		/*!< Channel variables to set for call */
 	struct sip_pvt *next;			/*!< Next call in chain */
+	struct sip_pvt *prev;			/*!< Previous call in chain */
+	struct sip_pvt *hashnext;		/*!< Next call in the same Call-ID hash bucket */
+	struct sip_pvt *medianext;		/*!< Next call with RTP, checked by do_monitor */
+	struct sip_pvt *mediaprev;		/*!< Previous call with RTP */
+	struct sip_pvt *destroynext;		/*!< Next call waiting to be destroyed */
+	int destroyqueued;			/*!< Are we on the destroy queue? (protected by destroylock) */
 	struct sip_invite_param *options;	/*!< Options for INVITE */
 } *iflist = NULL;
 
+/*! \brief Number of buckets in the Call-ID hash of active dialogs */
+#define SIP_DIALOG_BUCKETS	4099
+
+/*! \brief Active dialogs hashed by Call-ID, protected by iflock.  Each bucket
+   keeps the same newest-first order as iflist. */
+static struct sip_pvt *dialogs[SIP_DIALOG_BUCKETS];
+
+/*! \brief Dialogs that carry RTP, the only ones needing keepalive/timeout checks (protected by iflock) */
+static struct sip_pvt *mediadialogs = NULL;
+
+/*! \brief Dialogs flagged with SIP_NEEDDESTROY that do_monitor has not reaped yet (protected by destroylock) */
+static struct sip_pvt *destroyq = NULL;
+
+/*! \brief Most packets we let wait for one worker thread before dropping them */
+#define SIP_WORKER_MAXQUEUE	2048
+
+/*! \brief A received packet waiting for a worker thread */
+struct sip_work {
+	struct sip_work *next;
+	struct sockaddr_in sin;			/*!< Where it came from */
+	struct sip_request req;			/*!< The parsed packet */
+};
+
+/*! \brief A SIP worker thread and its queue of packets.  Packets are assigned by
+   Call-ID, so every packet of a dialog is handled by the same worker, in order */
+struct sip_worker {
+	pthread_t thread;
+	ast_cond_t cond;			/*!< Signalled when work is queued */
+	struct sip_work *head;			/*!< Queued packets */
+	struct sip_work *tail;
+	int depth;				/*!< Packets queued now */
+	int maxdepth;				/*!< Most packets ever queued */
+	unsigned long processed;		/*!< Packets handled */
+	unsigned long dropped;			/*!< Packets dropped on a full queue */
+};
+
+/*! \brief Protects the worker queues and counters */
+AST_MUTEX_DEFINE_STATIC(workerlock);
+static struct sip_worker *workers = NULL;
+static int workercount = 0;		/*!< Running workers, 0 when packets are handled by do_monitor */
+static int workers_stopping = 0;
+
+/*! \brief  dialog_hash: Hash a Call-ID into the dialogs table */
+static unsigned int dialog_hash(const char *callid)
+{
+	unsigned int hash = 0;
+
+	while (*callid)
+		hash = hash * 33 + (unsigned char) *callid++;
+	return hash % SIP_DIALOG_BUCKETS;
+}
+
+/*! \brief  dialog_link: Add dialog to iflist and its indexes; iflock must be held */
+static void dialog_link(struct sip_pvt *p)
+{
+	unsigned int bucket = dialog_hash(p->callid);
+
+	p->prev = NULL;
+	p->next = iflist;
+	if (iflist)
+		iflist->prev = p;
+	iflist = p;
+
+	p->hashnext = dialogs[bucket];
+	dialogs[bucket] = p;
+
+	if (p->rtp) {
+		p->mediaprev = NULL;
+		p->medianext = mediadialogs;
+		if (mediadialogs)
+			mediadialogs->mediaprev = p;
+		mediadialogs = p;
+	}
+}
+
+/*! \brief  dialog_unhash: Remove dialog from the Call-ID hash; iflock must be held */
+static int dialog_unhash(struct sip_pvt *p)
+{
+	struct sip_pvt **cur;
+
+	for (cur = &dialogs[dialog_hash(p->callid)]; *cur; cur = &(*cur)->hashnext) {
+		if (*cur == p) {
+			*cur = p->hashnext;
+			p->hashnext = NULL;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*! \brief  dialog_unlink: Remove dialog from iflist and its indexes; iflock must be held */
+static int dialog_unlink(struct sip_pvt *p)
+{
+	struct sip_pvt **cur;
+
+	/* The hash tells us cheaply whether we are on the list at all */
+	if (dialog_unhash(p))
+		return -1;
+
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		iflist = p->next;
+	if (p->next)
+		p->next->prev = p->prev;
+
+	if (p->mediaprev || (mediadialogs == p)) {
+		if (p->mediaprev)
+			p->mediaprev->medianext = p->medianext;
+		else
+			mediadialogs = p->medianext;
+		if (p->medianext)
+			p->medianext->mediaprev = p->mediaprev;
+	}
+
+	ast_mutex_lock(&destroylock);
+	if (p->destroyqueued) {
+		for (cur = &destroyq; *cur; cur = &(*cur)->destroynext) {
+			if (*cur == p) {
+				*cur = p->destroynext;
+				break;
+			}
+		}
+		p->destroyqueued = 0;
+	}
+	ast_mutex_unlock(&destroylock);
+	return 0;
+}
+
+/*! \brief  sip_markdestroy: Flag dialog for destruction and queue it for do_monitor */
+static void sip_markdestroy(struct sip_pvt *p)
+{
+	ast_set_flag(p, SIP_NEEDDESTROY);
+	ast_mutex_lock(&destroylock);
+	if (!p->destroyqueued) {
+		p->destroyqueued = 1;
+		p->destroynext = destroyq;
+		destroyq = p;
+	}
+	ast_mutex_unlock(&destroylock);
+}
+
 #define FLAG_RESPONSE (1 << 0)
 #define FLAG_FATAL (1 << 1)
+#define FLAG_DEAD (1 << 2)		/*!< Acked while retrans_pkt was running, it frees the packet */
+#define FLAG_STOPPED (1 << 3)		/*!< Semi-acked while retrans_pkt was running */
 
 /*! \brief sip packet - read in sipsock_read, transmitted in send_request */
 struct sip_pkt {
@@ -793,7 +971,7 @@ struct sip_peer {
 	ast_group_t callgroup;		/*!<  Call group */
 	ast_group_t pickupgroup;	/*!<  Pickup group */
 	struct ast_dnsmgr_entry *dnsmgr;/*!<  DNS refresh manager for peer */
-	struct sockaddr_in addr;	/*!<  IP address of peer */
+	struct sockaddr_in addr;	/*!<  IP address of peer, call sip_index_peer() after changing it */
 
 	/* Qualification */
 	struct sip_pvt *call;		/*!<  Call pointer */
@@ -873,6 +1051,7 @@ static struct ast_register_list {
 
 
 static int __sip_do_register(struct sip_registry *r);
+static int __sip_pretend_ack(struct sip_pvt *p);
 
 static int sipsock  = -1;
 
@@ -912,6 +1091,7 @@ static struct sip_peer *build_peer(const char *name, struct ast_variable *v, int
 static struct sip_user *build_user(const char *name, struct ast_variable *v, int realtime);
 static int sip_do_reload(void);
 static int expire_register(void *data);
+static void sip_link_peer(struct sip_peer *peer);
 static int callevents = 0;
 
 static struct ast_channel *sip_request_call(const char *type, int format, void *data, int *cause);
@@ -1185,6 +1365,26 @@ static int retrans_pkt(void *data)
 	/* Lock channel */
 	ast_mutex_lock(&pkt->owner->lock);
 
+	/* A worker may have acked the packet while we waited for the lock */
+	if (ast_test_flag(pkt, FLAG_DEAD)) {
+		prev = NULL;
+		for (cur = pkt->owner->deadpackets; cur && cur != pkt; cur = cur->next)
+			prev = cur;
+		if (prev)
+			prev->next = pkt->next;
+		else
+			pkt->owner->deadpackets = pkt->next;
+		ast_mutex_unlock(&pkt->owner->lock);
+		free(pkt);
+		return 0;
+	}
+	if (ast_test_flag(pkt, FLAG_STOPPED)) {
+		ast_clear_flag(pkt, FLAG_STOPPED);
+		pkt->retransid = -1;
+		ast_mutex_unlock(&pkt->owner->lock);
+		return 0;
+	}
+
 	if (pkt->retrans < MAX_RETRANS) {
 		char buf[80];
 
@@ -1253,7 +1453,7 @@ static int retrans_pkt(void *data)
 			/* If no channel owner, destroy now */
 			/* Let the peerpoke system expire packets when the timer expires for poke_noanswer */
 			if (pkt->method != SIP_OPTIONS)
-				ast_set_flag(pkt->owner, SIP_NEEDDESTROY);	
+				sip_markdestroy(pkt->owner);	
 		}
 	}
 	/* In any case, go ahead and remove the packet */
@@ -1325,12 +1525,20 @@ static int __sip_autodestruct(void *data)
 {
 	struct sip_pvt *p = data;
 
+	ast_mutex_lock(&p->lock);
+	/* A worker cancelled or rescheduled us while we waited for the lock */
+	if (p->autokillstale) {
+		p->autokillstale--;
+		ast_mutex_unlock(&p->lock);
+		return 0;
+	}
 
 	/* If this is a subscription, tell the phone that we got a timeout */
 	if (p->subscribed) {
 		transmit_state_notify(p, AST_EXTENSION_DEACTIVATED, 1, 1, 1);	/* Send first notification */
 		p->subscribed = NONE;
 		append_history(p, "Subscribestatus", "timeout");
+		ast_mutex_unlock(&p->lock);
 		return 10000;	/* Reschedule this destruction so that we know that it's gone */
 	}
 
@@ -1339,12 +1547,22 @@ static int __sip_autodestruct(void *data)
 
 	ast_log(LOG_DEBUG, "Auto destroying call '%s'\n", p->callid);
 	append_history(p, "AutoDestroy", "");
+	while(p->owner && ast_mutex_trylock(&p->owner->lock)) {
+		ast_mutex_unlock(&p->lock);
+		usleep(1);
+		ast_mutex_lock(&p->lock);
+	}
 	if (p->owner) {
 		ast_log(LOG_WARNING, "Autodestruct on call '%s' with owner in place\n", p->callid);
 		ast_queue_hangup(p->owner);
+		ast_mutex_unlock(&p->owner->lock);
 	} else {
-		sip_destroy(p);
+		/* Taking iflock here could deadlock against a worker holding the
+		   dialog, so leave the unlinking to do_monitor */
+		__sip_pretend_ack(p);
+		sip_markdestroy(p);
 	}
+	ast_mutex_unlock(&p->lock);
 	return 0;
 }
 
@@ -1359,8 +1577,8 @@ static int sip_scheddestroy(struct sip_pvt *p, int ms)
 		append_history(p, "SchedDestroy", tmp);
 	}
 
-	if (p->autokillid > -1)
-		ast_sched_del(sched, p->autokillid);
+	if (p->autokillid > -1 && ast_sched_del(sched, p->autokillid))
+		p->autokillstale++;	/* Already running, it will notice */
 	p->autokillid = ast_sched_add(sched, ms, __sip_autodestruct, p);
 	return 0;
 }
@@ -1368,8 +1586,8 @@ static int sip_scheddestroy(struct sip_pvt *p, int ms)
 /*! \brief  sip_cancel_destroy: Cancel destruction of SIP call ---*/
 static int sip_cancel_destroy(struct sip_pvt *p)
 {
-	if (p->autokillid > -1)
-		ast_sched_del(sched, p->autokillid);
+	if (p->autokillid > -1 && ast_sched_del(sched, p->autokillid))
+		p->autokillstale++;	/* Already running, it will notice */
 	append_history(p, "CancelDestroy", "");
 	p->autokillid = -1;
 	return 0;
@@ -1405,7 +1623,14 @@ static int __sip_ack(struct sip_pvt *p, int seqno, int resp, int sipmethod)
 			if (cur->retransid > -1) {
 				if (sipdebug && option_debug > 3)
 					ast_log(LOG_DEBUG, "** SIP TIMER: Cancelling retransmit of packet (reply received) Retransid #%d\n", cur->retransid);
-				ast_sched_del(sched, cur->retransid);
+				if (ast_sched_del(sched, cur->retransid)) {
+					/* retrans_pkt is running and waiting for our lock, let it free the packet */
+					ast_set_flag(cur, FLAG_DEAD);
+					cur->next = p->deadpackets;
+					p->deadpackets = cur;
+					res = 0;
+					break;
+				}
 				cur->retransid = -1;
 			}
 			free(cur);
@@ -1461,8 +1686,10 @@ static int __sip_semi_ack(struct sip_pvt *p, int seqno, int resp, int sipmethod)
 			if (cur->retransid > -1) {
 				if (option_debug > 3 && sipdebug)
 					ast_log(LOG_DEBUG, "*** SIP TIMER: Cancelling retransmission #%d - %s (got response)\n", cur->retransid, msg);
-				ast_sched_del(sched, cur->retransid);
-				cur->retransid = -1;
+				if (ast_sched_del(sched, cur->retransid))
+					ast_set_flag(cur, FLAG_STOPPED);	/* retrans_pkt is running, it will stop */
+				else
+					cur->retransid = -1;
 			}
 			res = 0;
 			break;
@@ -1776,7 +2003,7 @@ static struct sip_peer *realtime_peer(const char *peername, struct sockaddr_in *
 			}
 			peer->expire = ast_sched_add(sched, (global_rtautoclear) * 1000, expire_register, (void *)peer);
 		}
-		ASTOBJ_CONTAINER_LINK(&peerl,peer);
+		sip_link_peer(peer);
 	} else {
 		ast_set_flag(peer, SIP_REALTIME);
 	}
@@ -1785,6 +2012,41 @@ static struct sip_peer *realtime_peer(const char *peername, struct sockaddr_in *
 	return peer;
 }
 
+/*! \brief  sip_addr_hash: Hash of an address, for the address index of the peer list */
+static unsigned int sip_addr_hash(unsigned int addr, unsigned short port)
+{
+	unsigned int hash = (addr ^ ((unsigned int) port << 16)) * 2654435761U;
+
+	return hash ^ (hash >> 15);
+}
+
+/*! \brief  sip_addr_hashfunc: Hash a peer with this address would be indexed under */
+static unsigned int sip_addr_hashfunc(struct sockaddr_in *sin)
+{
+	return sip_addr_hash(sin->sin_addr.s_addr, sin->sin_port);
+}
+
+/*! \brief  sip_addr_hashfunc_anyport: Hash an insecure=port peer at this address would be indexed under */
+static unsigned int sip_addr_hashfunc_anyport(struct sockaddr_in *sin)
+{
+	return sip_addr_hash(sin->sin_addr.s_addr, 0);
+}
+
+/*! \brief  sip_index_peer: File a peer in the address index of the peer list
+ *	Call whenever its address or insecure=port setting may have changed */
+static void sip_index_peer(struct sip_peer *peer)
+{
+	ASTOBJ_CONTAINER_INDEX(&peerl, peer, ast_test_flag(peer, SIP_INSECURE_PORT) ?
+		sip_addr_hashfunc_anyport(&peer->addr) : sip_addr_hashfunc(&peer->addr));
+}
+
+/*! \brief  sip_link_peer: Add a peer to the peer list */
+static void sip_link_peer(struct sip_peer *peer)
+{
+	ASTOBJ_CONTAINER_LINK(&peerl, peer);
+	sip_index_peer(peer);
+}
+
 /*! \brief  sip_addrcmp: Support routine for find_peer ---*/
 static int sip_addrcmp(char *name, struct sockaddr_in *sin)
 {
@@ -1804,8 +2066,12 @@ static struct sip_peer *find_peer(const char *peer, struct sockaddr_in *sin, int
 
 	if (peer)
 		p = ASTOBJ_CONTAINER_FIND(&peerl,peer);
-	else
+	else {
 		p = ASTOBJ_CONTAINER_FIND_FULL(&peerl,sin,name,sip_addr_hashfunc,1,sip_addrcmp);
+		/* insecure=port peers are indexed by address alone */
+		if (!p)
+			p = ASTOBJ_CONTAINER_FIND_FULL(&peerl,sin,name,sip_addr_hashfunc_anyport,1,sip_addrcmp);
+	}
 
 	if (!p && realtime) {
 		p = realtime_peer(peer, sin);
@@ -2037,6 +2303,11 @@ static int auto_congest(void *nothing)
 {
 	struct sip_pvt *p = nothing;
 	ast_mutex_lock(&p->lock);
+	/* Cancelled by a response while we waited for the lock */
+	if (p->initid < 0) {
+		ast_mutex_unlock(&p->lock);
+		return 0;
+	}
 	p->initid = -1;
 	if (p->owner) {
 		if (!ast_mutex_trylock(&p->owner->lock)) {
@@ -2149,7 +2420,6 @@ static void sip_registry_destroy(struct sip_registry *reg)
 /*! \brief   __sip_destroy: Execute destrucion of call structure, release memory---*/
 static void __sip_destroy(struct sip_pvt *p, int lockowner)
 {
-	struct sip_pvt *cur, *prev = NULL;
 	struct sip_pkt *cp;
 	struct sip_history *hist;
 
@@ -2213,19 +2483,7 @@ static void __sip_destroy(struct sip_pvt *p, int lockowner)
 		free(hist);
 	}
 
-	cur = iflist;
-	while(cur) {
-		if (cur == p) {
-			if (prev)
-				prev->next = cur->next;
-			else
-				iflist = cur->next;
-			break;
-		}
-		prev = cur;
-		cur = cur->next;
-	}
-	if (!cur) {
+	if (dialog_unlink(p)) {
 		ast_log(LOG_WARNING, "Trying to destroy \"%s\", not found in dialog list?!?! \n", p->callid);
 		return;
 	} 
@@ -2236,6 +2494,11 @@ static void __sip_destroy(struct sip_pvt *p, int lockowner)
 		}
 		free(cp);
 	}
+	while((cp = p->deadpackets)) {
+		p->deadpackets = p->deadpackets->next;
+		ast_sched_del(sched, cp->retransid);
+		free(cp);
+	}
 	if (p->chanvars) {
 		ast_variables_destroy(p->chanvars);
 		p->chanvars = NULL;
@@ -2455,6 +2718,35 @@ static char *hangup_cause2sip(int cause)
 }
 
 
+/*! \brief  sip_rtcp_event: Tell the manager how the audio of a call fared */
+static void sip_rtcp_event(struct sip_pvt *p, struct ast_channel *ast)
+{
+	struct ast_rtp_quality qual;
+
+	if (!p->rtp || ast_rtp_get_quality(p->rtp, &qual))
+		return;
+	manager_event(EVENT_FLAG_CALL, "RTCPStats",
+		"Channel: %s\r\n"
+		"Uniqueid: %s\r\n"
+		"CallID: %s\r\n"
+		"LocalSSRC: %u\r\n"
+		"RemoteSSRC: %u\r\n"
+		"RxPackets: %u\r\n"
+		"RxLost: %d\r\n"
+		"RxJitter: %.1f\r\n"
+		"TxPackets: %u\r\n"
+		"TxLost: %d\r\n"
+		"TxJitter: %.1f\r\n"
+		"RTT: %.1f\r\n"
+		"MinRTT: %.1f\r\n"
+		"MaxRTT: %.1f\r\n"
+		"ReportsSent: %u\r\n"
+		"ReportsReceived: %u\r\n",
+		ast->name, ast->uniqueid, p->callid, qual.local_ssrc, qual.remote_ssrc,
+		qual.rxcount, qual.rxlost, qual.rxjitter, qual.txcount, qual.txlost, qual.txjitter,
+		qual.rtt, qual.minrtt, qual.maxrtt, qual.rtcptx, qual.rtcprx);
+}
+
 /*! \brief  sip_hangup: Hangup SIP call 
  * Part of PBX interface, called from ast_hangup */
 static int sip_hangup(struct ast_channel *ast)
@@ -2487,6 +2779,8 @@ static int sip_hangup(struct ast_channel *ast)
 	/* If the call is not UP, we need to send CANCEL instead of BYE */
 	if (ast->_state != AST_STATE_UP)
 		needcancel = 1;
+	else
+		sip_rtcp_event(p, ast);
 
 	/* Disconnect */
 	if (p->vad) {
@@ -2554,7 +2848,7 @@ static int sip_hangup(struct ast_channel *ast)
 		}
 	}
 	if (needdestroy)
-		ast_set_flag(p, SIP_NEEDDESTROY);
+		sip_markdestroy(p);
 	ast_mutex_unlock(&p->lock);
 	return 0;
 }
@@ -3128,6 +3422,19 @@ static void build_callid(char *callid, int len, struct in_addr ourip, char *from
 		snprintf(callid, len, "@%s", ast_inet_ntoa(iabuf, sizeof(iabuf), ourip));
 }
 
+/*! \brief  sip_rebuild_callid: Give a dialog already on iflist a fresh Call-ID */
+static void sip_rebuild_callid(struct sip_pvt *p)
+{
+	ast_mutex_lock(&iflock);
+	if (!dialog_unhash(p)) {
+		build_callid(p->callid, sizeof(p->callid), p->ourip, p->fromdomain);
+		p->hashnext = dialogs[dialog_hash(p->callid)];
+		dialogs[dialog_hash(p->callid)] = p;
+	} else
+		build_callid(p->callid, sizeof(p->callid), p->ourip, p->fromdomain);
+	ast_mutex_unlock(&iflock);
+}
+
 static void make_our_tag(char *tagbuf, size_t len)
 {
 	snprintf(tagbuf, len, "as%08x", thread_safe_rand());
@@ -3218,8 +3525,7 @@ static struct sip_pvt *sip_alloc(char *callid, struct sockaddr_in *sin, int useg
 
 	/* Add to active dialog list */
 	ast_mutex_lock(&iflock);
-	p->next = iflist;
-	iflist = p;
+	dialog_link(p);
 	ast_mutex_unlock(&iflock);
 	if (option_debug)
 		ast_log(LOG_DEBUG, "Allocating new SIP dialog for %s - %s (%s)\n", callid ? callid : "(No Call-ID)", sip_methods[intended_method].text, p->rtp ? "With RTP" : "No RTP");
@@ -3260,7 +3566,7 @@ static struct sip_pvt *find_call(struct sip_request *req, struct sockaddr_in *si
 	}
 
 	ast_mutex_lock(&iflock);
-	p = iflist;
+	p = dialogs[dialog_hash(callid)];
 	while(p) {	/* In pedantic, we do not want packets with bad syntax to be connected to a PVT */
 		int found = 0;
 		if (req->method == SIP_REGISTER)
@@ -3293,7 +3599,7 @@ static struct sip_pvt *find_call(struct sip_request *req, struct sockaddr_in *si
 			ast_mutex_unlock(&iflock);
 			return p;
 		}
-		p = p->next;
+		p = p->hashnext;
 	}
 	ast_mutex_unlock(&iflock);
 
@@ -5542,7 +5848,7 @@ static int sip_reg_timeout(void *data)
 		if (p->registry)
 			ASTOBJ_UNREF(p->registry, sip_registry_destroy);
 		r->call = NULL;
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 		/* Pretend to ACK anything just in case */
 		__sip_pretend_ack(p);
 	}
@@ -5899,6 +6205,7 @@ static int expire_register(void *data)
 		return 0;
 
 	memset(&peer->addr, 0, sizeof(peer->addr));
+	sip_index_peer(peer);
 
 	destroy_association(peer);
 	
@@ -5976,6 +6283,7 @@ static void reg_source_db(struct sip_peer *peer)
 	peer->addr.sin_family = AF_INET;
 	peer->addr.sin_addr = in;
 	peer->addr.sin_port = htons(port);
+	sip_index_peer(peer);
 	if (sipsock < 0) {
 		/* SIP isn't up yet, so schedule a poke only, pretty soon */
 		if (peer->pokeexpire > -1)
@@ -6115,6 +6423,7 @@ static enum parse_register_result parse_register_contact(struct sip_pvt *pvt, st
 	} else if (!strcasecmp(c, "*") || !expiry) {	/* Unregister this peer */
 		/* This means remove all registrations and return OK */
 		memset(&p->addr, 0, sizeof(p->addr));
+		sip_index_peer(p);
 		if (p->expire > -1)
 			ast_sched_del(sched, p->expire);
 		p->expire = -1;
@@ -6177,6 +6486,7 @@ static enum parse_register_result parse_register_contact(struct sip_pvt *pvt, st
 		   with */
 		memcpy(&p->addr, &pvt->recv, sizeof(p->addr));
 	}
+	sip_index_peer(p);
 
 	if (c && ast_strlen_zero(p->username))
 		ast_copy_string(p->username, c, sizeof(p->username));
@@ -6720,7 +7030,7 @@ static int register_verify(struct sip_pvt *p, struct sockaddr_in *sin, struct si
 		/* Create peer if we have autocreate mode enabled */
 		peer = temp_peer(name);
 		if (peer) {
-			ASTOBJ_CONTAINER_LINK(&peerl, peer);
+			sip_link_peer(peer);
 			sip_cancel_destroy(p);
 			switch (parse_register_contact(p, peer, req)) {
 			case PARSE_REGISTER_FAILED:
@@ -6920,7 +7230,7 @@ static struct sip_pvt *get_sip_pvt_byid_locked(char *callid)
 	
 	/* Search interfaces and find the match */
 	ast_mutex_lock(&iflock);
-	sip_pvt_ptr = iflist;
+	sip_pvt_ptr = dialogs[dialog_hash(callid)];
 	while(sip_pvt_ptr) {
 		if (!strcmp(sip_pvt_ptr->callid, callid)) {
 			/* Go ahead and lock it (and its owner) before returning */
@@ -6936,7 +7246,7 @@ static struct sip_pvt *get_sip_pvt_byid_locked(char *callid)
 			}
 			break;
 		}
-		sip_pvt_ptr = sip_pvt_ptr->next;
+		sip_pvt_ptr = sip_pvt_ptr->hashnext;
 	}
 	ast_mutex_unlock(&iflock);
 	return sip_pvt_ptr;
@@ -7564,14 +7874,14 @@ static void receive_message(struct sip_pvt *p, struct sip_request *req)
 	content_type = get_header(req, "Content-Type");
 	if (strcmp(content_type, "text/plain")) { /* No text/plain attachment */
 		transmit_response(p, "415 Unsupported Media Type", req); /* Good enough, or? */
-		ast_set_flag(p, SIP_NEEDDESTROY);
+		sip_markdestroy(p);
 		return;
 	}
 
 	if (get_msg_text(buf, sizeof(buf), req)) {
 		ast_log(LOG_WARNING, "Unable to retrieve text from %s\n", p->callid);
 		transmit_response(p, "202 Accepted", req);
-		ast_set_flag(p, SIP_NEEDDESTROY);
+		sip_markdestroy(p);
 		return;
 	}
 
@@ -7590,7 +7900,7 @@ static void receive_message(struct sip_pvt *p, struct sip_request *req)
 		ast_log(LOG_WARNING,"Received message to %s from %s, dropped it...\n  Content-Type:%s\n  Message: %s\n", get_header(req,"To"), get_header(req,"From"), content_type, buf);
 		transmit_response(p, "405 Method Not Allowed", req); /* Good enough, or? */
 	}
-	ast_set_flag(p, SIP_NEEDDESTROY);
+	sip_markdestroy(p);
 	return;
 }
 
@@ -7915,6 +8225,30 @@ static int sip_show_objects(int fd, int argc, char *argv[])
 	ASTOBJ_CONTAINER_DUMP(fd, tmp, sizeof(tmp), &regl);
 	return RESULT_SUCCESS;
 }
+
+/*! \brief  sip_show_workers: Show the SIP worker threads and their queues ---*/
+static int sip_show_workers(int fd, int argc, char *argv[])
+{
+#define FORMAT "%-6.6s %-8.8s %-10.10s %-12.12s %-10.10s\n"
+#define FORMAT2 "%-6d %-8d %-10d %-12lu %-10lu\n"
+	int x;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+	ast_mutex_lock(&workerlock);
+	if (!workercount) {
+		ast_mutex_unlock(&workerlock);
+		ast_cli(fd, "SIP packets are handled by the monitor thread (workerthreads=0)\n");
+		return RESULT_SUCCESS;
+	}
+	ast_cli(fd, FORMAT, "Worker", "Queued", "MaxQueued", "Processed", "Dropped");
+	for (x = 0; x < workercount; x++)
+		ast_cli(fd, FORMAT2, x, workers[x].depth, workers[x].maxdepth, workers[x].processed, workers[x].dropped);
+	ast_mutex_unlock(&workerlock);
+	return RESULT_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
 /*! \brief  print_group: Print call group and pickup group ---*/
 static void  print_group(int fd, ast_group_t group, int crlf) 
 {
@@ -8075,7 +8409,7 @@ static int sip_prune_realtime(int fd, int argc, char *argv[])
 			if ((peer = ASTOBJ_CONTAINER_FIND_UNLINK(&peerl, name))) {
 				if (!ast_test_flag((&peer->flags_page2), SIP_PAGE2_RTCACHEFRIENDS)) {
 					ast_cli(fd, "Peer '%s' is not a Realtime peer, cannot be pruned.\n", name);
-					ASTOBJ_CONTAINER_LINK(&peerl, peer);
+					sip_link_peer(peer);
 				} else
 					ast_cli(fd, "Peer '%s' pruned.\n", name);
 				ASTOBJ_UNREF(peer, sip_destroy_peer);
@@ -8487,6 +8821,7 @@ static int sip_show_settings(int fd, int argc, char *argv[])
 	ast_cli(fd, "  Always auth rejects:    %s\n", global_alwaysauthreject ? "Yes" : "No");
 	ast_cli(fd, "  User Agent:             %s\n", default_useragent);
 	ast_cli(fd, "  MWI checking interval:  %d secs\n", global_mwitime);
+	ast_cli(fd, "  Worker threads:         %d\n", global_workerthreads);
 	ast_cli(fd, "  Reg. context:           %s\n", ast_strlen_zero(regcontext) ? "(not set)" : regcontext);
 	ast_cli(fd, "  Caller ID:              %s\n", default_callerid);
 	ast_cli(fd, "  From: Domain:           %s\n", default_fromdomain);
@@ -8777,6 +9112,7 @@ static char *complete_sip_prune_realtime_user(char *line, char *word, int pos, i
 static int sip_show_channel(int fd, int argc, char *argv[])
 {
 	struct sip_pvt *cur;
+	struct ast_rtp_quality qual;
 	char iabuf[INET_ADDRSTRLEN];
 	size_t len;
 	int found = 0;
@@ -8820,6 +9156,13 @@ static int sip_show_channel(int fd, int argc, char *argv[])
 			ast_cli(fd, "  Promiscuous Redir:      %s\n", ast_test_flag(cur, SIP_PROMISCREDIR) ? "Yes" : "No");
 			ast_cli(fd, "  Route:                  %s\n", cur->route ? cur->route->hop : "N/A");
 			ast_cli(fd, "  DTMF Mode:              %s\n", dtmfmode2str(ast_test_flag(cur, SIP_DTMF)));
+			if (cur->rtp && !ast_rtp_get_quality(cur->rtp, &qual)) {
+				ast_cli(fd, "  RTP Received:           %u packets, %d lost, jitter %.1f ms (SSRC %08x)\n", qual.rxcount, qual.rxlost, qual.rxjitter, qual.remote_ssrc);
+				ast_cli(fd, "  RTP Sent:               %u packets, %d reported lost, jitter %.1f ms (SSRC %08x)\n", qual.txcount, qual.txlost, qual.txjitter, qual.local_ssrc);
+				ast_cli(fd, "  RTCP Reports:           %u sent, %u received\n", qual.rtcptx, qual.rtcprx);
+				if (qual.maxrtt)
+					ast_cli(fd, "  Round Trip Time:        %.1f ms (min %.1f, max %.1f)\n", qual.rtt, qual.minrtt, qual.maxrtt);
+			}
 			ast_cli(fd, "  SIP Options:            ");
 			if (cur->sipoptions) {
 				int x;
@@ -8934,7 +9277,7 @@ static void handle_request_info(struct sip_pvt *p, struct sip_request *req)
 	
 		if (!p->owner) {	/* not a PBX call */
 			transmit_response(p, "481 Call leg/transaction does not exist", req);
-			ast_set_flag(p, SIP_NEEDDESTROY);
+			sip_markdestroy(p);
 			return;
 		}
 
@@ -9129,7 +9472,7 @@ static int sip_notify(int fd, int argc, char *argv[])
 		if (ast_sip_ouraddrfor(&p->sa.sin_addr, &p->ourip))
 			memcpy(&p->ourip, &__ourip, sizeof(p->ourip));
 		build_via(p, p->via, sizeof(p->via));
-		build_callid(p->callid, sizeof(p->callid), p->ourip, p->fromdomain);
+		sip_rebuild_callid(p);
 		ast_cli(fd, "Sending NOTIFY of type '%s' to '%s'\n", argv[2], argv[i]);
 		transmit_sip_request(p, &req);
 		sip_scheddestroy(p, 15000);
@@ -9460,6 +9803,10 @@ static char show_objects_usage[] =
 "Usage: sip show objects\n" 
 "       Shows status of known SIP objects\n";
 
+static char show_workers_usage[] =
+"Usage: sip show workers\n"
+"       Shows the SIP worker threads with their queue depths and packet counts\n";
+
 static char show_settings_usage[] = 
 "Usage: sip show settings\n"
 "       Provides detailed list of the configuration of the SIP channel.\n";
@@ -9705,6 +10052,82 @@ static struct ast_custom_function sipchaninfo_function = {
 	"- peername              The name of the peer.\n"
 };
 
+/*! \brief  function_siprtcpstats_read: ${SIPRTCPSTATS()} Dialplan function - reads audio quality of the current call */
+static char *function_siprtcpstats_read(struct ast_channel *chan, char *cmd, char *data, char *buf, size_t len) 
+{
+	struct sip_pvt *p;
+	struct ast_rtp_quality qual;
+	int res;
+
+	*buf = 0;
+
+	ast_mutex_lock(&chan->lock);
+	if (chan->type != channeltype) {
+		ast_log(LOG_WARNING, "This function can only be used on SIP channels.\n");
+		ast_mutex_unlock(&chan->lock);
+		return NULL;
+	}
+	p = chan->tech_pvt;
+	res = (p && p->rtp) ? ast_rtp_get_quality(p->rtp, &qual) : -1;
+	ast_mutex_unlock(&chan->lock);
+	if (res)
+		return NULL;
+
+	if (ast_strlen_zero(data) || !strcasecmp(data, "all"))
+		snprintf(buf, len, "ssrc=%u;themssrc=%u;rxcount=%u;rxlost=%d;rxjitter=%.1f;txcount=%u;txlost=%d;txjitter=%.1f;rtt=%.1f;minrtt=%.1f;maxrtt=%.1f",
+			qual.local_ssrc, qual.remote_ssrc, qual.rxcount, qual.rxlost, qual.rxjitter,
+			qual.txcount, qual.txlost, qual.txjitter, qual.rtt, qual.minrtt, qual.maxrtt);
+	else if (!strcasecmp(data, "ssrc"))
+		snprintf(buf, len, "%u", qual.local_ssrc);
+	else if (!strcasecmp(data, "themssrc"))
+		snprintf(buf, len, "%u", qual.remote_ssrc);
+	else if (!strcasecmp(data, "rxcount"))
+		snprintf(buf, len, "%u", qual.rxcount);
+	else if (!strcasecmp(data, "rxlost"))
+		snprintf(buf, len, "%d", qual.rxlost);
+	else if (!strcasecmp(data, "rxjitter"))
+		snprintf(buf, len, "%.1f", qual.rxjitter);
+	else if (!strcasecmp(data, "txcount"))
+		snprintf(buf, len, "%u", qual.txcount);
+	else if (!strcasecmp(data, "txlost"))
+		snprintf(buf, len, "%d", qual.txlost);
+	else if (!strcasecmp(data, "txjitter"))
+		snprintf(buf, len, "%.1f", qual.txjitter);
+	else if (!strcasecmp(data, "rtt"))
+		snprintf(buf, len, "%.1f", qual.rtt);
+	else if (!strcasecmp(data, "minrtt"))
+		snprintf(buf, len, "%.1f", qual.minrtt);
+	else if (!strcasecmp(data, "maxrtt"))
+		snprintf(buf, len, "%.1f", qual.maxrtt);
+	else {
+		ast_log(LOG_WARNING, "Unknown SIPRTCPSTATS item '%s'\n", data);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/* Structure to declare a dialplan function: SIPRTCPSTATS */
+static struct ast_custom_function siprtcpstats_function = {
+	.name = "SIPRTCPSTATS",
+	.synopsis = "Gets RTP/RTCP quality statistics of the audio on the current SIP channel",
+	.syntax = "SIPRTCPSTATS([item])",
+	.read = function_siprtcpstats_read,
+	.desc = "Valid items are:\n"
+	"- all                   All of the below, as name=value pairs separated by ';' (default).\n"
+	"- ssrc                  Our synchronization source.\n"
+	"- themssrc              The synchronization source of the other end.\n"
+	"- rxcount               Packets received.\n"
+	"- rxlost                Packets the other end sent which never arrived.\n"
+	"- rxjitter              Interarrival jitter of received packets, in ms.\n"
+	"- txcount               Packets sent.\n"
+	"- txlost                Packets we sent which the other end reports lost.\n"
+	"- txjitter              Jitter the other end reports, in ms.\n"
+	"- rtt                   Last round trip time from RTCP, in ms.\n"
+	"- minrtt                Shortest round trip time, in ms.\n"
+	"- maxrtt                Longest round trip time, in ms.\n"
+};
+
 
 
 /*! \brief  parse_moved_contact: Parse 302 Moved temporalily response */
@@ -9884,7 +10307,7 @@ static void handle_response_invite(struct sip_pvt *p, int resp, char *rest, stru
 			char *authorization = (resp == 401 ? "Authorization" : "Proxy-Authorization");
 			if ((p->authtries == MAX_AUTHTRIES) || do_proxy_auth(p, req, authenticate, authorization, SIP_INVITE, 1)) {
 				ast_log(LOG_NOTICE, "Failed to authenticate on INVITE to '%s'\n", get_header(&p->initreq, "From"));
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 				ast_set_flag(p, SIP_ALREADYGONE);	
 				if (p->owner)
 					ast_queue_control(p->owner, AST_CONTROL_CONGESTION);
@@ -9897,7 +10320,7 @@ static void handle_response_invite(struct sip_pvt *p, int resp, char *rest, stru
 		ast_log(LOG_WARNING, "Forbidden - wrong password on authentication for INVITE to '%s'\n", get_header(&p->initreq, "From"));
 		if (!ignore && p->owner)
 			ast_queue_control(p->owner, AST_CONTROL_CONGESTION);
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 		ast_set_flag(p, SIP_ALREADYGONE);	
 		break;
 	case 404: /* Not found */
@@ -9922,7 +10345,7 @@ static void handle_response_invite(struct sip_pvt *p, int resp, char *rest, stru
 		} else if (!ignore) {
 			update_call_counter(p, DEC_CALL_LIMIT);
 			append_history(p, "Hangup", "Got 487 on CANCEL request from us on call without owner. Killing this dialog.");
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 			ast_set_flag(p, SIP_ALREADYGONE);	
 		}
 		break;
@@ -9950,7 +10373,7 @@ static int handle_response_register(struct sip_pvt *p, int resp, char *rest, str
 	case 401:	/* Unauthorized */
 		if ((p->authtries == MAX_AUTHTRIES) || do_register_auth(p, req, "WWW-Authenticate", "Authorization")) {
 			ast_log(LOG_NOTICE, "Failed to authenticate on REGISTER to '%s@%s' (Tries %d)\n", p->registry->username, p->registry->hostname, p->authtries);
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 			}
 		break;
 	case 403:	/* Forbidden */
@@ -9959,13 +10382,13 @@ static int handle_response_register(struct sip_pvt *p, int resp, char *rest, str
 			p->registry->regattempts = global_regattempts_max+1;
 		ast_sched_del(sched, r->timeout);
 		r->timeout = -1;
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 		break;
 	case 404:	/* Not found */
 		ast_log(LOG_WARNING, "Got 404 Not found on SIP register to service %s@%s, giving up\n", p->registry->username,p->registry->hostname);
 		if (global_regattempts_max)
 			p->registry->regattempts = global_regattempts_max+1;
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 		r->call = NULL;
 		ast_sched_del(sched, r->timeout);
 		r->timeout = -1;
@@ -9973,14 +10396,14 @@ static int handle_response_register(struct sip_pvt *p, int resp, char *rest, str
 	case 407:	/* Proxy auth */
 		if ((p->authtries == MAX_AUTHTRIES) || do_register_auth(p, req, "Proxy-Authenticate", "Proxy-Authorization")) {
 			ast_log(LOG_NOTICE, "Failed to authenticate on REGISTER to '%s' (tries '%d')\n", get_header(&p->initreq, "From"), p->authtries);
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 		}
 		break;
 	case 479:	/* SER: Not able to process the URI - address is wrong in register*/
 		ast_log(LOG_WARNING, "Got error 479 on register to %s@%s, giving up (check config)\n", p->registry->username,p->registry->hostname);
 		if (global_regattempts_max)
 			p->registry->regattempts = global_regattempts_max+1;
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 		r->call = NULL;
 		ast_sched_del(sched, r->timeout);
 		r->timeout = -1;
@@ -9988,7 +10411,7 @@ static int handle_response_register(struct sip_pvt *p, int resp, char *rest, str
 	case 200:	/* 200 OK */
 		if (!r) {
 			ast_log(LOG_WARNING, "Got 200 OK on REGISTER that isn't a register\n");
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 			return 0;
 		}
 
@@ -10005,7 +10428,7 @@ static int handle_response_register(struct sip_pvt *p, int resp, char *rest, str
 		p->registry = NULL;
 		/* Let this one hang around until we have all the responses */
 		sip_scheddestroy(p, 32000);
-		/* ast_set_flag(p, SIP_NEEDDESTROY);	*/
+		/* sip_markdestroy(p);	*/
 
 		/* set us up for re-registering */
 		/* figure out how long we got registered for */
@@ -10103,7 +10526,7 @@ static int handle_response_peerpoke(struct sip_pvt *p, int resp, char *rest, str
 			ast_sched_del(sched, peer->pokeexpire);
 		if (sipmethod == SIP_INVITE)	/* Does this really happen? */
 			transmit_request(p, SIP_ACK, seqno, 0, 0);
-		ast_set_flag(p, SIP_NEEDDESTROY);
+		sip_markdestroy(p);
 
 		/* Try again eventually */
 		if ((peer->lastms < 0)  || (peer->lastms > peer->maxms))
@@ -10175,7 +10598,7 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 			p->authtries = 0;	/* Reset authentication counter */
 			if (sipmethod == SIP_MESSAGE) {
 				/* We successfully transmitted a message */
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 			} else if (sipmethod == SIP_NOTIFY) {
 				/* They got the notify, this is the end */
 				if (p->owner) {
@@ -10183,7 +10606,7 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 					ast_queue_hangup(p->owner);
 				} else {
 					if (p->subscribed == NONE) {
-						ast_set_flag(p, SIP_NEEDDESTROY); 
+						sip_markdestroy(p); 
 					}
 				}
 			} else if (sipmethod == SIP_INVITE) {
@@ -10192,7 +10615,7 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 				res = handle_response_register(p, resp, rest, req, ignore, seqno);
 			} else if (sipmethod == SIP_BYE) {
 				/* Ok, we're ready to go */
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 			} 
 			break;
 		case 401: /* Not www-authorized on SIP method */
@@ -10202,7 +10625,7 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 				res = handle_response_register(p, resp, rest, req, ignore, seqno);
 			} else {
 				ast_log(LOG_WARNING, "Got authentication request (401) on unknown %s to '%s'\n", sip_methods[sipmethod].text, get_header(req, "To"));
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 			}
 			break;
 		case 403: /* Forbidden - we failed authentication */
@@ -10229,16 +10652,16 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 				if (ast_strlen_zero(p->authname)) {
 					ast_log(LOG_WARNING, "Asked to authenticate %s, to %s:%d but we have no matching peer!\n",
 							msg, ast_inet_ntoa(iabuf, sizeof(iabuf), p->recv.sin_addr), ntohs(p->recv.sin_port));
-					ast_set_flag(p, SIP_NEEDDESTROY);	
+					sip_markdestroy(p);	
 				}
 				if ((p->authtries == MAX_AUTHTRIES) || do_proxy_auth(p, req, "Proxy-Authenticate", "Proxy-Authorization", sipmethod, 0)) {
 					ast_log(LOG_NOTICE, "Failed to authenticate on %s to '%s'\n", msg, get_header(&p->initreq, "From"));
-					ast_set_flag(p, SIP_NEEDDESTROY);	
+					sip_markdestroy(p);	
 				}
 			} else if (p->registry && sipmethod == SIP_REGISTER) {
 				res = handle_response_register(p, resp, rest, req, ignore, seqno);
 			} else	/* We can't handle this, giving up in a bad way */
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 
 			break;
 		case 487:
@@ -10314,7 +10737,7 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 				if (sipmethod != SIP_MESSAGE && sipmethod != SIP_INFO)
 					ast_set_flag(p, SIP_ALREADYGONE);	
 				if (!p->owner)
-					ast_set_flag(p, SIP_NEEDDESTROY);	
+					sip_markdestroy(p);	
 			} else if ((resp >= 100) && (resp < 200)) {
 				if (sipmethod == SIP_INVITE) {
 					if (!ignore)
@@ -10348,10 +10771,10 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 				ast_log(LOG_DEBUG, "Got 200 OK on CANCEL\n");
 			} else if (sipmethod == SIP_MESSAGE) 
 				/* We successfully transmitted a message */
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 			else if (sipmethod == SIP_BYE) 
 				/* Ok, we're ready to go */
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 			break;
 		case 401:	/* www-auth */
 		case 407:
@@ -10367,7 +10790,7 @@ static void handle_response(struct sip_pvt *p, int resp, char *rest, struct sip_
 				}
 				if ((p->authtries == MAX_AUTHTRIES) || do_proxy_auth(p, req, auth, auth2, sipmethod, 0)) {
 					ast_log(LOG_NOTICE, "Failed to authenticate on %s to '%s'\n", msg, get_header(&p->initreq, "From"));
-					ast_set_flag(p, SIP_NEEDDESTROY);	
+					sip_markdestroy(p);	
 				}
 			} else if (sipmethod == SIP_INVITE) {
 				handle_response_invite(p, resp, rest, req, ignore, seqno);
@@ -10622,7 +11045,7 @@ static int handle_request_options(struct sip_pvt *p, struct sip_request *req, in
 	/* Destroy if this OPTIONS was the opening request, but not if
 	   it's in the middle of a normal call flow. */
 	if (!p->lastinvite)
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 
 	return res;
 }
@@ -10652,7 +11075,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 			/* At this point we support no extensions, so fail */
 			transmit_response_with_unsupported(p, "420 Bad extension", req, required);
 			if (!p->lastinvite)
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 			return -1;
 			
 		}
@@ -10667,7 +11090,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 		   being able to call yourself */
 		transmit_response_reliable(p, "482 Loop Detected", req, 1);
 		if (!p->lastinvite)
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 		return 0;
 	}
 	if (!ignore) {
@@ -10687,7 +11110,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 				if (process_sdp(p, req)) {
 					transmit_response(p, "488 Not acceptable here", req);
 					if (!p->lastinvite)
-						ast_set_flag(p, SIP_NEEDDESTROY);	
+						sip_markdestroy(p);	
 					return -1;
 				}
 			} else {
@@ -10711,7 +11134,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 				ast_log(LOG_NOTICE, "Failed to authenticate user %s\n", get_header(req, "From"));
 				transmit_response_reliable(p, "403 Forbidden", req, 1);
 			}
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 			p->theirtag[0] = '\0'; /* Forget their to-tag, we'll get a new one */
 			return 0;
 		}
@@ -10719,7 +11142,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 		if (find_sdp(req)) {
 			if (process_sdp(p, req)) {
 				transmit_response(p, "488 Not acceptable here", req);
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 				return -1;
 			}
 		} else {
@@ -10739,7 +11162,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 			if (res < 0) {
 				ast_log(LOG_NOTICE, "Failed to place call for user %s, too many calls\n", p->username);
 				transmit_response_reliable(p, "480 Temporarily Unavailable (Call limit) ", req, 1);
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 			}
 			return 0;
 		}
@@ -10756,7 +11179,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 			else
 				transmit_response_reliable(p, "484 Address Incomplete", req, 1);
 			update_call_counter(p, DEC_CALL_LIMIT);
-			ast_set_flag(p, SIP_NEEDDESTROY);		
+			sip_markdestroy(p);		
 			return 0;
 		} else {
 			/* If no extension was specified, use the s one */
@@ -10870,7 +11293,7 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 				ast_log(LOG_NOTICE, "Unable to create/find channel\n");
 				transmit_response_reliable(p, "503 Unavailable", req, 1);
 			}
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 		}
 	}
 	return res;
@@ -10968,7 +11391,7 @@ static int handle_request_cancel(struct sip_pvt *p, struct sip_request *req, int
 	if (p->owner)
 		ast_queue_hangup(p->owner);
 	else
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 	if (p->initreq.len > 0) {
 		if (!ignore)
 			transmit_response_reliable(p, "487 Request Terminated", &p->initreq, 1);
@@ -11030,7 +11453,7 @@ static int handle_request_bye(struct sip_pvt *p, struct sip_request *req, int de
 		if (option_debug > 2)
 			ast_log(LOG_DEBUG, "Received bye, issuing owner hangup\n");
 	} else {
-		ast_set_flag(p, SIP_NEEDDESTROY);	
+		sip_markdestroy(p);	
 		if (option_debug > 2)
 			ast_log(LOG_DEBUG, "Received bye, no owner, selfdestruct soon.\n");
 	}
@@ -11120,7 +11543,7 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 				else
 					transmit_response_reliable(p, "403 Forbidden", req, 1);
 			}
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 			return 0;
 		}
 		gotdest = get_destination(p, NULL);
@@ -11144,7 +11567,7 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 				transmit_response(p, "404 Not Found", req);
 			else
 				transmit_response(p, "484 Address Incomplete", req);	/* Overlap dialing on SUBSCRIBE?? */
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 		} else {
 
 			/* Initialize tag for new subscriptions */	
@@ -11174,7 +11597,7 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 
 						ast_log(LOG_WARNING,"SUBSCRIBE failure: no Accept header: pvt: stateid: %d, laststate: %d, dialogver: %d, subscribecont: '%s'\n",
 							p->stateid, p->laststate, p->dialogver, p->subscribecontext);
-						ast_set_flag(p, SIP_NEEDDESTROY);
+						sip_markdestroy(p);
 						return 0;
 					}
 					/* if p->subscribed is non-zero, then accept is not obligatory; according to rfc 3265 section 3.1.3, at least.
@@ -11184,7 +11607,7 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 					char mybuf[200];
 					snprintf(mybuf,sizeof(mybuf),"489 Bad Event (format %s)", accept);
  					transmit_response(p, mybuf, req);
- 					ast_set_flag(p, SIP_NEEDDESTROY);
+ 					sip_markdestroy(p);
  					return 0;
  				}
 				if (option_debug > 2)
@@ -11210,17 +11633,17 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 
 				if (found){
 					transmit_response(p, "200 OK", req);
-					ast_set_flag(p, SIP_NEEDDESTROY);	
+					sip_markdestroy(p);	
 				} else {
 					transmit_response(p, "404 Not found", req);
-					ast_set_flag(p, SIP_NEEDDESTROY);	
+					sip_markdestroy(p);	
 				}
 				return 0;
 			} else { /* At this point, Asterisk does not understand the specified event */
 				transmit_response(p, "489 Bad Event", req);
 				if (option_debug > 1)
 					ast_log(LOG_DEBUG, "Received SIP subscribe for unknown event package: %s\n", event);
-				ast_set_flag(p, SIP_NEEDDESTROY);	
+				sip_markdestroy(p);	
 				return 0;
 			}
 			if (p->subscribed != NONE) {
@@ -11252,7 +11675,7 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 
 			ast_log(LOG_NOTICE, "Got SUBSCRIBE for extension %s@%s from %s, but there is no hint for that extension\n", p->exten, p->context, ast_inet_ntoa(iabuf, sizeof(iabuf), p->sa.sin_addr));
 			transmit_response(p, "404 Not found", req);
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 			return 0;
 		} else {
 			struct sip_pvt *p_old;
@@ -11278,7 +11701,7 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 				if (!strcmp(p_old->username, p->username)) {
 					if (!strcmp(p_old->exten, p->exten) &&
 					    !strcmp(p_old->context, p->context)) {
-						ast_set_flag(p_old, SIP_NEEDDESTROY);
+						sip_markdestroy(p_old);
 						ast_mutex_unlock(&p_old->lock);
 						break;
 					}
@@ -11288,7 +11711,7 @@ static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req,
 			ast_mutex_unlock(&iflock);
 		}
 		if (!p->expiry)
-			ast_set_flag(p, SIP_NEEDDESTROY);
+			sip_markdestroy(p);
 	}
 	return 1;
 }
@@ -11364,7 +11787,7 @@ static int handle_request(struct sip_pvt *p, struct sip_request *req, struct soc
 	}
 	if (error) {
 		if (!p->initreq.headers)	/* New call */
-			ast_set_flag(p, SIP_NEEDDESTROY);	/* Make sure we destroy this dialog */
+			sip_markdestroy(p);	/* Make sure we destroy this dialog */
 		return -1;
 	}
 	/* Get the command XXX */
@@ -11382,7 +11805,7 @@ static int handle_request(struct sip_pvt *p, struct sip_request *req, struct soc
 		/* Response to our request -- Do some sanity checks */	
 		if (!p->initreq.headers) {
 			ast_log(LOG_DEBUG, "That's odd...  Got a response on a call we dont know about. Cseq %d Cmd %s\n", seqno, cmd);
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 			return 0;
 		} else if (p->ocseq && (p->ocseq < seqno)) {
 			ast_log(LOG_DEBUG, "Ignoring out of order response %d (expecting %d)\n", seqno, p->ocseq);
@@ -11452,7 +11875,7 @@ static int handle_request(struct sip_pvt *p, struct sip_request *req, struct soc
 				/* Will cease to exist after ACK */
 			} else if (req->method != SIP_ACK) {
 				transmit_response(p, "481 Call/Transaction Does Not Exist", req);
-				ast_set_flag(p, SIP_NEEDDESTROY);
+				sip_markdestroy(p);
 			}
 			return res;
 		}
@@ -11460,7 +11883,7 @@ static int handle_request(struct sip_pvt *p, struct sip_request *req, struct soc
 
 	if (!e && (p->method == SIP_INVITE || p->method == SIP_SUBSCRIBE || p->method == SIP_REGISTER)) {
 		transmit_response(p, "400 Bad request", req);
-		ast_set_flag(p, SIP_NEEDDESTROY);
+		sip_markdestroy(p);
 		return -1;
 	}
 
@@ -11504,7 +11927,7 @@ static int handle_request(struct sip_pvt *p, struct sip_request *req, struct soc
 			look into this someday XXX */
 		transmit_response(p, "200 OK", req);
 		if (!p->lastinvite) 
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 		break;
 	case SIP_ACK:
 		/* Make sure we don't ignore this */
@@ -11518,7 +11941,7 @@ static int handle_request(struct sip_pvt *p, struct sip_request *req, struct soc
 			check_pendings(p);
 		}
 		if (!p->lastinvite && ast_strlen_zero(p->randdata))
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 		break;
 	default:
 		transmit_response_with_allow(p, "501 Method Not Implemented", req, 0);
@@ -11526,29 +11949,23 @@ static int handle_request(struct sip_pvt *p, struct sip_request *req, struct soc
 			cmd, ast_inet_ntoa(iabuf, sizeof(iabuf), p->sa.sin_addr));
 		/* If this is some new method, and we don't have a call, destroy it now */
 		if (!p->initreq.headers)
-			ast_set_flag(p, SIP_NEEDDESTROY);	
+			sip_markdestroy(p);	
 		break;
 	}
 	return res;
 }
 
-/*! \brief  sipsock_read: Read data from SIP socket ---*/
-/*    Successful messages is connected to SIP call and forwarded to handle_request() */
-static int sipsock_read(int *id, int fd, short events, void *ignore)
+/*! \brief  sip_read_packet: Read one packet from the SIP socket and parse it.
+	Returns 0 if the packet should be handled, -1 if it is to be ignored */
+static int sip_read_packet(struct sip_request *req, struct sockaddr_in *sin)
 {
-	struct sip_request req;
-	struct sockaddr_in sin = { 0, };
-	struct sip_pvt *p;
 	int res;
 	socklen_t len;
-	int nounlock;
-	int recount = 0;
 	char iabuf[INET_ADDRSTRLEN];
-	unsigned int lockretry = 100;
 
-	len = sizeof(sin);
-	memset(&req, 0, sizeof(req));
-	res = recvfrom(sipsock, req.data, sizeof(req.data) - 1, 0, (struct sockaddr *)&sin, &len);
+	len = sizeof(*sin);
+	memset(req, 0, sizeof(*req));
+	res = recvfrom(sipsock, req->data, sizeof(req->data) - 1, 0, (struct sockaddr *)sin, &len);
 	if (res < 0) {
 #if !defined(__FreeBSD__)
 		if (errno == EAGAIN)
@@ -11557,44 +11974,56 @@ static int sipsock_read(int *id, int fd, short events, void *ignore)
 #endif
 		if (errno != ECONNREFUSED)
 			ast_log(LOG_WARNING, "Recv error: %s\n", strerror(errno));
-		return 1;
+		return -1;
 	}
-	if (res == sizeof(req.data)) {
+	if (res == sizeof(req->data)) {
 		ast_log(LOG_DEBUG, "Received packet exceeds buffer. Data is possibly lost\n");
-		req.data[sizeof(req.data) - 1] = '\0';
+		req->data[sizeof(req->data) - 1] = '\0';
 	} else
-		req.data[res] = '\0';
-	req.len = res;
-	if(sip_debug_test_addr(&sin))
-		ast_set_flag(&req, SIP_PKT_DEBUG);
+		req->data[res] = '\0';
+	req->len = res;
+	if(sip_debug_test_addr(sin))
+		ast_set_flag(req, SIP_PKT_DEBUG);
 	if (pedanticsipchecking)
-		req.len = lws2sws(req.data, req.len);	/* Fix multiline headers */
-	if (ast_test_flag(&req, SIP_PKT_DEBUG)) {
-		ast_verbose("\n<-- SIP read from %s:%d: \n%s\n", ast_inet_ntoa(iabuf, sizeof(iabuf), sin.sin_addr), ntohs(sin.sin_port), req.data);
+		req->len = lws2sws(req->data, req->len);	/* Fix multiline headers */
+	if (ast_test_flag(req, SIP_PKT_DEBUG)) {
+		ast_verbose("\n<-- SIP read from %s:%d: \n%s\n", ast_inet_ntoa(iabuf, sizeof(iabuf), sin->sin_addr), ntohs(sin->sin_port), req->data);
 	}
-	parse_request(&req);
-	req.method = find_sip_method(req.rlPart1);
-	if (ast_test_flag(&req, SIP_PKT_DEBUG)) {
-		ast_verbose("--- (%d headers %d lines)%s ---\n", req.headers, req.lines, (req.headers + req.lines == 0) ? " Nat keepalive" : "");
+	parse_request(req);
+	req->method = find_sip_method(req->rlPart1);
+	if (ast_test_flag(req, SIP_PKT_DEBUG)) {
+		ast_verbose("--- (%d headers %d lines)%s ---\n", req->headers, req->lines, (req->headers + req->lines == 0) ? " Nat keepalive" : "");
 	}
 
-	if (req.headers < 2) {
+	if (req->headers < 2) {
 		/* Must have at least two headers */
-		return 1;
+		return -1;
 	}
+	return 0;
+}
 
+/*! \brief  sip_process_packet: Find the dialog for a parsed packet and handle it.
+	If biglock is given it is held while the request is handled, which
+	serializes all SIP processing (single-threaded mode) */
+static void sip_process_packet(struct sip_request *req, struct sockaddr_in *sin, ast_mutex_t *biglock)
+{
+	struct sip_pvt *p;
+	int nounlock;
+	int recount = 0;
+	unsigned int lockretry = 100;
 
-	/* Process request, with netlock held */
 retrylock:
-	ast_mutex_lock(&netlock);
-	p = find_call(&req, &sin, req.method);
+	if (biglock)
+		ast_mutex_lock(biglock);
+	p = find_call(req, sin, req->method);
 	if (p) {
 		/* Go ahead and lock the owner if it has one -- we may need it */
 		if (p->owner && ast_mutex_trylock(&p->owner->lock)) {
 			ast_log(LOG_DEBUG, "Failed to grab lock, trying again...\n");
 			if (--lockretry) {
 				ast_mutex_unlock(&p->lock);
-				ast_mutex_unlock(&netlock);
+				if (biglock)
+					ast_mutex_unlock(biglock);
 				usleep(1);
 				goto retrylock;
 			}
@@ -11602,24 +12031,25 @@ retrylock:
 		if (!lockretry) {
 			if (p->owner)
 				ast_log(LOG_ERROR, "We could NOT get the channel lock for %s - Call ID %s! \n", p->owner->name, p->callid);
-			ast_log(LOG_ERROR, "SIP MESSAGE JUST IGNORED: %s \n", req.data);
+			ast_log(LOG_ERROR, "SIP MESSAGE JUST IGNORED: %s \n", req->data);
 			ast_log(LOG_ERROR, "BAD! BAD! BAD!\n");
 			ast_mutex_unlock(&p->lock);
-			ast_mutex_unlock(&netlock);
+			if (biglock)
+				ast_mutex_unlock(biglock);
 #ifdef SOLARIS
 			thr_yield();
 #endif
-			return 1;
+			return;
 		}
-		memcpy(&p->recv, &sin, sizeof(p->recv));
+		memcpy(&p->recv, sin, sizeof(p->recv));
 		if (recordhistory) {
 			char tmp[80];
 			/* This is a response, note what it was for */
-			snprintf(tmp, sizeof(tmp), "%s / %s /%s", req.data, get_header(&req, "CSeq"), req.rlPart2);
+			snprintf(tmp, sizeof(tmp), "%s / %s /%s", req->data, get_header(req, "CSeq"), req->rlPart2);
 			append_history(p, "Rx", tmp);
 		}
 		nounlock = 0;
-		if (handle_request(p, &req, &sin, &recount, &nounlock) == -1) {
+		if (handle_request(p, req, sin, &recount, &nounlock) == -1) {
 			/* Request failed */
 			ast_log(LOG_DEBUG, "SIP message could not be handled, bad request: %-70.70s\n", p->callid[0] ? p->callid : "<no callid>");
 		}
@@ -11628,10 +12058,150 @@ retrylock:
 			ast_mutex_unlock(&p->owner->lock);
 		ast_mutex_unlock(&p->lock);
 	}
-	ast_mutex_unlock(&netlock);
+	if (biglock)
+		ast_mutex_unlock(biglock);
 	if (recount)
 		ast_update_use_count();
+}
+
+/*! \brief  sip_worker_thread: Handle packets queued for one SIP worker */
+static void *sip_worker_thread(void *data)
+{
+	struct sip_worker *worker = data;
+	struct sip_work *work;
+
+	for (;;) {
+		ast_mutex_lock(&workerlock);
+		while (!worker->head && !workers_stopping)
+			ast_cond_wait(&worker->cond, &workerlock);
+		if (!(work = worker->head)) {
+			/* Stopping, and nothing left to do */
+			ast_mutex_unlock(&workerlock);
+			break;
+		}
+		worker->head = work->next;
+		if (!worker->head)
+			worker->tail = NULL;
+		worker->depth--;
+		ast_mutex_unlock(&workerlock);
+
+		sip_process_packet(&work->req, &work->sin, NULL);
+		free(work);
+
+		ast_mutex_lock(&workerlock);
+		worker->processed++;
+		ast_mutex_unlock(&workerlock);
+	}
+	return NULL;
+}
+
+/*! \brief  sip_worker_dispatch: Queue a packet to the worker owning its Call-ID.
+	All packets of a dialog go to the same worker, so they are handled in order */
+static void sip_worker_dispatch(struct sip_work *work)
+{
+	struct sip_worker *worker;
+
+	ast_mutex_lock(&workerlock);
+	worker = &workers[dialog_hash(get_header(&work->req, "Call-ID")) % workercount];
+	if (worker->depth >= SIP_WORKER_MAXQUEUE) {
+		worker->dropped++;
+		ast_mutex_unlock(&workerlock);
+		if (option_debug)
+			ast_log(LOG_DEBUG, "SIP worker queue full, dropping packet\n");
+		free(work);
+		return;
+	}
+	work->next = NULL;
+	if (worker->tail)
+		worker->tail->next = work;
+	else
+		worker->head = work;
+	worker->tail = work;
+	worker->depth++;
+	if (worker->depth > worker->maxdepth)
+		worker->maxdepth = worker->depth;
+	ast_cond_signal(&worker->cond);
+	ast_mutex_unlock(&workerlock);
+}
+
+/*! \brief  sip_workers_start: Start the pool of SIP worker threads */
+static int sip_workers_start(int count)
+{
+	int x;
 
+	if (count <= 0)
+		return 0;
+	if (!(workers = calloc(count, sizeof(*workers)))) {
+		ast_log(LOG_WARNING, "Out of memory, handling SIP in the monitor thread\n");
+		return -1;
+	}
+	workers_stopping = 0;
+	for (x = 0; x < count; x++) {
+		ast_cond_init(&workers[x].cond, NULL);
+		if (ast_pthread_create(&workers[x].thread, NULL, sip_worker_thread, &workers[x])) {
+			ast_log(LOG_WARNING, "Unable to start SIP worker thread: %s\n", strerror(errno));
+			ast_cond_destroy(&workers[x].cond);
+			break;
+		}
+	}
+	workercount = x;
+	if (!workercount) {
+		free(workers);
+		workers = NULL;
+	} else if (option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "Started %d SIP worker threads\n", workercount);
+	return 0;
+}
+
+/*! \brief  sip_workers_stop: Let the SIP workers finish their queues, then stop them */
+static void sip_workers_stop(void)
+{
+	int x, count = workercount;
+
+	if (!count)
+		return;
+	ast_mutex_lock(&workerlock);
+	/* From now on packets are handled by the monitor thread again */
+	workercount = 0;
+	workers_stopping = 1;
+	for (x = 0; x < count; x++)
+		ast_cond_signal(&workers[x].cond);
+	ast_mutex_unlock(&workerlock);
+	for (x = 0; x < count; x++) {
+		pthread_join(workers[x].thread, NULL);
+		ast_cond_destroy(&workers[x].cond);
+	}
+	free(workers);
+	workers = NULL;
+}
+
+/*! \brief  sipsock_read: Read data from SIP socket ---*/
+/*    Successful messages is connected to SIP call and forwarded to handle_request() */
+static int sipsock_read(int *id, int fd, short events, void *ignore)
+{
+	struct sip_request req;
+	struct sockaddr_in sin = { 0, };
+	struct sip_work *work;
+
+	if (workercount) {
+		/* Read straight into the work item, since a parsed request points into itself */
+		if (!(work = malloc(sizeof(*work)))) {
+			ast_log(LOG_WARNING, "Out of memory queueing SIP packet\n");
+			sip_read_packet(&req, &sin);
+			return 1;
+		}
+		memset(&work->sin, 0, sizeof(work->sin));
+		if (sip_read_packet(&work->req, &work->sin))
+			free(work);
+		else
+			sip_worker_dispatch(work);
+		return 1;
+	}
+
+	if (!sip_read_packet(&req, &sin)) {
+		/* Process request, with netlock held */
+		sip_process_packet(&req, &sin, &netlock);
+	}
 	return 1;
 }
 
@@ -11642,6 +12212,8 @@ static int sip_send_mwi_to_peer(struct sip_peer *peer)
 	struct sip_pvt *p;
 	int newmsgs, oldmsgs;
 
+	time(&peer->lastmsgcheck);
+
 	/* Do we have an IP address? If not, skip this peer */
 	if (!peer->addr.sin_addr.s_addr && !peer->defaddr.sin_addr.s_addr) 
 		return 0;
@@ -11649,8 +12221,6 @@ static int sip_send_mwi_to_peer(struct sip_peer *peer)
 	/* Check for messages */
 	ast_app_messagecount(peer->mailbox, &newmsgs, &oldmsgs);
 	
-	time(&peer->lastmsgcheck);
-	
 	/* Return now if it's the same thing we told them last time */
 	if (((newmsgs > 0x7fff ? 0x7fff0000 : (newmsgs << 16)) | (oldmsgs > 0xffff ? 0xffff : oldmsgs)) == peer->lastmsgssent) {
 		return 0;
@@ -11671,7 +12241,7 @@ static int sip_send_mwi_to_peer(struct sip_peer *peer)
 	if (ast_sip_ouraddrfor(&p->sa.sin_addr,&p->ourip))
 		memcpy(&p->ourip, &__ourip, sizeof(p->ourip));
 	build_via(p, p->via, sizeof(p->via));
-	build_callid(p->callid, sizeof(p->callid), p->ourip, p->fromdomain);
+	sip_rebuild_callid(p);
 	/* Send MWI */
 	ast_set_flag(p, SIP_OUTGOING);
 	transmit_notify_with_mwi(p, newmsgs, oldmsgs, peer->vmexten);
@@ -11679,16 +12249,108 @@ static int sip_send_mwi_to_peer(struct sip_peer *peer)
 	return 0;
 }
 
+/*! \brief  sip_mwi_changed: Remember that the message counts of a mailbox changed, for the next MWI sweep ---*/
+static void sip_mwi_changed(const char *mailbox, int newmsgs, int oldmsgs, void *data)
+{
+	struct sip_mwi_change *change;
+	unsigned int hash;
+
+	if (!mailbox) {
+		ast_mutex_lock(&mwi_lock);
+		mwi_changed_all = 1;
+		ast_mutex_unlock(&mwi_lock);
+		return;
+	}
+	hash = ast_strhash(mailbox);
+	ast_mutex_lock(&mwi_lock);
+	for (change = mwi_changes[hash % MWI_CHANGE_BUCKETS]; change; change = change->next) {
+		if ((change->hash == hash) && !strcmp(change->mailbox, mailbox))
+			break;
+	}
+	if (!change && (change = calloc(1, sizeof(*change) + strlen(mailbox)))) {
+		strcpy(change->mailbox, mailbox);
+		change->hash = hash;
+		change->next = mwi_changes[hash % MWI_CHANGE_BUCKETS];
+		mwi_changes[hash % MWI_CHANGE_BUCKETS] = change;
+		mwi_changed++;
+	}
+	ast_mutex_unlock(&mwi_lock);
+}
+
+/*! \brief  peer_mwi_changed: Whether one of the mailboxes of a peer is in changes ---*/
+static int peer_mwi_changed(struct sip_peer *peer, struct sip_mwi_change **changes)
+{
+	struct sip_mwi_change *change;
+	char box[AST_MAX_EXTENSION * 2], *mailboxes, *cur;
+	unsigned int hash;
+
+	mailboxes = ast_strdupa(peer->mailbox);
+	while ((cur = strsep(&mailboxes, ", "))) {
+		if (ast_strlen_zero(cur))
+			continue;
+		snprintf(box, sizeof(box), strchr(cur, '@') ? "%s" : "%s@default", cur);
+		hash = ast_strhash(box);
+		for (change = changes[hash % MWI_CHANGE_BUCKETS]; change; change = change->next) {
+			if ((change->hash == hash) && !strcmp(change->mailbox, box))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*! \brief  sip_mwi_sweep: Find the peers needing MWI: those whose mailbox
+	changed, those that registered, and with checkmwi, those we have not
+	checked for that long ---*/
+static void sip_mwi_sweep(time_t t)
+{
+	struct sip_mwi_change *changes[MWI_CHANGE_BUCKETS], *change;
+	int changed, all, x;
+
+	ast_mutex_lock(&mwi_lock);
+	memcpy(changes, mwi_changes, sizeof(changes));
+	memset(mwi_changes, 0, sizeof(mwi_changes));
+	changed = mwi_changed;
+	mwi_changed = 0;
+	all = mwi_changed_all;
+	mwi_changed_all = 0;
+	ast_mutex_unlock(&mwi_lock);
+
+	mwi_ndue = mwi_next = 0;
+	ASTOBJ_CONTAINER_TRAVERSE(&peerl, 1, do {
+		if (!ast_strlen_zero(iterator->mailbox) &&
+		    (all || (global_mwitime && ((t - iterator->lastmsgcheck) > global_mwitime)) ||
+		     ((iterator->lastmsgssent == -1) && (iterator->addr.sin_addr.s_addr || iterator->defaddr.sin_addr.s_addr)) ||
+		     (changed && peer_mwi_changed(iterator, changes)))) {
+			if (mwi_ndue == mwi_maxdue) {
+				struct sip_peer **tmp = realloc(mwi_due, (mwi_maxdue + 64) * sizeof(*mwi_due));
+				if (tmp) {
+					mwi_due = tmp;
+					mwi_maxdue += 64;
+				}
+			}
+			if (mwi_ndue < mwi_maxdue)
+				mwi_due[mwi_ndue++] = ASTOBJ_REF(iterator);
+		}
+	} while (0)
+	);
+
+	for (x = 0; x < MWI_CHANGE_BUCKETS; x++) {
+		while ((change = changes[x])) {
+			changes[x] = change->next;
+			free(change);
+		}
+	}
+}
+
 /*! \brief  do_monitor: The SIP monitoring thread ---*/
 static void *do_monitor(void *data)
 {
 	int res;
-	struct sip_pvt *sip;
+	struct sip_pvt *sip, *reap;
 	struct sip_peer *peer = NULL;
-	time_t t;
+	time_t t, lastsweep = 0, lastmwisweep = 0;
 	int fastrestart =0;
-	int lastpeernum = -1;
-	int curpeernum;
+	int x;
 	int reloading;
 
 	/* Add an I/O event to our UDP socket */
@@ -11707,7 +12369,10 @@ static void *do_monitor(void *data)
 		if (reloading) {
 			if (option_verbose > 0)
 				ast_verbose(VERBOSE_PREFIX_1 "Reloading SIP\n");
+			/* Nothing may be handling packets while the configuration changes */
+			sip_workers_stop();
 			sip_do_reload();
+			sip_workers_start(global_workerthreads);
 
 			/* Change the I/O fd of our UDP socket */
 			if (sipsock > -1) {
@@ -11719,58 +12384,86 @@ static void *do_monitor(void *data)
 		}
 		/* Check for interfaces needing to be killed */
 		ast_mutex_lock(&iflock);
-restartsearch:		
 		time(&t);
-		sip = iflist;
-		/* don't scan the interface list if it hasn't been a reasonable period
-		   of time since the last time we did it (when MWI is being sent, we can
-		   get back to this point every millisecond or less)
+		/* RTP keepalives and timeouts have one second resolution, so there is
+		   no point in looking at the calls carrying media more often than that
+		   (when MWI is being sent, we can get back to this point every
+		   millisecond or less)
 		*/
-		while(!fastrestart && sip) {
-			ast_mutex_lock(&sip->lock);
-			if (sip->rtp && sip->owner && (sip->owner->_state == AST_STATE_UP) && !sip->redirip.sin_addr.s_addr) {
-				if (sip->lastrtptx && sip->rtpkeepalive && t > sip->lastrtptx + sip->rtpkeepalive) {
-					/* Need to send an empty RTP packet */
-					time(&sip->lastrtptx);
-					ast_rtp_sendcng(sip->rtp, 0);
-				}
-				if (sip->lastrtprx && (sip->rtptimeout || sip->rtpholdtimeout) && t > sip->lastrtprx + sip->rtptimeout) {
-					/* Might be a timeout now -- see if we're on hold */
-					struct sockaddr_in sin;
-					ast_rtp_get_peer(sip->rtp, &sin);
-					if (sin.sin_addr.s_addr || 
-							(sip->rtpholdtimeout && 
-							  (t > sip->lastrtprx + sip->rtpholdtimeout))) {
-						/* Needs a hangup */
-						if (sip->rtptimeout) {
-							while(sip->owner && ast_mutex_trylock(&sip->owner->lock)) {
-								ast_mutex_unlock(&sip->lock);
-								usleep(1);
-								ast_mutex_lock(&sip->lock);
-							}
-							if (sip->owner) {
-								ast_log(LOG_NOTICE, "Disconnecting call '%s' for lack of RTP activity in %ld seconds\n", sip->owner->name, (long)(t - sip->lastrtprx));
-								/* Issue a softhangup */
-								ast_softhangup_nolock(sip->owner, AST_SOFTHANGUP_DEV);
-								ast_mutex_unlock(&sip->owner->lock);
-								/* forget the timeouts for this call, since a hangup
-								   has already been requested and we don't want to
-								   repeatedly request hangups
-								*/
-								sip->rtptimeout = 0;
-								sip->rtpholdtimeout = 0;
+		if (t != lastsweep) {
+			lastsweep = t;
+			for (sip = mediadialogs; sip; sip = sip->medianext) {
+				/* Workers take iflock while holding a dialog, so don't wait
+				   for one; a busy dialog is clearly not timing out */
+				if (ast_mutex_trylock(&sip->lock))
+					continue;
+				if (sip->rtp && sip->owner && (sip->owner->_state == AST_STATE_UP) && !sip->redirip.sin_addr.s_addr) {
+					time_t relayrx, relaytx;
+					/* Media relayed by the RTP core doesn't pass through us */
+					ast_rtp_get_relay_times(sip->rtp, &relayrx, &relaytx);
+					if (relayrx > sip->lastrtprx)
+						sip->lastrtprx = relayrx;
+					if (relaytx > sip->lastrtptx)
+						sip->lastrtptx = relaytx;
+					if (sip->lastrtptx && sip->rtpkeepalive && t > sip->lastrtptx + sip->rtpkeepalive) {
+						/* Need to send an empty RTP packet */
+						time(&sip->lastrtptx);
+						ast_rtp_sendcng(sip->rtp, 0);
+					}
+					if (sip->lastrtprx && (sip->rtptimeout || sip->rtpholdtimeout) && t > sip->lastrtprx + sip->rtptimeout) {
+						/* Might be a timeout now -- see if we're on hold */
+						struct sockaddr_in sin;
+						ast_rtp_get_peer(sip->rtp, &sin);
+						if (sin.sin_addr.s_addr || 
+								(sip->rtpholdtimeout && 
+								  (t > sip->lastrtprx + sip->rtpholdtimeout))) {
+							/* Needs a hangup */
+							if (sip->rtptimeout) {
+								while(sip->owner && ast_mutex_trylock(&sip->owner->lock)) {
+									ast_mutex_unlock(&sip->lock);
+									usleep(1);
+									ast_mutex_lock(&sip->lock);
+								}
+								if (sip->owner) {
+									ast_log(LOG_NOTICE, "Disconnecting call '%s' for lack of RTP activity in %ld seconds\n", sip->owner->name, (long)(t - sip->lastrtprx));
+									/* Issue a softhangup */
+									ast_softhangup_nolock(sip->owner, AST_SOFTHANGUP_DEV);
+									ast_mutex_unlock(&sip->owner->lock);
+									/* forget the timeouts for this call, since a hangup
+									   has already been requested and we don't want to
+									   repeatedly request hangups
+									*/
+									sip->rtptimeout = 0;
+									sip->rtpholdtimeout = 0;
+								}
 							}
 						}
 					}
 				}
+				ast_mutex_unlock(&sip->lock);
 			}
-			if (ast_test_flag(sip, SIP_NEEDDESTROY) && !sip->packets && !sip->owner) {
+		}
+		/* Reap the dialogs that have been flagged with SIP_NEEDDESTROY */
+		ast_mutex_lock(&destroylock);
+		reap = destroyq;
+		destroyq = NULL;
+		ast_mutex_unlock(&destroylock);
+		while ((sip = reap)) {
+			reap = sip->destroynext;
+			if (!ast_mutex_trylock(&sip->lock)) {
+				if (ast_test_flag(sip, SIP_NEEDDESTROY) && !sip->packets && !sip->owner) {
+					/* Nobody holds it and with iflock held nobody can find it */
+					ast_mutex_unlock(&sip->lock);
+					__sip_destroy(sip, 1);
+					continue;
+				}
 				ast_mutex_unlock(&sip->lock);
-				__sip_destroy(sip, 1);
-				goto restartsearch;
 			}
-			ast_mutex_unlock(&sip->lock);
-			sip = sip->next;
+			/* Busy, still has packets or an owner, look at it again next time around */
+			ast_mutex_lock(&destroylock);
+			sip->destroynext = destroyq;
+			destroyq = sip;
+			ast_mutex_unlock(&destroylock);
 		}
 		ast_mutex_unlock(&iflock);
 		/* Don't let anybody kill us right away.  Nobody should lock the interface list
@@ -11802,27 +12495,18 @@ restartsearch:
 
 		/* needs work to send mwi to realtime peers */
 		time(&t);
-		fastrestart = 0;
-		curpeernum = 0;
-		peer = NULL;
-		ASTOBJ_CONTAINER_TRAVERSE(&peerl, !peer, do {
-			if ((curpeernum > lastpeernum) && !ast_strlen_zero(iterator->mailbox) && ((t - iterator->lastmsgcheck) > global_mwitime)) {
-				fastrestart = 1;
-				lastpeernum = curpeernum;
-				peer = ASTOBJ_REF(iterator);
-			};
-			curpeernum++;
-		} while (0)
-		);
-		if (peer) {
+		if ((t != lastmwisweep) && (mwi_next == mwi_ndue)) {
+			lastmwisweep = t;
+			sip_mwi_sweep(t);
+		}
+		for (x = 0; (x < MWI_PEERS_PER_PASS) && (mwi_next < mwi_ndue); x++) {
+			peer = mwi_due[mwi_next++];
 			ASTOBJ_WRLOCK(peer);
 			sip_send_mwi_to_peer(peer);
 			ASTOBJ_UNLOCK(peer);
 			ASTOBJ_UNREF(peer,sip_destroy_peer);
-		} else {
-			/* Reset where we come from */
-			lastpeernum = -1;
 		}
+		fastrestart = (mwi_next < mwi_ndue);
 		ast_mutex_unlock(&monlock);
 	}
 	/* Never reached */
@@ -11924,7 +12608,7 @@ static int sip_poke_peer(struct sip_peer *peer)
 	if (ast_sip_ouraddrfor(&p->sa.sin_addr,&p->ourip))
 		memcpy(&p->ourip, &__ourip, sizeof(p->ourip));
 	build_via(p, p->via, sizeof(p->via));
-	build_callid(p->callid, sizeof(p->callid), p->ourip, p->fromdomain);
+	sip_rebuild_callid(p);
 
 	if (peer->pokeexpire > -1)
 		ast_sched_del(sched, peer->pokeexpire);
@@ -12069,7 +12753,7 @@ static struct ast_channel *sip_request_call(const char *type, int format, void *
 	if (ast_sip_ouraddrfor(&p->sa.sin_addr,&p->ourip))
 		memcpy(&p->ourip, &__ourip, sizeof(p->ourip));
 	build_via(p, p->via, sizeof(p->via));
-	build_callid(p->callid, sizeof(p->callid), p->ourip, p->fromdomain);
+	sip_rebuild_callid(p);
 	
 	/* We have an extension to call, don't use the full contact here */
 	/* This to enable dialling registered peers with extension dialling,
@@ -12840,6 +13524,7 @@ static int reload_config(void)
 	ast_set_flag(&global_flags, SIP_CAN_REINVITE);
 	ast_set_flag(&global_flags_page2, SIP_PAGE2_RTUPDATE);
 	global_mwitime = DEFAULT_MWITIME;
+	global_workerthreads = 0;
 	strcpy(global_vmexten, DEFAULT_VMEXTEN);
 	srvlookup = 0;
 	autocreatepeer = 0;
@@ -12884,9 +13569,14 @@ static int reload_config(void)
 			relaxdtmf = ast_true(v->value);
 		} else if (!strcasecmp(v->name, "checkmwi")) {
 			if ((sscanf(v->value, "%d", &global_mwitime) != 1) || (global_mwitime < 0)) {
-				ast_log(LOG_WARNING, "'%s' is not a valid MWI time setting at line %d.  Using default (10).\n", v->value, v->lineno);
+				ast_log(LOG_WARNING, "'%s' is not a valid MWI time setting at line %d.  Using default (%d).\n", v->value, v->lineno, DEFAULT_MWITIME);
 				global_mwitime = DEFAULT_MWITIME;
 			}
+		} else if (!strcasecmp(v->name, "workerthreads")) {
+			if ((sscanf(v->value, "%d", &global_workerthreads) != 1) || (global_workerthreads < 0)) {
+				ast_log(LOG_WARNING, "'%s' is not a valid number of worker threads at line %d.  Using default (0).\n", v->value, v->lineno);
+				global_workerthreads = 0;
+			}
 		} else if (!strcasecmp(v->name, "vmexten")) {
 			ast_copy_string(global_vmexten, v->value, sizeof(global_vmexten));
 		} else if (!strcasecmp(v->name, "rtptimeout")) {
@@ -13072,7 +13762,7 @@ static int reload_config(void)
 					peer = build_peer(cat, ast_variable_browse(cfg, cat), 0);
 					if (peer) {
 						ast_device_state_changed("SIP/%s", peer->name);
-						ASTOBJ_CONTAINER_LINK(&peerl,peer);
+						sip_link_peer(peer);
 						ASTOBJ_UNREF(peer, sip_destroy_peer);
 					}
 				} else if (strcasecmp(utype, "user")) {
@@ -13184,6 +13874,22 @@ static struct ast_rtp *sip_get_rtp_peer(struct ast_channel *chan)
 	return rtp;
 }
 
+/*! \brief  sip_get_relay_rtp: Returns null if the RTP core has to see our audio,
+	i.e. when DTMF is detected inband (part of RTP interface) */
+static struct ast_rtp *sip_get_relay_rtp(struct ast_channel *chan)
+{
+	struct sip_pvt *p;
+	struct ast_rtp *rtp = NULL;
+	p = chan->tech_pvt;
+	if (!p)
+		return NULL;
+	ast_mutex_lock(&p->lock);
+	if (p->rtp && !p->vad && (ast_test_flag(p, SIP_DTMF) != SIP_DTMF_INBAND))
+		rtp = p->rtp;
+	ast_mutex_unlock(&p->lock);
+	return rtp;
+}
+
 /*! \brief  sip_get_vrtp_peer: Returns null if we can't reinvite video (part of RTP interface) */
 static struct ast_rtp *sip_get_vrtp_peer(struct ast_channel *chan)
 {
@@ -13505,6 +14211,7 @@ static struct ast_rtp_protocol sip_rtp = {
 	get_vrtp_info: sip_get_vrtp_peer,
 	set_rtp_peer: sip_set_rtp_peer,
 	get_codec: sip_get_codec,
+	get_relay_info: sip_get_relay_rtp,
 };
 
 /*! \brief  sip_poke_all_peers: Send a poke to all known peers */
@@ -13607,6 +14314,7 @@ static struct ast_cli_entry  my_clis[] = {
 	{ { "sip", "show", "history", NULL }, sip_show_history, "Show SIP dialog history", show_history_usage, complete_sipch  },
 	{ { "sip", "show", "domains", NULL }, sip_show_domains, "List our local SIP domains.", show_domains_usage },
 	{ { "sip", "show", "settings", NULL }, sip_show_settings, "Show SIP global settings", show_settings_usage  },
+	{ { "sip", "show", "workers", NULL }, sip_show_workers, "Show SIP worker threads", show_workers_usage },
 	{ { "sip", "debug", NULL }, sip_do_debug, "Enable SIP debugging", debug_usage },
 	{ { "sip", "debug", "ip", NULL }, sip_do_debug, "Enable SIP debugging on IP", debug_usage },
 	{ { "sip", "debug", "peer", NULL }, sip_do_debug, "Enable SIP debugging on Peername", debug_usage, complete_sip_debug_peer },
@@ -13629,14 +14337,15 @@ static struct ast_cli_entry  my_clis[] = {
 /*! \brief  load_module: PBX load module - initialization ---*/
 int load_module()
 {
-	ASTOBJ_CONTAINER_INIT(&userl);	/* User object list */
-	ASTOBJ_CONTAINER_INIT(&peerl);	/* Peer object list */
+	ASTOBJ_CONTAINER_INIT_HASHED(&userl, SIP_OBJ_BUCKETS);	/* User object list */
+	ASTOBJ_CONTAINER_INIT_HASHED(&peerl, SIP_OBJ_BUCKETS);	/* Peer object list */
 	ASTOBJ_CONTAINER_INIT(&regl);	/* Registry object list */
 
 	sched = sched_context_create();
 	if (!sched) {
 		ast_log(LOG_WARNING, "Unable to create schedule context\n");
-	}
+	} else
+		ast_sched_set_name(sched, "chan_sip");
 
 	io = io_context_create();
 	if (!io) {
@@ -13668,6 +14377,7 @@ int load_module()
 	ast_custom_function_register(&sip_header_function);
 	ast_custom_function_register(&sippeer_function);
 	ast_custom_function_register(&sipchaninfo_function);
+	ast_custom_function_register(&siprtcpstats_function);
 	ast_custom_function_register(&checksipdomain_function);
 
 	/* Register manager commands */
@@ -13679,6 +14389,11 @@ int load_module()
 	sip_poke_all_peers();	
 	sip_send_all_registers();
 	
+	sip_workers_start(global_workerthreads);
+
+	/* Send MWI when voicemail tells us the messages changed */
+	ast_mwi_add(sip_mwi_changed, NULL);
+
 	/* And start the monitor for the first time */
 	restart_monitor();
 
@@ -13688,10 +14403,15 @@ int load_module()
 int unload_module()
 {
 	struct sip_pvt *p, *pl;
+	struct sip_peer *peer;
+	int x;
 	
 	/* First, take us out of the channel type list */
 	ast_channel_unregister(&sip_tech);
 
+	ast_mwi_del(sip_mwi_changed, NULL);
+
+	ast_custom_function_unregister(&siprtcpstats_function);
 	ast_custom_function_unregister(&sipchaninfo_function);
 	ast_custom_function_unregister(&sippeer_function);
 	ast_custom_function_unregister(&sip_header_function);
@@ -13735,6 +14455,29 @@ int unload_module()
 		return -1;
 	}
 
+	/* Peers the monitor did not get to send MWI to */
+	while (mwi_next < mwi_ndue) {
+		peer = mwi_due[mwi_next++];
+		ASTOBJ_UNREF(peer, sip_destroy_peer);
+	}
+	free(mwi_due);
+	mwi_due = NULL;
+	mwi_ndue = mwi_maxdue = mwi_next = 0;
+	ast_mutex_lock(&mwi_lock);
+	for (x = 0; x < MWI_CHANGE_BUCKETS; x++) {
+		struct sip_mwi_change *change;
+
+		while ((change = mwi_changes[x])) {
+			mwi_changes[x] = change->next;
+			free(change);
+		}
+	}
+	mwi_changed = 0;
+	ast_mutex_unlock(&mwi_lock);
+
+	/* No more packets are coming in, let the workers finish what is queued */
+	sip_workers_stop();
+
 	if (!ast_mutex_lock(&iflock)) {
 		/* Destroy all the interfaces and free their memory */
 		p = iflist;
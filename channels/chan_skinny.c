@@ -1325,6 +1325,90 @@ static void do_housekeeping(struct skinnysession *s)
 
 }
 
+/* A mailbox whose messages changed, waiting for do_monitor() to set the lamps */
+struct skinny_mwi_change {
+	struct skinny_mwi_change *next;
+	char mailbox[1];
+};
+
+static struct skinny_mwi_change *mwi_changes;
+static int mwi_changed_all;		/* Any mailbox may have changed */
+/* Protect the changed mailboxes */
+AST_MUTEX_DEFINE_STATIC(mwilock);
+
+/* Voicemail tells us the messages of a mailbox changed.  We are not
+   allowed to block here, so only remember it for the monitor thread */
+static void skinny_mwi_changed(const char *mailbox, int newmsgs, int oldmsgs, void *data)
+{
+	struct skinny_mwi_change *change;
+
+	ast_mutex_lock(&mwilock);
+	if (!mailbox) {
+		mwi_changed_all = 1;
+	} else {
+		for (change = mwi_changes; change; change = change->next) {
+			if (!strcmp(change->mailbox, mailbox))
+				break;
+		}
+		if (!change && (change = malloc(sizeof(*change) + strlen(mailbox)))) {
+			strcpy(change->mailbox, mailbox);
+			change->next = mwi_changes;
+			mwi_changes = change;
+		}
+	}
+	ast_mutex_unlock(&mwilock);
+}
+
+/* Whether one of the changed mailboxes is among those of a line */
+static int skinny_line_mwi_changed(struct skinny_line *l, struct skinny_mwi_change *changes)
+{
+	struct skinny_mwi_change *change;
+
+	for (change = changes; change; change = change->next) {
+		if (ast_mwi_mailbox_in(l->mailbox, change->mailbox))
+			return 1;
+	}
+	return 0;
+}
+
+/* Light the voicemail lamps of the lines whose mailbox changed */
+static void skinny_mwi_sweep(void)
+{
+	struct skinny_mwi_change *changes, *change;
+	struct skinnysession *s;
+	struct skinny_line *l;
+	int all;
+
+	ast_mutex_lock(&mwilock);
+	changes = mwi_changes;
+	mwi_changes = NULL;
+	all = mwi_changed_all;
+	mwi_changed_all = 0;
+	ast_mutex_unlock(&mwilock);
+	if (!changes && !all)
+		return;
+
+	ast_mutex_lock(&sessionlock);
+	for (s = sessions; s; s = s->next) {
+		if (!s->device || !s->device->registered)
+			continue;
+		for (l = s->device->lines; l; l = l->next) {
+			if (ast_strlen_zero(l->mailbox) || (!all && !skinny_line_mwi_changed(l, changes)))
+				continue;
+			if (has_voicemail(l))
+				transmit_lamp_indication(s, STIMULUS_VOICEMAIL, l->instance, l->mwiblink ? SKINNY_LAMP_BLINK : SKINNY_LAMP_ON);
+			else
+				transmit_lamp_indication(s, STIMULUS_VOICEMAIL, l->instance, SKINNY_LAMP_OFF);
+		}
+	}
+	ast_mutex_unlock(&sessionlock);
+
+	while ((change = changes)) {
+		changes = change->next;
+		free(change);
+	}
+}
+
 /* I do not believe skinny can deal with video. 
    Anyone know differently? */
 static struct ast_rtp *skinny_get_vrtp_peer(struct ast_channel *chan)
@@ -3005,6 +3089,7 @@ static void *do_monitor(void *data)
 			ast_sched_runq(sched);
 		}
 		ast_mutex_unlock(&monlock);
+		skinny_mwi_sweep();
 	}
 	/* Never reached */
 	return NULL;
@@ -3282,13 +3367,15 @@ int load_module()
 	sched = sched_context_create();
 	if (!sched) {
 		ast_log(LOG_WARNING, "Unable to create schedule context\n");
-	}
+	} else
+		ast_sched_set_name(sched, "chan_skinny");
 	io = io_context_create();
 	if (!io) {
 		ast_log(LOG_WARNING, "Unable to create I/O context\n");
 	}
 	/* And start the monitor for the first time */
 	restart_monitor();
+	ast_mwi_add(skinny_mwi_changed, NULL);
 
 	/* Announce our presence to Asterisk */	
 	if (!res) {
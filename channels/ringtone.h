@@ -0,0 +1,30 @@
+/* ringtone.h: Generated from frequencies 440 and 480 
+   by gentone.  200 samples  */
+static short ringtone[200] = {
+	    0, 11581, 21659, 28927, 32445, 31764, 26981, 18727, 
+	 8084, -3559, -14693, -23875, -29927, -32083, -30088, -24228, 
+	-15290, -4453,  6864, 17195, 25212, 29902, 30693, 27526, 
+	20856, 11585,   944, -9673, -18899, -25560, -28837, -28357, 
+	-24244, -17089, -7868,  2192, 11780, 19667, 24872, 26779, 
+	25212, 20450, 13179,  4396, -4731, -13019, -19421, -23164, 
+	-23839, -21446, -16384, -9384, -1408,  6484, 13281, 18145, 
+	20517, 20182, 17286, 12301,  5951,  -887, -7314, -12519, 
+	-15886, -17068, -16017, -12983, -8458, -3109,  2327,  7142, 
+	10750, 12757, 13007, 11585,  8793,  5095,  1044, -2800, 
+	-5951, -8053, -8921, -8560, -7141, -4967, -2421,   104, 
+	 2260,  3791,  4567,  4589,  3977,  2941,  1733,   600, 
+	 -257,  -722,  -772,  -481,     0,   481,   772,   722, 
+	  257,  -600, -1733, -2941, -3977, -4589, -4567, -3791, 
+	-2260,  -104,  2421,  4967,  7141,  8560,  8921,  8053, 
+	 5951,  2800, -1044, -5095, -8793, -11585, -13007, -12757, 
+	-10750, -7142, -2327,  3109,  8458, 12983, 16017, 17068, 
+	15886, 12519,  7314,   887, -5951, -12301, -17286, -20182, 
+	-20517, -18145, -13281, -6484,  1408,  9384, 16384, 21446, 
+	23839, 23164, 19421, 13019,  4731, -4396, -13179, -20450, 
+	-25212, -26779, -24872, -19667, -11780, -2192,  7868, 17089, 
+	24244, 28357, 28837, 25560, 18899,  9673,  -944, -11585, 
+	-20856, -27526, -30693, -29902, -25212, -17195, -6864,  4453, 
+	15290, 24228, 30088, 32083, 29927, 23875, 14693,  3559, 
+	-8084, -18727, -26981, -31764, -32445, -28927, -21659, -11581, 
+	
+};
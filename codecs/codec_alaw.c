@@ -42,6 +42,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 7221 $")
 #include "asterisk/translate.h"
 #include "asterisk/channel.h"
 #include "asterisk/alaw.h"
+#include "asterisk/simd.h"
 
 #define BUFFER_SIZE   8096	/* size for the translation buffers */
 
@@ -147,7 +148,6 @@ static int
 alawtolin_framein (struct ast_translator_pvt *pvt, struct ast_frame *f)
 {
   struct alaw_decoder_pvt *tmp = (struct alaw_decoder_pvt *) pvt;
-  int x;
   unsigned char *b;
 
   if(f->datalen == 0) { /* perform PLC with nominal framesize of 20ms/160 samples */
@@ -169,8 +169,7 @@ alawtolin_framein (struct ast_translator_pvt *pvt, struct ast_frame *f)
 
   /* Reset ssindex and signal to frame's specified values */
   b = f->data;
-  for (x=0;x<f->datalen;x++)
-  	tmp->outbuf[tmp->tail + x] = AST_ALAW(b[x]);
+  ast_alaw_decode(tmp->outbuf + tmp->tail, b, f->datalen);
 
   if(useplc) plc_rx(&tmp->plc, tmp->outbuf+tmp->tail, f->datalen);
 
@@ -223,7 +222,6 @@ static struct ast_frame * alawtolin_frameout (struct ast_translator_pvt *pvt)
 static int lintoalaw_framein (struct ast_translator_pvt *pvt, struct ast_frame *f)
 {
   struct alaw_encoder_pvt *tmp = (struct alaw_encoder_pvt *) pvt;
-  int x;
   short *s;
   if (tmp->tail + f->datalen/2 >= sizeof(tmp->outbuf))
     {
@@ -231,8 +229,7 @@ static int lintoalaw_framein (struct ast_translator_pvt *pvt, struct ast_frame *
       return -1;
     }
   s = f->data;
-  for (x=0;x<f->datalen/2;x++) 
-  	tmp->outbuf[x+tmp->tail] = AST_LIN2A(s[x]);
+  ast_alaw_encode(tmp->outbuf + tmp->tail, s, f->datalen/2);
   tmp->tail += f->datalen/2;
   return 0;
 }
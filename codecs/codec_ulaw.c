@@ -42,6 +42,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 7221 $")
 #include "asterisk/translate.h"
 #include "asterisk/channel.h"
 #include "asterisk/ulaw.h"
+#include "asterisk/simd.h"
 
 #define BUFFER_SIZE   8096	/* size for the translation buffers */
 
@@ -151,7 +152,6 @@ static int
 ulawtolin_framein (struct ast_translator_pvt *pvt, struct ast_frame *f)
 {
   struct ulaw_decoder_pvt *tmp = (struct ulaw_decoder_pvt *) pvt;
-  int x;
   unsigned char *b;
 
   if(f->datalen == 0) { /* perform PLC with nominal framesize of 20ms/160 samples */
@@ -173,8 +173,7 @@ ulawtolin_framein (struct ast_translator_pvt *pvt, struct ast_frame *f)
 
   /* Reset ssindex and signal to frame's specified values */
   b = f->data;
-  for (x=0;x<f->datalen;x++)
-  	tmp->outbuf[tmp->tail + x] = AST_MULAW(b[x]);
+  ast_ulaw_decode(tmp->outbuf + tmp->tail, b, f->datalen);
 
   if(useplc) plc_rx(&tmp->plc, tmp->outbuf+tmp->tail, f->datalen);
 
@@ -229,7 +228,6 @@ static int
 lintoulaw_framein (struct ast_translator_pvt *pvt, struct ast_frame *f)
 {
   struct ulaw_encoder_pvt *tmp = (struct ulaw_encoder_pvt *) pvt;
-  int x;
   short *s;
   if (tmp->tail + f->datalen/2 >= sizeof(tmp->outbuf))
     {
@@ -237,8 +235,7 @@ lintoulaw_framein (struct ast_translator_pvt *pvt, struct ast_frame *f)
       return -1;
     }
   s = f->data;
-  for (x=0;x<f->datalen/2;x++) 
-  	tmp->outbuf[x+tmp->tail] = AST_LIN2MU(s[x]);
+  ast_ulaw_encode(tmp->outbuf + tmp->tail, s, f->datalen/2);
   tmp->tail += f->datalen/2;
   return 0;
 }
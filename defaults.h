@@ -0,0 +1,22 @@
+/*
+ * defaults.h 
+ * Automatically generated
+ */
+#define AST_CONFIG_DIR "/etc/asterisk"
+#define AST_RUN_DIR    "/var/run"
+#define AST_SOCKET     "/var/run/asterisk.ctl"
+#define AST_PID        "/var/run/asterisk.pid"
+#define AST_MODULE_DIR "/usr/lib/asterisk/modules"
+#define AST_SPOOL_DIR  "/var/spool/asterisk"
+#define AST_VAR_DIR    "/var/lib/asterisk"
+#define AST_LOG_DIR    "/var/log/asterisk"
+#define AST_AGI_DIR    "/var/lib/asterisk/agi-bin"
+#define AST_KEY_DIR    "/var/lib/asterisk/keys"
+#define AST_DB         "/var/lib/asterisk/astdb"
+#define AST_TMP_DIR    "/var/spool/asterisk/tmp"
+
+#define AST_CONFIG_FILE "/etc/asterisk/asterisk.conf"
+
+#define AST_SOUNDS     "/var/lib/asterisk/sounds"
+#define AST_IMAGES     "/var/lib/asterisk/images"
+
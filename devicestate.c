@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "asterisk.h"
 
@@ -40,6 +41,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 67593 $")
 #include "asterisk/devicestate.h"
 #include "asterisk/pbx.h"
 #include "asterisk/options.h"
+#include "asterisk/astobj.h"
+#include "asterisk/cli.h"
 
 static const char *devstatestring[] = {
 	/* 0 AST_DEVICE_UNKNOWN */	"Unknown",	/* Valid, but unknown state */
@@ -62,14 +65,56 @@ static AST_LIST_HEAD_STATIC(devstate_cbs, devstate_cb);
 
 struct state_change {
 	AST_LIST_ENTRY(state_change) list;
+	struct state_change *hashnext;	/* Next in the state_pending bucket */
+	unsigned int hash;
 	char device[1];
 };
 
 static AST_LIST_HEAD_STATIC(state_changes, state_change);
 
+/* The queued changes again, by device, so a device that changes again before
+   the thread gets to it is only queued once: the thread looks up the state
+   when it gets to the device anyway.  Protected by the state_changes lock. */
+#define STATE_CHANGE_BUCKETS 256
+static struct state_change *state_pending[STATE_CHANGE_BUCKETS];
+
 static pthread_t change_thread = AST_PTHREADT_NULL;
 static ast_cond_t change_pending;
 
+/* The last known state of each device queried, so ast_device_state() does not
+   ask the channel driver and walk the channel list every time.  A reported
+   change of the device marks its entry stale, and the next query (normally
+   the state change thread's) looks the state up again.  Entries older than
+   DEVICE_STATE_MAXAGE seconds are looked up again too, for changes that
+   nobody reports. */
+struct devstate_entry {
+	struct devstate_entry *next;	/* Next in the devstates bucket */
+	unsigned int hash;
+	unsigned int generation;	/* Bumped on each reported change */
+	int stale;
+	int state;
+	time_t updated;
+	char device[1];
+};
+
+#define DEVICE_STATE_BUCKETS 1024
+#define DEVICE_STATE_MAXAGE 2
+
+static struct devstate_entry *devstates[DEVICE_STATE_BUCKETS];
+static int devstate_count;
+/* Bumped on each reported change, for lookups of devices not cached yet */
+static unsigned int devstate_generation;
+AST_MUTEX_DEFINE_STATIC(devstate_lock);
+
+static struct {
+	unsigned int hits;		/* Answered from the cache */
+	unsigned int misses;		/* Devices not cached yet */
+	unsigned int stale;		/* Looked up again after a reported change */
+	unsigned int expired;		/* Looked up again after DEVICE_STATE_MAXAGE */
+	unsigned int changes;		/* Changes reported */
+	unsigned int coalesced;		/* Changes of a device already queued */
+} devstate_stats;
+
 /*--- devstate2str: Find devicestate as text message for output */
 const char *devstate2str(int devstate) 
 {
@@ -100,8 +145,8 @@ int ast_parse_device_state(const char *device)
 	return res;
 }
 
-/*--- ast_device_state: Check device state through channel specific function or generic function */
-int ast_device_state(const char *device)
+/*--- device_state_lookup: Check device state through channel specific function or generic function */
+static int device_state_lookup(const char *device)
 {
 	char *buf;
 	char *tech;
@@ -137,6 +182,106 @@ int ast_device_state(const char *device)
 	}
 }
 
+/* Call with devstate_lock held */
+static struct devstate_entry *devstate_find(const char *device, unsigned int hash)
+{
+	struct devstate_entry *entry;
+
+	for (entry = devstates[hash % DEVICE_STATE_BUCKETS]; entry; entry = entry->next) {
+		if ((entry->hash == hash) && !strcasecmp(entry->device, device))
+			break;
+	}
+	return entry;
+}
+
+/*! \brief Remember the state of a device, looked up at generation.
+ * The entry is only fresh if no change was reported while we looked. */
+static void devstate_store(const char *device, unsigned int hash, unsigned int generation, int state, int add)
+{
+	struct devstate_entry *entry;
+
+	ast_mutex_lock(&devstate_lock);
+	entry = devstate_find(device, hash);
+	if (entry) {
+		entry->stale = (entry->generation != generation);
+	} else if (add && (state != AST_DEVICE_INVALID)) {
+		entry = calloc(1, sizeof(*entry) + strlen(device));
+		if (entry) {
+			strcpy(entry->device, device);
+			entry->hash = hash;
+			entry->stale = (devstate_generation != generation);
+			entry->next = devstates[hash % DEVICE_STATE_BUCKETS];
+			devstates[hash % DEVICE_STATE_BUCKETS] = entry;
+			devstate_count++;
+		}
+	}
+	if (entry) {
+		entry->state = state;
+		entry->updated = time(NULL);
+	}
+	ast_mutex_unlock(&devstate_lock);
+}
+
+/*! \brief Look the state of a device up again and remember it */
+static int devstate_refresh(const char *device, unsigned int hash, int add)
+{
+	struct devstate_entry *entry;
+	unsigned int generation;
+	int state;
+
+	ast_mutex_lock(&devstate_lock);
+	entry = devstate_find(device, hash);
+	generation = entry ? entry->generation : devstate_generation;
+	ast_mutex_unlock(&devstate_lock);
+
+	state = device_state_lookup(device);
+	devstate_store(device, hash, generation, state, add);
+	return state;
+}
+
+/*--- ast_device_state: Check device state, from the cache if we know it */
+int ast_device_state(const char *device)
+{
+	struct devstate_entry *entry;
+	unsigned int hash;
+	int state;
+
+	hash = ast_strhash(device);
+	ast_mutex_lock(&devstate_lock);
+	entry = devstate_find(device, hash);
+	if (!entry) {
+		devstate_stats.misses++;
+	} else if (entry->stale) {
+		devstate_stats.stale++;
+	} else if (time(NULL) - entry->updated >= DEVICE_STATE_MAXAGE) {
+		devstate_stats.expired++;
+	} else {
+		devstate_stats.hits++;
+		state = entry->state;
+		ast_mutex_unlock(&devstate_lock);
+		return state;
+	}
+	ast_mutex_unlock(&devstate_lock);
+
+	return devstate_refresh(device, hash, 1);
+}
+
+/*! \brief Mark the cached state of a device stale */
+static void devstate_changed(const char *device, unsigned int hash)
+{
+	struct devstate_entry *entry;
+
+	ast_mutex_lock(&devstate_lock);
+	devstate_generation++;
+	devstate_stats.changes++;
+	entry = devstate_find(device, hash);
+	if (entry) {
+		entry->generation++;
+		entry->stale = 1;
+	}
+	ast_mutex_unlock(&devstate_lock);
+}
+
 /*--- ast_devstate_add: Add device state watcher */
 int ast_devstate_add(ast_devstate_cb_type callback, void *data)
 {
@@ -182,7 +327,8 @@ static void do_state_change(const char *device)
 	int state;
 	struct devstate_cb *devcb;
 
-	state = ast_device_state(device);
+	/* Only devices somebody asked about are cached */
+	state = devstate_refresh(device, ast_strhash(device), 0);
 	if (option_debug > 2)
 		ast_log(LOG_DEBUG, "Changing state for %s - state %d (%s)\n", device, state, devstate2str(state));
 
@@ -206,6 +352,8 @@ static int __ast_device_state_changed_literal(char *buf)
 	if (tmp)
 		*tmp = '\0';
 
+	devstate_changed(device, ast_strhash(device));
+
 	if (change_thread != AST_PTHREADT_NULL)
 		change = calloc(1, sizeof(*change) + strlen(device));
 
@@ -214,9 +362,26 @@ static int __ast_device_state_changed_literal(char *buf)
 		/* there is no background thread, so process the change now */
 		do_state_change(device);
 	} else {
-		/* queue the change */
+		struct state_change *queued;
+
+		/* queue the change, unless it is already queued */
 		strcpy(change->device, device);
+		change->hash = ast_strhash(device);
 		AST_LIST_LOCK(&state_changes);
+		for (queued = state_pending[change->hash % STATE_CHANGE_BUCKETS]; queued; queued = queued->hashnext) {
+			if ((queued->hash == change->hash) && !strcasecmp(queued->device, device))
+				break;
+		}
+		if (queued) {
+			AST_LIST_UNLOCK(&state_changes);
+			ast_mutex_lock(&devstate_lock);
+			devstate_stats.coalesced++;
+			ast_mutex_unlock(&devstate_lock);
+			free(change);
+			return 1;
+		}
+		change->hashnext = state_pending[change->hash % STATE_CHANGE_BUCKETS];
+		state_pending[change->hash % STATE_CHANGE_BUCKETS] = change;
 		AST_LIST_INSERT_TAIL(&state_changes, change, list);
 		if (AST_LIST_FIRST(&state_changes) == change)
 			/* the list was empty, signal the thread */
@@ -249,13 +414,20 @@ int ast_device_state_changed(const char *fmt, ...)
 /*--- do_devstate_changes: Go through the dev state change queue and update changes in the dev state thread */
 static void *do_devstate_changes(void *data)
 {
-	struct state_change *cur;
+	struct state_change *cur, **prev;
 
 	AST_LIST_LOCK(&state_changes);
 	for(;;) {
 		/* the list lock will _always_ be held at this point in the loop */
 		cur = AST_LIST_REMOVE_HEAD(&state_changes, list);
 		if (cur) {
+			/* from here on, a change of the device needs queueing again */
+			for (prev = &state_pending[cur->hash % STATE_CHANGE_BUCKETS]; *prev; prev = &(*prev)->hashnext) {
+				if (*prev == cur) {
+					*prev = cur->hashnext;
+					break;
+				}
+			}
 			/* we got an entry, so unlock the list while we process it */
 			AST_LIST_UNLOCK(&state_changes);
 			do_state_change(cur->device);
@@ -271,6 +443,43 @@ static void *do_devstate_changes(void *data)
 	return NULL;
 }
 
+static int handle_show_devicestates(int fd, int argc, char *argv[])
+{
+	struct devstate_entry *entry;
+	time_t now;
+	int x;
+
+	if (argc != 2)
+		return RESULT_SHOWUSAGE;
+
+	now = time(NULL);
+	ast_mutex_lock(&devstate_lock);
+	ast_cli(fd, "%-40.40s %-15.15s %s\n", "Device", "State", "Age");
+	for (x = 0; x < DEVICE_STATE_BUCKETS; x++) {
+		for (entry = devstates[x]; entry; entry = entry->next) {
+			ast_cli(fd, "%-40.40s %-15.15s %ds%s\n", entry->device, devstate2str(entry->state),
+				(int) (now - entry->updated), entry->stale ? " (stale)" : "");
+		}
+	}
+	ast_cli(fd, "%d cached device%s\n", devstate_count, (devstate_count == 1) ? "" : "s");
+	ast_cli(fd, "Queries: %u answered from the cache, %u new devices, %u after a change, %u expired\n",
+		devstate_stats.hits, devstate_stats.misses, devstate_stats.stale, devstate_stats.expired);
+	ast_cli(fd, "Changes: %u reported, %u while already queued\n",
+		devstate_stats.changes, devstate_stats.coalesced);
+	ast_mutex_unlock(&devstate_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static char show_devicestates_usage[] =
+"Usage: show devicestates\n"
+"       Lists the cached device states, and how many device state\n"
+"       queries were answered from the cache.\n";
+
+static struct ast_cli_entry cli_show_devicestates =
+	{ { "show", "devicestates", NULL }, handle_show_devicestates,
+	  "Show cached device states", show_devicestates_usage };
+
 /*--- ast_device_state_engine_init: Initialize the device state engine in separate thread */
 int ast_device_state_engine_init(void)
 {
@@ -279,6 +488,7 @@ int ast_device_state_engine_init(void)
 		ast_log(LOG_ERROR, "Unable to start device state change thread.\n");
 		return -1;
 	}
+	ast_cli_register(&cli_show_devicestates);
 
 	return 0;
 }
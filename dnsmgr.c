@@ -289,6 +289,7 @@ int dnsmgr_init(void)
 		ast_log(LOG_ERROR, "Unable to create schedule context.\n");
 		return -1;
 	}
+	ast_sched_set_name(sched, "dnsmgr");
 	ast_cli_register(&cli_reload);
 	ast_cli_register(&cli_status);
 	return do_reload(1);
@@ -56,6 +56,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 58388 $")
 #include "asterisk/dsp.h"
 #include "asterisk/ulaw.h"
 #include "asterisk/alaw.h"
+#include "asterisk/simd.h"
 
 /* Number of goertzels for progress detect */
 #define GSAMP_SIZE_NA 183			/* North America - 350, 440, 480, 620, 950, 1400, 1800 Hz */
@@ -1369,7 +1370,6 @@ struct ast_frame *ast_dsp_process(struct ast_channel *chan, struct ast_dsp *dsp,
 	int silence;
 	int res;
 	int digit;
-	int x;
 	short *shortdata;
 	unsigned char *odata;
 	int len;
@@ -1381,12 +1381,10 @@ struct ast_frame *ast_dsp_process(struct ast_channel *chan, struct ast_dsp *dsp,
 			case AST_FORMAT_SLINEAR: \
 				break; \
 			case AST_FORMAT_ULAW: \
-				for (x=0;x<len;x++) \
-					odata[x] = AST_LIN2MU((unsigned short)shortdata[x]); \
+				ast_ulaw_encode(odata, shortdata, len); \
 				break; \
 			case AST_FORMAT_ALAW: \
-				for (x=0;x<len;x++) \
-					odata[x] = AST_LIN2A((unsigned short)shortdata[x]); \
+				ast_alaw_encode(odata, shortdata, len); \
 				break; \
 			} \
 		} \
@@ -1410,8 +1408,7 @@ struct ast_frame *ast_dsp_process(struct ast_channel *chan, struct ast_dsp *dsp,
 			ast_log(LOG_WARNING, "Unable to allocate stack space for data: %s\n", strerror(errno));
 			return af;
 		}
-		for (x=0;x<len;x++) 
-			shortdata[x] = AST_MULAW(odata[x]);
+		ast_ulaw_decode(shortdata, odata, len);
 		break;
 	case AST_FORMAT_ALAW:
 		shortdata = alloca(af->datalen * 2);
@@ -1419,8 +1416,7 @@ struct ast_frame *ast_dsp_process(struct ast_channel *chan, struct ast_dsp *dsp,
 			ast_log(LOG_WARNING, "Unable to allocate stack space for data: %s\n", strerror(errno));
 			return af;
 		}
-		for (x=0;x<len;x++) 
-			shortdata[x] = AST_ALAW(odata[x]);
+		ast_alaw_decode(shortdata, odata, len);
 		break;
 	default:
 		ast_log(LOG_WARNING, "Inband DTMF is not supported on codec %s. Use RFC2833\n", ast_getformatname(af->subclass));
@@ -28,6 +28,9 @@
 #include <errno.h>
 #include <stdio.h>
 
+#include <stddef.h>
+#include <pthread.h>
+
 #include "asterisk.h"
 
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 47859 $")
@@ -40,6 +43,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 47859 $")
 #include "asterisk/cli.h"
 #include "asterisk/term.h"
 #include "asterisk/utils.h"
+#include "asterisk/simd.h"
 
 #ifdef TRACE_FRAMES
 static int headers = 0;
@@ -49,6 +53,45 @@ AST_MUTEX_DEFINE_STATIC(framelock);
 
 #define SMOOTHER_SIZE 8000
 
+/*! Space after the header of each frame pool size class.  Class 0 holds bare
+    headers, the others a header followed by AST_FRIENDLY_OFFSET, payload and
+    source string, as laid out by ast_frdup().  20ms of 8kHz, 16kHz and
+    32kHz slinear fit the three payload classes. */
+static const int frame_pool_sizes[] = { 0, 448, 768, 1408 };
+#define FRAME_POOL_CLASSES	(sizeof(frame_pool_sizes) / sizeof(frame_pool_sizes[0]))
+/*! Free blocks kept per size class by each thread */
+#define FRAME_POOL_MAX		64
+
+/*! A pooled frame: the header, followed by its size class's worth of space */
+struct frame_pool_blk {
+	struct frame_pool_blk *next;
+	int cls;
+	struct ast_frame f;
+};
+
+struct frame_pool_stats {
+	unsigned int allocs;	/*!< Blocks handed out */
+	unsigned int hits;	/*!< ...of which came off the free list */
+	unsigned int frees;	/*!< Blocks given back */
+	unsigned int overflows;	/*!< ...of which went to free() because the list was full */
+};
+
+/*! Per thread free lists */
+struct frame_pool {
+	struct frame_pool_blk *blks[FRAME_POOL_CLASSES];
+	int count[FRAME_POOL_CLASSES];
+	struct frame_pool_stats stats[FRAME_POOL_CLASSES];
+	struct frame_pool *next;
+	struct frame_pool *prev;
+};
+
+static pthread_key_t frame_pool_key;
+static pthread_once_t frame_pool_once = PTHREAD_ONCE_INIT;
+AST_MUTEX_DEFINE_STATIC(poollock);
+/*! Live thread pools, and the totals of pools whose threads have exited */
+static struct frame_pool *pools = NULL;
+static struct frame_pool_stats retired[FRAME_POOL_CLASSES];
+
 #define TYPE_HIGH	 0x0
 #define TYPE_LOW	 0x1
 #define TYPE_SILENCE	 0x2
@@ -249,12 +292,131 @@ void ast_smoother_free(struct ast_smoother *s)
 	free(s);
 }
 
+/*! \brief frame_pool_destroy: Release a thread's free lists when it exits */
+static void frame_pool_destroy(void *data)
+{
+	struct frame_pool *pool = data;
+	struct frame_pool_blk *blk;
+	int x;
+
+	ast_mutex_lock(&poollock);
+	if (pool->next)
+		pool->next->prev = pool->prev;
+	if (pool->prev)
+		pool->prev->next = pool->next;
+	else
+		pools = pool->next;
+	for (x = 0; x < FRAME_POOL_CLASSES; x++) {
+		retired[x].allocs += pool->stats[x].allocs;
+		retired[x].hits += pool->stats[x].hits;
+		retired[x].frees += pool->stats[x].frees;
+		retired[x].overflows += pool->stats[x].overflows;
+	}
+	ast_mutex_unlock(&poollock);
+	for (x = 0; x < FRAME_POOL_CLASSES; x++) {
+		while ((blk = pool->blks[x])) {
+			pool->blks[x] = blk->next;
+			free(blk);
+		}
+	}
+	free(pool);
+}
+
+static void frame_pool_key_create(void)
+{
+	pthread_key_create(&frame_pool_key, frame_pool_destroy);
+}
+
+/*! \brief frame_pool_get: Find (or create) the calling thread's pool */
+static struct frame_pool *frame_pool_get(void)
+{
+	struct frame_pool *pool;
+
+	pthread_once(&frame_pool_once, frame_pool_key_create);
+	pool = pthread_getspecific(frame_pool_key);
+	if (pool)
+		return pool;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	if (pthread_setspecific(frame_pool_key, pool)) {
+		free(pool);
+		return NULL;
+	}
+	ast_mutex_lock(&poollock);
+	pool->next = pools;
+	if (pools)
+		pools->prev = pool;
+	pools = pool;
+	ast_mutex_unlock(&poollock);
+	return pool;
+}
+
+/*! \brief frame_pool_alloc: Get a zeroed frame header with at least len bytes
+    of space behind it.  Returns NULL if len is too big to pool, or on failure */
+static struct ast_frame *frame_pool_alloc(int len)
+{
+	struct frame_pool *pool;
+	struct frame_pool_blk *blk;
+	int cls;
+
+	for (cls = 0; cls < FRAME_POOL_CLASSES; cls++) {
+		if (len <= frame_pool_sizes[cls])
+			break;
+	}
+	if (cls == FRAME_POOL_CLASSES)
+		return NULL;
+	pool = frame_pool_get();
+	if (!pool)
+		return NULL;
+	pool->stats[cls].allocs++;
+	if ((blk = pool->blks[cls])) {
+		pool->blks[cls] = blk->next;
+		pool->count[cls]--;
+		pool->stats[cls].hits++;
+	} else {
+		blk = malloc(sizeof(*blk) + frame_pool_sizes[cls]);
+		if (!blk)
+			return NULL;
+		blk->cls = cls;
+	}
+	memset(&blk->f, 0, sizeof(blk->f));
+	blk->f.mallocd = AST_MALLOCD_HDR | AST_MALLOCD_POOL;
+	return &blk->f;
+}
+
+/*! \brief frame_pool_free: Return a pooled header to this thread's free list */
+static void frame_pool_free(struct ast_frame *fr)
+{
+	struct frame_pool_blk *blk = (struct frame_pool_blk *)((char *)fr - offsetof(struct frame_pool_blk, f));
+	struct frame_pool *pool = frame_pool_get();
+
+	if (!pool) {
+		free(blk);
+		return;
+	}
+	pool->stats[blk->cls].frees++;
+	if (pool->count[blk->cls] >= FRAME_POOL_MAX) {
+		pool->stats[blk->cls].overflows++;
+		free(blk);
+		return;
+	}
+	blk->next = pool->blks[blk->cls];
+	pool->blks[blk->cls] = blk;
+	pool->count[blk->cls]++;
+}
+
 static struct ast_frame *ast_frame_header_new(void)
 {
 	struct ast_frame *f;
-	f = malloc(sizeof(struct ast_frame));
-	if (f)
-		memset(f, 0, sizeof(struct ast_frame));
+	f = frame_pool_alloc(0);
+	if (!f) {
+		f = malloc(sizeof(struct ast_frame));
+		if (f) {
+			memset(f, 0, sizeof(struct ast_frame));
+			f->mallocd = AST_MALLOCD_HDR;
+		}
+	}
 #ifdef TRACE_FRAMES
 	if (f) {
 		f->prev = NULL;
@@ -270,10 +432,6 @@ static struct ast_frame *ast_frame_header_new(void)
 	return f;
 }
 
-/*!
- * \todo Important: I should be made more efficient.  Frame headers should
- * most definitely be cached
- */
 void ast_frfree(struct ast_frame *fr)
 {
 	if (fr->mallocd & AST_MALLOCD_DATA) {
@@ -296,20 +454,28 @@ void ast_frfree(struct ast_frame *fr)
 			headerlist = fr->next;
 		ast_mutex_unlock(&framelock);
 #endif			
-		free(fr);
+		if (fr->mallocd & AST_MALLOCD_POOL)
+			frame_pool_free(fr);
+		else
+			free(fr);
 	}
 }
 
 /*!
  * \brief 'isolates' a frame by duplicating non-malloc'ed components
  * (header, src, data).
- * On return all components are malloc'ed
+ * On return all components are malloc'ed, or the whole frame lives in
+ * a single block freed along with the header
  */
 struct ast_frame *ast_frisolate(struct ast_frame *fr)
 {
 	struct ast_frame *out;
 	void *newdata;
 
+	/* Nothing is ours yet, so a single pooled copy will do */
+	if (!fr->mallocd)
+		return ast_frdup(fr);
+
 	if (!(fr->mallocd & AST_MALLOCD_HDR)) {
 		/* Allocate a new header if needed */
 		out = ast_frame_header_new();
@@ -332,7 +498,7 @@ struct ast_frame *ast_frisolate(struct ast_frame *fr)
 			out->src = strdup(fr->src);
 			if (!out->src) {
 				if (out != fr)
-					free(out);
+					ast_frfree(out);
 				ast_log(LOG_WARNING, "Out of memory\n");
 				return NULL;
 			}
@@ -346,7 +512,7 @@ struct ast_frame *ast_frisolate(struct ast_frame *fr)
 			if (out->src != fr->src)
 				free((void *) out->src);
 			if (out != fr)
-				free(out);
+				ast_frfree(out);
 			ast_log(LOG_WARNING, "Out of memory\n");
 			return NULL;
 		}
@@ -357,7 +523,7 @@ struct ast_frame *ast_frisolate(struct ast_frame *fr)
 		out->data = newdata;
 	}
 
-	out->mallocd = AST_MALLOCD_HDR | AST_MALLOCD_SRC | AST_MALLOCD_DATA;
+	out->mallocd = (out->mallocd & AST_MALLOCD_POOL) | AST_MALLOCD_HDR | AST_MALLOCD_SRC | AST_MALLOCD_DATA;
 	
 	return out;
 }
@@ -378,18 +544,21 @@ struct ast_frame *ast_frdup(struct ast_frame *f)
 		srclen = strlen(f->src);
 	if (srclen > 0)
 		len += srclen + 1;
-	buf = calloc(1, len);
-	if (!buf)
-		return NULL;
-	out = buf;
-	/* Set us as having malloc'd header only, so it will eventually
-	   get freed. */
+	out = frame_pool_alloc(len - sizeof(struct ast_frame));
+	if (!out) {
+		out = calloc(1, len);
+		if (!out)
+			return NULL;
+		/* Set us as having malloc'd header only, so it will eventually
+		   get freed. */
+		out->mallocd = AST_MALLOCD_HDR;
+	}
+	buf = out;
 	out->frametype = f->frametype;
 	out->subclass = f->subclass;
 	out->datalen = f->datalen;
 	out->samples = f->samples;
 	out->delivery = f->delivery;
-	out->mallocd = AST_MALLOCD_HDR;
 	out->offset = AST_FRIENDLY_OFFSET;
 	if (out->datalen) {
 		out->data = buf + sizeof(struct ast_frame) + AST_FRIENDLY_OFFSET;
@@ -856,6 +1025,53 @@ static char frame_stats_usage[] =
 "       Displays debugging statistics from framer\n";
 #endif
 
+static int show_frame_pools(int fd, int argc, char *argv[])
+{
+#define FORMAT "%-12s %12s %12s %8s %12s %12s %8s\n"
+#define FORMAT2 "%-12s %12u %12u %7u%% %12u %12u %8d\n"
+	struct frame_pool *pool;
+	struct frame_pool_stats totals[FRAME_POOL_CLASSES];
+	int count[FRAME_POOL_CLASSES];
+	int threads = 0;
+	char size[16];
+	int x;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+	ast_mutex_lock(&poollock);
+	memcpy(totals, retired, sizeof(totals));
+	memset(count, 0, sizeof(count));
+	for (pool = pools; pool; pool = pool->next) {
+		threads++;
+		for (x = 0; x < FRAME_POOL_CLASSES; x++) {
+			totals[x].allocs += pool->stats[x].allocs;
+			totals[x].hits += pool->stats[x].hits;
+			totals[x].frees += pool->stats[x].frees;
+			totals[x].overflows += pool->stats[x].overflows;
+			count[x] += pool->count[x];
+		}
+	}
+	ast_mutex_unlock(&poollock);
+	ast_cli(fd, "Frame pools in %d threads, keeping up to %d free blocks per class per thread\n", threads, FRAME_POOL_MAX);
+	ast_cli(fd, FORMAT, "Class", "Allocs", "Hits", "Hit rate", "Frees", "Overflows", "Free");
+	for (x = 0; x < FRAME_POOL_CLASSES; x++) {
+		if (frame_pool_sizes[x])
+			snprintf(size, sizeof(size), "hdr+%d", frame_pool_sizes[x]);
+		else
+			ast_copy_string(size, "hdr", sizeof(size));
+		ast_cli(fd, FORMAT2, size, totals[x].allocs, totals[x].hits,
+			totals[x].allocs ? (unsigned int)((unsigned long long)totals[x].hits * 100 / totals[x].allocs) : 0,
+			totals[x].frees, totals[x].overflows, count[x]);
+	}
+	return RESULT_SUCCESS;
+#undef FORMAT
+#undef FORMAT2
+}
+
+static char frame_pools_usage[] =
+"Usage: show frame pools\n"
+"       Displays usage and hit rates of the per-thread frame free lists\n";
+
 /* Builtin Asterisk CLI-commands for debugging */
 static struct ast_cli_entry my_clis[] = {
 { { "show", "codecs", NULL }, show_codecs, "Shows codecs", frame_show_codecs_usage },
@@ -863,6 +1079,7 @@ static struct ast_cli_entry my_clis[] = {
 { { "show", "video", "codecs", NULL }, show_codecs, "Shows video codecs", frame_show_codecs_usage },
 { { "show", "image", "codecs", NULL }, show_codecs, "Shows image codecs", frame_show_codecs_usage },
 { { "show", "codec", NULL }, show_codec_n, "Shows a specific codec", frame_show_codec_n_usage },
+{ { "show", "frame", "pools", NULL }, show_frame_pools, "Shows frame pool statistics", frame_pools_usage },
 #ifdef TRACE_FRAMES
 { { "show", "frame", "stats", NULL }, show_frame_stats, "Shows frame statistics", frame_stats_usage },
 #endif
@@ -1276,8 +1493,6 @@ int ast_codec_get_len(int format, int samples)
 
 int ast_frame_adjust_volume(struct ast_frame *f, int adjustment)
 {
-	int count;
-	short *fdata = f->data;
 	short adjust_value = abs(adjustment);
 
 	if ((f->frametype != AST_FRAME_VOICE) || (f->subclass != AST_FORMAT_SLINEAR))
@@ -1286,22 +1501,16 @@ int ast_frame_adjust_volume(struct ast_frame *f, int adjustment)
 	if (!adjustment)
 		return 0;
 
-	for (count = 0; count < f->samples; count++) {
-		if (adjustment > 0) {
-			ast_slinear_saturated_multiply(&fdata[count], &adjust_value);
-		} else if (adjustment < 0) {
-			ast_slinear_saturated_divide(&fdata[count], &adjust_value);
-		}
-	}
+	if (adjustment > 0)
+		ast_slinear_gain(f->data, f->samples, adjust_value);
+	else
+		ast_slinear_attenuate(f->data, f->samples, adjust_value);
 
 	return 0;
 }
 
 int ast_frame_slinear_sum(struct ast_frame *f1, struct ast_frame *f2)
 {
-	int count;
-	short *data1, *data2;
-
 	if ((f1->frametype != AST_FRAME_VOICE) || (f1->subclass != AST_FORMAT_SLINEAR))
 		return -1;
 
@@ -1311,10 +1520,7 @@ int ast_frame_slinear_sum(struct ast_frame *f1, struct ast_frame *f2)
 	if (f1->samples != f2->samples)
 		return -1;
 
-	for (count = 0, data1 = f1->data, data2 = f2->data;
-	     count < f1->samples;
-	     count++, data1++, data2++)
-		ast_slinear_saturated_add(data1, data2);
+	ast_slinear_sum(f1->data, f2->data, f1->samples);
 
 	return 0;
 }
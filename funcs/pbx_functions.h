@@ -0,0 +1,38 @@
+/* Automatically generated - do not edit */
+#include "func_md5.c"
+#include "func_math.c"
+#include "func_groupcount.c"
+#include "func_strings.c"
+#include "func_cdr.c"
+#include "func_logic.c"
+#include "func_env.c"
+#include "func_db.c"
+#include "func_timeout.c"
+#include "func_language.c"
+#include "func_moh.c"
+static struct ast_custom_function *builtins[] = {
+&md5_function,
+&checkmd5_function,
+&math_function,
+&group_count_function,
+&group_match_count_function,
+&group_function,
+&group_list_function,
+&fieldqty_function,
+&regex_function,
+&len_function,
+&strftime_function,
+&eval_function,
+&cdr_function,
+&isnull_function,
+&set_function,
+&exists_function,
+&if_function,
+&if_time_function,
+&env_function,
+&db_function,
+&db_exists_function,
+&timeout_function,
+&language_function,
+&moh_function,
+};
@@ -62,6 +62,8 @@ int term_init(void);
 int astdb_init(void);
 /* Provided by channel.c */
 void ast_channels_init(void);
+/* Provided by sched.c */
+void ast_sched_init(void);
 /* Provided by dnsmgr.c */
 int dnsmgr_init(void);
 void dnsmgr_start_refresh(void);
@@ -113,6 +113,26 @@ int ast_app_has_voicemail(const char *mailbox, const char *folder);
 /*! Determine number of new/old messages in a mailbox */
 int ast_app_messagecount(const char *mailbox, int *newmsgs, int *oldmsgs);
 
+typedef void (*ast_mwi_cb_type)(const char *mailbox, int newmsgs, int oldmsgs, void *data);
+
+/*! \brief Registers a callback for changes of mailbox message counts
+ * \param callback Called with the mailbox (mailbox@context) and its new counts,
+ * in the thread that changed them, so it must not block.  A NULL mailbox
+ * means any mailbox may have changed (voicemail was just loaded).
+ * \param data Passed to the callback
+ * Returns 0 on success, -1 on failure
+ */
+int ast_mwi_add(ast_mwi_cb_type callback, void *data);
+void ast_mwi_del(ast_mwi_cb_type callback, void *data);
+
+/*! \brief Tells the callbacks the message counts of a mailbox (mailbox@context),
+ * or with NULL of any mailbox, changed.  Called by the voicemail module. */
+void ast_mwi_changed(const char *mailbox, int newmsgs, int oldmsgs);
+
+/*! \brief Whether mailbox (mailbox@context) is in a list of mailboxes as
+ * configured for a peer (mailbox[@context][,mailbox[@context]...]) */
+int ast_mwi_mailbox_in(const char *mailboxes, const char *mailbox);
+
 /*! Safely spawn an external program while closing file descriptors 
 	\note This replaces the \b system call in all Asterisk modules
 */
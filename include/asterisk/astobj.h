@@ -24,6 +24,8 @@
 #define _ASTERISK_ASTOBJ_H
 
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 
 #include "asterisk/lock.h"
 #include "asterisk/compiler.h"
@@ -95,6 +97,25 @@ extern "C" {
 
 #define ASTOBJ_FLAG_MARKED	(1 << 0)		/* Object has been marked for future operation */
 
+/*! Number of hash indexes a hashed container keeps: index 0 is by name,
+    index 1 is keyed by whatever its owner files objects under with
+    #ASTOBJ_CONTAINER_INDEX() */
+#define ASTOBJ_HASH_INDEXES	2
+
+/*! \brief Default hash function for object names.
+ * Case insensitive, as names are compared with strcasecmp().
+ */
+static inline unsigned int ast_strhash(const char *str)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*str) {
+		hash ^= (unsigned char) tolower(*str++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
 /* C++ is simply a syntactic crutch for those who cannot think for themselves
    in an object oriented way. */
 
@@ -138,7 +159,10 @@ extern "C" {
 	char name[namelen]; \
 	unsigned int refcount; \
 	unsigned int objflags; \
-	__ASTOBJ_HASH(type,hashes)
+	__ASTOBJ_HASH(type,hashes); \
+	type *_hashnext[ASTOBJ_HASH_INDEXES]; \
+	unsigned int _hashval[ASTOBJ_HASH_INDEXES]; \
+	unsigned int _hashed
 	
 /*! \brief Add ASTOBJ components to a struct (without locking support).
  *
@@ -270,7 +294,10 @@ extern "C" {
 	} while(0)
 
 /* Containers for objects -- current implementation is linked lists, but
-   should be able to be converted to hashes relatively easily */
+   should be able to be converted to hashes relatively easily.  A container
+   initialized with #ASTOBJ_CONTAINER_INIT_HASHED() also keeps its objects in
+   hash indexes, for lookups that do not walk the list; the list itself, and
+   so the traversal order, stays as it is. */
 
 /*! \brief Lock an ASTOBJ_CONTAINER for reading.
  */
@@ -305,7 +332,57 @@ extern "C" {
  * \endcode
  */
 #define ASTOBJ_CONTAINER_COMPONENTS_NOLOCK_FULL(type,hashes,buckets) \
-	type *head
+	type *head; \
+	type **_hash[ASTOBJ_HASH_INDEXES]; \
+	unsigned int _buckets
+
+/*! \brief Add an object to one of the hash indexes of a container.
+ *
+ * Internal; call with the container locked.  Does nothing on containers
+ * that are not hashed.
+ */
+#define __ASTOBJ_CONTAINER_HASH_LINK(container,obj,index,hashval) \
+	do { \
+		if ((container)->_hash[0]) { \
+			typeof((container)->head) *__bucket; \
+			__ASTOBJ_CONTAINER_HASH_UNLINK_ONE(container,obj,index); \
+			(obj)->_hashval[index] = (hashval); \
+			__bucket = &(container)->_hash[index][(obj)->_hashval[index] % (container)->_buckets]; \
+			(obj)->_hashnext[index] = *__bucket; \
+			*__bucket = (obj); \
+			(obj)->_hashed |= (1 << (index)); \
+		} \
+	} while(0)
+
+/*! \brief Remove an object from one of the hash indexes of a container.
+ *
+ * Internal; call with the container locked.
+ */
+#define __ASTOBJ_CONTAINER_HASH_UNLINK_ONE(container,obj,index) \
+	do { \
+		typeof((container)->head) *__link; \
+		if ((container)->_hash[0] && ((obj)->_hashed & (1 << (index)))) { \
+			for (__link = &(container)->_hash[index][(obj)->_hashval[index] % (container)->_buckets]; *__link; __link = &(*__link)->_hashnext[index]) { \
+				if (*__link == (obj)) { \
+					*__link = (obj)->_hashnext[index]; \
+					break; \
+				} \
+			} \
+		} \
+		(obj)->_hashnext[index] = NULL; \
+		(obj)->_hashed &= ~(1 << (index)); \
+	} while(0)
+
+/*! \brief Remove an object from all the hash indexes of a container.
+ *
+ * Internal; call with the container locked.
+ */
+#define __ASTOBJ_CONTAINER_HASH_UNLINK(container,obj) \
+	do { \
+		int __index; \
+		for (__index = 0; __index < ASTOBJ_HASH_INDEXES; __index++) \
+			__ASTOBJ_CONTAINER_HASH_UNLINK_ONE(container,obj,__index); \
+	} while(0)
 
 /*! \brief Initialize a container.
  *
@@ -331,6 +408,37 @@ extern "C" {
 #define ASTOBJ_CONTAINER_INIT_FULL(container,hashes,buckets) \
 	do { \
 		ast_mutex_init(&(container)->_lock); \
+		memset((container)->_hash, 0, sizeof((container)->_hash)); \
+		(container)->_buckets = 0; \
+	} while(0)
+
+/*! \brief Initialize a container that also keeps hash indexes.
+ *
+ * \param container A pointer to the container to initialize.
+ * \param buckets The number of buckets in each hash index.
+ *
+ * This macro works like #ASTOBJ_CONTAINER_INIT() but also makes the container
+ * keep its objects hashed by name, so that #ASTOBJ_CONTAINER_FIND() does not
+ * have to walk the list, and allows objects to be filed in a second index with
+ * #ASTOBJ_CONTAINER_INDEX(), which #ASTOBJ_CONTAINER_FIND_FULL() searches when
+ * given a hash offset of 1.  If memory for the indexes cannot be had the
+ * container works as an ordinary list.
+ */
+#define ASTOBJ_CONTAINER_INIT_HASHED(container,buckets) \
+	do { \
+		int __index; \
+		ASTOBJ_CONTAINER_INIT_FULL(container,ASTOBJ_HASH_INDEXES,buckets); \
+		for (__index = 0; __index < ASTOBJ_HASH_INDEXES; __index++) { \
+			if (!((container)->_hash[__index] = calloc((buckets), sizeof(*(container)->_hash[__index])))) \
+				break; \
+		} \
+		if (__index < ASTOBJ_HASH_INDEXES) { \
+			for (__index = 0; __index < ASTOBJ_HASH_INDEXES; __index++) { \
+				free((container)->_hash[__index]); \
+				(container)->_hash[__index] = NULL; \
+			} \
+		} else \
+			(container)->_buckets = (buckets); \
 	} while(0)
 	
 /*! \brief Destroy a container.
@@ -347,6 +455,11 @@ extern "C" {
  */
 #define ASTOBJ_CONTAINER_DESTROY_FULL(container,hashes,buckets) \
 	do { \
+		int __index; \
+		for (__index = 0; __index < ASTOBJ_HASH_INDEXES; __index++) { \
+			free((container)->_hash[__index]); \
+			(container)->_hash[__index] = NULL; \
+		} \
 		ast_mutex_destroy(&(container)->_lock); \
 	} while(0)
 
@@ -402,10 +515,23 @@ extern "C" {
 #define ASTOBJ_CONTAINER_FIND(container,namestr) \
 	({ \
 		typeof((container)->head) found = NULL; \
-		ASTOBJ_CONTAINER_TRAVERSE(container, !found, do { \
-			if (!(strcasecmp(iterator->name, (namestr)))) \
-				found = ASTOBJ_REF(iterator); \
-		} while (0)); \
+		if ((container)->_hash[0]) { \
+			typeof((container)->head) iterator; \
+			unsigned int __hashval = ASTOBJ_DEFAULT_HASH(namestr); \
+			ASTOBJ_CONTAINER_RDLOCK(container); \
+			for (iterator = (container)->_hash[0][__hashval % (container)->_buckets]; iterator; iterator = iterator->_hashnext[0]) { \
+				if ((iterator->_hashval[0] == __hashval) && !(strcasecmp(iterator->name, (namestr)))) { \
+					found = ASTOBJ_REF(iterator); \
+					break; \
+				} \
+			} \
+			ASTOBJ_CONTAINER_UNLOCK(container); \
+		} else { \
+			ASTOBJ_CONTAINER_TRAVERSE(container, !found, do { \
+				if (!(strcasecmp(iterator->name, (namestr)))) \
+					found = ASTOBJ_REF(iterator); \
+			} while (0)); \
+		} \
 		found; \
 	})
 
@@ -414,12 +540,16 @@ extern "C" {
  * \param container A pointer to the container to search.
  * \param data The data to search for.
  * \param field The field/member of the container's objects to search.
- * \param hashfunc The hash function to use, currently not implemented.
- * \param hashoffset The hash offset to use, currently not implemented.
+ * \param hashfunc The hash function to use on data.
+ * \param hashoffset The hash index to search: 0 for the name, 1 for the
+ * index kept with #ASTOBJ_CONTAINER_INDEX().
  * \param comparefunc The function used to compare the field and data values.
  *
  * This macro iterates through a container passing the specified field and data
  * elements to the specified comparefunc.  The function should return 0 when a match is found.
+ * On a hashed container only the objects filed under hashfunc(data) in index
+ * hashoffset are compared, so hashfunc must give the hash an object that
+ * matches would have been filed under.
  * 
  * \note When the returned object is no longer in use, #ASTOBJ_UNREF() should
  * be used to free the additional reference created by this macro.
@@ -429,13 +559,29 @@ extern "C" {
 #define ASTOBJ_CONTAINER_FIND_FULL(container,data,field,hashfunc,hashoffset,comparefunc) \
 	({ \
 		typeof((container)->head) found = NULL; \
-		ASTOBJ_CONTAINER_TRAVERSE(container, !found, do { \
-			ASTOBJ_RDLOCK(iterator); \
-			if (!(comparefunc(iterator->field, (data)))) { \
-				found = ASTOBJ_REF(iterator); \
+		if ((container)->_hash[0]) { \
+			typeof((container)->head) iterator; \
+			unsigned int __hashval = hashfunc(data); \
+			ASTOBJ_CONTAINER_RDLOCK(container); \
+			for (iterator = (container)->_hash[hashoffset][__hashval % (container)->_buckets]; iterator && !found; iterator = iterator->_hashnext[hashoffset]) { \
+				if (iterator->_hashval[hashoffset] != __hashval) \
+					continue; \
+				ASTOBJ_RDLOCK(iterator); \
+				if (!(comparefunc(iterator->field, (data)))) { \
+					found = ASTOBJ_REF(iterator); \
+				} \
+				ASTOBJ_UNLOCK(iterator); \
 			} \
-			ASTOBJ_UNLOCK(iterator); \
-		} while (0)); \
+			ASTOBJ_CONTAINER_UNLOCK(container); \
+		} else { \
+			ASTOBJ_CONTAINER_TRAVERSE(container, !found, do { \
+				ASTOBJ_RDLOCK(iterator); \
+				if (!(comparefunc(iterator->field, (data)))) { \
+					found = ASTOBJ_REF(iterator); \
+				} \
+				ASTOBJ_UNLOCK(iterator); \
+			} while (0)); \
+		} \
 		found; \
 	})
 
@@ -457,6 +603,7 @@ extern "C" {
 		ASTOBJ_CONTAINER_WRLOCK(container); \
 		while((iterator = (container)->head)) { \
 			(container)->head = (iterator)->next[0]; \
+			__ASTOBJ_CONTAINER_HASH_UNLINK(container,iterator); \
 			ASTOBJ_UNREF(iterator,destructor); \
 		} \
 		ASTOBJ_CONTAINER_UNLOCK(container); \
@@ -489,6 +636,7 @@ extern "C" {
 					prev->next[0] = next; \
 				else \
 					(container)->head = next; \
+				__ASTOBJ_CONTAINER_HASH_UNLINK(container,iterator); \
 				ASTOBJ_CONTAINER_UNLOCK(container); \
 			} \
 			prev = iterator; \
@@ -523,6 +671,7 @@ extern "C" {
 					prev->next[0] = next; \
 				else \
 					(container)->head = next; \
+				__ASTOBJ_CONTAINER_HASH_UNLINK(container,iterator); \
 				ASTOBJ_CONTAINER_UNLOCK(container); \
 			} \
 			prev = iterator; \
@@ -563,6 +712,7 @@ extern "C" {
 					prev->next[0] = next; \
 				else \
 					(container)->head = next; \
+				__ASTOBJ_CONTAINER_HASH_UNLINK(container,iterator); \
 				ASTOBJ_CONTAINER_UNLOCK(container); \
 			} \
 			ASTOBJ_UNLOCK(iterator); \
@@ -590,6 +740,7 @@ extern "C" {
 					prev->next[0] = next; \
 				else \
 					(container)->head = next; \
+				__ASTOBJ_CONTAINER_HASH_UNLINK(container,iterator); \
 				ASTOBJ_CONTAINER_UNLOCK(container); \
 				ASTOBJ_UNLOCK(iterator); \
 				ASTOBJ_UNREF(iterator,destructor); \
@@ -612,13 +763,36 @@ extern "C" {
  *
  * Currently this function adds an object to the head of the list.  One day it
  * will support adding objects atthe position specified using the various
- * options this macro offers.
+ * options this macro offers.  On a hashed container the object is also filed
+ * in the name index.
  */
 #define ASTOBJ_CONTAINER_LINK_FULL(container,newobj,data,field,hashfunc,hashoffset,comparefunc) \
 	do { \
 		ASTOBJ_CONTAINER_WRLOCK(container); \
 		(newobj)->next[0] = (container)->head; \
 		(container)->head = ASTOBJ_REF(newobj); \
+		(newobj)->_hashed = 0; \
+		__ASTOBJ_CONTAINER_HASH_LINK(container,newobj,0,ASTOBJ_DEFAULT_HASH((newobj)->name)); \
+		ASTOBJ_CONTAINER_UNLOCK(container); \
+	} while(0)
+
+/*! \brief File an object in the second hash index of a container.
+ *
+ * \param container A pointer to the container to operate on.
+ * \param obj A pointer to an object linked in the container.
+ * \param hashval The hash to file it under.
+ *
+ * The owner of a hashed container calls this after linking an object, and
+ * again whenever whatever the hash was computed from changes, so that
+ * #ASTOBJ_CONTAINER_FIND_FULL() with a hash offset of 1 keeps finding it.
+ * Objects that are not linked in the container are left alone, and
+ * unlinking an object takes it out of the index as well.
+ */
+#define ASTOBJ_CONTAINER_INDEX(container,obj,hashval) \
+	do { \
+		ASTOBJ_CONTAINER_WRLOCK(container); \
+		if ((obj)->_hashed & 1) \
+			__ASTOBJ_CONTAINER_HASH_LINK(container,obj,1,hashval); \
 		ASTOBJ_CONTAINER_UNLOCK(container); \
 	} while(0)
 
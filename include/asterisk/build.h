@@ -0,0 +1,11 @@
+/*
+ * build.h 
+ * Automatically generated
+ */
+#define BUILD_HOSTNAME "vm"
+#define BUILD_KERNEL "6.18.44-fc-v130"
+#define BUILD_MACHINE "x86_64"
+#define BUILD_OS "Linux"
+#define BUILD_DATE "2026-10-17 03:21:12 UTC"
+#define BUILD_USER "root"
+
@@ -105,6 +105,10 @@ extern int ast_cdr_copy_vars(struct ast_cdr *to_cdr, struct ast_cdr *from_cdr);
 
 typedef int (*ast_cdrbe)(struct ast_cdr *cdr);
 
+/*! \brief Post several records at once, all of them or none of them, eg. in
+    a single transaction.  Returns 0 if they were all posted, -1 if none were. */
+typedef int (*ast_cdrbe_batch)(struct ast_cdr **cdrs, int count);
+
 /*! \brief Allocate a CDR record 
  * Returns a malloc'd ast_cdr structure, returns NULL on error (malloc failure)
  */
@@ -148,6 +152,17 @@ extern int ast_cdr_setcid(struct ast_cdr *cdr, struct ast_channel *chan);
  */
 extern int ast_cdr_register(char *name, char *desc, ast_cdrbe be);
 
+/*! Register a CDR handling engine that can also post records in bulk */
+/*!
+ * \param name name associated with the particular CDR handler
+ * \param desc description of the CDR handler
+ * \param be function pointer to a CDR handler, for single records
+ * \param batch function pointer to a CDR handler for several records, used
+ *        in batch mode for up to 'size' records at a time
+ * Returns -1 on error, 0 on success.
+ */
+extern int ast_cdr_register_batch(char *name, char *desc, ast_cdrbe be, ast_cdrbe_batch batch);
+
 /*! Unregister a CDR handling engine */
 /*!
  * \param name name of CDR handler to unregister
@@ -216,10 +231,10 @@ extern void ast_cdr_end(struct ast_cdr *cdr);
  */
 extern void ast_cdr_detach(struct ast_cdr *cdr);
 
-/*! Spawns (possibly) a new thread to submit a batch of CDRs to the backend engines */
+/*! Queues a batch of CDRs for the backend engines */
 /*!
  * \param shutdown Whether or not we are shutting down
- * Blocks the asterisk shutdown procedures until the CDR data is submitted.
+ * If shutting down, blocks until the backends have posted the CDR data.
  * Returns nothing
  */
 extern void ast_cdr_submit_batch(int shutdown);
@@ -246,6 +246,9 @@ struct ast_channel_tech {
 
 struct ast_channel_spy_list;
 
+/*! Number of lookup hashes channel.c files each channel in */
+#define AST_CHANNEL_INDEXES	4
+
 /*! Main Channel structure associated with a channel. 
  * This is the side of it mostly used by the pbx and call management.
  */
@@ -414,6 +417,14 @@ struct ast_channel {
 
 	/*! For easy linking */
 	struct ast_channel *next;
+	/*! Next channel in the same bucket of each lookup hash, not to be touched outside channel.c */
+	struct ast_channel *hashnext[AST_CHANNEL_INDEXES];
+	/*! Keys the channel is filed under in the lookup hashes */
+	unsigned int hashkey[AST_CHANNEL_INDEXES];
+	/*! Which lookup hashes the channel is filed in */
+	unsigned int hashfiled;
+	/*! Set once the channel is off the list of unnamed channels */
+	int hashnamed;
 };
 
 /* \defgroup chanprop Channel tech properties:
@@ -559,6 +570,12 @@ int ast_queue_control(struct ast_channel *chan, int control);
 /*! \brief Change channel name */
 void ast_change_name(struct ast_channel *chan, char *newname);
 
+/*! \brief Refile a channel in the lookup hashes after its name, exten or
+ * macroexten was written directly.  The pbx calls this before running each
+ * application, so channels are found by the extension they are in.
+ */
+void ast_channel_refile(struct ast_channel *chan);
+
 /*! \brief Free a channel structure */
 void  ast_channel_free(struct ast_channel *);
 
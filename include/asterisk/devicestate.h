@@ -63,7 +63,8 @@ int ast_parse_device_state(const char *device);
  * Asks a channel for device state, data is  normaly a number from dialstring
  * used by the low level module
  * Trys the channel devicestate callback if not supported search in the
- * active channels list for the device.
+ * active channels list for the device.  The answer is cached until a change
+ * of the device is reported, or for a few seconds at most.
  * Returns an AST_DEVICE_??? state -1 on failure
  */
 int ast_device_state(const char *device);
@@ -122,6 +122,8 @@ struct ast_frame {
 #define AST_MALLOCD_DATA	(1 << 1)
 /*! Need the source be free'd? (haha!) */
 #define AST_MALLOCD_SRC		(1 << 2)
+/*! Was the header taken from a frame pool? (only meaningful with AST_MALLOCD_HDR) */
+#define AST_MALLOCD_POOL	(1 << 3)
 
 /* Frame types */
 /*! A DTMF digit, subclass is the digit */
@@ -56,6 +56,16 @@ extern "C" {
 
 struct io_context;
 
+/*! How an io_context waits for events */
+enum ast_io_backend {
+	/*! Whatever 'iobackend' in asterisk.conf asks for */
+	AST_IO_BACKEND_DEFAULT = 0,
+	/*! poll() over every descriptor in the context */
+	AST_IO_BACKEND_POLL,
+	/*! epoll, where available; adding and removing entries is O(1) */
+	AST_IO_BACKEND_EPOLL,
+};
+
 /*! Creates a context */
 /*!
  * Create a context for I/O operations
@@ -64,6 +74,14 @@ struct io_context;
  */
 extern struct io_context *io_context_create(void);
 
+/*! Creates a context using a particular backend */
+/*!
+ * \param backend which backend to use.  Falls back to poll() if the one
+ * asked for is not available.
+ * Returns an allocated io_context structure
+ */
+extern struct io_context *io_context_create_backend(enum ast_io_backend backend);
+
 /*! Destroys a context */
 /*
  * \param ioc structure to destroy
@@ -84,6 +102,8 @@ typedef int (*ast_io_cb)(int *id, int fd, short events, void *cbdata);
  * \param data data to pass to the callback
  * Watch for any of revents activites on fd, calling callback with data as 
  * callback data.  Returns a pointer to ID of the IO event, or NULL on failure.
+ * With the epoll backend a descriptor can be watched only once per context;
+ * adding it again fails, where poll() would have watched it twice.
  */
 extern int *ast_io_add(struct io_context *ioc, int fd, ast_io_cb callback, short events, void *data);
 
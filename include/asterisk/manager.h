@@ -59,11 +59,28 @@
 #define AST_MAX_MANHEADERS 80
 #define AST_MAX_MANHEADER_LEN 256
 
+/*! A formatted event, built once by manager_event() and shared by every
+    session queue it is placed on.  Freed when the last reference drops. */
 struct eventqent {
+	/*! References held by manager_event() and the session queues */
+	int usecount;
+	/*! Length of eventdata, not counting the terminating NUL */
+	int len;
 	struct eventqent *next;
 	char eventdata[1];
 };
 
+/*! Default length of a session's outbound event queue */
+#define DEFAULT_MANAGER_EVENTQUEUE	1024
+
+/*! What to do when a session's outbound event queue is full */
+enum manager_overflow {
+	/*! Discard the oldest queued event to make room */
+	MANAGER_OVERFLOW_DROPOLDEST = 0,
+	/*! Disconnect the session */
+	MANAGER_OVERFLOW_DISCONNECT,
+};
+
 struct mansession {
 	/*! Execution thread */
 	pthread_t t;
@@ -91,8 +108,20 @@ struct mansession {
 	char inbuf[AST_MAX_MANHEADER_LEN];
 	int inlen;
 	int send_events;
-	/* Queued events that we've not had the ability to send yet */
-	struct eventqent *eventq;
+	/* Ring of queued events that we've not had the ability to send yet */
+	struct eventqent **eventq;
+	/* Size of the eventq ring */
+	int eventqsize;
+	/* Index of the oldest queued event */
+	int eventqhead;
+	/* Number of events in the ring */
+	int eventqlen;
+	/* Bytes of the oldest queued event already written */
+	int eventqoffset;
+	/* Signalled when the event writer finishes a half written event */
+	ast_cond_t partialcond;
+	/* Events discarded because the ring was full */
+	unsigned int dropped;
 	/* Timeout for ast_carefulwrite() */
 	int writetimeout;
 	struct mansession *next;
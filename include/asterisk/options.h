@@ -46,6 +46,10 @@ extern int option_transmit_silence_during_record;
 extern int option_maxcalls;
 extern int option_highpriority;
 extern double option_maxload;
+extern int option_pbxthreads;
+extern int option_pbxidlethreads;
+extern int option_threadstacksize;
+extern int option_iobackend;
 extern int option_dontwarn;
 extern int option_priority_jumping;
 extern char defaultlanguage[];
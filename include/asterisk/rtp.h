@@ -55,6 +55,9 @@ struct ast_rtp_protocol {
 	/* Set RTP peer */
 	int (* const set_rtp_peer)(struct ast_channel *chan, struct ast_rtp *peer, struct ast_rtp *vpeer, int codecs, int nat_active);
 	int (* const get_codec)(struct ast_channel *chan);
+	/* Get RTP struct whose packets may be relayed through us untouched, or NULL if
+	   we need to see the media (optional) */
+	struct ast_rtp *(* const get_relay_info)(struct ast_channel *chan);
 	const char * const type;
 	struct ast_rtp_protocol *next;
 };
@@ -156,6 +159,31 @@ void ast_rtp_proto_unregister(struct ast_rtp_protocol *proto);
 
 void ast_rtp_stop(struct ast_rtp *rtp);
 
+/*! \brief Quality of an RTP session: what we counted ourselves, and what the
+    other end told us in its RTCP reports */
+struct ast_rtp_quality {
+	unsigned int local_ssrc;	/*!< Our SSRC */
+	unsigned int txcount;		/*!< Packets we sent */
+	int txlost;			/*!< Packets of ours the other end reports lost */
+	double txjitter;		/*!< Jitter the other end reports, in ms */
+	unsigned int remote_ssrc;	/*!< Their SSRC */
+	unsigned int rxcount;		/*!< Packets we received */
+	int rxlost;			/*!< Packets of theirs we never received */
+	double rxjitter;		/*!< Interarrival jitter of what we received, in ms */
+	double rtt;			/*!< Last round trip time, in ms (0 if unknown) */
+	double minrtt;
+	double maxrtt;
+	unsigned int rtcptx;		/*!< RTCP reports sent */
+	unsigned int rtcprx;		/*!< RTCP reports received */
+};
+
+/*! \brief Fill in qual for the session.  Returns -1 if it has no RTCP, and
+    so no statistics */
+int ast_rtp_get_quality(struct ast_rtp *rtp, struct ast_rtp_quality *qual);
+
+/*! \brief When a packet was last relayed from (rx) and to (tx) this session, or 0 */
+void ast_rtp_get_relay_times(struct ast_rtp *rtp, time_t *rx, time_t *tx);
+
 void ast_rtp_init(void);
 
 void ast_rtp_reload(void);
@@ -38,6 +38,27 @@ extern "C" {
 
 struct sched_context;
 
+/*! Number of buckets in the dispatch lateness histogram */
+#define SCHED_LATE_BUCKETS 7
+
+/*! Counters kept for each scheduling context */
+struct ast_sched_stats {
+	/*! Events currently queued */
+	int depth;
+	/*! Largest number of events ever queued at once */
+	int peak;
+	/*! Events added, deleted and run since the context was created */
+	unsigned long adds;
+	unsigned long dels;
+	unsigned long runs;
+	/*! Deletes for ids that were not queued */
+	unsigned long delmisses;
+	/*! Dispatch lateness histogram: <1, <5, <10, <50, <100, <500 and >=500 ms */
+	unsigned long late[SCHED_LATE_BUCKETS];
+	/*! Worst lateness seen, in ms */
+	int maxlate;
+};
+
 /*! New schedule context */
 /* !
  * Create a scheduling context
@@ -53,6 +74,22 @@ extern struct sched_context *sched_context_create(void);
  */
 void sched_context_destroy(struct sched_context *c);
 
+/*! Names a schedule context */
+/*!
+ * \param con Context to name
+ * \param name Name shown for this context by "show sched stats"
+ * Unnamed contexts (such as the ones owned by each channel) are
+ * summarized together on a single line.
+ */
+void ast_sched_set_name(struct sched_context *con, const char *name);
+
+/*! Gets the statistics of a schedule context */
+/*!
+ * \param con Context to query
+ * \param stats Filled in with a snapshot of the context's counters
+ */
+void ast_sched_get_stats(struct sched_context *con, struct ast_sched_stats *stats);
+
 /*! callback for a cheops scheduler */
 /*! 
  * A cheops scheduler callback takes a pointer with callback data and
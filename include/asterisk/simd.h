@@ -0,0 +1,73 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ * \brief Bulk signed linear and G.711 sample processing
+ *
+ * These give exactly the same results as doing the work a sample at a
+ * time with ast_slinear_saturated_add() and friends, AST_MULAW(),
+ * AST_LIN2MU(), AST_ALAW() and AST_LIN2A(), but use the vector
+ * instructions of the CPU we are running on where there are any.
+ */
+
+#ifndef _ASTERISK_SIMD_H
+#define _ASTERISK_SIMD_H
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+enum ast_simd_level {
+	AST_SIMD_SCALAR = 0,	/*!< Plain C, one sample at a time */
+	AST_SIMD_SSE2,		/*!< 8 samples at a time */
+	AST_SIMD_AVX2,		/*!< 16 samples at a time */
+};
+
+/*! \brief Pick the fastest kernels this CPU can run, but no faster than max.
+ * \return The level picked
+ */
+enum ast_simd_level ast_simd_init(enum ast_simd_level max);
+
+/*! \brief The level in use */
+enum ast_simd_level ast_simd_level(void);
+
+/*! \brief Name of a level, for humans */
+const char *ast_simd_level_name(enum ast_simd_level level);
+
+/*! \brief dst[x] += src[x], saturating */
+void ast_slinear_sum(short *dst, const short *src, int samples);
+
+/*! \brief buf[x] *= factor, saturating */
+void ast_slinear_gain(short *buf, int samples, short factor);
+
+/*! \brief buf[x] /= divisor */
+void ast_slinear_attenuate(short *buf, int samples, short divisor);
+
+/*! \brief Convert samples of u-law in src to signed linear in dst */
+void ast_ulaw_decode(short *dst, const unsigned char *src, int samples);
+
+/*! \brief Convert samples of signed linear in src to u-law in dst */
+void ast_ulaw_encode(unsigned char *dst, const short *src, int samples);
+
+/*! \brief Convert samples of A-law in src to signed linear in dst */
+void ast_alaw_decode(short *dst, const unsigned char *src, int samples);
+
+/*! \brief Convert samples of signed linear in src to A-law in dst */
+void ast_alaw_encode(unsigned char *dst, const short *src, int samples);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* _ASTERISK_SIMD_H */
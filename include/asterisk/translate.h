@@ -58,6 +58,8 @@ struct ast_translator {
 	int cost;
 	/*! For linking, not to be modified by the translator */
 	struct ast_translator *next;
+	/*! Cost was measured on this machine, not guessed; not to be modified by the translator */
+	int measured;
 };
 
 struct ast_trans_pvt;
@@ -65,7 +67,10 @@ struct ast_trans_pvt;
 /*! Register a translator */
 /*! 
  * \param t populated ast_translator structure
- * This registers a codec translator with asterisk
+ * This registers a codec translator with asterisk.  Its cost is taken
+ * from the cost cache when this build of it has already been measured on
+ * this CPU, otherwise it is guessed and measured shortly afterwards in
+ * the background.
  * Returns 0 on success, -1 on failure
  */
 extern int ast_register_translator(struct ast_translator *t);
@@ -222,6 +222,8 @@ static force_inline int inaddrcmp(const struct sockaddr_in *sin1, const struct s
 #define AST_STACKSIZE 256 * 1024
 #define ast_pthread_create(a,b,c,d) ast_pthread_create_stack(a,b,c,d,0)
 int ast_pthread_create_stack(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine)(void *), void *data, size_t stacksize);
+/*! \brief Stack size given to threads which don't ask for one ('threadstacksize' in asterisk.conf) */
+size_t ast_thread_stacksize(void);
 
 /*!
 	\brief Process a string to find and replace characters
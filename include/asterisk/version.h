@@ -0,0 +1,7 @@
+/*
+ * version.h 
+ * Automatically generated
+ */
+#define ASTERISK_VERSION "asterisk-1.2.27-solvoip-218"
+#define ASTERISK_VERSION_NUM 00227
+
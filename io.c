@@ -28,6 +28,11 @@
 #include <termios.h>
 #include <string.h> /* for memset */
 #include <sys/ioctl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#define HAVE_EPOLL
+#endif
 
 #include "asterisk.h"
 
@@ -35,6 +40,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 44168 $")
 
 #include "asterisk/io.h"
 #include "asterisk/logger.h"
+#include "asterisk/options.h"
 
 #ifdef DEBUG_IO
 #define DEBUG DEBUG_M
@@ -49,6 +55,12 @@ struct io_rec {
 	ast_io_cb callback;		/* What is to be called */
 	void *data; 				/* Data to be passed */
 	int *id; 					/* ID number */
+	/* The rest is only used by the epoll backend, where the id is the
+	   slot in ior[] for as long as the entry lives */
+	int fd;					/* File descriptor being watched */
+	short events;				/* Events being watched for */
+	unsigned int gen;			/* Bumped when the slot is freed */
+	int nextfree;				/* Next free slot, or -1 */
 };
 
 /* These two arrays are keyed with
@@ -75,14 +87,232 @@ struct io_context {
 	int current_ioc;
 	/* Whether something has been deleted */
 	int needshrink;
+	/* epoll descriptor, or -1 for the poll backend */
+	int epfd;
+#ifdef HAVE_EPOLL
+	/* Events returned by epoll_wait() */
+	struct epoll_event *events;
+	/* First free slot in ior, or -1 */
+	int freeslot;
+#endif
 };
 
+#ifdef HAVE_EPOLL
+/* Most events we collect from one epoll_wait() */
+#define EPOLL_MAX_EVENTS 256
+
+static struct io_context *io_context_create_epoll(void)
+{
+	struct io_context *tmp;
+	int x;
+
+	tmp = calloc(1, sizeof(struct io_context));
+	if (!tmp)
+		return NULL;
+	tmp->current_ioc = -1;
+	tmp->maxfdcnt = GROW_SHRINK_SIZE / 2;
+	tmp->ior = calloc(tmp->maxfdcnt, sizeof(struct io_rec));
+	tmp->events = calloc(EPOLL_MAX_EVENTS, sizeof(struct epoll_event));
+	tmp->epfd = epoll_create(GROW_SHRINK_SIZE);
+	if (!tmp->ior || !tmp->events || (tmp->epfd < 0)) {
+		if (tmp->epfd < 0)
+			ast_log(LOG_WARNING, "Unable to create epoll descriptor: %s\n", strerror(errno));
+		else
+			close(tmp->epfd);
+		free(tmp->ior);
+		free(tmp->events);
+		free(tmp);
+		return NULL;
+	}
+	for (x = 0; x < tmp->maxfdcnt; x++)
+		tmp->ior[x].nextfree = (x + 1 < tmp->maxfdcnt) ? x + 1 : -1;
+	tmp->freeslot = 0;
+	return tmp;
+}
+
+static short epoll_to_io(unsigned int events)
+{
+	short res = 0;
+
+	if (events & EPOLLIN)
+		res |= AST_IO_IN;
+	if (events & EPOLLOUT)
+		res |= AST_IO_OUT;
+	if (events & EPOLLPRI)
+		res |= AST_IO_PRI;
+	if (events & EPOLLERR)
+		res |= AST_IO_ERR;
+	if (events & EPOLLHUP)
+		res |= AST_IO_HUP;
+	return res;
+}
+
+static unsigned int io_to_epoll(short events)
+{
+	unsigned int res = 0;
+
+	if (events & AST_IO_IN)
+		res |= EPOLLIN;
+	if (events & AST_IO_OUT)
+		res |= EPOLLOUT;
+	if (events & AST_IO_PRI)
+		res |= EPOLLPRI;
+	return res;
+}
+
+/* Tell epoll about slot x.  The generation rides along with the slot so
+   that an event for an entry removed earlier in the same ast_io_wait()
+   is not delivered to whoever has reused its slot */
+static int epoll_set(struct io_context *ioc, int op, int x)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = io_to_epoll(ioc->ior[x].events);
+	ev.data.u64 = ((unsigned long long)ioc->ior[x].gen << 32) | (unsigned int)x;
+	return epoll_ctl(ioc->epfd, op, ioc->ior[x].fd, &ev);
+}
+
+static int *epoll_add(struct io_context *ioc, int fd, ast_io_cb callback, short events, void *data)
+{
+	struct io_rec *tmp;
+	int x;
+
+	if (ioc->freeslot < 0) {
+		tmp = realloc(ioc->ior, (ioc->maxfdcnt + GROW_SHRINK_SIZE) * sizeof(struct io_rec));
+		if (!tmp)
+			return NULL;
+		ioc->ior = tmp;
+		memset(ioc->ior + ioc->maxfdcnt, 0, GROW_SHRINK_SIZE * sizeof(struct io_rec));
+		for (x = ioc->maxfdcnt; x < ioc->maxfdcnt + GROW_SHRINK_SIZE; x++)
+			ioc->ior[x].nextfree = (x + 1 < ioc->maxfdcnt + GROW_SHRINK_SIZE) ? x + 1 : -1;
+		ioc->freeslot = ioc->maxfdcnt;
+		ioc->maxfdcnt += GROW_SHRINK_SIZE;
+	}
+	x = ioc->freeslot;
+	ioc->ior[x].id = malloc(sizeof(int));
+	if (!ioc->ior[x].id)
+		return NULL;
+	ioc->ior[x].fd = fd;
+	ioc->ior[x].events = events;
+	ioc->ior[x].callback = callback;
+	ioc->ior[x].data = data;
+	if (epoll_set(ioc, EPOLL_CTL_ADD, x)) {
+		if (errno == EEXIST)
+			ast_log(LOG_WARNING, "Unable to watch fd %d: already watched in this context, which the epoll I/O backend does not allow\n", fd);
+		else
+			ast_log(LOG_WARNING, "Unable to watch fd %d: %s\n", fd, strerror(errno));
+		free(ioc->ior[x].id);
+		ioc->ior[x].id = NULL;
+		return NULL;
+	}
+	ioc->freeslot = ioc->ior[x].nextfree;
+	*(ioc->ior[x].id) = x;
+	ioc->fdcnt++;
+	return ioc->ior[x].id;
+}
+
+static int *epoll_change(struct io_context *ioc, int *id, int fd, ast_io_cb callback, short events, void *data)
+{
+	int x = *id;
+
+	if ((x < 0) || (x >= ioc->maxfdcnt) || (ioc->ior[x].id != id))
+		return NULL;
+	if (callback)
+		ioc->ior[x].callback = callback;
+	if (data)
+		ioc->ior[x].data = data;
+	if (fd > -1) {
+		/* The old descriptor may already be closed, which removes it */
+		epoll_ctl(ioc->epfd, EPOLL_CTL_DEL, ioc->ior[x].fd, NULL);
+		ioc->ior[x].fd = fd;
+		if (events)
+			ioc->ior[x].events = events;
+		if (epoll_set(ioc, EPOLL_CTL_ADD, x)) {
+			ast_log(LOG_WARNING, "Unable to watch fd %d: %s\n", fd, strerror(errno));
+			return NULL;
+		}
+	} else if (events) {
+		ioc->ior[x].events = events;
+		if (epoll_set(ioc, EPOLL_CTL_MOD, x)) {
+			ast_log(LOG_WARNING, "Unable to change events for fd %d: %s\n", ioc->ior[x].fd, strerror(errno));
+			return NULL;
+		}
+	}
+	return id;
+}
+
+static int epoll_remove(struct io_context *ioc, int *id)
+{
+	int x = *id;
+
+	if ((x < 0) || (x >= ioc->maxfdcnt) || (ioc->ior[x].id != id)) {
+		ast_log(LOG_NOTICE, "Unable to remove unknown id %p\n", id);
+		return -1;
+	}
+	epoll_ctl(ioc->epfd, EPOLL_CTL_DEL, ioc->ior[x].fd, NULL);
+	free(ioc->ior[x].id);
+	ioc->ior[x].id = NULL;
+	ioc->ior[x].gen++;
+	ioc->ior[x].nextfree = ioc->freeslot;
+	ioc->freeslot = x;
+	ioc->fdcnt--;
+	return 0;
+}
+
+static int epoll_io_wait(struct io_context *ioc, int howlong)
+{
+	struct io_rec *r;
+	int res, x, *id;
+	unsigned int slot, gen;
+
+	res = epoll_wait(ioc->epfd, ioc->events, EPOLL_MAX_EVENTS, howlong);
+	for (x = 0; x < res; x++) {
+		slot = (unsigned int)ioc->events[x].data.u64;
+		if (slot >= ioc->maxfdcnt)
+			continue;
+		/* Callbacks may add entries and move ior, so look it up each time */
+		r = &ioc->ior[slot];
+		gen = (unsigned int)(ioc->events[x].data.u64 >> 32);
+		if (!r->id || (r->gen != gen))
+			continue;
+		ioc->current_ioc = slot;
+		if (r->callback) {
+			id = r->id;
+			/* The callback may have removed the entry itself, and the
+			   slot may even hold a new one by now */
+			if (!r->callback(id, r->fd, epoll_to_io(ioc->events[x].events), r->data) &&
+			    (ioc->ior[slot].id == id) && (ioc->ior[slot].gen == gen))
+				ast_io_remove(ioc, id);
+		}
+		ioc->current_ioc = -1;
+	}
+	return res;
+}
+#endif /* HAVE_EPOLL */
+
 struct io_context *io_context_create(void)
+{
+	return io_context_create_backend(AST_IO_BACKEND_DEFAULT);
+}
+
+struct io_context *io_context_create_backend(enum ast_io_backend backend)
 {
 	/* Create an I/O context */
 	struct io_context *tmp;
+
+	if (backend == AST_IO_BACKEND_DEFAULT)
+		backend = option_iobackend;
+#ifdef HAVE_EPOLL
+	if (backend == AST_IO_BACKEND_EPOLL) {
+		if ((tmp = io_context_create_epoll()))
+			return tmp;
+		ast_log(LOG_WARNING, "Falling back to poll() for this I/O context\n");
+	}
+#endif
 	tmp = malloc(sizeof(struct io_context));
 	if (tmp) {
+		tmp->epfd = -1;
 		tmp->needshrink = 0;
 		tmp->fdcnt = 0;
 		tmp->maxfdcnt = GROW_SHRINK_SIZE/2;
@@ -109,6 +339,18 @@ struct io_context *io_context_create(void)
 void io_context_destroy(struct io_context *ioc)
 {
 	/* Free associated memory with an I/O context */
+#ifdef HAVE_EPOLL
+	if (ioc->epfd > -1) {
+		int x;
+
+		for (x = 0; x < ioc->maxfdcnt; x++) {
+			if (ioc->ior[x].id)
+				free(ioc->ior[x].id);
+		}
+		close(ioc->epfd);
+		free(ioc->events);
+	}
+#endif
 	if (ioc->fds)
 		free(ioc->fds);
 	if (ioc->ior)
@@ -160,6 +402,10 @@ int *ast_io_add(struct io_context *ioc, int fd, ast_io_cb callback, short events
 	 */
 	int *ret;
 	DEBUG(ast_log(LOG_DEBUG, "ast_io_add()\n"));
+#ifdef HAVE_EPOLL
+	if (ioc->epfd > -1)
+		return epoll_add(ioc, fd, callback, events, data);
+#endif
 	if (ioc->fdcnt >= ioc->maxfdcnt) {
 		/* 
 		 * We don't have enough space for this entry.  We need to
@@ -191,6 +437,10 @@ int *ast_io_add(struct io_context *ioc, int fd, ast_io_cb callback, short events
 
 int *ast_io_change(struct io_context *ioc, int *id, int fd, ast_io_cb callback, short events, void *data)
 {
+#ifdef HAVE_EPOLL
+	if (ioc->epfd > -1)
+		return epoll_change(ioc, id, fd, callback, events, data);
+#endif
 	if (*id < ioc->fdcnt) {
 		if (fd > -1)
 			ioc->fds[*id].fd = fd;
@@ -239,7 +489,15 @@ int ast_io_remove(struct io_context *ioc, int *_id)
 		ast_log(LOG_WARNING, "Asked to remove NULL?\n");
 		return -1;
 	}
-	for (x = 0; x < ioc->fdcnt; x++) {
+#ifdef HAVE_EPOLL
+	if (ioc->epfd > -1)
+		return epoll_remove(ioc, _id);
+#endif
+	/* The id is kept equal to its index, so try there before searching */
+	x = *_id;
+	if ((x < 0) || (x >= ioc->fdcnt) || (ioc->ior[x].id != _id))
+		x = 0;
+	for (; x < ioc->fdcnt; x++) {
 		if (ioc->ior[x].id == _id) {
 			/* Free the int immediately and set to NULL so we know it's unused now */
 			free(ioc->ior[x].id);
@@ -268,6 +526,10 @@ int ast_io_wait(struct io_context *ioc, int howlong)
 	int x;
 	int origcnt;
 	DEBUG(ast_log(LOG_DEBUG, "ast_io_wait()\n"));
+#ifdef HAVE_EPOLL
+	if (ioc->epfd > -1)
+		return epoll_io_wait(ioc, howlong);
+#endif
 	res = poll(ioc->fds, ioc->fdcnt, howlong);
 	if (res > 0) {
 		/*
@@ -306,6 +568,22 @@ void ast_io_dump(struct io_context *ioc)
 	ast_log(LOG_DEBUG, "================================================\n");
 	ast_log(LOG_DEBUG, "| ID    FD     Callback    Data        Events  |\n");
 	ast_log(LOG_DEBUG, "+------+------+-----------+-----------+--------+\n");
+#ifdef HAVE_EPOLL
+	if (ioc->epfd > -1) {
+		for (x = 0; x < ioc->maxfdcnt; x++) {
+			if (!ioc->ior[x].id)
+				continue;
+			ast_log(LOG_DEBUG, "| %.4d | %.4d | %p | %p | %.6x |\n", 
+					*ioc->ior[x].id,
+					ioc->ior[x].fd,
+					ioc->ior[x].callback,
+					ioc->ior[x].data,
+					ioc->ior[x].events);
+		}
+		ast_log(LOG_DEBUG, "================================================\n");
+		return;
+	}
+#endif
 	for (x = 0; x < ioc->fdcnt; x++) {
 		ast_log(LOG_DEBUG, "| %.4d | %.4d | %p | %p | %.6x |\n", 
 				*ioc->ior[x].id,
@@ -95,6 +95,61 @@ static struct msglist {
 
 static char hostname[MAXHOSTNAMELEN];
 
+/*! Date string for the second in datecache_time, so a busy second only
+    runs localtime_r() and strftime() once.  Protected by loglock */
+static time_t datecache_time = 0;
+static char datecache[256];
+
+/*! A message waiting for the logger thread */
+struct logmsg {
+	struct logmsg *volatile next;
+	int level;
+	time_t t;
+	long tid;
+	int line;
+	char *file;
+	char *function;
+	char str[0];
+};
+
+/*! Hand messages to a writer thread rather than writing them ourselves */
+static int logasync = 0;
+static int logqueuelen = 10000;
+static pthread_t logthread = AST_PTHREADT_NULL;
+static int logthread_stop = 0;
+AST_MUTEX_DEFINE_STATIC(logcondlock);
+static ast_cond_t logcond;
+
+/*! Intrusive MPSC queue: producers swap themselves in at logq_head, the
+    logger thread alone pops from logq_tail.  logq_stub keeps it non-empty */
+static struct logmsg logq_stub;
+static struct logmsg *volatile logq_head = &logq_stub;
+static struct logmsg *logq_tail = &logq_stub;
+static volatile int logq_depth = 0;
+static int logq_peak = 0;
+static volatile int logq_dropped = 0;
+
+#if defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 1)))
+#define logq_xchg(p, v)		__sync_lock_test_and_set(p, v)
+#define logq_fetchadd(p, v)	__sync_fetch_and_add(p, v)
+#else
+/* No atomic exchange here, so fall back to a (short) lock */
+AST_MUTEX_DEFINE_STATIC(logqlock);
+
+static struct logmsg *logq_xchg(struct logmsg *volatile *p, struct logmsg *v)
+{
+	struct logmsg *old;
+
+	ast_mutex_lock(&logqlock);
+	old = *p;
+	*p = v;
+	ast_mutex_unlock(&logqlock);
+	return old;
+}
+
+#define logq_fetchadd(p, v)	ast_atomic_fetchadd_int(p, v)
+#endif
+
 enum logtypes {
 	LOGTYPE_SYSLOG,
 	LOGTYPE_FILE,
@@ -286,6 +341,8 @@ static struct logchannel *make_logchannel(char *channel, char *components, int l
 	return chan;
 }
 
+static void *logger_thread(void *data);
+
 static void init_logger_chain(void)
 {
 	struct logchannel *chan, *cur;
@@ -342,6 +399,18 @@ static void init_logger_chain(void)
 		ast_copy_string(dateformat, s, sizeof(dateformat));
 	} else
 		ast_copy_string(dateformat, "%b %e %T", sizeof(dateformat));
+	datecache_time = 0;
+	if ((s = ast_variable_retrieve(cfg, "general", "async")))
+		logasync = ast_true(s);
+	else
+		logasync = 0;
+	if ((s = ast_variable_retrieve(cfg, "general", "asyncqueuelen"))) {
+		if ((sscanf(s, "%d", &logqueuelen) != 1) || (logqueuelen < 1)) {
+			fprintf(stderr, "Invalid asyncqueuelen '%s' in logger.conf, using 10000\n", s);
+			logqueuelen = 10000;
+		}
+	} else
+		logqueuelen = 10000;
 	if ((s = ast_variable_retrieve(cfg, "general", "queue_log"))) {
 		logfiles.queue_log = ast_true(s);
 	}
@@ -362,6 +431,14 @@ static void init_logger_chain(void)
 
 	ast_config_destroy(cfg);
 	ast_mutex_unlock(&loglock);
+
+	if (logasync && (logthread == AST_PTHREADT_NULL)) {
+		logthread_stop = 0;
+		if (ast_pthread_create(&logthread, NULL, logger_thread, NULL)) {
+			logthread = AST_PTHREADT_NULL;
+			fprintf(stderr, "Unable to start logger thread, logging synchronously\n");
+		}
+	}
 }
 
 void ast_queue_log(const char *queuename, const char *callid, const char *agent, const char *event, const char *fmt, ...)
@@ -554,6 +631,10 @@ static int handle_logger_show_channels(int fd, int argc, char *argv[])
 		chan = chan->next;
 	}
 	ast_cli(fd, "\n");
+	ast_cli(fd, "Asynchronous logging: %s\n", logasync ? "Enabled" : "Disabled");
+	if (logthread != AST_PTHREADT_NULL)
+		ast_cli(fd, "Queued messages: %d (peak %d, limit %d), dropped: %d\n", logq_depth, logq_peak, logqueuelen, logq_dropped);
+	ast_cli(fd, "\n");
 
 	ast_mutex_unlock(&loglock);
  		
@@ -615,6 +696,8 @@ int init_logger(void)
 
 	mkdir((char *)ast_config_AST_LOG_DIR, 0755);
   
+	ast_cond_init(&logcond, NULL);
+
 	/* create log channels */
 	init_logger_chain();
 
@@ -645,6 +728,15 @@ void close_logger(void)
 {
 	struct msglist *m, *tmp;
 
+	/* Let the logger thread write out whatever is still queued */
+	if (logthread != AST_PTHREADT_NULL) {
+		logasync = 0;
+		logthread_stop = 1;
+		ast_cond_signal(&logcond);
+		pthread_join(logthread, NULL);
+		logthread = AST_PTHREADT_NULL;
+	}
+
 	ast_mutex_lock(&msglist_lock);
 	m = list;
 	while(m) {
@@ -661,7 +753,7 @@ void close_logger(void)
 	return;
 }
 
-static void ast_log_vsyslog(int level, const char *file, int line, const char *function, const char *fmt, va_list args) 
+static void ast_log_syslog(int level, long tid, const char *file, int line, const char *function, const char *msg) 
 {
 	char buf[BUFSIZ];
 	char *s;
@@ -672,83 +764,49 @@ static void ast_log_vsyslog(int level, const char *file, int line, const char *f
 		return;
 	}
 	if (level == __LOG_VERBOSE) {
-		snprintf(buf, sizeof(buf), "VERBOSE[%ld]: ", (long)GETTID());
+		snprintf(buf, sizeof(buf), "VERBOSE[%ld]: ", tid);
 		level = __LOG_DEBUG;
 	} else if (level == __LOG_DTMF) {
-		snprintf(buf, sizeof(buf), "DTMF[%ld]: ", (long)GETTID());
+		snprintf(buf, sizeof(buf), "DTMF[%ld]: ", tid);
 		level = __LOG_DEBUG;
 	} else {
 		snprintf(buf, sizeof(buf), "%s[%ld]: %s:%d in %s: ",
-			 levels[level], (long)GETTID(), file, line, function);
+			 levels[level], tid, file, line, function);
 	}
 	s = buf + strlen(buf);
-	vsnprintf(s, sizeof(buf) - strlen(buf), fmt, args);
+	ast_copy_string(s, msg, sizeof(buf) - strlen(buf));
 	term_strip(s, s, strlen(s) + 1);
 	syslog(syslog_level_map[level], "%s", buf);
 }
 
-/*
- * send log messages to syslog and/or the console
- */
-void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+/*! \brief logger_date: Format the time for a message, reusing the last
+   result within the same second.  Call with loglock held */
+static const char *logger_date(time_t t)
 {
-	struct logchannel *chan;
-	char buf[BUFSIZ];
-	time_t t;
 	struct tm tm;
-	char date[256];
 
-	va_list ap;
-	
-	if (!logchannels)
-	{
-		/* 
-		 * we don't have the logger chain configured yet,
-		 * so just log to stdout 
-		*/
-		if (level != __LOG_VERBOSE) {
-			va_start(ap, fmt);
-			vsnprintf(buf, sizeof(buf), fmt, ap);
-			va_end(ap);
-			fputs(buf, stdout);
-		}
-		return;
-	}
-
-	/* don't display LOG_DEBUG messages unless option_verbose _or_ option_debug
-	   are non-zero; LOG_DEBUG messages can still be displayed if option_debug
-	   is zero, if option_verbose is non-zero (this allows for 'level zero'
-	   LOG_DEBUG messages to be displayed, if the logmask on any channel
-	   allows it)
-	*/
-	if (!option_verbose && !option_debug && (level == __LOG_DEBUG)) {
-		return;
+	if (t != datecache_time) {
+		localtime_r(&t, &tm);
+		strftime(datecache, sizeof(datecache), dateformat, &tm);
+		datecache_time = t;
 	}
+	return datecache;
+}
 
-	/* Ignore anything that never gets logged anywhere */
-	if (!(global_logmask & (1 << level)))
-		return;
-	
-	/* Ignore anything other than the currently debugged file if there is one */
-	if ((level == __LOG_DEBUG) && !ast_strlen_zero(debug_filename) && strcasecmp(debug_filename, file))
-		return;
-
-	/* begin critical section */
-	ast_mutex_lock(&loglock);
-
-	time(&t);
-	localtime_r(&t, &tm);
-	strftime(date, sizeof(date), dateformat, &tm);
+/*! \brief logger_write: Send a formatted message to every channel that
+   wants it.  Call with loglock held */
+static void logger_write(int level, time_t t, long tid, const char *file, int line, const char *function, const char *msg, int flush)
+{
+	struct logchannel *chan;
+	char buf[BUFSIZ];
+	const char *date = logger_date(t);
 
 	if (logfiles.event_log && level == __LOG_EVENT) {
-		va_start(ap, fmt);
-
-		fprintf(eventlog, "%s asterisk[%d]: ", date, (int) getpid());
-		vfprintf(eventlog, fmt, ap);
-		fflush(eventlog);
-
-		va_end(ap);
-		ast_mutex_unlock(&loglock);
+		if (eventlog) {
+			fprintf(eventlog, "%s asterisk[%d]: %s", date, (int) getpid(), msg);
+			if (flush)
+				fflush(eventlog);
+		}
 		return;
 	}
 
@@ -756,9 +814,7 @@ void ast_log(int level, const char *file, int line, const char *function, const
 	while(chan && !chan->disabled) {
 		/* Check syslog channels */
 		if (chan->type == LOGTYPE_SYSLOG && (chan->logmask & (1 << level))) {
-			va_start(ap, fmt);
-			ast_log_vsyslog(level, file, line, function, fmt, ap);
-			va_end(ap);
+			ast_log_syslog(level, tid, file, line, function, msg);
 		/* Console channels */
 		} else if ((chan->logmask & (1 << level)) && (chan->type == LOGTYPE_CONSOLE)) {
 			char linestr[128];
@@ -769,22 +825,19 @@ void ast_log(int level, const char *file, int line, const char *function, const
 				snprintf(buf, sizeof(buf), option_timestamp ? "[%s] %s[%ld]: %s:%s %s: " : "%s %s[%ld]: %s:%s %s: ",
 					date,
 					term_color(tmp1, levels[level], colors[level], 0, sizeof(tmp1)),
-					(long)GETTID(),
+					tid,
 					term_color(tmp2, file, COLOR_BRWHITE, 0, sizeof(tmp2)),
 					term_color(tmp3, linestr, COLOR_BRWHITE, 0, sizeof(tmp3)),
 					term_color(tmp4, function, COLOR_BRWHITE, 0, sizeof(tmp4)));
 				
 				ast_console_puts(buf);
-				va_start(ap, fmt);
-				vsnprintf(buf, sizeof(buf), fmt, ap);
-				va_end(ap);
-				ast_console_puts(buf);
+				ast_console_puts(msg);
 			}
 		/* File channels */
 		} else if ((chan->logmask & (1 << level)) && (chan->fileptr)) {
 			int res;
 			snprintf(buf, sizeof(buf), option_timestamp ? "[%s] %s[%ld]: " : "%s %s[%ld] %s: ", date,
-				levels[level], (long)GETTID(), file);
+				levels[level], tid, file);
 			res = fprintf(chan->fileptr, buf);
 			if (res <= 0 && buf[0] != '\0') {	/* Error, no characters printed */
 				fprintf(stderr,"**** Asterisk Logging Error: ***********\n");
@@ -796,25 +849,206 @@ void ast_log(int level, const char *file, int line, const char *function, const
 				chan->disabled = 1;	
 			} else {
 				/* No error message, continue printing */
-				va_start(ap, fmt);
-				vsnprintf(buf, sizeof(buf), fmt, ap);
-				va_end(ap);
+				ast_copy_string(buf, msg, sizeof(buf));
 				term_strip(buf, buf, sizeof(buf));
 				fputs(buf, chan->fileptr);
-				fflush(chan->fileptr);
+				if (flush)
+					fflush(chan->fileptr);
 			}
 		}
 		chan = chan->next;
 	}
+}
 
+static void logger_rotate_oversize(void)
+{
+	reload_logger(1);
+	ast_log(LOG_EVENT,"Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
+	if (option_verbose)
+		ast_verbose("Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
+}
+
+/*! \brief logq_push: Queue a message for the logger thread.  Never blocks */
+static void logq_push(int level, const char *file, int line, const char *function, const char *msg)
+{
+	struct logmsg *m, *prev;
+	int msglen = strlen(msg) + 1, filelen = strlen(file) + 1, depth;
+
+	if (logq_fetchadd(&logq_depth, 1) >= logqueuelen) {
+		logq_fetchadd(&logq_depth, -1);
+		logq_fetchadd(&logq_dropped, 1);
+		return;
+	}
+	m = malloc(sizeof(*m) + msglen + filelen + strlen(function) + 1);
+	if (!m) {
+		logq_fetchadd(&logq_depth, -1);
+		logq_fetchadd(&logq_dropped, 1);
+		return;
+	}
+	m->next = NULL;
+	m->level = level;
+	time(&m->t);
+	m->tid = (long)GETTID();
+	m->line = line;
+	/* Modules may be gone by the time this is written, so copy their strings */
+	strcpy(m->str, msg);
+	m->file = m->str + msglen;
+	strcpy(m->file, file);
+	m->function = m->file + filelen;
+	strcpy(m->function, function);
+
+	prev = logq_xchg(&logq_head, m);
+	prev->next = m;
+	depth = logq_depth;
+	if (depth > logq_peak)
+		logq_peak = depth;
+	/* Only the first message of a burst needs to wake the thread; it
+	   drains everything it finds before sleeping again */
+	if (depth == 1)
+		ast_cond_signal(&logcond);
+}
+
+static void logq_pushstub(void)
+{
+	struct logmsg *prev;
+
+	logq_stub.next = NULL;
+	prev = logq_xchg(&logq_head, &logq_stub);
+	prev->next = &logq_stub;
+}
+
+/*! \brief logq_pop: Take the oldest message off the queue, if one has
+   been fully linked in.  Only called by the logger thread */
+static struct logmsg *logq_pop(void)
+{
+	struct logmsg *tail = logq_tail, *next = tail->next;
+
+	if (tail == &logq_stub) {
+		if (!next)
+			return NULL;
+		logq_tail = tail = next;
+		next = next->next;
+	}
+	if (next) {
+		logq_tail = next;
+		return tail;
+	}
+	/* tail is the last message, unless a producer is mid-push */
+	if (tail != logq_head)
+		return NULL;
+	logq_pushstub();
+	next = tail->next;
+	if (next) {
+		logq_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/*! \brief logger_thread: Write queued messages in batches, flushing each
+   file once per batch */
+static void *logger_thread(void *data)
+{
+	struct logmsg *m;
+	struct logchannel *chan;
+	struct timeval tv;
+	struct timespec ts;
+	int count;
+
+	for (;;) {
+		ast_mutex_lock(&loglock);
+		for (count = 0; (m = logq_pop()); count++) {
+			logq_fetchadd(&logq_depth, -1);
+			logger_write(m->level, m->t, m->tid, m->file, m->line, m->function, m->str, 0);
+			free(m);
+		}
+		if (count) {
+			if (eventlog)
+				fflush(eventlog);
+			for (chan = logchannels; chan; chan = chan->next) {
+				if (chan->fileptr)
+					fflush(chan->fileptr);
+			}
+		}
+		ast_mutex_unlock(&loglock);
+		if (count && filesize_reload_needed)
+			logger_rotate_oversize();
+		if (logthread_stop && !logq_depth)
+			break;
+		if (!count) {
+			/* A push that raced with us draining the queue may not have
+			   signalled, so don't sleep for long */
+			ast_mutex_lock(&logcondlock);
+			tv = ast_tvadd(ast_tvnow(), ast_samp2tv(100, 1000));
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			ast_cond_timedwait(&logcond, &logcondlock, &ts);
+			ast_mutex_unlock(&logcondlock);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * send log messages to syslog and/or the console
+ */
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+	char buf[BUFSIZ];
+	time_t t;
+
+	va_list ap;
+	
+	if (!logchannels)
+	{
+		/* 
+		 * we don't have the logger chain configured yet,
+		 * so just log to stdout 
+		*/
+		if (level != __LOG_VERBOSE) {
+			va_start(ap, fmt);
+			vsnprintf(buf, sizeof(buf), fmt, ap);
+			va_end(ap);
+			fputs(buf, stdout);
+		}
+		return;
+	}
+
+	/* don't display LOG_DEBUG messages unless option_verbose _or_ option_debug
+	   are non-zero; LOG_DEBUG messages can still be displayed if option_debug
+	   is zero, if option_verbose is non-zero (this allows for 'level zero'
+	   LOG_DEBUG messages to be displayed, if the logmask on any channel
+	   allows it)
+	*/
+	if (!option_verbose && !option_debug && (level == __LOG_DEBUG)) {
+		return;
+	}
+
+	/* Ignore anything that never gets logged anywhere */
+	if (!(global_logmask & (1 << level)))
+		return;
+	
+	/* Ignore anything other than the currently debugged file if there is one */
+	if ((level == __LOG_DEBUG) && !ast_strlen_zero(debug_filename) && strcasecmp(debug_filename, file))
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (logasync && (logthread != AST_PTHREADT_NULL)) {
+		logq_push(level, file, line, function, buf);
+		return;
+	}
+
+	/* begin critical section */
+	ast_mutex_lock(&loglock);
+	time(&t);
+	logger_write(level, t, (long)GETTID(), file, line, function, buf, 1);
 	ast_mutex_unlock(&loglock);
 	/* end critical section */
-	if (filesize_reload_needed) {
-		reload_logger(1);
-		ast_log(LOG_EVENT,"Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
-		if (option_verbose)
-			ast_verbose("Rotated Logs Per SIGXFSZ (Exceeded file size limit)\n");
-	}
+	if (filesize_reload_needed)
+		logger_rotate_oversize();
 }
 
 void ast_verbose(const char *fmt, ...)
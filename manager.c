@@ -88,6 +88,14 @@ static pthread_t t;
 AST_MUTEX_DEFINE_STATIC(sessionlock);
 static int block_sockets = 0;
 
+static int eventqueuelen = DEFAULT_MANAGER_EVENTQUEUE;
+static enum manager_overflow overflowpolicy = MANAGER_OVERFLOW_DROPOLDEST;
+/*! Events dropped across all sessions, protected by sessionlock */
+static unsigned int total_dropped = 0;
+/*! Thread that drains the session event queues, and the pipe used to wake it */
+static pthread_t writer_thread = AST_PTHREADT_NULL;
+static int writer_pipe[2] = { -1, -1 };
+
 static struct permalias {
 	int num;
 	char *label;
@@ -138,6 +146,153 @@ int ast_carefulwrite(int fd, char *s, int len, int timeoutms)
 	return res;
 }
 
+/*! \brief  unref_event: Drop a reference to a queued event, freeing it with the last one */
+static void unref_event(struct eventqent *eqe)
+{
+	if (ast_atomic_dec_and_test(&eqe->usecount))
+		free(eqe);
+}
+
+/*! \brief  pop_event: Remove the oldest event from a session queue. Call with s->__lock held */
+static void pop_event(struct mansession *s)
+{
+	struct eventqent *eqe = s->eventq[s->eventqhead];
+
+	s->eventq[s->eventqhead] = NULL;
+	s->eventqhead = (s->eventqhead + 1) % s->eventqsize;
+	s->eventqlen--;
+	s->eventqoffset = 0;
+	unref_event(eqe);
+}
+
+/*! \brief  append_event: Queue a shared event on a session. Call with s->__lock held.
+    Returns -1 if the session must be disconnected */
+static int append_event(struct mansession *s, struct eventqent *eqe)
+{
+	int next;
+
+	if (!s->eventq) {
+		s->eventq = calloc(eventqueuelen, sizeof(*s->eventq));
+		if (!s->eventq) {
+			ast_log(LOG_WARNING, "Out of memory\n");
+			return -1;
+		}
+		s->eventqsize = eventqueuelen;
+	}
+	if (s->eventqlen == s->eventqsize) {
+		if (overflowpolicy == MANAGER_OVERFLOW_DISCONNECT)
+			return -1;
+		if (s->eventqoffset) {
+			/* The oldest event is partly on the wire already, so
+			   drop the one behind it and keep the stream intact */
+			next = (s->eventqhead + 1) % s->eventqsize;
+			unref_event(s->eventq[next]);
+			s->eventq[next] = s->eventq[s->eventqhead];
+			s->eventq[s->eventqhead] = NULL;
+			s->eventqhead = next;
+			s->eventqlen--;
+		} else
+			pop_event(s);
+		s->dropped++;
+		total_dropped++;
+	}
+	next = (s->eventqhead + s->eventqlen) % s->eventqsize;
+	ast_atomic_fetchadd_int(&eqe->usecount, 1);
+	s->eventq[next] = eqe;
+	s->eventqlen++;
+	return 0;
+}
+
+/*! \brief  flush_events: Write as much of a session's event queue as the
+    socket takes without blocking. Call with s->__lock held. The socket may
+    be blocking (block_sockets), so every send is non-blocking by itself.
+    While the session is busy with an action, only a half written event is
+    finished */
+static int flush_events(struct mansession *s)
+{
+	struct eventqent *eqe;
+	int res;
+
+	while (s->eventqlen && (!s->busy || s->eventqoffset)) {
+		eqe = s->eventq[s->eventqhead];
+		res = send(s->fd, eqe->eventdata + s->eventqoffset, eqe->len - s->eventqoffset, MSG_DONTWAIT);
+		if (res < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+				return 0;
+			return -1;
+		}
+		s->eventqoffset += res;
+		if (s->eventqoffset < eqe->len)
+			return 0;
+		pop_event(s);
+	}
+	return 0;
+}
+
+/*! \brief  wake_writer: Kick the event writer out of poll() */
+static void wake_writer(void)
+{
+	if (writer_pipe[1] > -1)
+		write(writer_pipe[1], "", 1);
+}
+
+/*! \brief  event_writer: Drain session event queues as their sockets become
+    writable, so a slow client never stalls the threads raising events */
+static void *event_writer(void *ignore)
+{
+	struct mansession *s;
+	struct pollfd *fds, *tmp;
+	int nfds, maxfds = 16;
+	char buf[64];
+
+	fds = malloc(maxfds * sizeof(*fds));
+	if (!fds) {
+		ast_log(LOG_WARNING, "Out of memory\n");
+		return NULL;
+	}
+	for (;;) {
+		nfds = 1;
+		ast_mutex_lock(&sessionlock);
+		for (s = sessions; s; s = s->next) {
+			ast_mutex_lock(&s->__lock);
+			if (s->eventqlen && (!s->busy || s->eventqoffset) && !s->dead) {
+				if (flush_events(s)) {
+					ast_log(LOG_WARNING, "Disconnecting slow (or gone) manager session!\n");
+					s->dead = 1;
+					pthread_kill(s->t, SIGURG);
+				}
+				if (s->busy && (s->dead || !s->eventqoffset)) {
+					/* session_busy() is waiting for the socket */
+					ast_cond_broadcast(&s->partialcond);
+				} else if (s->eventqlen && !s->dead) {
+					if (nfds == maxfds) {
+						tmp = realloc(fds, 2 * maxfds * sizeof(*fds));
+						if (tmp) {
+							fds = tmp;
+							maxfds *= 2;
+						}
+					}
+					if (nfds < maxfds) {
+						fds[nfds].fd = s->fd;
+						fds[nfds].events = POLLOUT;
+						nfds++;
+					}
+				}
+			}
+			ast_mutex_unlock(&s->__lock);
+		}
+		ast_mutex_unlock(&sessionlock);
+		fds[0].fd = writer_pipe[0];
+		fds[0].events = POLLIN;
+		/* If we ran out of room for a descriptor, come back soon anyway */
+		if ((poll(fds, nfds, (nfds < maxfds) ? -1 : 100) > 0) && (fds[0].revents & POLLIN)) {
+			while (read(writer_pipe[0], buf, sizeof(buf)) > 0)
+				;
+		}
+	}
+	return NULL;
+}
+
 /*! authority_to_str: Convert authority code to string with serveral options */
 static char *authority_to_str(int authority, char *res, int reslen)
 {
@@ -227,14 +382,17 @@ static int handle_showmanconn(int fd, int argc, char *argv[])
 {
 	struct mansession *s;
 	char iabuf[INET_ADDRSTRLEN];
-	char *format = "  %-15.15s  %-15.15s\n";
+	char *format = "  %-15.15s  %-15.15s  %-8s  %-8s\n";
+	char *format2 = "  %-15.15s  %-15.15s  %-8d  %-8u\n";
 	ast_mutex_lock(&sessionlock);
 	s = sessions;
-	ast_cli(fd, format, "Username", "IP Address");
+	ast_cli(fd, format, "Username", "IP Address", "Queued", "Dropped");
 	while (s) {
-		ast_cli(fd, format,s->username, ast_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr));
+		ast_cli(fd, format2, s->username, ast_inet_ntoa(iabuf, sizeof(iabuf), s->sin.sin_addr), s->eventqlen, s->dropped);
 		s = s->next;
 	}
+	ast_cli(fd, "Event queue length: %d, on overflow: %s, total dropped: %u\n", eventqueuelen,
+		(overflowpolicy == MANAGER_OVERFLOW_DISCONNECT) ? "disconnect" : "drop oldest", total_dropped);
 
 	ast_mutex_unlock(&sessionlock);
 	return RESULT_SUCCESS;
@@ -267,15 +425,14 @@ static struct ast_cli_entry show_manconn_cli =
 
 static void free_session(struct mansession *s)
 {
-	struct eventqent *eqe;
 	if (s->fd > -1)
 		close(s->fd);
 	ast_mutex_destroy(&s->__lock);
-	while(s->eventq) {
-		eqe = s->eventq;
-		s->eventq = s->eventq->next;
-		free(eqe);
-	}
+	ast_cond_destroy(&s->partialcond);
+	while(s->eventqlen)
+		pop_event(s);
+	if (s->eventq)
+		free(s->eventq);
 	free(s);
 }
 
@@ -1334,10 +1491,6 @@ static int process_message(struct mansession *s, struct message *m)
 			astman_send_error(s, m, "Authentication Required");
 	} else {
 		int ret=0;
-		struct eventqent *eqe;
-		ast_mutex_lock(&s->__lock);
-		s->busy = 1;
-		ast_mutex_unlock(&s->__lock);
 		while( tmp ) { 		
 			if (!strcasecmp(action, tmp->action)) {
 				if ((s->writeperm & tmp->authority) == tmp->authority) {
@@ -1352,18 +1505,6 @@ static int process_message(struct mansession *s, struct message *m)
 		}
 		if (!tmp)
 			astman_send_error(s, m, "Invalid/unknown command");
-		ast_mutex_lock(&s->__lock);
-		s->busy = 0;
-		while(s->eventq) {
-			if (ast_carefulwrite(s->fd, s->eventq->eventdata, strlen(s->eventq->eventdata), s->writetimeout) < 0) {
-				ret = -1;
-				break;
-			}
-			eqe = s->eventq;
-			s->eventq = s->eventq->next;
-			free(eqe);
-		}
-		ast_mutex_unlock(&s->__lock);
 		return ret;
 	}
 	return 0;
@@ -1418,6 +1559,47 @@ static int get_input(struct mansession *s, char *output)
 	return 0;
 }
 
+/*! \brief  session_busy: Keep the event writer off the socket while we answer an action */
+static int session_busy(struct mansession *s)
+{
+	struct timeval tv;
+	struct timespec ts;
+	int res = 0;
+
+	ast_mutex_lock(&s->__lock);
+	s->busy = 1;
+	/* Have the event writer finish any half written event so our response
+	   doesn't land in the middle of it.  Writing it ourselves could block
+	   with the session lock held, and manager_event() takes that lock. */
+	if (s->eventqoffset && !s->dead) {
+		wake_writer();
+		tv = ast_tvadd(ast_tvnow(), ast_samp2tv(s->writetimeout, 1000));
+		ts.tv_sec = tv.tv_sec;
+		ts.tv_nsec = tv.tv_usec * 1000;
+		while (s->eventqoffset && !s->dead) {
+			if (ast_cond_timedwait(&s->partialcond, &s->__lock, &ts) == ETIMEDOUT)
+				break;
+		}
+		if (s->eventqoffset || s->dead)
+			res = -1;
+	}
+	ast_mutex_unlock(&s->__lock);
+	return res;
+}
+
+/*! \brief  session_idle: Hand the socket back to the event writer */
+static void session_idle(struct mansession *s)
+{
+	int pending;
+
+	ast_mutex_lock(&s->__lock);
+	s->busy = 0;
+	pending = s->eventqlen;
+	ast_mutex_unlock(&s->__lock);
+	if (pending)
+		wake_writer();
+}
+
 static void *session_do(void *data)
 {
 	struct mansession *s = data;
@@ -1437,7 +1619,11 @@ static void *session_do(void *data)
 				continue;
 			m.headers[m.hdrcount][strlen(m.headers[m.hdrcount]) - 2] = '\0';
 			if (ast_strlen_zero(m.headers[m.hdrcount])) {
-				if (process_message(s, &m))
+				if (session_busy(s))
+					break;
+				res = process_message(s, &m);
+				session_idle(s);
+				if (res)
 					break;
 				memset(&m, 0, sizeof(m));
 			} else if (m.hdrcount < AST_MAX_MANHEADERS - 1)
@@ -1504,6 +1690,7 @@ static void *accept_thread(void *ignore)
 			fcntl(as, F_SETFL, flags | O_NONBLOCK);
 		}
 		ast_mutex_init(&s->__lock);
+		ast_cond_init(&s->partialcond, NULL);
 		s->fd = as;
 		s->send_events = -1;
 		ast_mutex_lock(&sessionlock);
@@ -1517,34 +1704,16 @@ static void *accept_thread(void *ignore)
 	return NULL;
 }
 
-static int append_event(struct mansession *s, const char *str)
-{
-	struct eventqent *tmp, *prev=NULL;
-	tmp = malloc(sizeof(struct eventqent) + strlen(str));
-	if (tmp) {
-		tmp->next = NULL;
-		strcpy(tmp->eventdata, str);
-		if (s->eventq) {
-			prev = s->eventq;
-			while(prev->next) 
-				prev = prev->next;
-			prev->next = tmp;
-		} else {
-			s->eventq = tmp;
-		}
-		return 0;
-	}
-	return -1;
-}
-
 /*! \brief  manager_event: Send AMI event to client */
 int manager_event(int category, char *event, char *fmt, ...)
 {
 	struct mansession *s;
+	struct eventqent *eqe = NULL;
 	char auth[80];
 	char tmp[4096] = "";
 	char *tmp_next = tmp;
 	size_t tmp_left = sizeof(tmp) - 2;
+	int wake = 0;
 	va_list ap;
 
 	ast_mutex_lock(&sessionlock);
@@ -1555,7 +1724,8 @@ int manager_event(int category, char *event, char *fmt, ...)
 		if ((s->send_events & category) != category)
 			continue;
 
-		if (ast_strlen_zero(tmp)) {
+		if (!eqe) {
+			/* Format the event once; every session queue shares it */
 			ast_build_string(&tmp_next, &tmp_left, "Event: %s\r\nPrivilege: %s\r\n",
 					 event, authority_to_str(category, auth, sizeof(auth)));
 			va_start(ap, fmt);
@@ -1564,14 +1734,23 @@ int manager_event(int category, char *event, char *fmt, ...)
 			*tmp_next++ = '\r';
 			*tmp_next++ = '\n';
 			*tmp_next = '\0';
+			eqe = malloc(sizeof(struct eventqent) + (tmp_next - tmp));
+			if (!eqe) {
+				ast_log(LOG_WARNING, "Out of memory\n");
+				break;
+			}
+			eqe->usecount = 1;
+			eqe->len = tmp_next - tmp;
+			eqe->next = NULL;
+			memcpy(eqe->eventdata, tmp, eqe->len + 1);
 		}
 
 		ast_mutex_lock(&s->__lock);
-		if (s->busy) {
-			append_event(s, tmp);
-		} else if (!s->dead) {
-			if (ast_carefulwrite(s->fd, tmp, tmp_next - tmp, s->writetimeout) < 0) {
-				ast_log(LOG_WARNING, "Disconnecting slow (or gone) manager session!\n");
+		if (!s->dead) {
+			if (!s->eventqlen && !s->busy)
+				wake = 1;
+			if (append_event(s, eqe)) {
+				ast_log(LOG_WARNING, "Disconnecting manager session with a full event queue!\n");
 				s->dead = 1;
 				pthread_kill(s->t, SIGURG);
 			}
@@ -1579,6 +1758,10 @@ int manager_event(int category, char *event, char *fmt, ...)
 		ast_mutex_unlock(&s->__lock);
 	}
 	ast_mutex_unlock(&sessionlock);
+	if (eqe)
+		unref_event(eqe);
+	if (wake)
+		wake_writer();
 
 	return 0;
 }
@@ -1713,6 +1896,8 @@ int init_manager(void)
 	}
 	portno = DEFAULT_MANAGER_PORT;
 	displayconnects = 1;
+	eventqueuelen = DEFAULT_MANAGER_EVENTQUEUE;
+	overflowpolicy = MANAGER_OVERFLOW_DROPOLDEST;
 	cfg = ast_config_load("manager.conf");
 	if (!cfg) {
 		ast_log(LOG_NOTICE, "Unable to open management configuration manager.conf.  Call management disabled.\n");
@@ -1743,6 +1928,20 @@ int init_manager(void)
 	if ((val = ast_variable_retrieve(cfg, "general", "displayconnects"))) {
 			displayconnects = ast_true(val);;
 	}
+	if ((val = ast_variable_retrieve(cfg, "general", "eventqueuelen"))) {
+		if ((sscanf(val, "%d", &eventqueuelen) != 1) || (eventqueuelen < 2)) {
+			ast_log(LOG_WARNING, "Invalid eventqueuelen '%s', using %d\n", val, DEFAULT_MANAGER_EVENTQUEUE);
+			eventqueuelen = DEFAULT_MANAGER_EVENTQUEUE;
+		}
+	}
+	if ((val = ast_variable_retrieve(cfg, "general", "eventoverflow"))) {
+		if (!strcasecmp(val, "disconnect"))
+			overflowpolicy = MANAGER_OVERFLOW_DISCONNECT;
+		else if (!strcasecmp(val, "dropoldest"))
+			overflowpolicy = MANAGER_OVERFLOW_DROPOLDEST;
+		else
+			ast_log(LOG_WARNING, "Invalid eventoverflow '%s', using dropoldest\n", val);
+	}
 				
 	
 	ba.sin_family = AF_INET;
@@ -1794,6 +1993,16 @@ int init_manager(void)
 			ast_verbose("Asterisk Management interface listening on port %d\n", portno);
 		ast_pthread_create(&t, NULL, accept_thread, NULL);
 	}
+	if (writer_thread == AST_PTHREADT_NULL) {
+		if (pipe(writer_pipe)) {
+			ast_log(LOG_WARNING, "Unable to create manager event pipe: %s\n", strerror(errno));
+			writer_pipe[0] = writer_pipe[1] = -1;
+			return -1;
+		}
+		fcntl(writer_pipe[0], F_SETFL, fcntl(writer_pipe[0], F_GETFL) | O_NONBLOCK);
+		fcntl(writer_pipe[1], F_SETFL, fcntl(writer_pipe[1], F_GETFL) | O_NONBLOCK);
+		ast_pthread_create(&writer_thread, NULL, event_writer, NULL);
+	}
 	return 0;
 }
 
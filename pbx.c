@@ -57,6 +57,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 62737 $")
 #include "asterisk/app.h"
 #include "asterisk/devicestate.h"
 #include "asterisk/compat.h"
+#include "asterisk/astobj.h"
 
 /*!
  * \note I M P O R T A N T :
@@ -101,6 +102,7 @@ AST_APP_OPTIONS(waitexten_opts, {
 });
 
 struct ast_context;
+struct pbx_trie;
 
 /*!\brief ast_exten: An extension 
 	The dialplan is saved as a linked list with each context
@@ -161,6 +163,9 @@ struct ast_context {
 	struct ast_ignorepat *ignorepats;	/*!< Patterns for which to continue playing dialtone */
 	const char *registrar;			/*!< Registrar */
 	struct ast_sw *alts;			/*!< Alternative switches */
+	struct ast_context *hashnext;		/*!< Next in the name index bucket */
+	struct pbx_trie *trie;			/*!< Index of the extensions, see pbx_trie_candidates() */
+	int triedirty;				/*!< Extensions changed since the index was built */
 	char name[0];				/*!< Name of the context */
 };
 
@@ -190,9 +195,22 @@ struct ast_hint {
 	struct ast_exten *exten;	/*!< Extension */
 	int laststate; 			/*!< Last known state */
 	struct ast_state_cb *callbacks;	/*!< Callback list for this extension */
+	struct hint_device *devices;	/*!< The devices of the hint, as filed in hint_devices */
 	struct ast_hint *next;		/*!< Pointer to next hint in list */
 };
 
+/*! \brief One device of a hint.  These are filed by device name, so a device
+  state change finds the hints it affects without parsing all the others */
+struct hint_device {
+	struct ast_hint *hint;		/*!< Hint the device belongs to */
+	unsigned int hash;		/*!< Hash of the device name */
+	struct hint_device *next;	/*!< Next in the hint_devices bucket */
+	struct hint_device *hintnext;	/*!< Next device of the same hint */
+	char name[1];
+};
+
+#define HINT_DEVICE_BUCKETS	4096
+
 int ast_pbx_outgoing_cdr_failed(void);
 
 static int pbx_builtin_answer(struct ast_channel *, void *);
@@ -529,6 +547,9 @@ static struct pbx_builtin {
 
 static struct ast_context *contexts = NULL;
 AST_MUTEX_DEFINE_STATIC(conlock); 		/* Lock for the ast_context list */
+/*! Contexts by name, so lookups don't walk the whole list.  Protected by conlock */
+#define CONTEXT_BUCKETS 2053
+static struct ast_context *contexthash[CONTEXT_BUCKETS];
 static struct ast_app *apps = NULL;
 AST_MUTEX_DEFINE_STATIC(applock); 		/* Lock for the application list */
 
@@ -545,6 +566,7 @@ AST_MUTEX_DEFINE_STATIC(hintlock);		/* Lock for extension state notifys */
 static int stateid = 1;
 struct ast_hint *hints = NULL;
 struct ast_state_cb *statecbs = NULL;
+static struct hint_device *hint_devices[HINT_DEVICE_BUCKETS];	/* Devices of all hints, by name.  Protected by hintlock */
 
 /* 
    \note This function is special. It saves the stack so that no matter
@@ -571,6 +593,8 @@ int pbx_exec(struct ast_channel *c, 		/*!< Channel */
 
 		c->appl = app->name;
 		c->data = data;		
+		/* Keep ast_get_channel_by_exten_locked() up with the dialplan */
+		ast_channel_refile(c);
 		res = execute(c, data);
 		/* restore channel values */
 		c->appl= saved_c_appl;
@@ -754,18 +778,431 @@ int ast_extension_close(const char *pattern, const char *data, int needmore)
 		return 0;
 }
 
+/*! \brief Index of a context's extensions, so lookups don't have to try
+   every pattern in turn.  Literal extensions live in a case folded
+   character trie, patterns in a trie of their elements (a digit, or a
+   N/X/Z/[] character set).  The index only narrows the search: every
+   candidate it yields is still checked with ast_extension_match() or
+   ast_extension_close(), and in dialplan order, so results are the same
+   as walking the whole list. */
+struct pbx_trie_entry {
+	struct ast_exten *exten;		/*!< Head of the priority list */
+	int order;				/*!< Position in the context's list */
+	struct pbx_trie_entry *next;
+};
+
+struct pbx_trie_node {
+	int c;					/*!< Character matched to get here, or -1 for a set */
+	unsigned char *set;			/*!< Bitmap of characters matched, for sets */
+	int count;				/*!< Entries at or below this node */
+	struct pbx_trie_entry *ends;		/*!< Extensions ending here */
+	struct pbx_trie_entry *dots;		/*!< Patterns continuing with '.' */
+	struct pbx_trie_entry *bangs;		/*!< Patterns continuing with '!' */
+	struct pbx_trie_node *children;
+	struct pbx_trie_node *sibling;
+};
+
+struct pbx_trie {
+	struct pbx_trie_node literals;
+	struct pbx_trie_node patterns;
+	struct pbx_trie_entry *odd;		/*!< Patterns we can't index; always tried */
+	int oddcount;
+};
+
+/*! Most candidates a lookup will sort before falling back to the list */
+#define PBX_TRIE_MAXCANDIDATES	64
+/*! Most pattern nodes a lookup will track at once */
+#define PBX_TRIE_MAXACTIVE	64
+#define PBX_TRIE_SETLEN		(128 / 8)
+
+static void pbx_trie_node_free(struct pbx_trie_node *node)
+{
+	struct pbx_trie_node *child;
+	struct pbx_trie_entry *ent, **lists[3];
+	int x;
+
+	while ((child = node->children)) {
+		node->children = child->sibling;
+		pbx_trie_node_free(child);
+		free(child);
+	}
+	lists[0] = &node->ends;
+	lists[1] = &node->dots;
+	lists[2] = &node->bangs;
+	for (x = 0; x < 3; x++) {
+		while ((ent = *lists[x])) {
+			*lists[x] = ent->next;
+			free(ent);
+		}
+	}
+	if (node->set)
+		free(node->set);
+}
+
+static void pbx_trie_free(struct pbx_trie *trie)
+{
+	struct pbx_trie_entry *ent;
+
+	if (!trie)
+		return;
+	pbx_trie_node_free(&trie->literals);
+	pbx_trie_node_free(&trie->patterns);
+	while ((ent = trie->odd)) {
+		trie->odd = ent->next;
+		free(ent);
+	}
+	free(trie);
+}
+
+/*! \brief pbx_trie_child: Find or add the child of node for a character or set */
+static struct pbx_trie_node *pbx_trie_child(struct pbx_trie_node *node, int c, unsigned char *set)
+{
+	struct pbx_trie_node *child;
+
+	for (child = node->children; child; child = child->sibling) {
+		if (set ? (child->set && !memcmp(child->set, set, PBX_TRIE_SETLEN)) : (child->c == c))
+			return child;
+	}
+	child = calloc(1, sizeof(*child));
+	if (!child)
+		return NULL;
+	child->c = set ? -1 : c;
+	if (set) {
+		child->set = malloc(PBX_TRIE_SETLEN);
+		if (!child->set) {
+			free(child);
+			return NULL;
+		}
+		memcpy(child->set, set, PBX_TRIE_SETLEN);
+	}
+	child->sibling = node->children;
+	node->children = child;
+	return child;
+}
+
+static void pbx_trie_setrange(unsigned char *set, int lo, int hi)
+{
+	int c;
+
+	/* Compare as EXTENSION_MATCH_CORE does, with plain chars */
+	for (c = 0; c < 128; c++) {
+		if (((char)c >= (char)lo) && ((char)c <= (char)hi))
+			set[c >> 3] |= 1 << (c & 7);
+	}
+}
+
+/*! \brief pbx_trie_add: File an extension in the index, in the same terms
+   EXTENSION_MATCH_CORE reads the pattern */
+static int pbx_trie_add(struct pbx_trie *trie, struct ast_exten *e, int order)
+{
+	struct pbx_trie_node *node;
+	struct pbx_trie_entry *ent, **list;
+	unsigned char set[PBX_TRIE_SETLEN];
+	const char *p, *where;
+	int i, border;
+
+	ent = malloc(sizeof(*ent));
+	if (!ent)
+		return -1;
+	ent->exten = e;
+	ent->order = order;
+	p = e->exten;
+	if (*p != '_') {
+		node = &trie->literals;
+		for (; node && *p; p++)
+			node = pbx_trie_child(node, tolower(*p), NULL);
+		if (!node) {
+			free(ent);
+			return -1;
+		}
+		ent->next = node->ends;
+		node->ends = ent;
+		return 0;
+	}
+	node = &trie->patterns;
+	list = NULL;
+	for (p++; node && !list && *p && (*p != '/'); p++) {
+		switch (toupper(*p)) {
+		case '[':
+			where = strchr(++p, ']');
+			if (!where) {
+				/* Never matches past here, but let the real matcher say so */
+				ent->next = trie->odd;
+				trie->odd = ent;
+				trie->oddcount++;
+				return 0;
+			}
+			border = where - p;
+			memset(set, 0, sizeof(set));
+			for (i = 0; i < border; i++) {
+				if ((i + 2 < border) && (p[i + 1] == '-')) {
+					pbx_trie_setrange(set, p[i], p[i + 2]);
+					i += 2;
+				} else
+					pbx_trie_setrange(set, p[i], p[i]);
+			}
+			node = pbx_trie_child(node, 0, set);
+			p += border;
+			break;
+		case 'N':
+			memset(set, 0, sizeof(set));
+			pbx_trie_setrange(set, '2', '9');
+			node = pbx_trie_child(node, 0, set);
+			break;
+		case 'X':
+			memset(set, 0, sizeof(set));
+			pbx_trie_setrange(set, '0', '9');
+			node = pbx_trie_child(node, 0, set);
+			break;
+		case 'Z':
+			memset(set, 0, sizeof(set));
+			pbx_trie_setrange(set, '1', '9');
+			node = pbx_trie_child(node, 0, set);
+			break;
+		case '.':
+			list = &node->dots;
+			break;
+		case '!':
+			list = &node->bangs;
+			break;
+		case ' ':
+		case '-':
+			/* Ignored by the matcher */
+			break;
+		default:
+			node = pbx_trie_child(node, (unsigned char)*p, NULL);
+		}
+	}
+	if (!node) {
+		free(ent);
+		return -1;
+	}
+	if (!list)
+		list = &node->ends;
+	ent->next = *list;
+	*list = ent;
+	return 0;
+}
+
+static int pbx_trie_listlen(struct pbx_trie_entry *ent)
+{
+	int count = 0;
+
+	for (; ent; ent = ent->next)
+		count++;
+	return count;
+}
+
+static int pbx_trie_count(struct pbx_trie_node *node)
+{
+	struct pbx_trie_node *child;
+
+	node->count = pbx_trie_listlen(node->ends) + pbx_trie_listlen(node->dots) + pbx_trie_listlen(node->bangs);
+	for (child = node->children; child; child = child->sibling)
+		node->count += pbx_trie_count(child);
+	return node->count;
+}
+
+/*! \brief pbx_trie_build: Compile the index of a context.  Call with con->lock held */
+static struct pbx_trie *pbx_trie_build(struct ast_context *con)
+{
+	struct pbx_trie *trie;
+	struct ast_exten *e;
+	int order = 0;
+
+	trie = calloc(1, sizeof(*trie));
+	if (!trie)
+		return NULL;
+	for (e = con->root; e; e = e->next) {
+		if (pbx_trie_add(trie, e, order++)) {
+			ast_log(LOG_WARNING, "Out of memory indexing context '%s'\n", con->name);
+			pbx_trie_free(trie);
+			return NULL;
+		}
+	}
+	pbx_trie_count(&trie->literals);
+	pbx_trie_count(&trie->patterns);
+	return trie;
+}
+
+/*! \brief pbx_context_trie: Get the index of a context, compiling it again
+   if the extensions have changed since */
+static struct pbx_trie *pbx_context_trie(struct ast_context *con)
+{
+	ast_mutex_lock(&con->lock);
+	if (con->triedirty || !con->trie) {
+		pbx_trie_free(con->trie);
+		con->trie = pbx_trie_build(con);
+		if (con->trie)
+			con->triedirty = 0;
+	}
+	ast_mutex_unlock(&con->lock);
+	return con->trie;
+}
+
+static int pbx_trie_addlist(struct pbx_trie_entry *ent, struct pbx_trie_entry **cands, int *ncands)
+{
+	for (; ent; ent = ent->next) {
+		if (*ncands >= PBX_TRIE_MAXCANDIDATES)
+			return -1;
+		cands[(*ncands)++] = ent;
+	}
+	return 0;
+}
+
+static int pbx_trie_addtree(struct pbx_trie_node *node, struct pbx_trie_entry **cands, int *ncands)
+{
+	struct pbx_trie_node *child;
+
+	if (*ncands + node->count > PBX_TRIE_MAXCANDIDATES)
+		return -1;
+	pbx_trie_addlist(node->ends, cands, ncands);
+	pbx_trie_addlist(node->dots, cands, ncands);
+	pbx_trie_addlist(node->bangs, cands, ncands);
+	for (child = node->children; child; child = child->sibling)
+		pbx_trie_addtree(child, cands, ncands);
+	return 0;
+}
+
+static int pbx_trie_entry_cmp(const void *a, const void *b)
+{
+	return (*(struct pbx_trie_entry **)a)->order - (*(struct pbx_trie_entry **)b)->order;
+}
+
+/*! \brief pbx_trie_candidates: Find the extensions of a context that might
+   satisfy a helper action on exten, in dialplan order.
+   Returns the number found, or -1 if the whole list must be walked instead */
+static int pbx_trie_candidates(struct ast_context *con, const char *exten, int action, struct ast_exten **found)
+{
+	struct pbx_trie *trie;
+	struct pbx_trie_entry *cands[PBX_TRIE_MAXCANDIDATES];
+	struct pbx_trie_node *active[PBX_TRIE_MAXACTIVE], *next[PBX_TRIE_MAXACTIVE];
+	struct pbx_trie_node *node, *child;
+	const char *p;
+	int nactive, nnext, ncands = 0;
+	int wantclose = (action == HELPER_CANMATCH) || (action == HELPER_MATCHMORE);
+	int x;
+
+	/* Leave the odd cases (anything close matches an empty string, dashes
+	   are skipped in the middle of a number, and so on) to the full walk */
+	if (ast_strlen_zero(exten) || (exten[0] == '_'))
+		return -1;
+	for (p = exten; *p; p++) {
+		if ((*p == '-') || ((unsigned char)*p >= 128))
+			return -1;
+	}
+	if (!(trie = pbx_context_trie(con)))
+		return -1;
+
+	/* Literal extensions */
+	for (node = &trie->literals, p = exten; node && *p; p++) {
+		for (child = node->children; child && (child->c != tolower(*p)); child = child->sibling)
+			;
+		node = child;
+	}
+	if (node) {
+		if (wantclose) {
+			if (pbx_trie_addtree(node, cands, &ncands))
+				return -1;
+		} else if (pbx_trie_addlist(node->ends, cands, &ncands))
+			return -1;
+	}
+
+	/* Patterns */
+	active[0] = &trie->patterns;
+	nactive = 1;
+	for (p = exten; nactive && *p; p++) {
+		nnext = 0;
+		for (x = 0; x < nactive; x++) {
+			node = active[x];
+			/* '.' and '!' match whatever is left */
+			if (pbx_trie_addlist(node->dots, cands, &ncands) || pbx_trie_addlist(node->bangs, cands, &ncands))
+				return -1;
+			/* ast_extension_close() without needmore accepts a pattern
+			   that runs out before the number does */
+			if ((action == HELPER_CANMATCH) && pbx_trie_addlist(node->ends, cands, &ncands))
+				return -1;
+			for (child = node->children; child; child = child->sibling) {
+				if (child->set ? (child->set[*p >> 3] & (1 << (*p & 7))) : (child->c == *p)) {
+					if (nnext >= PBX_TRIE_MAXACTIVE)
+						return -1;
+					next[nnext++] = child;
+				}
+			}
+		}
+		memcpy(active, next, nnext * sizeof(active[0]));
+		nactive = nnext;
+	}
+	for (x = 0; x < nactive; x++) {
+		node = active[x];
+		if (wantclose) {
+			if (pbx_trie_addtree(node, cands, &ncands))
+				return -1;
+		} else if (pbx_trie_addlist(node->ends, cands, &ncands) || pbx_trie_addlist(node->bangs, cands, &ncands))
+			return -1;
+	}
+
+	if (pbx_trie_addlist(trie->odd, cands, &ncands))
+		return -1;
+	qsort(cands, ncands, sizeof(cands[0]), pbx_trie_entry_cmp);
+	for (x = 0; x < ncands; x++)
+		found[x] = cands[x]->exten;
+	return ncands;
+}
+
+/*! \brief context_hash: Bucket for a context name, ignoring case */
+static unsigned int context_hash(const char *name)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = hash * 33 + tolower(*name++);
+	return hash % CONTEXT_BUCKETS;
+}
+
+/*! \brief context_link: Add a context to the name index.  Call with conlock held */
+static void context_link(struct ast_context *con)
+{
+	unsigned int bucket = context_hash(con->name);
+
+	con->hashnext = contexthash[bucket];
+	contexthash[bucket] = con;
+}
+
+/*! \brief context_unlink: Remove a context from the name index.  Call with conlock held */
+static void context_unlink(struct ast_context *con)
+{
+	struct ast_context **prev;
+
+	for (prev = &contexthash[context_hash(con->name)]; *prev; prev = &(*prev)->hashnext) {
+		if (*prev == con) {
+			*prev = con->hashnext;
+			con->hashnext = NULL;
+			break;
+		}
+	}
+}
+
+/*! \brief find_context: Look up a registered context by name, matching case
+   unless nocase is set.  Call with conlock held */
+static struct ast_context *find_context(const char *name, int nocase)
+{
+	struct ast_context *tmp;
+
+	for (tmp = contexthash[context_hash(name)]; tmp; tmp = tmp->hashnext) {
+		if (nocase ? !strcasecmp(name, tmp->name) : !strcmp(name, tmp->name))
+			break;
+	}
+	return tmp;
+}
+
 struct ast_context *ast_context_find(const char *name)
 {
 	struct ast_context *tmp;
 	ast_mutex_lock(&conlock);
-	if (name) {
-		tmp = contexts;
-		while(tmp) {
-			if (!strcasecmp(name, tmp->name))
-				break;
-			tmp = tmp->next;
-		}
-	} else
+	if (name)
+		tmp = find_context(name, 1);
+	else
 		tmp = contexts;
 	ast_mutex_unlock(&conlock);
 	return tmp;
@@ -800,9 +1237,11 @@ static struct ast_exten *pbx_find_extension(struct ast_channel *chan, struct ast
 	int x, res;
 	struct ast_context *tmp;
 	struct ast_exten *e, *eroot;
+	struct ast_exten *cands[PBX_TRIE_MAXCANDIDATES];
 	struct ast_include *i;
 	struct ast_sw *sw;
 	struct ast_switch *asw;
+	int ncands;
 
 	/* Initialize status if appropriate */
 	if (!*stacklen) {
@@ -823,99 +1262,99 @@ static struct ast_exten *pbx_find_extension(struct ast_channel *chan, struct ast
 	if (bypass)
 		tmp = bypass;
 	else
-		tmp = contexts;
-	while(tmp) {
-		/* Match context */
-		if (bypass || !strcmp(tmp->name, context)) {
-			struct ast_exten *earlymatch = NULL;
-
-			if (*status < STATUS_NO_EXTENSION)
-				*status = STATUS_NO_EXTENSION;
-			for (eroot = tmp->root; eroot; eroot=eroot->next) {
-				int match = 0;
-				/* Match extension */
-				if ((((action != HELPER_MATCHMORE) && ast_extension_match(eroot->exten, exten)) ||
-				     ((action == HELPER_CANMATCH) && (ast_extension_close(eroot->exten, exten, 0))) ||
-				     ((action == HELPER_MATCHMORE) && (match = ast_extension_close(eroot->exten, exten, 1)))) &&
-				    (!eroot->matchcid || matchcid(eroot->cidmatch, callerid))) {
-
-					if (action == HELPER_MATCHMORE && match == 2 && !earlymatch) {
-						/* It matched an extension ending in a '!' wildcard
-						   So ignore it for now, unless there's a better match */
-						earlymatch = eroot;
-					} else {
-						e = eroot;
-						if (*status < STATUS_NO_PRIORITY)
-							*status = STATUS_NO_PRIORITY;
-						while(e) {
-							/* Match priority */
-							if (action == HELPER_FINDLABEL) {
-								if (*status < STATUS_NO_LABEL)
-									*status = STATUS_NO_LABEL;
-							 	if (label && e->label && !strcmp(label, e->label)) {
-									*status = STATUS_SUCCESS;
-									*foundcontext = context;
-									return e;
-								}
-							} else if (e->priority == priority) {
+		tmp = find_context(context, 0);
+	/* Match context */
+	if (tmp) {
+		struct ast_exten *earlymatch = NULL;
+
+		if (*status < STATUS_NO_EXTENSION)
+			*status = STATUS_NO_EXTENSION;
+		/* Only try what the index says might match, or everything */
+		ncands = pbx_trie_candidates(tmp, exten, action, cands);
+		x = 0;
+		for (eroot = (ncands < 0) ? tmp->root : (ncands ? cands[0] : NULL); eroot;
+		     eroot = (ncands < 0) ? eroot->next : ((++x < ncands) ? cands[x] : NULL)) {
+			int match = 0;
+			/* Match extension */
+			if ((((action != HELPER_MATCHMORE) && ast_extension_match(eroot->exten, exten)) ||
+			     ((action == HELPER_CANMATCH) && (ast_extension_close(eroot->exten, exten, 0))) ||
+			     ((action == HELPER_MATCHMORE) && (match = ast_extension_close(eroot->exten, exten, 1)))) &&
+			    (!eroot->matchcid || matchcid(eroot->cidmatch, callerid))) {
+
+				if (action == HELPER_MATCHMORE && match == 2 && !earlymatch) {
+					/* It matched an extension ending in a '!' wildcard
+					   So ignore it for now, unless there's a better match */
+					earlymatch = eroot;
+				} else {
+					e = eroot;
+					if (*status < STATUS_NO_PRIORITY)
+						*status = STATUS_NO_PRIORITY;
+					while(e) {
+						/* Match priority */
+						if (action == HELPER_FINDLABEL) {
+							if (*status < STATUS_NO_LABEL)
+								*status = STATUS_NO_LABEL;
+						 	if (label && e->label && !strcmp(label, e->label)) {
 								*status = STATUS_SUCCESS;
 								*foundcontext = context;
 								return e;
 							}
-							e = e->peer;
+						} else if (e->priority == priority) {
+							*status = STATUS_SUCCESS;
+							*foundcontext = context;
+							return e;
 						}
+						e = e->peer;
 					}
 				}
 			}
-			if (earlymatch) {
-				/* Bizarre logic for HELPER_MATCHMORE. We return zero to break out 
-				   of the loop waiting for more digits, and _then_ match (normally)
-				   the extension we ended up with. We got an early-matching wildcard
-				   pattern, so return NULL to break out of the loop. */
-				return NULL;
-			}
-			/* Check alternative switches */
-			sw = tmp->alts;
-			while(sw) {
-				if ((asw = pbx_findswitch(sw->name))) {
-					/* Substitute variables now */
-					if (sw->eval) 
-						pbx_substitute_variables_helper(chan, sw->data, sw->tmpdata, SWITCH_DATA_LENGTH - 1);
-					if (action == HELPER_CANMATCH)
-						res = asw->canmatch ? asw->canmatch(chan, context, exten, priority, callerid, sw->eval ? sw->tmpdata : sw->data) : 0;
-					else if (action == HELPER_MATCHMORE)
-						res = asw->matchmore ? asw->matchmore(chan, context, exten, priority, callerid, sw->eval ? sw->tmpdata : sw->data) : 0;
-					else
-						res = asw->exists ? asw->exists(chan, context, exten, priority, callerid, sw->eval ? sw->tmpdata : sw->data) : 0;
-					if (res) {
-						/* Got a match */
-						*swo = asw;
-						*data = sw->eval ? sw->tmpdata : sw->data;
-						*foundcontext = context;
-						return NULL;
-					}
-				} else {
-					ast_log(LOG_WARNING, "No such switch '%s'\n", sw->name);
+		}
+		if (earlymatch) {
+			/* Bizarre logic for HELPER_MATCHMORE. We return zero to break out 
+			   of the loop waiting for more digits, and _then_ match (normally)
+			   the extension we ended up with. We got an early-matching wildcard
+			   pattern, so return NULL to break out of the loop. */
+			return NULL;
+		}
+		/* Check alternative switches */
+		sw = tmp->alts;
+		while(sw) {
+			if ((asw = pbx_findswitch(sw->name))) {
+				/* Substitute variables now */
+				if (sw->eval) 
+					pbx_substitute_variables_helper(chan, sw->data, sw->tmpdata, SWITCH_DATA_LENGTH - 1);
+				if (action == HELPER_CANMATCH)
+					res = asw->canmatch ? asw->canmatch(chan, context, exten, priority, callerid, sw->eval ? sw->tmpdata : sw->data) : 0;
+				else if (action == HELPER_MATCHMORE)
+					res = asw->matchmore ? asw->matchmore(chan, context, exten, priority, callerid, sw->eval ? sw->tmpdata : sw->data) : 0;
+				else
+					res = asw->exists ? asw->exists(chan, context, exten, priority, callerid, sw->eval ? sw->tmpdata : sw->data) : 0;
+				if (res) {
+					/* Got a match */
+					*swo = asw;
+					*data = sw->eval ? sw->tmpdata : sw->data;
+					*foundcontext = context;
+					return NULL;
 				}
-				sw = sw->next;
+			} else {
+				ast_log(LOG_WARNING, "No such switch '%s'\n", sw->name);
 			}
-			/* Setup the stack */
-			incstack[*stacklen] = tmp->name;
-			(*stacklen)++;
-			/* Now try any includes we have in this context */
-			i = tmp->includes;
-			while(i) {
-				if (include_valid(i)) {
-					if ((e = pbx_find_extension(chan, bypass, i->rname, exten, priority, label, callerid, action, incstack, stacklen, status, swo, data, foundcontext))) 
-						return e;
-					if (*swo) 
-						return NULL;
-				}
-				i = i->next;
+			sw = sw->next;
+		}
+		/* Setup the stack */
+		incstack[*stacklen] = tmp->name;
+		(*stacklen)++;
+		/* Now try any includes we have in this context */
+		i = tmp->includes;
+		while(i) {
+			if (include_valid(i)) {
+				if ((e = pbx_find_extension(chan, bypass, i->rname, exten, priority, label, callerid, action, incstack, stacklen, status, swo, data, foundcontext))) 
+					return e;
+				if (*swo) 
+					return NULL;
 			}
-			break;
+			i = i->next;
 		}
-		tmp = tmp->next;
 	}
 	return NULL;
 }
@@ -1903,43 +2342,97 @@ int ast_extension_state(struct ast_channel *c, char *context, char *exten)
 	return ast_extension_state2(e);    		/* Check all devices in the hint */
 }
 
-void ast_hint_state_changed(const char *device)
+/*! \brief File the devices of a hint in hint_devices
+ * \note Don't call without hintlock
+ */
+static void hint_devices_add(struct ast_hint *hint)
 {
-	struct ast_hint *hint;
-	struct ast_state_cb *cblist;
 	char buf[AST_MAX_EXTENSION];
 	char *parse;
 	char *cur;
+	unsigned int hash;
+	struct hint_device *hd;
+
+	ast_copy_string(buf, ast_get_extension_app(hint->exten), sizeof(buf));
+	parse = buf;
+	for (cur = strsep(&parse, "&"); cur; cur = strsep(&parse, "&")) {
+		if (ast_strlen_zero(cur))
+			continue;
+		/* A hint is only told once about a change, however many times it
+		   lists the device */
+		for (hd = hint->devices; hd; hd = hd->hintnext) {
+			if (!strcasecmp(hd->name, cur))
+				break;
+		}
+		if (hd)
+			continue;
+		hd = malloc(sizeof(*hd) + strlen(cur));
+		if (!hd) {
+			ast_log(LOG_WARNING, "Out of memory, state changes of %s will not update hint %s\n", cur, ast_get_extension_name(hint->exten));
+			continue;
+		}
+		hash = ast_strhash(cur);
+		hd->hint = hint;
+		hd->hash = hash;
+		strcpy(hd->name, cur);
+		hd->next = hint_devices[hash % HINT_DEVICE_BUCKETS];
+		hint_devices[hash % HINT_DEVICE_BUCKETS] = hd;
+		hd->hintnext = hint->devices;
+		hint->devices = hd;
+	}
+}
+
+/*! \brief Take the devices of a hint out of hint_devices
+ * \note Don't call without hintlock
+ */
+static void hint_devices_remove(struct ast_hint *hint)
+{
+	struct hint_device *hd, **prev;
+
+	while ((hd = hint->devices)) {
+		hint->devices = hd->hintnext;
+		for (prev = &hint_devices[hd->hash % HINT_DEVICE_BUCKETS]; *prev; prev = &(*prev)->next) {
+			if (*prev == hd) {
+				*prev = hd->next;
+				break;
+			}
+		}
+		free(hd);
+	}
+}
+
+void ast_hint_state_changed(const char *device)
+{
+	struct ast_hint *hint;
+	struct ast_state_cb *cblist;
+	struct hint_device *hd;
+	unsigned int hash = ast_strhash(device);
 	int state;
 
 	ast_mutex_lock(&hintlock);
 
-	for (hint = hints; hint; hint = hint->next) {
-		ast_copy_string(buf, ast_get_extension_app(hint->exten), sizeof(buf));
-		parse = buf;
-		for (cur = strsep(&parse, "&"); cur; cur = strsep(&parse, "&")) {
-			if (strcasecmp(cur, device))
-				continue;
+	for (hd = hint_devices[hash % HINT_DEVICE_BUCKETS]; hd; hd = hd->next) {
+		if ((hd->hash != hash) || strcasecmp(hd->name, device))
+			continue;
+		hint = hd->hint;
 
-			/* Get device state for this hint */
-			state = ast_extension_state2(hint->exten);
-			
-			if ((state == -1) || (state == hint->laststate))
-				continue;
+		/* Get device state for this hint */
+		state = ast_extension_state2(hint->exten);
+		
+		if ((state == -1) || (state == hint->laststate))
+			continue;
 
-			/* Device state changed since last check - notify the watchers */
-			
-			/* For general callbacks */
-			for (cblist = statecbs; cblist; cblist = cblist->next)
-				cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
-			
-			/* For extension callbacks */
-			for (cblist = hint->callbacks; cblist; cblist = cblist->next)
-				cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
-			
-			hint->laststate = state;
-			break;
-		}
+		/* Device state changed since last check - notify the watchers */
+		
+		/* For general callbacks */
+		for (cblist = statecbs; cblist; cblist = cblist->next)
+			cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
+		
+		/* For extension callbacks */
+		for (cblist = hint->callbacks; cblist; cblist = cblist->next)
+			cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
+		
+		hint->laststate = state;
 	}
 
 	ast_mutex_unlock(&hintlock);
@@ -2127,6 +2620,7 @@ static int ast_add_hint(struct ast_exten *e)
 	memset(list, 0, sizeof(struct ast_hint));
 	list->exten = e;
 	list->laststate = ast_extension_state2(e);
+	hint_devices_add(list);
 	list->next = hints;
 	hints = list;
 
@@ -2144,7 +2638,10 @@ static int ast_change_hint(struct ast_exten *oe, struct ast_exten *ne)
 
 	while(list) {
 		if (list->exten == oe) {
+			/* The new extension may well list other devices */
+			hint_devices_remove(list);
 	    		list->exten = ne;
+			hint_devices_add(list);
 			ast_mutex_unlock(&hintlock);	
 			return 0;
 		}
@@ -2180,6 +2677,7 @@ static int ast_remove_hint(struct ast_exten *e)
 				free(cbprev);
 	    		}
 	    		list->callbacks = NULL;
+			hint_devices_remove(list);
 
 	    		if (!prev)
 				hints = list->next;
@@ -2522,6 +3020,68 @@ static void decrease_call_count(void)
 	ast_mutex_unlock(&maxcalllock);
 }
 
+/*! \brief A channel waiting for a PBX thread */
+struct pbx_work {
+	struct ast_channel *chan;
+	struct timeval queued;		/*!< When ast_pbx_start() was called */
+	struct pbx_work *next;
+};
+
+/*! How long (seconds) a pooled PBX thread beyond pbxidlethreads waits for work before exiting */
+#define PBX_POOL_IDLE_TIMEOUT	30
+
+AST_MUTEX_DEFINE_STATIC(pbxpoollock);
+static ast_cond_t pbxpoolcond;
+static struct pbx_work *pbxq_head = NULL;
+static struct pbx_work *pbxq_tail = NULL;
+
+/* Everything below is protected by pbxpoollock */
+static int pbxq_len = 0;			/*!< Calls waiting for a pooled thread */
+static int pbxq_peak = 0;
+static int pbx_threads = 0;			/*!< Live PBX threads, either model */
+static int pbx_threads_peak = 0;
+static int pbx_threads_idle = 0;		/*!< Pooled threads waiting for work */
+static unsigned int pbx_threads_created = 0;
+static unsigned int pbx_threads_failed = 0;
+static unsigned int pbx_dispatched = 0;		/*!< Calls which have reached a PBX thread */
+static unsigned long long pbx_wait_total = 0;	/*!< usecs between ast_pbx_start() and the thread picking the call up */
+static unsigned int pbx_wait_max = 0;
+
+/*! \brief pbx_dispatch_stats: Account for a call reaching its PBX thread.
+   Call with pbxpoollock held */
+static void pbx_dispatch_stats(struct pbx_work *w)
+{
+	struct timeval now = ast_tvnow();
+	long long waited;
+
+	waited = (now.tv_sec - w->queued.tv_sec) * 1000000LL + (now.tv_usec - w->queued.tv_usec);
+	if (waited < 0)
+		waited = 0;
+	pbx_dispatched++;
+	pbx_wait_total += waited;
+	if (waited > pbx_wait_max)
+		pbx_wait_max = waited;
+}
+
+/*! \brief pbx_thread_reserve: Count a PBX thread we are about to create.
+   Call with pbxpoollock held */
+static void pbx_thread_reserve(void)
+{
+	pbx_threads++;
+	pbx_threads_created++;
+	if (pbx_threads > pbx_threads_peak)
+		pbx_threads_peak = pbx_threads;
+}
+
+/*! \brief pbx_thread_failed: Undo pbx_thread_reserve() when creating the
+   thread did not work out.  Call with pbxpoollock held */
+static void pbx_thread_failed(void)
+{
+	pbx_threads--;
+	pbx_threads_created--;
+	pbx_threads_failed++;
+}
+
 static void *pbx_thread(void *data)
 {
 	/* Oh joyeous kernel, we're a new thread, with nothing to do but
@@ -2532,20 +3092,150 @@ static void *pbx_thread(void *data)
 	   before invoking the function; it will be decremented when the
 	   PBX has finished running on the channel
 	 */
-	struct ast_channel *c = data;
+	struct pbx_work *w = data;
+	struct ast_channel *c = w->chan;
+
+	ast_mutex_lock(&pbxpoollock);
+	pbx_dispatch_stats(w);
+	ast_mutex_unlock(&pbxpoollock);
+	free(w);
 
 	__ast_pbx_run(c);
 	decrease_call_count();
 
+	ast_mutex_lock(&pbxpoollock);
+	pbx_threads--;
+	ast_mutex_unlock(&pbxpoollock);
+
 	pthread_exit(NULL);
 
 	return NULL;
 }
 
+/*! \brief pbx_pool_thread: A reusable PBX thread, running calls from the
+   queue until it has been idle for a while */
+static void *pbx_pool_thread(void *data)
+{
+	struct pbx_work *w;
+	struct timeval tv;
+	struct timespec ts;
+	int res;
+
+	ast_mutex_lock(&pbxpoollock);
+	for (;;) {
+		if (!(w = pbxq_head)) {
+			tv = ast_tvadd(ast_tvnow(), ast_samp2tv(PBX_POOL_IDLE_TIMEOUT, 1));
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			pbx_threads_idle++;
+			res = ast_cond_timedwait(&pbxpoolcond, &pbxpoollock, &ts);
+			pbx_threads_idle--;
+			/* Only trim the pool back down to pbxidlethreads */
+			if ((res == ETIMEDOUT) && !pbxq_head && (pbx_threads_idle >= option_pbxidlethreads))
+				break;
+			continue;
+		}
+		pbxq_head = w->next;
+		if (!pbxq_head)
+			pbxq_tail = NULL;
+		pbxq_len--;
+		pbx_dispatch_stats(w);
+		ast_mutex_unlock(&pbxpoollock);
+
+		__ast_pbx_run(w->chan);
+		decrease_call_count();
+		free(w);
+
+		ast_mutex_lock(&pbxpoollock);
+	}
+	pbx_threads--;
+	ast_mutex_unlock(&pbxpoollock);
+
+	return NULL;
+}
+
+/*! \brief pbx_pool_spawn: Start one more pooled PBX thread, already
+   counted with pbx_thread_reserve() */
+static int pbx_pool_spawn(void)
+{
+	pthread_t t;
+	pthread_attr_t attr;
+	int res;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	res = ast_pthread_create(&t, &attr, pbx_pool_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (res) {
+		ast_log(LOG_WARNING, "Failed to create new PBX thread: %s\n", strerror(res));
+		ast_mutex_lock(&pbxpoollock);
+		pbx_thread_failed();
+		ast_mutex_unlock(&pbxpoollock);
+		return -1;
+	}
+	return 0;
+}
+
+/*! \brief pbx_pool_dispatch: Queue a call for the PBX thread pool, growing
+   the pool up to 'pbxthreads' if nobody is free to take it */
+static enum ast_pbx_result pbx_pool_dispatch(struct pbx_work *w)
+{
+	struct pbx_work *cur, *prev = NULL;
+	int spawn = 0;
+
+	ast_mutex_lock(&pbxpoollock);
+	if (pbxq_tail)
+		pbxq_tail->next = w;
+	else
+		pbxq_head = w;
+	pbxq_tail = w;
+	pbxq_len++;
+	if (pbxq_len > pbxq_peak)
+		pbxq_peak = pbxq_len;
+	if (pbxq_len <= pbx_threads_idle)
+		ast_cond_signal(&pbxpoolcond);
+	else if (pbx_threads < option_pbxthreads) {
+		pbx_thread_reserve();
+		spawn = 1;
+	}
+	else if (option_verbose > 2 && pbxq_len == 1)
+		ast_verbose(VERBOSE_PREFIX_3 "All %d PBX threads busy, queueing '%s'\n", pbx_threads, w->chan->name);
+	ast_mutex_unlock(&pbxpoollock);
+
+	if (!spawn || !pbx_pool_spawn())
+		return AST_PBX_SUCCESS;
+
+	/* Leave the call queued if some other thread will eventually get to it */
+	ast_mutex_lock(&pbxpoollock);
+	if (pbx_threads) {
+		ast_mutex_unlock(&pbxpoollock);
+		return AST_PBX_SUCCESS;
+	}
+	for (cur = pbxq_head; cur && cur != w; prev = cur, cur = cur->next);
+	if (cur) {
+		if (prev)
+			prev->next = cur->next;
+		else
+			pbxq_head = cur->next;
+		if (pbxq_tail == cur)
+			pbxq_tail = prev;
+		pbxq_len--;
+	}
+	ast_mutex_unlock(&pbxpoollock);
+	if (!cur) {
+		/* A thread got to it while we weren't looking */
+		return AST_PBX_SUCCESS;
+	}
+	free(w);
+	decrease_call_count();
+	return AST_PBX_FAILED;
+}
+
 enum ast_pbx_result ast_pbx_start(struct ast_channel *c)
 {
 	pthread_t t;
 	pthread_attr_t attr;
+	struct pbx_work *w;
 
 	if (!c) {
 		ast_log(LOG_WARNING, "Asked to start thread on NULL channel?\n");
@@ -2555,12 +3245,31 @@ enum ast_pbx_result ast_pbx_start(struct ast_channel *c)
 	if (increase_call_count(c))
 		return AST_PBX_CALL_LIMIT;
 
+	if (!(w = calloc(1, sizeof(*w)))) {
+		ast_log(LOG_WARNING, "Out of memory\n");
+		decrease_call_count();
+		return AST_PBX_FAILED;
+	}
+	w->chan = c;
+	w->queued = ast_tvnow();
+
+	if (option_pbxthreads)
+		return pbx_pool_dispatch(w);
+
 	/* Start a new thread, and get something handling this channel. */
+	ast_mutex_lock(&pbxpoollock);
+	pbx_thread_reserve();
+	ast_mutex_unlock(&pbxpoollock);
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	if (ast_pthread_create(&t, &attr, pbx_thread, c)) {
+	if (ast_pthread_create(&t, &attr, pbx_thread, w)) {
 		ast_log(LOG_WARNING, "Failed to create new channel thread\n");
 		pthread_attr_destroy(&attr);
+		ast_mutex_lock(&pbxpoollock);
+		pbx_thread_failed();
+		ast_mutex_unlock(&pbxpoollock);
+		free(w);
+		decrease_call_count();
 		return AST_PBX_FAILED;
 	}
 	pthread_attr_destroy(&attr);
@@ -2606,21 +3315,17 @@ int ast_context_remove_include(const char *context, const char *include, const c
 
 	if (ast_lock_contexts()) return -1;
 
-	/* walk contexts and search for the right one ...*/
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		/* we found one ... */
-		if (!strcmp(ast_get_context_name(c), context)) {
-			int ret;
-			/* remove include from this context ... */	
-			ret = ast_context_remove_include2(c, include, registrar);
+	/* find the right context ... */
+	c = find_context(context, 0);
+	if (c) {
+		int ret;
+		/* remove include from this context ... */	
+		ret = ast_context_remove_include2(c, include, registrar);
 
-			ast_unlock_contexts();
+		ast_unlock_contexts();
 
-			/* ... return results */
-			return ret;
-		}
-		c = ast_walk_contexts(c);
+		/* ... return results */
+		return ret;
 	}
 
 	/* we can't find the right one context */
@@ -2678,21 +3383,17 @@ int ast_context_remove_switch(const char *context, const char *sw, const char *d
 
 	if (ast_lock_contexts()) return -1;
 
-	/* walk contexts and search for the right one ...*/
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		/* we found one ... */
-		if (!strcmp(ast_get_context_name(c), context)) {
-			int ret;
-			/* remove switch from this context ... */	
-			ret = ast_context_remove_switch2(c, sw, data, registrar);
+	/* find the right context ... */
+	c = find_context(context, 0);
+	if (c) {
+		int ret;
+		/* remove switch from this context ... */	
+		ret = ast_context_remove_switch2(c, sw, data, registrar);
 
-			ast_unlock_contexts();
+		ast_unlock_contexts();
 
-			/* ... return results */
-			return ret;
-		}
-		c = ast_walk_contexts(c);
+		/* ... return results */
+		return ret;
 	}
 
 	/* we can't find the right one context */
@@ -2750,19 +3451,15 @@ int ast_context_remove_extension(const char *context, const char *extension, int
 
 	if (ast_lock_contexts()) return -1;
 
-	/* walk contexts ... */
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		/* ... search for the right one ... */
-		if (!strcmp(ast_get_context_name(c), context)) {
-			/* ... remove extension ... */
-			int ret = ast_context_remove_extension2(c, extension, priority,
-				registrar);
-			/* ... unlock contexts list and return */
-			ast_unlock_contexts();
-			return ret;
-		}
-		c = ast_walk_contexts(c);
+	/* find the right context ... */
+	c = find_context(context, 0);
+	if (c) {
+		/* ... remove extension ... */
+		int ret = ast_context_remove_extension2(c, extension, priority,
+			registrar);
+		/* ... unlock contexts list and return */
+		ast_unlock_contexts();
+		return ret;
 	}
 
 	/* we can't find the right context */
@@ -2785,6 +3482,7 @@ int ast_context_remove_extension2(struct ast_context *con, const char *extension
 	struct ast_exten *exten, *prev_exten = NULL;
 
 	if (ast_mutex_lock(&con->lock)) return -1;
+	con->triedirty = 1;
 
 	/* go through all extensions in context and search the right one ... */
 	exten = con->root;
@@ -3023,6 +3721,11 @@ static char show_hints_help[] =
 "Usage: show hints\n"
 "       Show registered hints\n";
 
+static char show_pbx_threads_help[] =
+"Usage: show pbx threads\n"
+"       Show how calls are being handed to PBX threads, and how long\n"
+"       they waited to get one\n";
+
 
 /*
  * IMPLEMENTATION OF CLI FUNCTIONS IS IN THE SAME ORDER AS COMMANDS HELPS
@@ -3205,6 +3908,29 @@ static int handle_show_switches(int fd, int argc, char *argv[])
 	return RESULT_SUCCESS;
 }
 
+/*
+ * 'show pbx threads' CLI command implementation function ...
+ */
+static int handle_show_pbx_threads(int fd, int argc, char *argv[])
+{
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	ast_mutex_lock(&pbxpoollock);
+	if (option_pbxthreads)
+		ast_cli(fd, "Model: pool of up to %d threads, keeping %d idle\n", option_pbxthreads, option_pbxidlethreads);
+	else
+		ast_cli(fd, "Model: one thread per call\n");
+	ast_cli(fd, "Thread stack size: %d KB\n", (int)(ast_thread_stacksize() / 1024));
+	ast_cli(fd, "Live threads: %d (peak %d), idle: %d\n", pbx_threads, pbx_threads_peak, pbx_threads_idle);
+	ast_cli(fd, "Threads created: %u, failed: %u\n", pbx_threads_created, pbx_threads_failed);
+	ast_cli(fd, "Queued calls: %d (peak %d)\n", pbxq_len, pbxq_peak);
+	ast_cli(fd, "Calls dispatched: %u, wait avg %.3f ms, max %.3f ms\n", pbx_dispatched,
+		pbx_dispatched ? (double)pbx_wait_total / pbx_dispatched / 1000.0 : 0.0, pbx_wait_max / 1000.0);
+	ast_mutex_unlock(&pbxpoollock);
+	return RESULT_SUCCESS;
+}
+
 /*
  * 'show applications' CLI command implementation functions ...
  */
@@ -3630,6 +4356,8 @@ static struct ast_cli_entry pbx_cli[] = {
 	  "Show alternative switches", show_switches_help },
 	{ { "show", "hints", NULL }, handle_show_hints,
 	  "Show dialplan hints", show_hints_help },
+	{ { "show", "pbx", "threads", NULL }, handle_show_pbx_threads,
+	  "Show PBX thread usage", show_pbx_threads_help },
 };
 
 int ast_unregister_application(const char *app) 
@@ -3671,15 +4399,19 @@ struct ast_context *ast_context_create(struct ast_context **extcontexts, const c
 	} else
 		local_contexts = extcontexts;
 
-	tmp = *local_contexts;
-	while(tmp) {
-		if (!strcasecmp(tmp->name, name)) {
-			ast_log(LOG_WARNING, "Tried to register context '%s', already in use\n", name);
-			if (!extcontexts)
-				ast_mutex_unlock(&conlock);
-			return NULL;
+	if (!extcontexts)
+		tmp = find_context(name, 1);
+	else {
+		for (tmp = *local_contexts; tmp; tmp = tmp->next) {
+			if (!strcasecmp(tmp->name, name))
+				break;
 		}
-		tmp = tmp->next;
+	}
+	if (tmp) {
+		ast_log(LOG_WARNING, "Tried to register context '%s', already in use\n", name);
+		if (!extcontexts)
+			ast_mutex_unlock(&conlock);
+		return NULL;
 	}
 	tmp = malloc(length);
 	if (tmp) {
@@ -3692,6 +4424,8 @@ struct ast_context *ast_context_create(struct ast_context **extcontexts, const c
 		tmp->includes = NULL;
 		tmp->ignorepats = NULL;
 		*local_contexts = tmp;
+		if (!extcontexts)
+			context_link(tmp);
 		if (option_debug)
 			ast_log(LOG_DEBUG, "Registered context '%s'\n", tmp->name);
 		if (option_verbose > 2)
@@ -3775,6 +4509,11 @@ void ast_merge_contexts_and_delete(struct ast_context **extcontexts, const char
 			tmp = tmp->next;
 		}
 	}
+	/* Index the new contexts, and compile them now rather than on their first call */
+	for (tmp = *extcontexts; tmp; tmp = tmp->next) {
+		context_link(tmp);
+		pbx_context_trie(tmp);
+	}
 	if (lasttmp) {
 		lasttmp->next = contexts;
 		contexts = *extcontexts;
@@ -3833,17 +4572,13 @@ int ast_context_add_include(const char *context, const char *include, const char
 		return -1;
 	}
 
-	/* walk contexts ... */
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		/* ... search for the right one ... */
-		if (!strcmp(ast_get_context_name(c), context)) {
-			int ret = ast_context_add_include2(c, include, registrar);
-			/* ... unlock contexts list and return */
-			ast_unlock_contexts();
-			return ret;
-		}
-		c = ast_walk_contexts(c);
+	/* find the right context ... */
+	c = find_context(context, 0);
+	if (c) {
+		int ret = ast_context_add_include2(c, include, registrar);
+		/* ... unlock contexts list and return */
+		ast_unlock_contexts();
+		return ret;
 	}
 
 	/* we can't find the right context */
@@ -4274,17 +5009,13 @@ int ast_context_add_switch(const char *context, const char *sw, const char *data
 		return -1;
 	}
 
-	/* walk contexts ... */
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		/* ... search for the right one ... */
-		if (!strcmp(ast_get_context_name(c), context)) {
-			int ret = ast_context_add_switch2(c, sw, data, eval, registrar);
-			/* ... unlock contexts list and return */
-			ast_unlock_contexts();
-			return ret;
-		}
-		c = ast_walk_contexts(c);
+	/* find the right context ... */
+	c = find_context(context, 0);
+	if (c) {
+		int ret = ast_context_add_switch2(c, sw, data, eval, registrar);
+		/* ... unlock contexts list and return */
+		ast_unlock_contexts();
+		return ret;
 	}
 
 	/* we can't find the right context */
@@ -4391,14 +5122,12 @@ int ast_context_remove_ignorepat(const char *context, const char *ignorepat, con
 		return -1;
 	}
 
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		if (!strcmp(ast_get_context_name(c), context)) {
-			int ret = ast_context_remove_ignorepat2(c, ignorepat, registrar);
-			ast_unlock_contexts();
-			return ret;
-		}
-		c = ast_walk_contexts(c);
+	/* find the right context ... */
+	c = find_context(context, 0);
+	if (c) {
+		int ret = ast_context_remove_ignorepat2(c, ignorepat, registrar);
+		ast_unlock_contexts();
+		return ret;
 	}
 
 	ast_unlock_contexts();
@@ -4450,14 +5179,12 @@ int ast_context_add_ignorepat(const char *con, const char *value, const char *re
 		return -1;
 	}
 
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		if (!strcmp(ast_get_context_name(c), con)) {
-			int ret = ast_context_add_ignorepat2(c, value, registrar);
-			ast_unlock_contexts();
-			return ret;
-		} 
-		c = ast_walk_contexts(c);
+	/* find the right context ... */
+	c = find_context(con, 0);
+	if (c) {
+		int ret = ast_context_add_ignorepat2(c, value, registrar);
+		ast_unlock_contexts();
+		return ret;
 	}
 
 	ast_unlock_contexts();
@@ -4534,15 +5261,13 @@ int ast_add_extension(const char *context, int replace, const char *extension, i
 		return -1;
 	}
 
-	c = ast_walk_contexts(NULL);
-	while (c) {
-		if (!strcmp(context, ast_get_context_name(c))) {
-			int ret = ast_add_extension2(c, replace, extension, priority, label, callerid,
-				application, data, datad, registrar);
-			ast_unlock_contexts();
-			return ret;
-		}
-		c = ast_walk_contexts(c);
+	/* find the right context ... */
+	c = find_context(context, 0);
+	if (c) {
+		int ret = ast_add_extension2(c, replace, extension, priority, label, callerid,
+			application, data, datad, registrar);
+		ast_unlock_contexts();
+		return ret;
 	}
 
 	ast_unlock_contexts();
@@ -4761,6 +5486,7 @@ int ast_add_extension2(struct ast_context *con,
 		errno = EBUSY;
 		return -1;
 	}
+	con->triedirty = 1;
 	e = con->root;
 	while(e) {
 		/* Make sure patterns are always last! */
@@ -5361,6 +6087,7 @@ void __ast_context_destroy(struct ast_context *con, const char *registrar)
 				tmpl->next = tmp->next;
 			else
 				contexts = tmp->next;
+			context_unlink(tmp);
 			/* Okay, now we're safe to let it go -- in a sense, we were
 			   ready to let it go as soon as we locked it. */
 			ast_mutex_unlock(&tmp->lock);
@@ -5393,6 +6120,7 @@ void __ast_context_destroy(struct ast_context *con, const char *registrar)
 				e = e->next;
 				destroy_exten(el);
 			}
+			pbx_trie_free(tmp->trie);
 			ast_mutex_destroy(&tmp->lock);
 			free(tmp);
 			if (!con) {
@@ -6275,6 +7003,21 @@ int load_pbx(void)
 	AST_LIST_HEAD_INIT_NOLOCK(&globals);
 	ast_cli_register_multiple(pbx_cli, sizeof(pbx_cli) / sizeof(pbx_cli[0]));
 
+	ast_cond_init(&pbxpoolcond, NULL);
+	if (option_pbxthreads) {
+		if (option_pbxidlethreads > option_pbxthreads)
+			option_pbxidlethreads = option_pbxthreads;
+		if (option_verbose)
+			ast_verbose( "Starting %d of at most %d PBX threads\n", option_pbxidlethreads, option_pbxthreads);
+		for (x = 0; x < option_pbxidlethreads; x++) {
+			ast_mutex_lock(&pbxpoollock);
+			pbx_thread_reserve();
+			ast_mutex_unlock(&pbxpoollock);
+			if (pbx_pool_spawn())
+				break;
+		}
+	}
+
 	/* Register builtin applications */
 	for (x=0; x<sizeof(builtins) / sizeof(struct pbx_builtin); x++) {
 		if (option_verbose)
@@ -4764,6 +4764,7 @@ int load_module(void)
 		ast_log(LOG_ERROR, "Out of memory\n");
 		return -1;
 	}
+	ast_sched_set_name(sched, "pbx_dundi");
 
 	set_config("dundi.conf",&sin);
 
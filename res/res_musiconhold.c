@@ -135,7 +135,12 @@ struct mohclass {
 	int pid;		/* PID of mpg123 */
 	time_t start;
 	pthread_t thread;
+	/* Protects members, encodings and their rings, so that listeners
+	   only wait on the thread of their own class */
+	ast_mutex_t lock;
 	struct mohdata *members;
+	/* Formats the listeners take the audio in */
+	struct moh_encoding *encodings;
 	/* Source of audio */
 	int srcfd;
 	/* FD for timing source */
@@ -143,9 +148,31 @@ struct mohclass {
 	struct mohclass *next;
 };
 
+/* Frames of the audio of a class, each MOH_FRAME_SAMPLES long */
+#define MOH_FRAME_SAMPLES	160
+/* How many frames a listener can be behind before it skips some */
+#define MOH_FRAMES		128
+
+/* The audio of a streamed class in one format, encoded once for all the
+   listeners taking that format */
+struct moh_encoding {
+	int format;
+	int users;
+	/* From the format of the class, NULL if this is that format */
+	struct ast_trans_pvt *trans;
+	/* Ring of the last MOH_FRAMES frames */
+	struct ast_frame *frames[MOH_FRAMES];
+	/* Frames put in the ring so far */
+	unsigned int seq;
+	struct moh_encoding *next;
+};
+
 struct mohdata {
-	int pipe[2];
 	int origwfmt;
+	struct moh_encoding *encoding;
+	/* Next frame of the encoding to send */
+	unsigned int seq;
+	int sample_queue;
 	struct mohclass *parent;
 	struct mohdata *next;
 };
@@ -159,9 +186,23 @@ AST_MUTEX_DEFINE_STATIC(moh_lock);
 #define MAX_MP3S 256
 
 
+static void moh_encoding_free(struct moh_encoding *enc)
+{
+	int x;
+
+	if (enc->trans)
+		ast_translator_free_path(enc->trans);
+	for (x = 0; x < MOH_FRAMES; x++) {
+		if (enc->frames[x])
+			ast_frfree(enc->frames[x]);
+	}
+	free(enc);
+}
+
 static void ast_moh_free_class(struct mohclass **class) 
 {
 	struct mohdata *members, *mtmp;
+	struct moh_encoding *enc;
 	
 	members = (*class)->members;
 	while(members) {
@@ -169,10 +210,17 @@ static void ast_moh_free_class(struct mohclass **class)
 		members = members->next;
 		free(mtmp);
 	}
+	while ((enc = (*class)->encodings)) {
+		(*class)->encodings = enc->next;
+		moh_encoding_free(enc);
+	}
 	if ((*class)->thread) {
 		pthread_cancel((*class)->thread);
+		/* It may be in the middle of a frame, with the class lock held */
+		pthread_join((*class)->thread, NULL);
 		(*class)->thread = 0;
 	}
+	ast_mutex_destroy(&(*class)->lock);
 	free(*class);
 	*class = NULL;
 }
@@ -495,12 +543,47 @@ static int spawn_mp3(struct mohclass *class)
 	return fds[0];
 }
 
+/*! \brief Put audio of the class in the ring of each format its listeners take.
+ * Call with the class lock held. */
+static void moh_encode(struct mohclass *class, char *data, int len, int samples)
+{
+	struct moh_encoding *enc;
+	struct ast_frame f, *out;
+	int pieces, x;
+
+	/* Cut into frames of MOH_FRAME_SAMPLES, so that listeners get the
+	   usual packet sizes */
+	pieces = samples / MOH_FRAME_SAMPLES;
+	if ((pieces < 1) || (len % pieces))
+		pieces = 1;
+	for (x = 0; x < pieces; x++) {
+		memset(&f, 0, sizeof(f));
+		f.frametype = AST_FRAME_VOICE;
+		f.subclass = class->format;
+		f.datalen = len / pieces;
+		f.data = data + x * f.datalen;
+		f.samples = ast_codec_get_samples(&f);
+		for (enc = class->encodings; enc; enc = enc->next) {
+			if (enc->trans) {
+				/* The translator may keep the audio until it has a whole frame */
+				if (!(out = ast_translate(enc->trans, &f, 0)))
+					continue;
+			} else
+				out = &f;
+			if (!(out = ast_frdup(out)))
+				continue;
+			if (enc->frames[enc->seq % MOH_FRAMES])
+				ast_frfree(enc->frames[enc->seq % MOH_FRAMES]);
+			enc->frames[enc->seq++ % MOH_FRAMES] = out;
+		}
+	}
+}
+
 static void *monmp3thread(void *data)
 {
 #define	MOH_MS_INTERVAL		100
 
 	struct mohclass *class = data;
-	struct mohdata *moh;
 	char buf[8192];
 	short sbuf[8192];
 	int res, res2;
@@ -579,16 +662,12 @@ static void *monmp3thread(void *data)
 			continue;
 		}
 		pthread_testcancel();
-		ast_mutex_lock(&moh_lock);
-		moh = class->members;
-		while (moh) {
-			/* Write data */
-			if ((res = write(moh->pipe[1], sbuf, res2)) != res2) 
-				if (option_debug)
-					ast_log(LOG_DEBUG, "Only wrote %d of %d bytes to pipe\n", res, res2);
-			moh = moh->next;
-		}
-		ast_mutex_unlock(&moh_lock);
+		/* Don't get cancelled holding the lock the listeners need */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		ast_mutex_lock(&class->lock);
+		moh_encode(class, (char *) sbuf, res2, res);
+		ast_mutex_unlock(&class->lock);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	}
 	return NULL;
 }
@@ -662,29 +741,79 @@ static struct mohclass *get_mohbyname(char *name, int warn)
 	return NULL;
 }
 
-static struct mohdata *mohalloc(struct mohclass *cl)
+/*! \brief The encoding of a class in format, made if it is the first
+ * listener taking that format.  Call with the class lock held. */
+static struct moh_encoding *moh_encoding_get(struct mohclass *cl, int format)
+{
+	struct moh_encoding *enc;
+
+	for (enc = cl->encodings; enc; enc = enc->next) {
+		if (enc->format == format)
+			break;
+	}
+	if (!enc) {
+		enc = malloc(sizeof(struct moh_encoding));
+		if (!enc)
+			return NULL;
+		memset(enc, 0, sizeof(struct moh_encoding));
+		enc->format = format;
+		if ((format != cl->format) && !(enc->trans = ast_translator_build_path(format, cl->format))) {
+			free(enc);
+			return NULL;
+		}
+		enc->next = cl->encodings;
+		cl->encodings = enc;
+		if (option_debug)
+			ast_log(LOG_DEBUG, "Music on hold class '%s' now also in format %s\n", cl->name, ast_getformatname(format));
+	}
+	enc->users++;
+	return enc;
+}
+
+/*! \brief A listener is done with an encoding, free it if it was the last.
+ * Call with the class lock held. */
+static void moh_encoding_put(struct mohclass *cl, struct moh_encoding *enc)
+{
+	struct moh_encoding *prev, *cur;
+
+	if (--enc->users)
+		return;
+	prev = NULL;
+	for (cur = cl->encodings; cur; prev = cur, cur = cur->next) {
+		if (cur == enc) {
+			if (prev)
+				prev->next = cur->next;
+			else
+				cl->encodings = cur->next;
+			break;
+		}
+	}
+	moh_encoding_free(enc);
+}
+
+static struct mohdata *mohalloc(struct mohclass *cl, int format)
 {
 	struct mohdata *moh;
-	long flags;
 	moh = malloc(sizeof(struct mohdata));
 	if (!moh)
 		return NULL;
 	memset(moh, 0, sizeof(struct mohdata));
-	if (pipe(moh->pipe)) {
-		ast_log(LOG_WARNING, "Failed to create pipe: %s\n", strerror(errno));
+	moh->parent = cl;
+	ast_mutex_lock(&cl->lock);
+	/* Without a translator to format, the channel translates the class format itself */
+	if (!(moh->encoding = moh_encoding_get(cl, format)) && (format != cl->format))
+		moh->encoding = moh_encoding_get(cl, cl->format);
+	if (!moh->encoding) {
+		ast_mutex_unlock(&cl->lock);
+		ast_log(LOG_WARNING, "Out of memory!\n");
 		free(moh);
 		return NULL;
 	}
-	/* Make entirely non-blocking */
-	flags = fcntl(moh->pipe[0], F_GETFL);
-	fcntl(moh->pipe[0], F_SETFL, flags | O_NONBLOCK);
-	flags = fcntl(moh->pipe[1], F_GETFL);
-	fcntl(moh->pipe[1], F_SETFL, flags | O_NONBLOCK);
-	moh->parent = cl;
-	ast_mutex_lock(&moh_lock);
+	/* Start at the audio the others are hearing now */
+	moh->seq = moh->encoding->seq;
 	moh->next = cl->members;
 	cl->members = moh;
-	ast_mutex_unlock(&moh_lock);
+	ast_mutex_unlock(&cl->lock);
 	return moh;
 }
 
@@ -692,7 +821,7 @@ static void moh_release(struct ast_channel *chan, void *data)
 {
 	struct mohdata *moh = data, *prev, *cur;
 	int oldwfmt;
-	ast_mutex_lock(&moh_lock);
+	ast_mutex_lock(&moh->parent->lock);
 	/* Unlink */
 	prev = NULL;
 	cur = moh->parent->members;
@@ -707,9 +836,8 @@ static void moh_release(struct ast_channel *chan, void *data)
 		prev = cur;
 		cur = cur->next;
 	}
-	ast_mutex_unlock(&moh_lock);
-	close(moh->pipe[0]);
-	close(moh->pipe[1]);
+	moh_encoding_put(moh->parent, moh->encoding);
+	ast_mutex_unlock(&moh->parent->lock);
 	oldwfmt = moh->origwfmt;
 	free(moh);
 	if (chan) {
@@ -725,11 +853,14 @@ static void *moh_alloc(struct ast_channel *chan, void *params)
 	struct mohdata *res;
 	struct mohclass *class = params;
 
-	res = mohalloc(class);
+	/* Take the music in the format the channel sends, so that it is
+	   encoded once for all the listeners with that format, instead of
+	   by each channel */
+	res = mohalloc(class, chan->rawwriteformat ? chan->rawwriteformat : class->format);
 	if (res) {
 		res->origwfmt = chan->writeformat;
-		if (ast_set_write_format(chan, class->format)) {
-			ast_log(LOG_WARNING, "Unable to set channel '%s' to format '%s'\n", chan->name, ast_codec2str(class->format));
+		if (ast_set_write_format(chan, res->encoding->format)) {
+			ast_log(LOG_WARNING, "Unable to set channel '%s' to format '%s'\n", chan->name, ast_codec2str(res->encoding->format));
 			moh_release(NULL, res);
 			res = NULL;
 		}
@@ -741,42 +872,34 @@ static void *moh_alloc(struct ast_channel *chan, void *params)
 
 static int moh_generate(struct ast_channel *chan, void *data, int len, int samples)
 {
-	struct ast_frame f;
 	struct mohdata *moh = data;
-	short buf[1280 + AST_FRIENDLY_OFFSET / 2];
+	struct moh_encoding *enc = moh->encoding;
+	struct ast_frame *f;
 	int res;
 
 	if (!moh->parent->pid)
 		return -1;
 
-	len = ast_codec_get_len(moh->parent->format, samples);
-
-	if (len > sizeof(buf) - AST_FRIENDLY_OFFSET) {
-		ast_log(LOG_WARNING, "Only doing %d of %d requested bytes on %s\n", (int)sizeof(buf), len, chan->name);
-		len = sizeof(buf) - AST_FRIENDLY_OFFSET;
-	}
-	res = read(moh->pipe[0], buf + AST_FRIENDLY_OFFSET/2, len);
-#if 0
-	if (res != len) {
-		ast_log(LOG_WARNING, "Read only %d of %d bytes: %s\n", res, len, strerror(errno));
-	}
-#endif
-	if (res <= 0)
-		return 0;
-
-	memset(&f, 0, sizeof(f));
-	
-	f.frametype = AST_FRAME_VOICE;
-	f.subclass = moh->parent->format;
-	f.mallocd = 0;
-	f.datalen = res;
-	f.data = buf + AST_FRIENDLY_OFFSET / 2;
-	f.offset = AST_FRIENDLY_OFFSET;
-	f.samples = ast_codec_get_samples(&f);
-
-	if (ast_write(chan, &f) < 0) {
-		ast_log(LOG_WARNING, "Failed to write frame to '%s': %s\n", chan->name, strerror(errno));
-		return -1;
+	moh->sample_queue += samples;
+	while (moh->sample_queue > 0) {
+		ast_mutex_lock(&moh->parent->lock);
+		/* Skip what the ring no longer has */
+		if (enc->seq - moh->seq > MOH_FRAMES)
+			moh->seq = enc->seq - MOH_FRAMES;
+		f = (moh->seq != enc->seq) ? ast_frdup(enc->frames[moh->seq++ % MOH_FRAMES]) : NULL;
+		ast_mutex_unlock(&moh->parent->lock);
+		if (!f) {
+			/* Nothing new yet */
+			moh->sample_queue = 0;
+			break;
+		}
+		moh->sample_queue -= f->samples;
+		res = ast_write(chan, f);
+		ast_frfree(f);
+		if (res < 0) {
+			ast_log(LOG_WARNING, "Failed to write frame to '%s': %s\n", chan->name, strerror(errno));
+			return -1;
+		}
 	}
 
 	return 0;
@@ -979,6 +1102,7 @@ static struct mohclass *moh_class_malloc(void)
 	memset(class, 0, sizeof(struct mohclass));
 
 	class->format = AST_FORMAT_SLINEAR;
+	ast_mutex_init(&class->lock);
 
 	return class;
 }
@@ -1202,6 +1326,7 @@ static int cli_files_show(int fd, int argc, char *argv[])
 static int moh_classes_show(int fd, int argc, char *argv[])
 {
 	struct mohclass *class;
+	struct moh_encoding *enc;
 
 	ast_mutex_lock(&moh_lock);
 	for (class = mohclasses; class; class = class->next) {
@@ -1211,6 +1336,10 @@ static int moh_classes_show(int fd, int argc, char *argv[])
 		if (ast_test_flag(class, MOH_CUSTOM))
 			ast_cli(fd, "\tApplication: %s\n", ast_strlen_zero(class->args) ? "<none>" : class->args);
 		ast_cli(fd, "\tFormat: %s\n", ast_getformatname(class->format));
+		ast_mutex_lock(&class->lock);
+		for (enc = class->encodings; enc; enc = enc->next)
+			ast_cli(fd, "\tPlaying as: %s (%d channel%s)\n", ast_getformatname(enc->format), enc->users, (enc->users == 1) ? "" : "s");
+		ast_mutex_unlock(&class->lock);
 	}
 	ast_mutex_unlock(&moh_lock);
 
@@ -60,7 +60,43 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 69992 $")
 
 #define DEFAULT_DTMF_TIMEOUT 3000 /* samples */
 
+#define RTCP_DEFAULT_INTERVALMS	5000
+#define RTCP_MIN_INTERVALMS	500
+#define RTCP_MAX_INTERVALMS	60000
+
+#define RTCP_PT_SR	200
+#define RTCP_PT_RR	201
+#define RTCP_PT_SDES	202
+
+/* Seconds between 1900 (NTP) and 1970 (Unix) */
+#define NTP_OFFSET	2208988800U
+
+#if defined(__linux__) && defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 14))
+#define HAVE_MMSG
+#endif
+
+#ifdef HAVE_MMSG
+/* Most packets moved by one recvmmsg()/sendmmsg() */
+#define RTP_BATCH		16
+/* Largest packet a batch slot holds; anything bigger bypasses the batch */
+#define RTP_BATCH_PKTSIZE	2048
+
+/*! \brief Packets waiting to go out, or just read, in one system call */
+struct rtp_batch {
+	int count;
+	struct mmsghdr msgs[RTP_BATCH];
+	struct iovec iov[RTP_BATCH];
+	struct sockaddr_in addr[RTP_BATCH];
+	unsigned short seqno[RTP_BATCH];
+	unsigned char buf[RTP_BATCH][RTP_BATCH_PKTSIZE];
+};
+#endif
+
 static int dtmftimeout = DEFAULT_DTMF_TIMEOUT;
+static int rtpbatchio = 0;	/* Use recvmmsg()/sendmmsg()? */
+static int rtprelay = 0;	/* Relay packets between bridged sessions that can't be redirected? */
+static int rtprelaythreads = 2;	/* Threads to share the relaying between */
+static int rtcpinterval = RTCP_DEFAULT_INTERVALMS;	/* Milliseconds between RTCP reports */
 
 static int rtpstart = 0;
 static int rtpend = 0;
@@ -127,6 +163,13 @@ struct ast_rtp {
 	int rtp_lookup_code_cache_result;
 	int rtp_offered_from_local;
 	struct ast_rtcp *rtcp;
+	time_t relayrx;			/*!< Last packet relayed from here */
+	time_t relaytx;			/*!< Last packet relayed out through here */
+#ifdef HAVE_MMSG
+	struct rtp_batch *rxbatch;	/*!< Callback mode receive batch */
+	struct rtp_batch *txbatch;	/*!< Packets queued by ast_rtp_write() */
+	int txbatching;			/*!< Queue packets rather than send them */
+#endif
 };
 
 /*!
@@ -146,10 +189,86 @@ struct ast_rtcp {
 	struct sockaddr_in us;
 	/*! Socket representation of the remote endpoint. */
 	struct sockaddr_in them;
+	/*! Scheduler id of the next report, -1 if none */
+	int schedid;
+	/*! What the scheduled report is given, see rtcp_unschedule() */
+	struct rtcp_report *report;
+	/* What we sent */
+	unsigned int txcount;		/*!< RTP packets sent */
+	unsigned int txoctets;		/*!< RTP payload octets sent */
+	unsigned int lasttxcount;	/*!< txcount at the last report; if it moved we send an SR */
+	/* What we received, RFC 3550 appendix A.1 and A.8 */
+	unsigned int themssrc;		/*!< Source we are receiving from */
+	unsigned int rxcount;		/*!< RTP packets received, from all sources */
+	unsigned int rxsrccount;	/*!< RTP packets received from themssrc */
+	int rxlostprior;		/*!< Packets lost from earlier sources */
+	unsigned int rxbaseseq;		/*!< First sequence number from themssrc */
+	unsigned int rxcycles;		/*!< Sequence number wraps, times 65536 */
+	unsigned short rxmaxseq;	/*!< Highest sequence number seen */
+	unsigned int expectedprior;	/*!< Packets expected at the last report */
+	unsigned int receivedprior;	/*!< Packets received at the last report */
+	int rxrate;			/*!< Timestamp clock rate of the source */
+	unsigned int rxlastts;
+	int rxtransit;			/*!< Relative transit time of the last packet */
+	double rxjitter;		/*!< Interarrival jitter, in timestamp units */
+	unsigned int lsr;		/*!< Middle of the NTP timestamp in their last SR */
+	struct timeval lsrrx;		/*!< When their last SR arrived */
+	/* What they told us */
+	int reportedlost;		/*!< Cumulative loss of our packets */
+	unsigned int reportedjitter;	/*!< Their jitter, in timestamp units */
+	double rtt;			/*!< Round trip times, in seconds */
+	double minrtt;
+	double maxrtt;
+	unsigned int srcount;		/*!< Sender reports sent */
+	unsigned int rrcount;		/*!< Receiver reports sent */
+	unsigned int rtcprx;		/*!< Reports received */
 };
 
 static struct ast_rtp_protocol *protos = NULL;
 
+/*! \brief A thread passing packets between bridged RTP sessions */
+struct rtp_relay_thread {
+	pthread_t t;
+	struct io_context *io;
+	int alert[2];			/*!< Wakes the thread to look at its requests */
+	ast_mutex_t lock;		/*!< Protects requests and count */
+	ast_cond_t cond;
+	struct rtp_relay *requests;	/*!< Relays waiting to be started or stopped */
+	int count;			/*!< Relays this thread is running */
+};
+
+/*! \brief Two RTP sessions whose packets are passed straight through */
+struct rtp_relay {
+	ast_mutex_t lock;		/*!< Held while a packet is forwarded */
+	struct ast_rtp *leg[2];
+	int formats[2];			/*!< Formats each leg accepts, 0 for any */
+	int *ioid[2];
+	struct rtp_relay_thread *thread;
+	int stop;			/*!< Request is to stop relaying */
+	int done;			/*!< Request has been handled */
+	int failed;			/*!< Saw media the other leg can't take */
+	short ptmap[2][128];		/*!< Payload type to send out of the other leg, -1 to drop, -2 not looked up */
+	int synced[2];
+	unsigned int rxssrc[2];
+	unsigned short seqoff[2];
+	unsigned int tsoff[2];
+	struct rtp_relay *next;		/*!< Next request for the thread */
+};
+
+/*! \brief A scheduled RTCP report.  The report may be running in the
+   scheduler thread while the session is destroyed in another, so it does
+   not point at the session directly */
+struct rtcp_report {
+	struct ast_rtp *rtp;		/*!< NULL once the session is gone */
+};
+
+/*! \brief Protects the rtp of scheduled reports, and the schedid and report of sessions */
+AST_MUTEX_DEFINE_STATIC(rtcplock);
+
+AST_MUTEX_DEFINE_STATIC(relaylock);
+static struct rtp_relay_thread *relaythreads = NULL;
+static int relaythreadcount = 0;
+
 int ast_rtp_fd(struct ast_rtp *rtp)
 {
 	return rtp->s;
@@ -355,10 +474,226 @@ static struct ast_frame *process_rfc3389(struct ast_rtp *rtp, unsigned char *dat
 	return f;
 }
 
+static struct ast_frame *rtp_parse(struct ast_rtp *rtp, int res, struct sockaddr_in *sin);
+static int rtcp_send_report(void *data);
+
+/*! \brief rtcp_schedule: Start sending reports once we know where to send them */
+static void rtcp_schedule(struct ast_rtp *rtp)
+{
+	struct rtcp_report *report;
+
+	if (!rtp->rtcp || !rtp->sched || !rtcpinterval)
+		return;
+	/* We get here for every packet; once the reports are going (or there
+	   is nowhere to send them yet) don't bother the global lock.  A stale
+	   look only puts the check off until the next packet. */
+	if ((rtp->rtcp->schedid > -1) || !rtp->rtcp->them.sin_addr.s_addr)
+		return;
+	ast_mutex_lock(&rtcplock);
+	if ((rtp->rtcp->schedid < 0) && rtp->rtcp->them.sin_addr.s_addr && (report = malloc(sizeof(*report)))) {
+		report->rtp = rtp;
+		rtp->rtcp->report = report;
+		rtp->rtcp->schedid = ast_sched_add(rtp->sched, rtcpinterval, rtcp_send_report, report);
+		if (rtp->rtcp->schedid < 0) {
+			rtp->rtcp->report = NULL;
+			free(report);
+		}
+	}
+	ast_mutex_unlock(&rtcplock);
+}
+
+/*! \brief rtcp_unschedule: Stop sending reports.  If the report is going out
+   right now it cannot be unscheduled, so it is told the session is gone and
+   frees itself the next time it runs */
+static void rtcp_unschedule(struct ast_rtp *rtp)
+{
+	ast_mutex_lock(&rtcplock);
+	if (rtp->rtcp->schedid > -1) {
+		if (!ast_sched_del(rtp->sched, rtp->rtcp->schedid))
+			free(rtp->rtcp->report);
+		else
+			rtp->rtcp->report->rtp = NULL;
+		rtp->rtcp->schedid = -1;
+		rtp->rtcp->report = NULL;
+	}
+	ast_mutex_unlock(&rtcplock);
+}
+
+/*! \brief rtcp_lost: Packets lost from the current source */
+static int rtcp_lost(struct ast_rtcp *rtcp)
+{
+	unsigned int expected;
+
+	if (!rtcp->rxsrccount)
+		return 0;
+	expected = rtcp->rxcycles + rtcp->rxmaxseq - rtcp->rxbaseseq + 1;
+	return expected - rtcp->rxsrccount;
+}
+
+/*! \brief rtcp_rx_stats: Account for a received packet in the reception
+   statistics, RFC 3550 appendix A.1 and A.8 */
+static void rtcp_rx_stats(struct ast_rtp *rtp, unsigned int ssrc, unsigned short seqno, unsigned int timestamp, int rate)
+{
+	struct ast_rtcp *rtcp = rtp->rtcp;
+	struct timeval now;
+	unsigned int arrival;
+	int transit, d;
+
+	if (!rtcp)
+		return;
+	rtcp->rxcount++;
+	if (!rtcp->rxsrccount || (ssrc != rtcp->themssrc) || (rate != rtcp->rxrate)) {
+		/* New source */
+		rtcp->rxlostprior += rtcp_lost(rtcp);
+		rtcp->themssrc = ssrc;
+		rtcp->rxsrccount = 1;
+		rtcp->rxbaseseq = rtcp->rxmaxseq = seqno;
+		rtcp->rxcycles = 0;
+		rtcp->expectedprior = rtcp->receivedprior = 0;
+		rtcp->rxrate = rate;
+		rtcp->rxlastts = timestamp;
+		rtcp->rxjitter = 0;
+		now = ast_tvnow();
+		rtcp->rxtransit = (now.tv_sec * rate + (unsigned int)(((long long)now.tv_usec * rate) / 1000000)) - timestamp;
+		return;
+	}
+	rtcp->rxsrccount++;
+	if ((unsigned short)(seqno - rtcp->rxmaxseq) < 0x8000) {
+		if (seqno < rtcp->rxmaxseq)
+			rtcp->rxcycles += 65536;
+		rtcp->rxmaxseq = seqno;
+	}
+	/* Packets sharing a timestamp (DTMF events, video frames) say
+	   nothing about jitter */
+	if (timestamp == rtcp->rxlastts)
+		return;
+	rtcp->rxlastts = timestamp;
+	now = ast_tvnow();
+	arrival = now.tv_sec * rate + (unsigned int)(((long long)now.tv_usec * rate) / 1000000);
+	transit = arrival - timestamp;
+	d = transit - rtcp->rxtransit;
+	rtcp->rxtransit = transit;
+	if (d < 0)
+		d = -d;
+	rtcp->rxjitter += (d - rtcp->rxjitter) / 16.0;
+}
+
+#ifdef HAVE_MMSG
+static struct rtp_batch *rtp_batch_new(void)
+{
+	struct rtp_batch *b;
+	int x;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+	for (x = 0; x < RTP_BATCH; x++) {
+		b->iov[x].iov_base = b->buf[x];
+		b->msgs[x].msg_hdr.msg_iov = &b->iov[x];
+		b->msgs[x].msg_hdr.msg_iovlen = 1;
+		b->msgs[x].msg_hdr.msg_name = &b->addr[x];
+	}
+	return b;
+}
+
+/*! \brief rtp_read_batch: Read everything waiting on the socket (up to
+   RTP_BATCH packets) with one recvmmsg(), handing each frame to the
+   callback.  Returns -1 if the socket failed */
+static int rtp_read_batch(struct ast_rtp *rtp)
+{
+	struct rtp_batch *b = rtp->rxbatch;
+	struct ast_frame *f;
+	int res, x, len;
+
+	for (x = 0; x < RTP_BATCH; x++) {
+		b->iov[x].iov_len = RTP_BATCH_PKTSIZE;
+		b->msgs[x].msg_hdr.msg_namelen = sizeof(b->addr[x]);
+		b->msgs[x].msg_hdr.msg_flags = 0;
+	}
+	res = recvmmsg(rtp->s, b->msgs, RTP_BATCH, MSG_DONTWAIT, NULL);
+	if (res < 0) {
+		if (errno == EBADF)
+			CRASH;
+		if (errno != EAGAIN) {
+			ast_log(LOG_WARNING, "RTP Read error: %s.\n", strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	for (x = 0; x < res; x++) {
+		if (b->msgs[x].msg_hdr.msg_flags & MSG_TRUNC) {
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Dropping RTP packet larger than %d bytes\n", RTP_BATCH_PKTSIZE);
+			continue;
+		}
+		/* The parser and the frames it returns work out of rawdata */
+		len = b->msgs[x].msg_len;
+		memcpy(rtp->rawdata + AST_FRIENDLY_OFFSET, b->buf[x], len);
+		f = rtp_parse(rtp, len, &b->addr[x]);
+		if (f && rtp->callback)
+			rtp->callback(rtp, f, rtp->data);
+	}
+	return 0;
+}
+
+static void rtp_tx_error(struct ast_rtp *rtp, unsigned int seqno, struct sockaddr_in *them);
+
+/*! \brief rtp_flush: Send whatever ast_rtp_raw_write() has queued */
+static void rtp_flush(struct ast_rtp *rtp)
+{
+	struct rtp_batch *b = rtp->txbatch;
+	int sent = 0, res;
+
+	if (!b)
+		return;
+	while (sent < b->count) {
+		res = sendmmsg(rtp->s, b->msgs + sent, b->count - sent, 0);
+		if (res < 0) {
+			/* Only the first packet failed; report it and carry on */
+			rtp_tx_error(rtp, b->seqno[sent], &b->addr[sent]);
+			sent++;
+		} else
+			sent += res;
+	}
+	b->count = 0;
+}
+
+/*! \brief rtp_queue: Add a packet to the transmit batch.  Returns -1 if
+   it has to be sent on its own */
+static int rtp_queue(struct ast_rtp *rtp, void *data, int len)
+{
+	struct rtp_batch *b;
+	int x;
+
+	if (len > RTP_BATCH_PKTSIZE) {
+		rtp_flush(rtp);
+		return -1;
+	}
+	if (!rtp->txbatch && !(rtp->txbatch = rtp_batch_new()))
+		return -1;
+	b = rtp->txbatch;
+	if (b->count == RTP_BATCH)
+		rtp_flush(rtp);
+	x = b->count++;
+	memcpy(b->buf[x], data, len);
+	b->iov[x].iov_len = len;
+	memcpy(&b->addr[x], &rtp->them, sizeof(b->addr[x]));
+	b->msgs[x].msg_hdr.msg_namelen = sizeof(b->addr[x]);
+	b->seqno[x] = rtp->seqno;
+	return 0;
+}
+#endif /* HAVE_MMSG */
+
 static int rtpread(int *id, int fd, short events, void *cbdata)
 {
 	struct ast_rtp *rtp = cbdata;
 	struct ast_frame *f;
+#ifdef HAVE_MMSG
+	if (rtpbatchio && (rtp->rxbatch || (rtp->rxbatch = rtp_batch_new()))) {
+		rtp_read_batch(rtp);
+		return 1;
+	}
+#endif
 	f = ast_rtp_read(rtp);
 	if (f) {
 		if (rtp->callback)
@@ -367,6 +702,187 @@ static int rtpread(int *id, int fd, short events, void *cbdata)
 	return 1;
 }
 
+/*! \brief ntp_middle: The middle 32 bits of the NTP timestamp for tv */
+static unsigned int ntp_middle(struct timeval tv)
+{
+	return ((tv.tv_sec + NTP_OFFSET) << 16) | (unsigned int)(((long long)tv.tv_usec << 16) / 1000000);
+}
+
+/*! \brief rtcp_parse: Pick out of a compound RTCP packet what the other end
+   says about our stream, and what we need to report on theirs */
+static void rtcp_parse(struct ast_rtp *rtp, unsigned int *rtcpdata, int words, struct sockaddr_in *sin)
+{
+	struct ast_rtcp *rtcp = rtp->rtcp;
+	struct timeval now = ast_tvnow();
+	unsigned int word, lsr, dlsr, rtt, *block;
+	char iabuf[INET_ADDRSTRLEN];
+	int pos, length, pt, rc, x;
+
+	rtcp->rtcprx++;
+	for (pos = 0; pos < words; pos += length) {
+		word = ntohl(rtcpdata[pos]);
+		length = (word & 0xffff) + 1;
+		if (((word >> 30) != 2) || (pos + length > words))
+			break;
+		pt = (word >> 16) & 0xff;
+		rc = (word >> 24) & 0x1f;
+		if (pt == RTCP_PT_SR) {
+			if (length < 7)
+				continue;
+			rtcp->lsr = (ntohl(rtcpdata[pos + 2]) << 16) | (ntohl(rtcpdata[pos + 3]) >> 16);
+			rtcp->lsrrx = now;
+			block = rtcpdata + pos + 7;
+		} else if (pt == RTCP_PT_RR) {
+			block = rtcpdata + pos + 2;
+		} else
+			continue;
+		if (rtp_debug_test_addr(sin))
+			ast_verbose("Got RTCP %s from %s:%d (ssrc %u, %d report blocks)\n", (pt == RTCP_PT_SR) ? "SR" : "RR",
+				ast_inet_ntoa(iabuf, sizeof(iabuf), sin->sin_addr), ntohs(sin->sin_port), ntohl(rtcpdata[pos + 1]), rc);
+		for (x = 0; (x < rc) && (block + 6 <= rtcpdata + pos + length); x++, block += 6) {
+			if (ntohl(block[0]) != rtp->ssrc)
+				continue;
+			word = ntohl(block[1]);
+			/* Cumulative loss is a signed 24 bit number */
+			rtcp->reportedlost = (word & 0x800000) ? (int)(word | 0xff000000) : (int)(word & 0xffffff);
+			rtcp->reportedjitter = ntohl(block[3]);
+			lsr = ntohl(block[4]);
+			dlsr = ntohl(block[5]);
+			if (!lsr)
+				continue;
+			rtt = ntp_middle(now) - lsr - dlsr;
+			/* Anything over a minute is clock trouble at one end */
+			if (rtt > 60 << 16)
+				continue;
+			rtcp->rtt = rtt / 65536.0;
+			if ((rtcp->rtt < rtcp->minrtt) || !rtcp->minrtt)
+				rtcp->minrtt = rtcp->rtt;
+			if (rtcp->rtt > rtcp->maxrtt)
+				rtcp->maxrtt = rtcp->rtt;
+		}
+	}
+}
+
+/*! \brief rtcp_send_report: Send a sender report if we sent anything since the
+   last one, or a receiver report, with an SDES CNAME (RFC 3550 6.4) */
+static int rtcp_send_report(void *data)
+{
+	struct rtcp_report *report = data;
+	struct ast_rtp *rtp;
+	struct ast_rtcp *rtcp;
+	unsigned int pkt[32];
+	unsigned int expected, expectedint, receivedint;
+	struct timeval now, delay;
+	char iabuf[INET_ADDRSTRLEN];
+	char *cname;
+	int len = 0, sr, rc, lost, lostint, fraction = 0;
+
+	ast_mutex_lock(&rtcplock);
+	if (!(rtp = report->rtp)) {
+		/* Destroyed while we were running last time */
+		ast_mutex_unlock(&rtcplock);
+		free(report);
+		return 0;
+	}
+	rtcp = rtp->rtcp;
+	if (!rtcp->them.sin_addr.s_addr || !rtcp->them.sin_port) {
+		rtcp->schedid = -1;
+		rtcp->report = NULL;
+		ast_mutex_unlock(&rtcplock);
+		free(report);
+		return 0;
+	}
+	now = ast_tvnow();
+	sr = (rtcp->txcount != rtcp->lasttxcount);
+	rc = rtcp->rxsrccount ? 1 : 0;
+	if (sr) {
+		pkt[len++] = htonl((2 << 30) | (rc << 24) | (RTCP_PT_SR << 16) | (6 + rc * 6));
+		pkt[len++] = htonl(rtp->ssrc);
+		pkt[len++] = htonl(now.tv_sec + NTP_OFFSET);
+		pkt[len++] = htonl((unsigned int)(((long long)now.tv_usec << 32) / 1000000));
+		pkt[len++] = htonl(rtp->lastts);
+		pkt[len++] = htonl(rtcp->txcount);
+		pkt[len++] = htonl(rtcp->txoctets);
+		rtcp->lasttxcount = rtcp->txcount;
+		rtcp->srcount++;
+	} else {
+		pkt[len++] = htonl((2 << 30) | (rc << 24) | (RTCP_PT_RR << 16) | (1 + rc * 6));
+		pkt[len++] = htonl(rtp->ssrc);
+		rtcp->rrcount++;
+	}
+	if (rc) {
+		expected = rtcp->rxcycles + rtcp->rxmaxseq - rtcp->rxbaseseq + 1;
+		lost = rtcp_lost(rtcp);
+		if (lost > 0x7fffff)
+			lost = 0x7fffff;
+		else if (lost < -0x800000)
+			lost = -0x800000;
+		expectedint = expected - rtcp->expectedprior;
+		receivedint = rtcp->rxsrccount - rtcp->receivedprior;
+		rtcp->expectedprior = expected;
+		rtcp->receivedprior = rtcp->rxsrccount;
+		lostint = expectedint - receivedint;
+		if (expectedint && (lostint > 0))
+			fraction = (lostint << 8) / expectedint;
+		pkt[len++] = htonl(rtcp->themssrc);
+		pkt[len++] = htonl((fraction << 24) | (lost & 0xffffff));
+		pkt[len++] = htonl(rtcp->rxcycles + rtcp->rxmaxseq);
+		pkt[len++] = htonl((unsigned int)rtcp->rxjitter);
+		pkt[len++] = htonl(rtcp->lsr);
+		if (rtcp->lsr) {
+			/* Delay since their SR, in 1/65536 seconds */
+			delay = ast_tvsub(now, rtcp->lsrrx);
+			pkt[len++] = htonl((delay.tv_sec << 16) | (unsigned int)(((long long)delay.tv_usec << 16) / 1000000));
+		} else
+			pkt[len++] = 0;
+	}
+	/* SDES with a CNAME of our SSRC in hex: 8 bytes of name, its 2 byte
+	   header and an end marker, padded to 12 bytes */
+	pkt[len++] = htonl((2 << 30) | (1 << 24) | (RTCP_PT_SDES << 16) | 4);
+	pkt[len++] = htonl(rtp->ssrc);
+	cname = (char *)(pkt + len);
+	memset(cname, 0, 12);
+	cname[0] = 1;
+	cname[1] = 8;
+	snprintf(cname + 2, 9, "%08x", rtp->ssrc);
+	cname[10] = 0;
+	len += 3;
+
+	if (sendto(rtcp->s, (void *)pkt, len * 4, 0, (struct sockaddr *)&rtcp->them, sizeof(rtcp->them)) < 0) {
+		ast_log(LOG_DEBUG, "RTCP %s transmission error to %s:%d: %s\n", sr ? "SR" : "RR",
+			ast_inet_ntoa(iabuf, sizeof(iabuf), rtcp->them.sin_addr), ntohs(rtcp->them.sin_port), strerror(errno));
+	} else if (rtp_debug_test_addr(&rtcp->them))
+		ast_verbose("Sent RTCP %s to %s:%d (sent %u, received %u, lost %d, fraction %d/256, jitter %u)\n", sr ? "SR" : "RR",
+			ast_inet_ntoa(iabuf, sizeof(iabuf), rtcp->them.sin_addr), ntohs(rtcp->them.sin_port),
+			rtcp->txcount, rtcp->rxcount, rtcp_lost(rtcp), fraction, (unsigned int)rtcp->rxjitter);
+	ast_mutex_unlock(&rtcplock);
+	return 1;
+}
+
+int ast_rtp_get_quality(struct ast_rtp *rtp, struct ast_rtp_quality *qual)
+{
+	struct ast_rtcp *rtcp = rtp->rtcp;
+
+	memset(qual, 0, sizeof(*qual));
+	if (!rtcp)
+		return -1;
+	qual->local_ssrc = rtp->ssrc;
+	qual->txcount = rtcp->txcount;
+	qual->rxcount = rtcp->rxcount;
+	qual->rxlost = rtcp->rxlostprior + rtcp_lost(rtcp);
+	if (rtcp->rxrate)
+		qual->rxjitter = rtcp->rxjitter * 1000.0 / rtcp->rxrate;
+	qual->remote_ssrc = rtcp->themssrc;
+	qual->txlost = rtcp->reportedlost;
+	qual->txjitter = rtcp->reportedjitter / 8.0;
+	qual->rtt = rtcp->rtt * 1000.0;
+	qual->minrtt = rtcp->minrtt * 1000.0;
+	qual->maxrtt = rtcp->maxrtt * 1000.0;
+	qual->rtcptx = rtcp->srcount + rtcp->rrcount;
+	qual->rtcprx = rtcp->rtcprx;
+	return 0;
+}
+
 struct ast_frame *ast_rtcp_read(struct ast_rtp *rtp)
 {
 	static struct ast_frame null_frame = { AST_FRAME_NULL, };
@@ -411,6 +927,7 @@ struct ast_frame *ast_rtcp_read(struct ast_rtp *rtp)
 	}
 	if (option_debug)
 		ast_log(LOG_DEBUG, "Got RTCP report of %d bytes\n", res);
+	rtcp_parse(rtp, rtcpdata, res / 4, &sin);
 	return &null_frame;
 }
 
@@ -425,11 +942,10 @@ static void calc_rxstamp(struct timeval *tv, struct ast_rtp *rtp, unsigned int t
 	*tv = ast_tvadd(rtp->rxcore, ts);
 }
 
-struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
+/*! \brief rtp_parse: Turn the res byte packet from sin sitting in
+   rtp->rawdata into a frame */
+static struct ast_frame *rtp_parse(struct ast_rtp *rtp, int res, struct sockaddr_in *sin)
 {
-	int res;
-	struct sockaddr_in sin;
-	socklen_t len;
 	unsigned int seqno;
 	int version;
 	int payloadtype;
@@ -446,24 +962,8 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 	struct ast_frame *f;
 	static struct ast_frame null_frame = { AST_FRAME_NULL, };
 	struct rtpPayloadType rtpPT;
-	
-	len = sizeof(sin);
-	
-	/* Cache where the header will go */
-	res = recvfrom(rtp->s, rtp->rawdata + AST_FRIENDLY_OFFSET, sizeof(rtp->rawdata) - AST_FRIENDLY_OFFSET,
-					0, (struct sockaddr *)&sin, &len);
-
 
 	rtpheader = (unsigned int *)(void *)(rtp->rawdata + AST_FRIENDLY_OFFSET);
-	if (res < 0) {
-		if (errno == EBADF)
-			CRASH;
-		if (errno != EAGAIN) {
-			ast_log(LOG_WARNING, "RTP Read error: %s.  Hanging up now.\n", strerror(errno));
-			return NULL;
-		}
-		return &null_frame;
-	}
 	if (res < hdrlen) {
 		ast_log(LOG_WARNING, "RTP Read too short\n");
 		return &null_frame;
@@ -476,9 +976,9 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 
 	if (rtp->nat) {
 		/* Send to whoever sent to us */
-		if ((rtp->them.sin_addr.s_addr != sin.sin_addr.s_addr) ||
-		    (rtp->them.sin_port != sin.sin_port)) {
-			memcpy(&rtp->them, &sin, sizeof(rtp->them));
+		if ((rtp->them.sin_addr.s_addr != sin->sin_addr.s_addr) ||
+		    (rtp->them.sin_port != sin->sin_port)) {
+			memcpy(&rtp->them, sin, sizeof(rtp->them));
 			rtp->rxseqno = 0;
 			ast_set_flag(rtp, FLAG_NAT_ACTIVE);
 			if (option_debug || rtpdebug)
@@ -532,16 +1032,18 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 		return &null_frame;
 	}
 
-	if(rtp_debug_test_addr(&sin))
+	if(rtp_debug_test_addr(sin))
 		ast_verbose("Got RTP packet from %s:%u (type %d, seq %u, ts %u, len %d)\n"
-			, ast_inet_ntoa(iabuf, sizeof(iabuf), sin.sin_addr), ntohs(sin.sin_port), payloadtype, seqno, timestamp,res - hdrlen);
+			, ast_inet_ntoa(iabuf, sizeof(iabuf), sin->sin_addr), ntohs(sin->sin_port), payloadtype, seqno, timestamp,res - hdrlen);
 
    rtpPT = ast_rtp_lookup_pt(rtp, payloadtype);
+	rtcp_rx_stats(rtp, ssrc, seqno, timestamp, (rtpPT.isAstFormat && (rtpPT.code >= AST_FORMAT_MAX_AUDIO)) ? 90000 : 8000);
+	rtcp_schedule(rtp);
 	if (!rtpPT.isAstFormat) {
 		/* This is special in-band data that's not one of our codecs */
 		if (rtpPT.code == AST_RTP_DTMF) {
 			/* It's special -- rfc2833 process it */
-			if(rtp_debug_test_addr(&sin)) {
+			if(rtp_debug_test_addr(sin)) {
 				unsigned char *data;
 				unsigned int event;
 				unsigned int event_end;
@@ -554,7 +1056,7 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 				event_end >>= 24;
 				duration = ntohl(*((unsigned int *)(void *)(data)));
 				duration &= 0xFFFF;
-				ast_verbose("Got rfc2833 RTP packet from %s:%d (type %d, seq %d, ts %d, len %d, mark %d, event %08x, end %d, duration %d) \n", ast_inet_ntoa(iabuf, sizeof(iabuf), sin.sin_addr), ntohs(sin.sin_port), payloadtype, seqno, timestamp, res - hdrlen, (mark?1:0), event, ((event_end & 0x80)?1:0), duration);
+				ast_verbose("Got rfc2833 RTP packet from %s:%d (type %d, seq %d, ts %d, len %d, mark %d, event %08x, end %d, duration %d) \n", ast_inet_ntoa(iabuf, sizeof(iabuf), sin->sin_addr), ntohs(sin->sin_port), payloadtype, seqno, timestamp, res - hdrlen, (mark?1:0), event, ((event_end & 0x80)?1:0), duration);
 			}
 			if (rtp->lasteventseqn <= seqno || (rtp->lasteventseqn >= 65530 && seqno <= 6)) {
 				f = process_rfc2833(rtp, rtp->rawdata + AST_FRIENDLY_OFFSET + hdrlen, res - hdrlen, seqno);
@@ -656,6 +1158,31 @@ struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
 	return &rtp->f;
 }
 
+struct ast_frame *ast_rtp_read(struct ast_rtp *rtp)
+{
+	int res;
+	struct sockaddr_in sin;
+	socklen_t len;
+	static struct ast_frame null_frame = { AST_FRAME_NULL, };
+
+	len = sizeof(sin);
+	
+	/* Cache where the header will go */
+	res = recvfrom(rtp->s, rtp->rawdata + AST_FRIENDLY_OFFSET, sizeof(rtp->rawdata) - AST_FRIENDLY_OFFSET,
+					0, (struct sockaddr *)&sin, &len);
+
+	if (res < 0) {
+		if (errno == EBADF)
+			CRASH;
+		if (errno != EAGAIN) {
+			ast_log(LOG_WARNING, "RTP Read error: %s.  Hanging up now.\n", strerror(errno));
+			return NULL;
+		}
+		return &null_frame;
+	}
+	return rtp_parse(rtp, res, &sin);
+}
+
 /* The following array defines the MIME Media type (and subtype) for each
    of our codecs, or RTP-specific data type. */
 static struct {
@@ -927,6 +1454,7 @@ static struct ast_rtcp *ast_rtcp_new(void)
 	if (!rtcp)
 		return NULL;
 	memset(rtcp, 0, sizeof(struct ast_rtcp));
+	rtcp->schedid = -1;
 	rtcp->s = rtp_socket();
 	rtcp->us.sin_family = AF_INET;
 	if (rtcp->s < 0) {
@@ -1077,6 +1605,7 @@ void ast_rtp_stop(struct ast_rtp *rtp)
 	memset(&rtp->them.sin_addr, 0, sizeof(rtp->them.sin_addr));
 	memset(&rtp->them.sin_port, 0, sizeof(rtp->them.sin_port));
 	if (rtp->rtcp) {
+		rtcp_unschedule(rtp);
 		memset(&rtp->rtcp->them.sin_addr, 0, sizeof(rtp->them.sin_addr));
 		memset(&rtp->rtcp->them.sin_port, 0, sizeof(rtp->them.sin_port));
 	}
@@ -1111,9 +1640,16 @@ void ast_rtp_destroy(struct ast_rtp *rtp)
 	if (rtp->s > -1)
 		close(rtp->s);
 	if (rtp->rtcp) {
+		rtcp_unschedule(rtp);
 		close(rtp->rtcp->s);
 		free(rtp->rtcp);
 	}
+#ifdef HAVE_MMSG
+	if (rtp->rxbatch)
+		free(rtp->rxbatch);
+	if (rtp->txbatch)
+		free(rtp->txbatch);
+#endif
 	free(rtp);
 }
 
@@ -1271,6 +1807,20 @@ int ast_rtp_sendcng(struct ast_rtp *rtp, int level)
 	return 0;
 }
 
+static void rtp_tx_error(struct ast_rtp *rtp, unsigned int seqno, struct sockaddr_in *them)
+{
+	char iabuf[INET_ADDRSTRLEN];
+
+	if (!rtp->nat || (rtp->nat && (ast_test_flag(rtp, FLAG_NAT_ACTIVE) == FLAG_NAT_ACTIVE))) {
+		ast_log(LOG_DEBUG, "RTP Transmission error of packet %d to %s:%d: %s\n", seqno, ast_inet_ntoa(iabuf, sizeof(iabuf), them->sin_addr), ntohs(them->sin_port), strerror(errno));
+	} else if ((ast_test_flag(rtp, FLAG_NAT_ACTIVE) == FLAG_NAT_INACTIVE) || rtpdebug) {
+		/* Only give this error message once if we are not RTP debugging */
+		if (option_debug || rtpdebug)
+			ast_log(LOG_DEBUG, "RTP NAT: Can't write RTP to private address %s:%d, waiting for other end to send audio...\n", ast_inet_ntoa(iabuf, sizeof(iabuf), them->sin_addr), ntohs(them->sin_port));
+		ast_set_flag(rtp, FLAG_NAT_INACTIVE_NOWARN);
+	}
+}
+
 static int ast_rtp_raw_write(struct ast_rtp *rtp, struct ast_frame *f, int codec)
 {
 	unsigned char *rtpheader;
@@ -1330,16 +1880,18 @@ static int ast_rtp_raw_write(struct ast_rtp *rtp, struct ast_frame *f, int codec
 	put_unaligned_uint32(rtpheader + 8, htonl(rtp->ssrc)); 
 
 	if (rtp->them.sin_port && rtp->them.sin_addr.s_addr) {
+#ifdef HAVE_MMSG
+		if (rtp->txbatching && !rtp_queue(rtp, rtpheader, f->datalen + hdrlen))
+			res = f->datalen + hdrlen;
+		else
+#endif
 		res = sendto(rtp->s, (void *)rtpheader, f->datalen + hdrlen, 0, (struct sockaddr *)&rtp->them, sizeof(rtp->them));
-		if (res <0) {
-			if (!rtp->nat || (rtp->nat && (ast_test_flag(rtp, FLAG_NAT_ACTIVE) == FLAG_NAT_ACTIVE))) {
-				ast_log(LOG_DEBUG, "RTP Transmission error of packet %d to %s:%d: %s\n", rtp->seqno, ast_inet_ntoa(iabuf, sizeof(iabuf), rtp->them.sin_addr), ntohs(rtp->them.sin_port), strerror(errno));
-			} else if ((ast_test_flag(rtp, FLAG_NAT_ACTIVE) == FLAG_NAT_INACTIVE) || rtpdebug) {
-				/* Only give this error message once if we are not RTP debugging */
-				if (option_debug || rtpdebug)
-					ast_log(LOG_DEBUG, "RTP NAT: Can't write RTP to private address %s:%d, waiting for other end to send audio...\n", ast_inet_ntoa(iabuf, sizeof(iabuf), rtp->them.sin_addr), ntohs(rtp->them.sin_port));
-				ast_set_flag(rtp, FLAG_NAT_INACTIVE_NOWARN);
-			}
+		if (res <0)
+			rtp_tx_error(rtp, rtp->seqno, &rtp->them);
+		else if (rtp->rtcp) {
+			rtp->rtcp->txcount++;
+			rtp->rtcp->txoctets += f->datalen;
+			rtcp_schedule(rtp);
 		}
 				
 		if(rtp_debug_test_addr(&rtp->them))
@@ -1352,7 +1904,7 @@ static int ast_rtp_raw_write(struct ast_rtp *rtp, struct ast_frame *f, int codec
 	return 0;
 }
 
-int ast_rtp_write(struct ast_rtp *rtp, struct ast_frame *_f)
+static int rtp_write(struct ast_rtp *rtp, struct ast_frame *_f)
 {
 	struct ast_frame *f;
 	int codec;
@@ -1499,6 +2051,24 @@ int ast_rtp_write(struct ast_rtp *rtp, struct ast_frame *_f)
 	return 0;
 }
 
+int ast_rtp_write(struct ast_rtp *rtp, struct ast_frame *_f)
+{
+#ifdef HAVE_MMSG
+	int res;
+
+	/* A frame can turn into several packets on the way through the
+	   smoother; send them all with one system call */
+	if (rtpbatchio) {
+		rtp->txbatching = 1;
+		res = rtp_write(rtp, _f);
+		rtp->txbatching = 0;
+		rtp_flush(rtp);
+		return res;
+	}
+#endif
+	return rtp_write(rtp, _f);
+}
+
 /*--- ast_rtp_proto_unregister: Unregister interface to channel driver */
 void ast_rtp_proto_unregister(struct ast_rtp_protocol *proto)
 {
@@ -1551,6 +2121,390 @@ static struct ast_rtp_protocol *get_proto(struct ast_channel *chan)
 	return NULL;
 }
 
+void ast_rtp_get_relay_times(struct ast_rtp *rtp, time_t *rx, time_t *tx)
+{
+	*rx = rtp->relayrx;
+	*tx = rtp->relaytx;
+}
+
+/*! \brief relay_map_pt: Work out what payload type pt from leg x becomes on
+   the other leg.  Returns -1 if the packet should be dropped */
+static int relay_map_pt(struct rtp_relay *r, int x, int pt)
+{
+	struct ast_rtp *dst = r->leg[!x];
+	struct rtpPayloadType rtpPT;
+	int y;
+
+	rtpPT = ast_rtp_lookup_pt(r->leg[x], pt);
+	if (!rtpPT.code)
+		return -1;
+	if (rtpPT.isAstFormat) {
+		if (r->formats[!x] && !(rtpPT.code & r->formats[!x])) {
+			/* Needs translating, which only the frame path can do */
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Can't relay %s, falling back to bridging frames\n", ast_getformatname(rtpPT.code));
+			r->failed = 1;
+			return -1;
+		}
+		return ast_rtp_lookup_code(dst, 1, rtpPT.code);
+	}
+	/* Events and comfort noise only go to a peer which agreed to them */
+	if (rtpPT.code == AST_RTP_CISCO_DTMF)
+		return -1;
+	for (y = 0; y < MAX_RTP_PT; y++) {
+		if (!dst->current_RTP_PT[y].isAstFormat && (dst->current_RTP_PT[y].code == rtpPT.code))
+			return y;
+	}
+	return -1;
+}
+
+/*! \brief relay_forward: Pass a packet from one leg of a relay to the other,
+   rewriting the header to continue the stream the other leg was sending */
+static int relay_forward(int *id, int fd, short events, void *cbdata)
+{
+	struct rtp_relay *r = cbdata;
+	struct ast_rtp *src, *dst;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	unsigned int *rtpheader;
+	unsigned int seqno, timestamp, ssrc, mark;
+	unsigned short seq;
+	char iabuf[INET_ADDRSTRLEN];
+	int x, res, pt;
+
+	x = (fd == r->leg[0]->s) ? 0 : 1;
+	src = r->leg[x];
+	dst = r->leg[!x];
+	if (events & (AST_IO_ERR | AST_IO_NVAL)) {
+		r->failed = 1;
+		return 1;
+	}
+	res = recvfrom(fd, src->rawdata + AST_FRIENDLY_OFFSET, sizeof(src->rawdata) - AST_FRIENDLY_OFFSET,
+					0, (struct sockaddr *)&sin, &len);
+	if (res < 12)
+		return 1;
+	/* Somebody is writing to one of the channels, which could send on
+	   this session too; this packet won't be missed much */
+	if (ast_mutex_trylock(&r->lock))
+		return 1;
+	rtpheader = (unsigned int *)(void *)(src->rawdata + AST_FRIENDLY_OFFSET);
+
+	/* Same rules as ast_rtp_read() for where the packet may come from */
+	if (!src->them.sin_addr.s_addr || !src->them.sin_port)
+		goto done;
+	if (src->nat && ((src->them.sin_addr.s_addr != sin.sin_addr.s_addr) ||
+			 (src->them.sin_port != sin.sin_port))) {
+		memcpy(&src->them, &sin, sizeof(src->them));
+		ast_set_flag(src, FLAG_NAT_ACTIVE);
+		if (option_debug || rtpdebug)
+			ast_log(LOG_DEBUG, "RTP NAT: Got relayed audio from other end. Now sending to address %s:%d\n", ast_inet_ntoa(iabuf, sizeof(iabuf), src->them.sin_addr), ntohs(src->them.sin_port));
+	}
+
+	seqno = ntohl(rtpheader[0]);
+	if (((seqno & 0xC0000000) >> 30) != 2)
+		goto done;
+	pt = (seqno & 0x7f0000) >> 16;
+	if (r->ptmap[x][pt] == -2)
+		r->ptmap[x][pt] = relay_map_pt(r, x, pt);
+	if ((pt = r->ptmap[x][pt]) < 0)
+		goto done;
+	if (!dst->them.sin_addr.s_addr || !dst->them.sin_port)
+		goto done;
+
+	seq = seqno & 0xffff;
+	mark = seqno & (1 << 23);
+	timestamp = ntohl(rtpheader[1]);
+	ssrc = ntohl(rtpheader[2]);
+	if (!r->synced[x] || (r->rxssrc[x] != ssrc)) {
+		/* Carry on from where the other leg's stream left off.  Keeping
+		   an offset rather than renumbering lets losses show through */
+		r->seqoff[x] = dst->seqno - seq;
+		r->tsoff[x] = dst->lastts + 160 - timestamp;
+		r->rxssrc[x] = ssrc;
+		r->synced[x] = 1;
+		mark = 1 << 23;
+	}
+	seq += r->seqoff[x];
+	timestamp += r->tsoff[x];
+	rtpheader[0] = htonl((seqno & 0xff000000) | mark | (pt << 16) | seq);
+	rtpheader[1] = htonl(timestamp);
+	rtpheader[2] = htonl(dst->ssrc);
+
+	/* Both sessions keep reporting on the streams they carry */
+	rtcp_rx_stats(src, ssrc, seqno & 0xffff, timestamp - r->tsoff[x], 8000);
+	rtcp_schedule(src);
+	res = sendto(dst->s, (void *)rtpheader, res, 0, (struct sockaddr *)&dst->them, sizeof(dst->them));
+	if (res < 0)
+		rtp_tx_error(dst, seq, &dst->them);
+	else if (dst->rtcp) {
+		dst->rtcp->txcount++;
+		dst->rtcp->txoctets += res - 12;
+		rtcp_schedule(dst);
+	}
+	dst->seqno = seq + 1;
+	dst->lastts = timestamp;
+	src->relayrx = dst->relaytx = time(NULL);
+	if (rtp_debug_test_addr(&dst->them))
+		ast_verbose("Relayed RTP packet to %s:%d (type %d, seq %u, ts %u, len %d)\n",
+			ast_inet_ntoa(iabuf, sizeof(iabuf), dst->them.sin_addr), ntohs(dst->them.sin_port), pt, seq, timestamp, res - 12);
+done:
+	ast_mutex_unlock(&r->lock);
+	return 1;
+}
+
+/*! \brief relay_alert: Start and stop the relays handed to this thread */
+static int relay_alert(int *id, int fd, short events, void *cbdata)
+{
+	struct rtp_relay_thread *rt = cbdata;
+	struct rtp_relay *r, *next;
+	char buf[64];
+	int x;
+
+	read(fd, buf, sizeof(buf));
+	ast_mutex_lock(&rt->lock);
+	r = rt->requests;
+	rt->requests = NULL;
+	ast_mutex_unlock(&rt->lock);
+
+	for (; r; r = next) {
+		next = r->next;
+		for (x = 0; x < 2; x++) {
+			if (r->stop) {
+				if (r->ioid[x])
+					ast_io_remove(rt->io, r->ioid[x]);
+				r->ioid[x] = NULL;
+			} else if (!(r->ioid[x] = ast_io_add(rt->io, r->leg[x]->s, relay_forward, AST_IO_IN, r)))
+				r->failed = 1;
+		}
+		ast_mutex_lock(&rt->lock);
+		rt->count += r->stop ? -1 : 1;
+		r->done = 1;
+		ast_cond_broadcast(&rt->cond);
+		ast_mutex_unlock(&rt->lock);
+	}
+	return 1;
+}
+
+static void *relay_thread(void *data)
+{
+	struct rtp_relay_thread *rt = data;
+
+	for (;;)
+		ast_io_wait(rt->io, 1000);
+	return NULL;
+}
+
+/*! \brief relay_pick_thread: Find the least busy relay thread, starting the
+   pool on first use */
+static struct rtp_relay_thread *relay_pick_thread(void)
+{
+	struct rtp_relay_thread *rt, *best = NULL;
+	int x;
+
+	ast_mutex_lock(&relaylock);
+	if (!relaythreads) {
+		relaythreads = calloc(rtprelaythreads, sizeof(*relaythreads));
+		for (x = 0; relaythreads && (x < rtprelaythreads); x++) {
+			rt = &relaythreads[x];
+			ast_mutex_init(&rt->lock);
+			ast_cond_init(&rt->cond, NULL);
+			if (pipe(rt->alert)) {
+				ast_log(LOG_WARNING, "Unable to create RTP relay pipe: %s\n", strerror(errno));
+				break;
+			}
+			fcntl(rt->alert[0], F_SETFL, fcntl(rt->alert[0], F_GETFL) | O_NONBLOCK);
+			if (!(rt->io = io_context_create()) ||
+			    !ast_io_add(rt->io, rt->alert[0], relay_alert, AST_IO_IN, rt) ||
+			    ast_pthread_create(&rt->t, NULL, relay_thread, rt)) {
+				ast_log(LOG_WARNING, "Unable to start RTP relay thread\n");
+				break;
+			}
+			relaythreadcount++;
+		}
+		if (option_verbose > 1)
+			ast_verbose(VERBOSE_PREFIX_2 "Started %d RTP relay threads\n", relaythreadcount);
+	}
+	for (x = 0; x < relaythreadcount; x++) {
+		if (!best || (relaythreads[x].count < best->count))
+			best = &relaythreads[x];
+	}
+	ast_mutex_unlock(&relaylock);
+	return best;
+}
+
+/*! \brief relay_request: Have the relay's thread start or stop it, and
+   wait until it has */
+static void relay_request(struct rtp_relay *r, int stop)
+{
+	struct rtp_relay_thread *rt = r->thread;
+
+	ast_mutex_lock(&rt->lock);
+	r->stop = stop;
+	r->done = 0;
+	r->next = rt->requests;
+	rt->requests = r;
+	write(rt->alert[1], "", 1);
+	while (!r->done)
+		ast_cond_wait(&rt->cond, &rt->lock);
+	ast_mutex_unlock(&rt->lock);
+}
+
+/*! \brief rtp_relay_bridge: Bridge two channels whose RTP can't be redirected
+   to each other by relaying their packets from a relay thread.  Only frames
+   from signalling (hangups, DTMF, control frames) and any video still come
+   through here */
+static enum ast_bridge_result rtp_relay_bridge(struct ast_channel *c0, struct ast_channel *c1, struct ast_rtp *p0, struct ast_rtp *p1, int flags, struct ast_frame **fo, struct ast_channel **rc, int timeoutms)
+{
+	struct ast_rtp_protocol *pr0 = get_proto(c0), *pr1 = get_proto(c1);
+	struct ast_channel *who, *cs[3];
+	struct ast_frame *f;
+	struct rtp_relay *r;
+	enum ast_bridge_result res = AST_BRIDGE_FAILED;
+	void *pvt0 = c0->tech_pvt, *pvt1 = c1->tech_pvt;
+	int fdx0, fdx1, x, ms, waited;
+
+	if (!pr0 || !pr1)
+		return AST_BRIDGE_FAILED_NOWARN;
+	if (!(r = calloc(1, sizeof(*r))))
+		return AST_BRIDGE_FAILED_NOWARN;
+	ast_mutex_init(&r->lock);
+	r->leg[0] = p0;
+	r->leg[1] = p1;
+	r->formats[0] = pr0->get_codec ? pr0->get_codec(c0) : 0;
+	r->formats[1] = pr1->get_codec ? pr1->get_codec(c1) : 0;
+	for (x = 0; x < 128; x++)
+		r->ptmap[0][x] = r->ptmap[1][x] = -2;
+	if (!(r->thread = relay_pick_thread())) {
+		ast_mutex_destroy(&r->lock);
+		free(r);
+		return AST_BRIDGE_FAILED_NOWARN;
+	}
+
+	/* Hide the RTP sockets from the channels, so only the relay reads them */
+	ast_mutex_lock(&c0->lock);
+	while(ast_mutex_trylock(&c1->lock)) {
+		ast_mutex_unlock(&c0->lock);
+		usleep(1);
+		ast_mutex_lock(&c0->lock);
+	}
+	for (fdx0 = 0; (fdx0 < AST_MAX_FDS) && (c0->fds[fdx0] != p0->s); fdx0++);
+	for (fdx1 = 0; (fdx1 < AST_MAX_FDS) && (c1->fds[fdx1] != p1->s); fdx1++);
+	if ((fdx0 == AST_MAX_FDS) || (fdx1 == AST_MAX_FDS)) {
+		ast_mutex_unlock(&c0->lock);
+		ast_mutex_unlock(&c1->lock);
+		ast_mutex_destroy(&r->lock);
+		free(r);
+		return AST_BRIDGE_FAILED_NOWARN;
+	}
+	c0->fds[fdx0] = -1;
+	c1->fds[fdx1] = -1;
+	ast_mutex_unlock(&c0->lock);
+	ast_mutex_unlock(&c1->lock);
+
+	relay_request(r, 0);
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Relaying RTP between %s and %s\n", c0->name, c1->name);
+
+	cs[0] = c0;
+	cs[1] = c1;
+	cs[2] = NULL;
+	for (;;) {
+		if ((c0->tech_pvt != pvt0) || (c1->tech_pvt != pvt1) ||
+		    (c0->masq || c0->masqr || c1->masq || c1->masqr)) {
+			ast_log(LOG_DEBUG, "Oooh, something is weird, backing out\n");
+			res = AST_BRIDGE_RETRY;
+			break;
+		}
+		if ((pr0->get_codec && (pr0->get_codec(c0) != r->formats[0])) ||
+		    (pr1->get_codec && (pr1->get_codec(c1) != r->formats[1]))) {
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Codecs changed, restarting RTP relay\n");
+			res = AST_BRIDGE_RETRY;
+			break;
+		}
+		if (r->failed) {
+			res = AST_BRIDGE_FAILED_NOWARN;
+			break;
+		}
+		/* Wake up now and then to look at how the relay is doing */
+		ms = 500;
+		if ((timeoutms > -1) && (timeoutms < ms))
+			ms = timeoutms;
+		waited = ms;
+		who = ast_waitfor_n(cs, 2, &ms);
+		if (timeoutms > -1) {
+			timeoutms -= waited - ms;
+			if (timeoutms < 0)
+				timeoutms = 0;
+		}
+		if (!who) {
+			if (!timeoutms) {
+				res = AST_BRIDGE_RETRY;
+				break;
+			}
+			/* Let the caller deal with a hangup or whentohangup */
+			if (ast_check_hangup(c0) || ast_check_hangup(c1)) {
+				res = AST_BRIDGE_RETRY;
+				break;
+			}
+			continue;
+		}
+		f = ast_read(who);
+		if (!f) {
+			*fo = f;
+			*rc = who;
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Oooh, got a hangup\n");
+			res = AST_BRIDGE_COMPLETE;
+			break;
+		} else if ((f->frametype == AST_FRAME_CONTROL) && !(flags & AST_BRIDGE_IGNORE_SIGS)) {
+			if ((f->subclass == AST_CONTROL_HOLD) || (f->subclass == AST_CONTROL_UNHOLD) ||
+			    (f->subclass == AST_CONTROL_VIDUPDATE)) {
+				ast_indicate(who == c0 ? c1 : c0, f->subclass);
+				ast_frfree(f);
+			} else {
+				*fo = f;
+				*rc = who;
+				ast_log(LOG_DEBUG, "Got a FRAME_CONTROL (%d) frame on channel %s\n", f->subclass, who->name);
+				res = AST_BRIDGE_COMPLETE;
+				break;
+			}
+		} else {
+			if ((f->frametype == AST_FRAME_DTMF) || 
+				(f->frametype == AST_FRAME_VOICE) || 
+				(f->frametype == AST_FRAME_VIDEO)) {
+				/* Forward DTMF from signalling and video; keep the relay off the
+				   sessions while the channel driver may be using them */
+				ast_mutex_lock(&r->lock);
+				ast_write(who == c0 ? c1 : c0, f);
+				ast_mutex_unlock(&r->lock);
+			}
+			ast_frfree(f);
+		}
+		/* Swap priority not that it's a big deal at this point */
+		cs[2] = cs[0];
+		cs[0] = cs[1];
+		cs[1] = cs[2];
+	}
+
+	relay_request(r, 1);
+	ast_mutex_lock(&c0->lock);
+	if ((c0->tech_pvt == pvt0) && (c0->fds[fdx0] == -1))
+		c0->fds[fdx0] = p0->s;
+	ast_mutex_unlock(&c0->lock);
+	ast_mutex_lock(&c1->lock);
+	if ((c1->tech_pvt == pvt1) && (c1->fds[fdx1] == -1))
+		c1->fds[fdx1] = p1->s;
+	ast_mutex_unlock(&c1->lock);
+	/* Frames take over the timestamps from here */
+	p0->txcore = p1->txcore = ast_tvnow();
+	ast_mutex_destroy(&r->lock);
+	free(r);
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Stopped relaying RTP between %s and %s\n", c0->name, c1->name);
+	return res;
+}
+
 /* ast_rtp_bridge: Bridge calls. If possible and allowed, initiate
 	re-invite so the peers exchange media directly outside 
 	of Asterisk. */
@@ -1621,9 +2575,17 @@ enum ast_bridge_result ast_rtp_bridge(struct ast_channel *c0, struct ast_channel
 
 	/* Check if bridge is still possible (In SIP canreinvite=no stops this, like NAT) */
 	if (!p0 || !p1) {
-		/* Somebody doesn't want to play... */
+		/* Somebody doesn't want to play... but maybe we can still pass
+		   their packets along without looking at them */
+		if (rtprelay && pr0->get_relay_info && pr1->get_relay_info) {
+			p0 = pr0->get_relay_info(c0);
+			p1 = pr1->get_relay_info(c1);
+		} else
+			p0 = p1 = NULL;
 		ast_mutex_unlock(&c0->lock);
 		ast_mutex_unlock(&c1->lock);
+		if (p0 && p1 && (p0 != p1))
+			return rtp_relay_bridge(c0, c1, p0, p1, flags, fo, rc, timeoutms);
 		return AST_BRIDGE_FAILED_NOWARN;
 	}
 	/* Get codecs from both sides */
@@ -1880,6 +2842,9 @@ void ast_rtp_reload(void)
 	rtpstart = 5000;
 	rtpend = 31000;
 	dtmftimeout = DEFAULT_DTMF_TIMEOUT;
+	rtpbatchio = 0;
+	rtprelay = 0;
+	rtcpinterval = RTCP_DEFAULT_INTERVALMS;
 	cfg = ast_config_load("rtp.conf");
 	if (cfg) {
 		if ((s = ast_variable_retrieve(cfg, "general", "rtpstart"))) {
@@ -1915,6 +2880,30 @@ void ast_rtp_reload(void)
 				dtmftimeout = DEFAULT_DTMF_TIMEOUT;
 			};
 		}
+		if ((s = ast_variable_retrieve(cfg, "general", "rtcpinterval"))) {
+			rtcpinterval = atoi(s);
+			if (rtcpinterval && (rtcpinterval < RTCP_MIN_INTERVALMS))
+				rtcpinterval = RTCP_MIN_INTERVALMS;
+			if (rtcpinterval > RTCP_MAX_INTERVALMS)
+				rtcpinterval = RTCP_MAX_INTERVALMS;
+		}
+		if ((s = ast_variable_retrieve(cfg, "general", "relay")))
+			rtprelay = ast_true(s);
+		if ((s = ast_variable_retrieve(cfg, "general", "relaythreads"))) {
+			/* Only takes effect before the first relay starts the threads */
+			if ((sscanf(s, "%d", &rtprelaythreads) != 1) || (rtprelaythreads < 1)) {
+				ast_log(LOG_WARNING, "Invalid relaythreads '%s', using 2\n", s);
+				rtprelaythreads = 2;
+			}
+		}
+		if ((s = ast_variable_retrieve(cfg, "general", "batchio"))) {
+#ifdef HAVE_MMSG
+			rtpbatchio = ast_true(s);
+#else
+			if (ast_true(s))
+				ast_log(LOG_WARNING, "Batched RTP I/O is not supported on this operating system!\n");
+#endif
+		}
 		ast_config_destroy(cfg);
 	}
 	if (rtpstart >= rtpend) {
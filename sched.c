@@ -20,6 +20,10 @@
  *
  * \brief Scheduler Routines (from cheops-NG)
  *
+ * Pending events are kept in a binary min-heap ordered by expiry time,
+ * with an id hash on the side so that ast_sched_del() and
+ * ast_sched_when() do not have to search the heap.  Insertion and
+ * deletion are O(log n), finding the next event is O(1).
  */
 
 #ifdef DEBUG_SCHEDULER
@@ -43,14 +47,23 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 7221 $")
 #include "asterisk/channel.h"
 #include "asterisk/lock.h"
 #include "asterisk/utils.h"
+#include "asterisk/cli.h"
 
 /* Determine if a is sooner than b */
 #define SOONER(a,b) (((b).tv_sec > (a).tv_sec) || \
 					 (((b).tv_sec == (a).tv_sec) && ((b).tv_usec > (a).tv_usec)))
 
+/*! Initial number of heap slots and id hash buckets (must be a power of 2) */
+#define SCHED_INITIAL_SIZE	16
+
+/*! Upper bounds (in ms) of the lateness histogram buckets; the last bucket is open ended */
+static const int sched_late_bounds[SCHED_LATE_BUCKETS - 1] = { 1, 5, 10, 50, 100, 500 };
+
 struct sched {
-	struct sched *next;		/* Next event in the list */
+	struct sched *next;		/* Next entry in the id hash bucket or the cache */
 	int id; 			/* ID number of event */
+	unsigned int slot;		/* Position of this event in the heap */
+	unsigned int seq;		/* Insertion order, keeps equal times FIFO */
 	struct timeval when;		/* Absolute time event should take place */
 	int resched;			/* When to reschedule */
 	int variable;		/* Use return value from callback to reschedule */
@@ -66,16 +79,37 @@ struct sched_context {
 	/* Number of outstanding schedule events */
 	int schedcnt;
 
-	/* Schedule entry and main queue */
- 	struct sched *schedq;
+	/* Heap of pending events, soonest first */
+	struct sched **heap;
+	unsigned int heapsize;
+
+	/* Pending events hashed by id */
+	struct sched **ids;
+	unsigned int idbuckets;
+
+	/* Insertion counter used to break ties in the heap */
+	unsigned int seq;
 
 #ifdef SCHED_MAX_CACHE
 	/* Cache of unused schedule structures and how many */
 	struct sched *schedc;
 	int schedccnt;
 #endif
+
+	/* Statistics for "show sched stats" */
+	char name[32];
+	struct timeval created;
+	struct ast_sched_stats stats;
+
+	/* Linkage in the list of all contexts */
+	struct sched_context *prev;
+	struct sched_context *next;
 };
 
+/*! All scheduler contexts, for "show sched stats" */
+static struct sched_context *contexts = NULL;
+AST_MUTEX_DEFINE_STATIC(contextlock);
+
 struct sched_context *sched_context_create(void)
 {
 	struct sched_context *tmp;
@@ -85,18 +119,44 @@ struct sched_context *sched_context_create(void)
 		ast_mutex_init(&tmp->lock);
 		tmp->eventcnt = 1;
 		tmp->schedcnt = 0;
-		tmp->schedq = NULL;
+		tmp->heap = NULL;
+		tmp->ids = NULL;
 #ifdef SCHED_MAX_CACHE
 		tmp->schedc = NULL;
 		tmp->schedccnt = 0;
 #endif
+		tmp->created = ast_tvnow();
+		ast_mutex_lock(&contextlock);
+		tmp->next = contexts;
+		if (contexts)
+			contexts->prev = tmp;
+		contexts = tmp;
+		ast_mutex_unlock(&contextlock);
 	}
 	return tmp;
 }
 
+void ast_sched_set_name(struct sched_context *con, const char *name)
+{
+	ast_mutex_lock(&con->lock);
+	ast_copy_string(con->name, name ? name : "", sizeof(con->name));
+	ast_mutex_unlock(&con->lock);
+}
+
 void sched_context_destroy(struct sched_context *con)
 {
 	struct sched *s, *sl;
+	unsigned int x;
+
+	ast_mutex_lock(&contextlock);
+	if (con->prev)
+		con->prev->next = con->next;
+	else
+		contexts = con->next;
+	if (con->next)
+		con->next->prev = con->prev;
+	ast_mutex_unlock(&contextlock);
+
 	ast_mutex_lock(&con->lock);
 #ifdef SCHED_MAX_CACHE
 	/* Eliminate the cache */
@@ -108,12 +168,12 @@ void sched_context_destroy(struct sched_context *con)
 	}
 #endif
 	/* And the queue */
-	s = con->schedq;
-	while(s) {
-		sl = s;
-		s = s->next;
-		free(sl);
-	}
+	for (x = 0; x < con->schedcnt; x++)
+		free(con->heap[x]);
+	if (con->heap)
+		free(con->heap);
+	if (con->ids)
+		free(con->ids);
 	/* And the context */
 	ast_mutex_unlock(&con->lock);
 	ast_mutex_destroy(&con->lock);
@@ -145,7 +205,7 @@ static void sched_release(struct sched_context *con, struct sched *tmp)
 	 * already have too many cache entries
 	 */
 
-#ifdef SCHED_MAX_CACHE	 
+#ifdef SCHED_MAX_CACHE
 	if (con->schedccnt < SCHED_MAX_CACHE) {
 		tmp->next = con->schedc;
 		con->schedc = tmp;
@@ -164,42 +224,171 @@ int ast_sched_wait(struct sched_context *con)
 	int ms;
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_wait()\n"));
 	ast_mutex_lock(&con->lock);
-	if (!con->schedq) {
+	if (!con->schedcnt) {
 		ms = -1;
 	} else {
-		ms = ast_tvdiff_ms(con->schedq->when, ast_tvnow());
+		ms = ast_tvdiff_ms(con->heap[0]->when, ast_tvnow());
 		if (ms < 0)
 			ms = 0;
 	}
 	ast_mutex_unlock(&con->lock);
 	return ms;
-	
+
+}
+
+/*! \brief Is event a due before event b?  Events due at the same time run in the order they were scheduled. */
+static inline int sched_before(const struct sched *a, const struct sched *b)
+{
+	if (SOONER(a->when, b->when))
+		return 1;
+	if (SOONER(b->when, a->when))
+		return 0;
+	return (int)(a->seq - b->seq) < 0;
+}
+
+static inline void heap_set(struct sched_context *con, unsigned int slot, struct sched *s)
+{
+	con->heap[slot] = s;
+	s->slot = slot;
+}
+
+static void heap_up(struct sched_context *con, unsigned int slot)
+{
+	struct sched *s = con->heap[slot];
+	unsigned int parent;
+
+	while (slot) {
+		parent = (slot - 1) / 2;
+		if (!sched_before(s, con->heap[parent]))
+			break;
+		heap_set(con, slot, con->heap[parent]);
+		slot = parent;
+	}
+	heap_set(con, slot, s);
+}
+
+static void heap_down(struct sched_context *con, unsigned int slot)
+{
+	struct sched *s = con->heap[slot];
+	unsigned int child;
+
+	for (;;) {
+		child = slot * 2 + 1;
+		if (child >= con->schedcnt)
+			break;
+		if ((child + 1 < con->schedcnt) && sched_before(con->heap[child + 1], con->heap[child]))
+			child++;
+		if (!sched_before(con->heap[child], s))
+			break;
+		heap_set(con, slot, con->heap[child]);
+		slot = child;
+	}
+	heap_set(con, slot, s);
+}
+
+/*! \brief Take an event out of the heap, wherever it is */
+static void heap_remove(struct sched_context *con, struct sched *s)
+{
+	unsigned int slot = s->slot;
+	struct sched *last;
+
+	con->schedcnt--;
+	if (slot == con->schedcnt)
+		return;
+	last = con->heap[con->schedcnt];
+	heap_set(con, slot, last);
+	if (slot && sched_before(last, con->heap[(slot - 1) / 2]))
+		heap_up(con, slot);
+	else
+		heap_down(con, slot);
+}
+
+static struct sched *id_find(struct sched_context *con, int id)
+{
+	struct sched *s;
+
+	if (!con->ids)
+		return NULL;
+	for (s = con->ids[id & (con->idbuckets - 1)]; s; s = s->next) {
+		if (s->id == id)
+			break;
+	}
+	return s;
 }
 
+static void id_unlink(struct sched_context *con, struct sched *s)
+{
+	struct sched **prev;
+
+	for (prev = &con->ids[s->id & (con->idbuckets - 1)]; *prev; prev = &(*prev)->next) {
+		if (*prev == s) {
+			*prev = s->next;
+			break;
+		}
+	}
+}
 
-static void schedule(struct sched_context *con, struct sched *s)
+/*! \brief Make sure there is room for one more event in the heap and id hash */
+static int sched_grow(struct sched_context *con)
+{
+	struct sched **tmp, *s, *next;
+	unsigned int size, x;
+
+	if (con->schedcnt >= con->heapsize) {
+		size = con->heapsize ? con->heapsize * 2 : SCHED_INITIAL_SIZE;
+		if (!(tmp = realloc(con->heap, size * sizeof(*tmp)))) {
+			ast_log(LOG_WARNING, "Out of memory growing schedule queue\n");
+			return -1;
+		}
+		con->heap = tmp;
+		con->heapsize = size;
+	}
+
+	/* Keep the average hash chain short */
+	if (con->schedcnt >= con->idbuckets * 2) {
+		size = con->idbuckets ? con->idbuckets * 2 : SCHED_INITIAL_SIZE;
+		if (!(tmp = calloc(size, sizeof(*tmp)))) {
+			ast_log(LOG_WARNING, "Out of memory growing schedule index\n");
+			return -1;
+		}
+		for (x = 0; x < con->idbuckets; x++) {
+			for (s = con->ids[x]; s; s = next) {
+				next = s->next;
+				s->next = tmp[s->id & (size - 1)];
+				tmp[s->id & (size - 1)] = s;
+			}
+		}
+		if (con->ids)
+			free(con->ids);
+		con->ids = tmp;
+		con->idbuckets = size;
+	}
+	return 0;
+}
+
+static int schedule(struct sched_context *con, struct sched *s)
 {
 	/*
 	 * Take a sched structure and put it in the
 	 * queue, such that the soonest event is
-	 * first in the list. 
+	 * on top of the heap.
 	 */
-	 
-	struct sched *last=NULL;
-	struct sched *current=con->schedq;
-	while(current) {
-		if (SOONER(s->when, current->when))
-			break;
-		last = current;
-		current = current->next;
-	}
-	/* Insert this event into the schedule */
-	s->next = current;
-	if (last) 
-		last->next = s;
-	else
-		con->schedq = s;
-	con->schedcnt++;
+	unsigned int bucket;
+
+	if (sched_grow(con))
+		return -1;
+	s->seq = con->seq++;
+	con->heap[con->schedcnt] = s;
+	s->slot = con->schedcnt++;
+	heap_up(con, s->slot);
+
+	bucket = s->id & (con->idbuckets - 1);
+	s->next = con->ids[bucket];
+	con->ids[bucket] = s;
+
+	if (con->schedcnt > con->stats.peak)
+		con->stats.peak = con->schedcnt;
+	return 0;
 }
 
 /*
@@ -242,10 +431,10 @@ int ast_sched_add_variable(struct sched_context *con, int when, ast_sched_cb cal
 		tmp->resched = when;
 		tmp->variable = variable;
 		tmp->when = ast_tv(0, 0);
-		if (sched_settime(&tmp->when, when)) {
+		if (sched_settime(&tmp->when, when) || schedule(con, tmp)) {
 			sched_release(con, tmp);
 		} else {
-			schedule(con, tmp);
+			con->stats.adds++;
 			res = tmp->id;
 		}
 	}
@@ -270,23 +459,16 @@ int ast_sched_del(struct sched_context *con, int id)
 	 * would be two or more in the list with that
 	 * id.
 	 */
-	struct sched *last=NULL, *s;
+	struct sched *s;
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_del()\n"));
 	ast_mutex_lock(&con->lock);
-	s = con->schedq;
-	while(s) {
-		if (s->id == id) {
-			if (last)
-				last->next = s->next;
-			else
-				con->schedq = s->next;
-			con->schedcnt--;
-			sched_release(con, s);
-			break;
-		}
-		last = s;
-		s = s->next;
-	}
+	if ((s = id_find(con, id))) {
+		id_unlink(con, s);
+		heap_remove(con, s);
+		sched_release(con, s);
+		con->stats.dels++;
+	} else
+		con->stats.delmisses++;
 #ifdef DUMP_SCHEDULER
 	/* Dump contents of the context while we have the lock so nothing gets screwed up by accident. */
 	ast_sched_dump(con);
@@ -302,35 +484,66 @@ int ast_sched_del(struct sched_context *con, int id)
 		return 0;
 }
 
+static int sched_cmp_dump(const void *a, const void *b)
+{
+	const struct sched *sa = *(const struct sched **)a, *sb = *(const struct sched **)b;
+
+	return sched_before(sa, sb) ? -1 : 1;
+}
+
 void ast_sched_dump(const struct sched_context *con)
 {
 	/*
 	 * Dump the contents of the scheduler to
 	 * stderr
 	 */
-	struct sched *q;
+	struct sched **q;
 	struct timeval tv = ast_tvnow();
+	int x;
 #ifdef SCHED_MAX_CACHE
 	ast_log(LOG_DEBUG, "Asterisk Schedule Dump (%d in Q, %d Total, %d Cache)\n", con->schedcnt, con->eventcnt - 1, con->schedccnt);
 #else
 	ast_log(LOG_DEBUG, "Asterisk Schedule Dump (%d in Q, %d Total)\n", con->schedcnt, con->eventcnt - 1);
 #endif
 
+	/* The heap is only partially ordered, so sort a copy for display */
+	if (!con->schedcnt || !(q = malloc(con->schedcnt * sizeof(*q))))
+		return;
+	memcpy(q, con->heap, con->schedcnt * sizeof(*q));
+	qsort(q, con->schedcnt, sizeof(*q), sched_cmp_dump);
+
 	ast_log(LOG_DEBUG, "=============================================================\n");
 	ast_log(LOG_DEBUG, "|ID    Callback          Data              Time  (sec:ms)   |\n");
 	ast_log(LOG_DEBUG, "+-----+-----------------+-----------------+-----------------+\n");
- 	for (q = con->schedq; q; q = q->next) {
- 		struct timeval delta =  ast_tvsub(q->when, tv);
+ 	for (x = 0; x < con->schedcnt; x++) {
+ 		struct timeval delta =  ast_tvsub(q[x]->when, tv);
 
 		ast_log(LOG_DEBUG, "|%.4d | %-15p | %-15p | %.6ld : %.6ld |\n", 
-			q->id,
-			q->callback,
-			q->data,
+			q[x]->id,
+			q[x]->callback,
+			q[x]->data,
 			delta.tv_sec,
 			(long int)delta.tv_usec);
 	}
 	ast_log(LOG_DEBUG, "=============================================================\n");
-	
+	free(q);
+}
+
+/*! \brief Account for how late an event was dispatched */
+static void sched_note_lateness(struct sched_context *con, struct timeval now, struct timeval when)
+{
+	int late = ast_tvdiff_ms(now, when);
+	int x;
+
+	if (late < 0)
+		late = 0;
+	for (x = 0; x < SCHED_LATE_BUCKETS - 1; x++) {
+		if (late < sched_late_bounds[x])
+			break;
+	}
+	con->stats.late[x]++;
+	if (late > con->stats.maxlate)
+		con->stats.maxlate = late;
 }
 
 int ast_sched_runq(struct sched_context *con)
@@ -339,26 +552,29 @@ int ast_sched_runq(struct sched_context *con)
 	 * Launch all events which need to be run at this time.
 	 */
 	struct sched *current;
-	struct timeval tv;
+	struct timeval now, tv;
 	int x=0;
 	int res;
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_runq()\n"));
-		
+
 	ast_mutex_lock(&con->lock);
 	for(;;) {
-		if (!con->schedq)
+		if (!con->schedcnt)
 			break;
-		
+
 		/* schedule all events which are going to expire within 1ms.
 		 * We only care about millisecond accuracy anyway, so this will
 		 * help us get more than one event at one time if they are very
 		 * close together.
 		 */
-		tv = ast_tvadd(ast_tvnow(), ast_tv(0, 1000));
-		if (SOONER(con->schedq->when, tv)) {
-			current = con->schedq;
-			con->schedq = con->schedq->next;
-			con->schedcnt--;
+		now = ast_tvnow();
+		tv = ast_tvadd(now, ast_tv(0, 1000));
+		if (SOONER(con->heap[0]->when, tv)) {
+			current = con->heap[0];
+			id_unlink(con, current);
+			heap_remove(con, current);
+			con->stats.runs++;
+			sched_note_lateness(con, now, current->when);
 
 			/*
 			 * At this point, the schedule queue is still intact.  We
@@ -368,20 +584,19 @@ int ast_sched_runq(struct sched_context *con)
 			 * the schedule queue.  If that's what it wants to do, it 
 			 * should return 0.
 			 */
-			
+
 			ast_mutex_unlock(&con->lock);
 			res = current->callback(current->data);
 			ast_mutex_lock(&con->lock);
-			
+
 			if (res) {
 			 	/*
 				 * If they return non-zero, we should schedule them to be
 				 * run again.
 				 */
-				if (sched_settime(&current->when, current->variable? res : current->resched)) {
+				if (sched_settime(&current->when, current->variable? res : current->resched) || schedule(con, current)) {
 					sched_release(con, current);
-				} else
-					schedule(con, current);
+				}
 			} else {
 				/* No longer needed, so release it */
 			 	sched_release(con, current);
@@ -401,11 +616,7 @@ long ast_sched_when(struct sched_context *con,int id)
 	DEBUG(ast_log(LOG_DEBUG, "ast_sched_when()\n"));
 
 	ast_mutex_lock(&con->lock);
-	s=con->schedq;
-	while (s!=NULL) {
-		if (s->id==id) break;
-		s=s->next;
-	}
+	s = id_find(con, id);
 	secs=-1;
 	if (s!=NULL) {
 		struct timeval now = ast_tvnow();
@@ -414,3 +625,95 @@ long ast_sched_when(struct sched_context *con,int id)
 	ast_mutex_unlock(&con->lock);
 	return secs;
 }
+
+void ast_sched_get_stats(struct sched_context *con, struct ast_sched_stats *stats)
+{
+	ast_mutex_lock(&con->lock);
+	*stats = con->stats;
+	stats->depth = con->schedcnt;
+	ast_mutex_unlock(&con->lock);
+}
+
+static void sched_stats_add(struct ast_sched_stats *total, const struct ast_sched_stats *s)
+{
+	int x;
+
+	total->depth += s->depth;
+	total->peak += s->peak;
+	total->adds += s->adds;
+	total->dels += s->dels;
+	total->delmisses += s->delmisses;
+	total->runs += s->runs;
+	for (x = 0; x < SCHED_LATE_BUCKETS; x++)
+		total->late[x] += s->late[x];
+	if (s->maxlate > total->maxlate)
+		total->maxlate = s->maxlate;
+}
+
+static double sched_rate(unsigned long count, int secs)
+{
+	return secs > 0 ? (double) count / secs : (double) count;
+}
+
+static void sched_show_one(int fd, const char *name, const struct ast_sched_stats *s, int secs)
+{
+	ast_cli(fd, "%-20.20s %7d %7d %9.1f %9.1f %9.1f %7lu %7lu %7lu %7lu %7lu %7lu %7lu %6dms\n",
+		name, s->depth, s->peak,
+		sched_rate(s->adds, secs), sched_rate(s->dels, secs), sched_rate(s->runs, secs),
+		s->late[0], s->late[1], s->late[2], s->late[3], s->late[4], s->late[5], s->late[6],
+		s->maxlate);
+}
+
+static int sched_show_stats(int fd, int argc, char *argv[])
+{
+	struct sched_context *con;
+	struct ast_sched_stats s, anon;
+	struct timeval now = ast_tvnow();
+	char name[32];
+	int anoncnt = 0, anonsecs = 0, secs;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	memset(&anon, 0, sizeof(anon));
+	ast_cli(fd, "%-20.20s %7s %7s %9s %9s %9s %7s %7s %7s %7s %7s %7s %7s %8s\n",
+		"Context", "Depth", "Peak", "Adds/s", "Dels/s", "Runs/s",
+		"<1ms", "<5ms", "<10ms", "<50ms", "<100ms", "<500ms", ">=500ms", "MaxLate");
+	ast_mutex_lock(&contextlock);
+	for (con = contexts; con; con = con->next) {
+		ast_mutex_lock(&con->lock);
+		s = con->stats;
+		s.depth = con->schedcnt;
+		ast_copy_string(name, con->name, sizeof(name));
+		secs = now.tv_sec - con->created.tv_sec;
+		ast_mutex_unlock(&con->lock);
+		if (ast_strlen_zero(name)) {
+			/* Per-channel and other unnamed contexts are summarized on one line */
+			sched_stats_add(&anon, &s);
+			if (secs > anonsecs)
+				anonsecs = secs;
+			anoncnt++;
+		} else
+			sched_show_one(fd, name, &s, secs);
+	}
+	ast_mutex_unlock(&contextlock);
+	if (anoncnt) {
+		snprintf(name, sizeof(name), "(%d unnamed)", anoncnt);
+		sched_show_one(fd, name, &anon, anonsecs);
+	}
+	ast_cli(fd, "Rates are averaged over each context's lifetime; lateness is time from due to dispatch.\n");
+	return RESULT_SUCCESS;
+}
+
+static char show_sched_stats_usage[] =
+"Usage: show sched stats\n"
+"       Shows queue depth, add/delete/run rates and dispatch lateness\n"
+"       histograms for every scheduler context.\n";
+
+static struct ast_cli_entry cli_show_sched_stats =
+{ { "show", "sched", "stats", NULL }, sched_show_stats, "Show scheduler statistics", show_sched_stats_usage };
+
+void ast_sched_init(void)
+{
+	ast_cli_register(&cli_show_sched_stats);
+}
@@ -0,0 +1,438 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Bulk signed linear and G.711 sample processing
+ *
+ * Each operation has a plain C version, and on x86 an SSE2 and an AVX2
+ * version picked at run time by ast_simd_init().  The G.711 vector
+ * versions compute the codes rather than looking them up, so they must
+ * match what ast_ulaw_init() and ast_alaw_init() put in the tables bit
+ * for bit: the tables are indexed by the sample with its low 2 (u-law)
+ * or 3 (A-law) bits dropped, and hold the code for the highest sample
+ * with that index, which is why those bits are set before encoding.
+ * utils/simdbench checks every input against the tables.
+ */
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include "asterisk/simd.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+
+#if defined(__GNUC__) && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9))) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* As in ulaw.c */
+#define ULAW_BIAS	0x84
+#define ULAW_CLIP	32635
+
+#define AMI_MASK	0x55
+
+struct simd_ops {
+	void (*sum)(short *dst, const short *src, int samples);
+	void (*gain)(short *buf, int samples, short factor);
+	void (*attenuate)(short *buf, int samples, short divisor);
+	void (*ulaw_decode)(short *dst, const unsigned char *src, int samples);
+	void (*ulaw_encode)(unsigned char *dst, const short *src, int samples);
+	void (*alaw_decode)(short *dst, const unsigned char *src, int samples);
+	void (*alaw_encode)(unsigned char *dst, const short *src, int samples);
+};
+
+/* Plain C, the same as ast_slinear_saturated_add() and friends */
+
+static void sum_c(short *dst, const short *src, int samples)
+{
+	int x, res;
+
+	for (x = 0; x < samples; x++) {
+		res = (int) dst[x] + src[x];
+		if (res > 32767)
+			dst[x] = 32767;
+		else if (res < -32767)
+			dst[x] = -32767;
+		else
+			dst[x] = (short) res;
+	}
+}
+
+static void gain_c(short *buf, int samples, short factor)
+{
+	int x, res;
+
+	for (x = 0; x < samples; x++) {
+		res = (int) buf[x] * factor;
+		if (res > 32767)
+			buf[x] = 32767;
+		else if (res < -32767)
+			buf[x] = -32767;
+		else
+			buf[x] = (short) res;
+	}
+}
+
+static void attenuate_c(short *buf, int samples, short divisor)
+{
+	int x;
+
+	for (x = 0; x < samples; x++)
+		buf[x] /= divisor;
+}
+
+static void ulaw_decode_c(short *dst, const unsigned char *src, int samples)
+{
+	int x;
+
+	for (x = 0; x < samples; x++)
+		dst[x] = AST_MULAW(src[x]);
+}
+
+static void ulaw_encode_c(unsigned char *dst, const short *src, int samples)
+{
+	int x;
+
+	for (x = 0; x < samples; x++)
+		dst[x] = AST_LIN2MU(src[x]);
+}
+
+static void alaw_decode_c(short *dst, const unsigned char *src, int samples)
+{
+	int x;
+
+	for (x = 0; x < samples; x++)
+		dst[x] = AST_ALAW(src[x]);
+}
+
+static void alaw_encode_c(unsigned char *dst, const short *src, int samples)
+{
+	int x;
+
+	for (x = 0; x < samples; x++)
+		dst[x] = AST_LIN2A(src[x]);
+}
+
+static const struct simd_ops ops_c = {
+	sum_c, gain_c, attenuate_c,
+	ulaw_decode_c, ulaw_encode_c, alaw_decode_c, alaw_encode_c,
+};
+
+#ifdef HAVE_SIMD_X86
+
+/*
+ * Both vector versions are written the same way; V() names the intrinsic
+ * for the vector width in use and VEC is the vector type.  SSE2 has no
+ * per-lane shifts, so a shift by a different amount in each lane is done
+ * as three conditional shifts by 1, 2 and 4.
+ */
+
+#define SIMD_KERNELS(suffix, VEC, WIDTH, V, LOAD, STORE, LOADBYTES, STOREBYTES) \
+\
+static inline VEC suffix##_select(VEC mask, VEC a, VEC b) \
+{ \
+	return V(or_si)(V(and_si)(mask, a), V(andnot_si)(mask, b)); \
+} \
+\
+/* x << n in the lanes where bit of n is set, for n up to 7 */ \
+static inline VEC suffix##_shift_by(VEC x, VEC n) \
+{ \
+	const VEC one = V(set1_epi16)(1), two = V(set1_epi16)(2), four = V(set1_epi16)(4); \
+\
+	x = suffix##_select(V(cmpeq_epi16)(V(and_si)(n, one), one), V(slli_epi16)(x, 1), x); \
+	x = suffix##_select(V(cmpeq_epi16)(V(and_si)(n, two), two), V(slli_epi16)(x, 2), x); \
+	return suffix##_select(V(cmpeq_epi16)(V(and_si)(n, four), four), V(slli_epi16)(x, 4), x); \
+} \
+\
+/* Shift each (non-negative) lane of x right by the position of its \
+   highest set bit above bit 7, 0 to 7, which is returned in *shift */ \
+static inline VEC suffix##_normalize(VEC x, VEC *shift) \
+{ \
+	VEC m4, m2, m1; \
+\
+	m4 = V(cmpgt_epi16)(x, V(set1_epi16)(0x7ff)); \
+	x = suffix##_select(m4, V(srli_epi16)(x, 4), x); \
+	m2 = V(cmpgt_epi16)(x, V(set1_epi16)(0x1ff)); \
+	x = suffix##_select(m2, V(srli_epi16)(x, 2), x); \
+	m1 = V(cmpgt_epi16)(x, V(set1_epi16)(0xff)); \
+	x = suffix##_select(m1, V(srli_epi16)(x, 1), x); \
+	*shift = V(or_si)(V(and_si)(m4, V(set1_epi16)(4)), \
+		V(or_si)(V(and_si)(m2, V(set1_epi16)(2)), V(and_si)(m1, V(set1_epi16)(1)))); \
+	return x; \
+} \
+\
+static void sum_##suffix(short *dst, const short *src, int samples) \
+{ \
+	const VEC floor = V(set1_epi16)(-32767); \
+	int x; \
+\
+	for (x = 0; x + WIDTH <= samples; x += WIDTH) { \
+		VEC a = LOAD(dst + x), b = LOAD(src + x); \
+		STORE(dst + x, V(max_epi16)(V(adds_epi16)(a, b), floor)); \
+	} \
+	sum_c(dst + x, src + x, samples - x); \
+} \
+\
+static void gain_##suffix(short *buf, int samples, short factor) \
+{ \
+	const VEC floor = V(set1_epi16)(-32767), f = V(set1_epi16)(factor); \
+	int x; \
+\
+	for (x = 0; x + WIDTH <= samples; x += WIDTH) { \
+		VEC a = LOAD(buf + x); \
+		VEC lo = V(mullo_epi16)(a, f), hi = V(mulhi_epi16)(a, f); \
+		/* Full 32 bit products, packed back with saturation */ \
+		a = V(packs_epi32)(V(unpacklo_epi16)(lo, hi), V(unpackhi_epi16)(lo, hi)); \
+		STORE(buf + x, V(max_epi16)(a, floor)); \
+	} \
+	gain_c(buf + x, samples - x, factor); \
+} \
+\
+static void attenuate_##suffix(short *buf, int samples, short divisor) \
+{ \
+	int x; \
+\
+	/* Single precision division of 16 bit numbers, truncated, always \
+	   gives the same answer as integer division */ \
+	for (x = 0; x + WIDTH <= samples; x += WIDTH) { \
+		VEC a = LOAD(buf + x); \
+		VEC lo = V(srai_epi32)(V(unpacklo_epi16)(a, a), 16); \
+		VEC hi = V(srai_epi32)(V(unpackhi_epi16)(a, a), 16); \
+		lo = V(cvttps_epi32)(V(div_ps)(V(cvtepi32_ps)(lo), V(set1_ps)(divisor))); \
+		hi = V(cvttps_epi32)(V(div_ps)(V(cvtepi32_ps)(hi), V(set1_ps)(divisor))); \
+		STORE(buf + x, V(packs_epi32)(lo, hi)); \
+	} \
+	attenuate_c(buf + x, samples - x, divisor); \
+} \
+\
+static inline VEC suffix##_ulaw_dec(VEC u) \
+{ \
+	const VEC bias = V(set1_epi16)(ULAW_BIAS); \
+	VEC mu = V(xor_si)(u, V(set1_epi16)(0xff)); \
+	VEC e = V(and_si)(V(srli_epi16)(mu, 4), V(set1_epi16)(7)); \
+	VEC y = V(add_epi16)(V(slli_epi16)(V(and_si)(mu, V(set1_epi16)(0x0f)), 3), bias); \
+	VEC neg = V(cmpeq_epi16)(V(and_si)(mu, V(set1_epi16)(0x80)), V(set1_epi16)(0x80)); \
+\
+	y = V(sub_epi16)(suffix##_shift_by(y, e), bias); \
+	return V(sub_epi16)(V(xor_si)(y, neg), neg); \
+} \
+\
+static inline VEC suffix##_ulaw_enc(VEC s) \
+{ \
+	VEC x = V(or_si)(s, V(set1_epi16)(3)); \
+	VEC sign = V(srai_epi16)(x, 15); \
+	VEC mag = V(sub_epi16)(V(xor_si)(x, sign), sign); \
+	VEC exp, u; \
+\
+	mag = V(add_epi16)(V(min_epi16)(mag, V(set1_epi16)(ULAW_CLIP)), V(set1_epi16)(ULAW_BIAS)); \
+	/* The mantissa is the 4 bits below the highest set, mag >> (exponent + 3) */ \
+	mag = suffix##_normalize(mag, &exp); \
+	u = V(and_si)(V(srli_epi16)(mag, 3), V(set1_epi16)(0x0f)); \
+	u = V(or_si)(u, V(or_si)(V(slli_epi16)(exp, 4), V(and_si)(sign, V(set1_epi16)(0x80)))); \
+	u = V(xor_si)(u, V(set1_epi16)(0xff)); \
+	/* The CCITT zero trap */ \
+	return V(or_si)(u, V(and_si)(V(cmpeq_epi16)(u, V(setzero_si)()), V(set1_epi16)(0x02))); \
+} \
+\
+static inline VEC suffix##_alaw_dec(VEC a) \
+{ \
+	const VEC zero = V(setzero_si)(); \
+	VEC i, seg, nz, pos; \
+\
+	a = V(xor_si)(a, V(set1_epi16)(AMI_MASK)); \
+	i = V(slli_epi16)(V(and_si)(a, V(set1_epi16)(0x0f)), 4); \
+	seg = V(and_si)(V(srli_epi16)(a, 4), V(set1_epi16)(7)); \
+	nz = V(cmpgt_epi16)(seg, zero); \
+	/* (i + 0x100) << (seg - 1) for segments above 0 */ \
+	i = V(add_epi16)(i, V(and_si)(nz, V(set1_epi16)(0x100))); \
+	i = suffix##_shift_by(i, V(and_si)(V(sub_epi16)(seg, V(set1_epi16)(1)), nz)); \
+	pos = V(cmpeq_epi16)(V(and_si)(a, V(set1_epi16)(0x80)), zero); \
+	return V(sub_epi16)(V(xor_si)(i, pos), pos); \
+} \
+\
+static inline VEC suffix##_alaw_enc(VEC s) \
+{ \
+	VEC x = V(or_si)(s, V(set1_epi16)(7)); \
+	VEC sign = V(srai_epi16)(x, 15); \
+	VEC pcm = V(sub_epi16)(V(xor_si)(x, sign), sign); \
+	VEC seg, zero, a; \
+\
+	/* mantissa = pcm >> (segment ? segment + 3 : 4) */ \
+	pcm = suffix##_normalize(pcm, &seg); \
+	zero = V(cmpeq_epi16)(seg, V(setzero_si)()); \
+	a = suffix##_select(zero, V(srli_epi16)(pcm, 4), V(srli_epi16)(pcm, 3)); \
+	a = V(or_si)(V(slli_epi16)(seg, 4), V(and_si)(a, V(set1_epi16)(0x0f))); \
+	return V(xor_si)(a, V(xor_si)(V(set1_epi16)(AMI_MASK | 0x80), V(and_si)(sign, V(set1_epi16)(0x80)))); \
+} \
+\
+static void ulaw_decode_##suffix(short *dst, const unsigned char *src, int samples) \
+{ \
+	int x; \
+\
+	for (x = 0; x + WIDTH <= samples; x += WIDTH) \
+		STORE(dst + x, suffix##_ulaw_dec(LOADBYTES(src + x))); \
+	ulaw_decode_c(dst + x, src + x, samples - x); \
+} \
+\
+static void ulaw_encode_##suffix(unsigned char *dst, const short *src, int samples) \
+{ \
+	int x; \
+\
+	for (x = 0; x + 2 * WIDTH <= samples; x += 2 * WIDTH) \
+		STOREBYTES(dst + x, suffix##_ulaw_enc(LOAD(src + x)), suffix##_ulaw_enc(LOAD(src + x + WIDTH))); \
+	ulaw_encode_c(dst + x, src + x, samples - x); \
+} \
+\
+static void alaw_decode_##suffix(short *dst, const unsigned char *src, int samples) \
+{ \
+	int x; \
+\
+	for (x = 0; x + WIDTH <= samples; x += WIDTH) \
+		STORE(dst + x, suffix##_alaw_dec(LOADBYTES(src + x))); \
+	alaw_decode_c(dst + x, src + x, samples - x); \
+} \
+\
+static void alaw_encode_##suffix(unsigned char *dst, const short *src, int samples) \
+{ \
+	int x; \
+\
+	for (x = 0; x + 2 * WIDTH <= samples; x += 2 * WIDTH) \
+		STOREBYTES(dst + x, suffix##_alaw_enc(LOAD(src + x)), suffix##_alaw_enc(LOAD(src + x + WIDTH))); \
+	alaw_encode_c(dst + x, src + x, samples - x); \
+} \
+\
+static const struct simd_ops ops_##suffix = { \
+	sum_##suffix, gain_##suffix, attenuate_##suffix, \
+	ulaw_decode_##suffix, ulaw_encode_##suffix, alaw_decode_##suffix, alaw_encode_##suffix, \
+};
+
+/* SSE2 */
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+#define SSE2(op)		_mm_##op
+#define SSE2_LOAD(p)		_mm_loadu_si128((const __m128i *)(const void *)(p))
+#define SSE2_STORE(p, v)	_mm_storeu_si128((__m128i *)(void *)(p), (v))
+#define SSE2_LOADBYTES(p)	_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(const void *)(p)), _mm_setzero_si128())
+#define SSE2_STOREBYTES(p, a, b) _mm_storeu_si128((__m128i *)(void *)(p), _mm_packus_epi16((a), (b)))
+
+/* The SSE2 names of the bitwise operations lack a width */
+#define _mm_or_si	_mm_or_si128
+#define _mm_and_si	_mm_and_si128
+#define _mm_andnot_si	_mm_andnot_si128
+#define _mm_xor_si	_mm_xor_si128
+#define _mm_setzero_si	_mm_setzero_si128
+
+SIMD_KERNELS(sse2, __m128i, 8, SSE2, SSE2_LOAD, SSE2_STORE, SSE2_LOADBYTES, SSE2_STOREBYTES)
+
+#pragma GCC pop_options
+
+/* AVX2 */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define AVX2(op)		_mm256_##op
+#define AVX2_LOAD(p)		_mm256_loadu_si256((const __m256i *)(const void *)(p))
+#define AVX2_STORE(p, v)	_mm256_storeu_si256((__m256i *)(void *)(p), (v))
+#define AVX2_LOADBYTES(p)	_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(const void *)(p)))
+/* Packing works within each 128 bit half, so put the quarters back in order */
+#define AVX2_STOREBYTES(p, a, b) _mm256_storeu_si256((__m256i *)(void *)(p), _mm256_permute4x64_epi64(_mm256_packus_epi16((a), (b)), 0xd8))
+
+#define _mm256_or_si		_mm256_or_si256
+#define _mm256_and_si		_mm256_and_si256
+#define _mm256_andnot_si	_mm256_andnot_si256
+#define _mm256_xor_si		_mm256_xor_si256
+#define _mm256_setzero_si	_mm256_setzero_si256
+
+SIMD_KERNELS(avx2, __m256i, 16, AVX2, AVX2_LOAD, AVX2_STORE, AVX2_LOADBYTES, AVX2_STOREBYTES)
+
+#pragma GCC pop_options
+
+#endif /* HAVE_SIMD_X86 */
+
+static const struct simd_ops *ops = &ops_c;
+static enum ast_simd_level level = AST_SIMD_SCALAR;
+
+enum ast_simd_level ast_simd_init(enum ast_simd_level max)
+{
+	ops = &ops_c;
+	level = AST_SIMD_SCALAR;
+#ifdef HAVE_SIMD_X86
+	__builtin_cpu_init();
+	if ((max >= AST_SIMD_AVX2) && __builtin_cpu_supports("avx2")) {
+		ops = &ops_avx2;
+		level = AST_SIMD_AVX2;
+	} else if ((max >= AST_SIMD_SSE2) && __builtin_cpu_supports("sse2")) {
+		ops = &ops_sse2;
+		level = AST_SIMD_SSE2;
+	}
+#endif
+	return level;
+}
+
+enum ast_simd_level ast_simd_level(void)
+{
+	return level;
+}
+
+const char *ast_simd_level_name(enum ast_simd_level l)
+{
+	switch (l) {
+	case AST_SIMD_SSE2:
+		return "SSE2";
+	case AST_SIMD_AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
+
+void ast_slinear_sum(short *dst, const short *src, int samples)
+{
+	ops->sum(dst, src, samples);
+}
+
+void ast_slinear_gain(short *buf, int samples, short factor)
+{
+	ops->gain(buf, samples, factor);
+}
+
+void ast_slinear_attenuate(short *buf, int samples, short divisor)
+{
+	ops->attenuate(buf, samples, divisor);
+}
+
+void ast_ulaw_decode(short *dst, const unsigned char *src, int samples)
+{
+	ops->ulaw_decode(dst, src, samples);
+}
+
+void ast_ulaw_encode(unsigned char *dst, const short *src, int samples)
+{
+	ops->ulaw_encode(dst, src, samples);
+}
+
+void ast_alaw_decode(short *dst, const unsigned char *src, int samples)
+{
+	ops->alaw_decode(dst, src, samples);
+}
+
+void ast_alaw_encode(unsigned char *dst, const short *src, int samples)
+{
+	ops->alaw_encode(dst, src, samples);
+}
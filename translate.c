@@ -25,10 +25,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#ifndef DLFCNCOMPAT
+#include <dlfcn.h>
+#endif
 
 #include "asterisk.h"
 
@@ -43,9 +49,19 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 11120 $")
 #include "asterisk/sched.h"
 #include "asterisk/cli.h"
 #include "asterisk/term.h"
+#include "asterisk/utils.h"
+#include "asterisk/version.h"
 
 #define MAX_RECALC 200 /* max sample recalc */
 
+/*! Cost given to a translator until it has been measured */
+#define COST_GUESS 1000
+/*! Seconds to wait after a registration before measuring, so that
+   everything loaded together is measured together */
+#define CALIBRATE_DELAY 2
+
+extern const char *ast_build_date;
+
 /*! \note
    This could all be done more efficiently *IF* we chained packets together
    by default, but it would also complicate virtually every application. */
@@ -70,6 +86,23 @@ struct ast_frame_delivery {
 
 static struct ast_translator_dir tr_matrix[MAX_FORMAT][MAX_FORMAT];
 
+/*! \brief A measured cost, as kept in the cost cache */
+struct tr_cost {
+	char name[80];			/*!< Translator name */
+	int srcfmt;			/*!< Source format, as a power of two */
+	int dstfmt;			/*!< Destination format, as a power of two */
+	char stamp[64];			/*!< Which build of the module was measured */
+	int cost;			/*!< Milliseconds per second of audio */
+	struct tr_cost *next;
+};
+
+/* The cost cache and the calibration thread are protected by list_lock */
+static struct tr_cost *costs = NULL;
+static int costs_loaded = 0;
+static int costs_dirty = 0;
+static ast_cond_t calibrate_cond;
+static pthread_t calibrate_thread = AST_PTHREADT_NULL;
+
 struct ast_trans_pvt {
 	struct ast_translator *step;
 	struct ast_translator_pvt *state;
@@ -329,10 +362,234 @@ static void rebuild_matrix(int samples)
 }
 
 
+/*! \brief Add a newly registered translator to the matrix, without starting over.
+   Any path that gets cheaper is the old way to its source format, then the
+   new translator, then the old way on from its destination format. */
+static void matrix_add(struct ast_translator *t)
+{
+	int s = t->srcfmt, d = t->dstfmt;
+	int x, z;
+	unsigned int cost;
+
+	if (tr_matrix[s][d].step && (tr_matrix[s][d].cost <= t->cost))
+		return;
+	tr_matrix[s][d].step = t;
+	tr_matrix[s][d].cost = t->cost;
+	tr_matrix[s][d].multistep = 0;
+
+	for (x = 0; x < MAX_FORMAT; x++) {
+		if ((x != s) && !tr_matrix[x][s].step)
+			continue;
+		for (z = 0; z < MAX_FORMAT; z++) {
+			if ((x == z) || ((x == s) && (z == d)))
+				continue;
+			if ((z != d) && !tr_matrix[d][z].step)
+				continue;
+			cost = t->cost;
+			if (x != s)
+				cost += tr_matrix[x][s].cost;
+			if (z != d)
+				cost += tr_matrix[d][z].cost;
+			if (!tr_matrix[x][z].step || (cost < tr_matrix[x][z].cost)) {
+				tr_matrix[x][z].step = (x == s) ? t : tr_matrix[x][s].step;
+				tr_matrix[x][z].cost = cost;
+				tr_matrix[x][z].multistep = 1;
+				if (option_debug)
+					ast_log(LOG_DEBUG, "Discovered %d cost path from %s to %s, via %s\n", cost, ast_getformatname(1 << x), ast_getformatname(1 << z), t->name);
+			}
+		}
+	}
+}
+
+/*! \brief What the cost cache is only good for: this CPU and this build of the core */
+static void cost_cache_key(char *buf, size_t len)
+{
+	char line[256], *model = NULL, *c;
+	FILE *f;
+
+	if ((f = fopen("/proc/cpuinfo", "r"))) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!strncasecmp(line, "model name", 10) && (c = strchr(line, ':'))) {
+				model = ast_strip(c + 1);
+				break;
+			}
+		}
+		fclose(f);
+	}
+	snprintf(buf, len, "%s|%s|%s", model ? model : "unknown", ASTERISK_VERSION, ast_build_date);
+	/* Keep it to one line */
+	for (c = buf; *c; c++) {
+		if ((*c == '\n') || (*c == '\r'))
+			*c = ' ';
+	}
+}
+
+/*! \brief Identify the build of the module a translator lives in, by the
+   size and time of its shared object */
+static void translator_stamp(struct ast_translator *t, char *buf, size_t len)
+{
+#ifndef DLFCNCOMPAT
+	Dl_info info;
+	struct stat st;
+
+	if (dladdr((void *) t->newpvt, &info) && info.dli_fname && !stat(info.dli_fname, &st)) {
+		snprintf(buf, len, "%lx-%lx", (unsigned long) st.st_mtime, (unsigned long) st.st_size);
+		return;
+	}
+#endif
+	ast_copy_string(buf, "builtin", len);
+}
+
+static struct tr_cost *cost_find(struct ast_translator *t)
+{
+	struct tr_cost *c;
+
+	for (c = costs; c; c = c->next) {
+		if (!strcmp(c->name, t->name) && (c->srcfmt == t->srcfmt) && (c->dstfmt == t->dstfmt))
+			return c;
+	}
+	return NULL;
+}
+
+/*! \brief Read the cost cache, unless it was written for another CPU or build */
+static void cost_cache_load(void)
+{
+	char fn[AST_CONFIG_MAX_PATH + 32], key[256], line[512];
+	struct tr_cost tmp, *c;
+	FILE *f;
+	int lineno = 0;
+
+	costs_loaded = 1;
+	snprintf(fn, sizeof(fn), "%s/translator_costs", ast_config_AST_VAR_DIR);
+	if (!(f = fopen(fn, "r")))
+		return;
+	cost_cache_key(key, sizeof(key));
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == ';')
+			continue;
+		if (!strncmp(line, "key=", 4)) {
+			if (strcmp(ast_strip(line + 4), key)) {
+				if (option_debug)
+					ast_log(LOG_DEBUG, "Translator costs in '%s' were measured elsewhere, ignoring them\n", fn);
+				break;
+			}
+			continue;
+		}
+		memset(&tmp, 0, sizeof(tmp));
+		if (sscanf(line, "%79s %d %d %63s %d", tmp.name, &tmp.srcfmt, &tmp.dstfmt, tmp.stamp, &tmp.cost) != 5 ||
+		    (tmp.srcfmt < 0) || (tmp.srcfmt >= MAX_FORMAT) || (tmp.dstfmt < 0) || (tmp.dstfmt >= MAX_FORMAT) || (tmp.cost < 1)) {
+			ast_log(LOG_WARNING, "Ignoring bad line %d of '%s'\n", lineno, fn);
+			continue;
+		}
+		if (!(c = malloc(sizeof(*c)))) {
+			ast_log(LOG_WARNING, "Out of memory\n");
+			break;
+		}
+		*c = tmp;
+		c->next = costs;
+		costs = c;
+	}
+	fclose(f);
+}
+
+/*! \brief Write the cost cache back, if anything was measured since it was read */
+static void cost_cache_save(void)
+{
+	char fn[AST_CONFIG_MAX_PATH + 32], tmpfn[AST_CONFIG_MAX_PATH + 40], key[256];
+	struct tr_cost *c;
+	FILE *f;
+
+	if (!costs_dirty)
+		return;
+	snprintf(fn, sizeof(fn), "%s/translator_costs", ast_config_AST_VAR_DIR);
+	snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+	if (!(f = fopen(tmpfn, "w"))) {
+		ast_log(LOG_WARNING, "Unable to write translator costs to '%s': %s\n", tmpfn, strerror(errno));
+		return;
+	}
+	cost_cache_key(key, sizeof(key));
+	fprintf(f, ";\n; Codec translator costs, measured by Asterisk.  Delete this file or\n"
+		"; run 'show translation recalc' to measure them again.\n;\nkey=%s\n", key);
+	for (c = costs; c; c = c->next)
+		fprintf(f, "%s %d %d %s %d\n", c->name, c->srcfmt, c->dstfmt, c->stamp, c->cost);
+	if (fclose(f) || rename(tmpfn, fn)) {
+		ast_log(LOG_WARNING, "Unable to write translator costs to '%s': %s\n", fn, strerror(errno));
+		unlink(tmpfn);
+		return;
+	}
+	costs_dirty = 0;
+}
+
+/*! \brief Remember the measured cost of a translator in the cost cache */
+static void cost_store(struct ast_translator *t)
+{
+	struct tr_cost *c;
+
+	if (!(c = cost_find(t))) {
+		if (!(c = calloc(1, sizeof(*c)))) {
+			ast_log(LOG_WARNING, "Out of memory\n");
+			return;
+		}
+		ast_copy_string(c->name, t->name, sizeof(c->name));
+		c->srcfmt = t->srcfmt;
+		c->dstfmt = t->dstfmt;
+		c->next = costs;
+		costs = c;
+	}
+	translator_stamp(t, c->stamp, sizeof(c->stamp));
+	c->cost = t->cost;
+	costs_dirty = 1;
+}
+
+/*! \brief Measure, in the background, the translators the cost cache had
+   nothing for, then put them in the matrix at their real cost */
+static void *calibrate_run(void *data)
+{
+	struct ast_translator *t;
+	int count;
+
+	ast_mutex_lock(&list_lock);
+	for (;;) {
+		for (t = list; t && t->measured; t = t->next);
+		if (!t) {
+			ast_cond_wait(&calibrate_cond, &list_lock);
+			continue;
+		}
+		/* Let the rest of a module load register first */
+		ast_mutex_unlock(&list_lock);
+		sleep(CALIBRATE_DELAY);
+		ast_mutex_lock(&list_lock);
+
+		/* One translator at a time, so that nothing waits on the
+		   lock for long, and so an unregistered one is never used */
+		count = 0;
+		for (;;) {
+			for (t = list; t && t->measured; t = t->next);
+			if (!t)
+				break;
+			calc_cost(t, 1);
+			t->measured = 1;
+			cost_store(t);
+			count++;
+			ast_mutex_unlock(&list_lock);
+			usleep(1000);
+			ast_mutex_lock(&list_lock);
+		}
+		rebuild_matrix(0);
+		cost_cache_save();
+		if (option_verbose > 1)
+			ast_verbose(VERBOSE_PREFIX_2 "Measured the cost of %d codec translator%s\n", count, (count == 1) ? "" : "s");
+	}
+	return NULL;
+}
+
+
 /*! \brief CLI "show translation" command handler */
 static int show_translation(int fd, int argc, char *argv[])
 {
 #define SHOW_TRANS 11
+	struct ast_translator *t;
 	int x, y, z;
 	char line[80];
 	if (argc > 4) 
@@ -353,6 +610,11 @@ static int show_translation(int fd, int argc, char *argv[])
 		}
 		ast_cli(fd,"         Recalculating Codec Translation (number of sample seconds: %d)\n\n",z);
 		rebuild_matrix(z);
+		for (t = list; t; t = t->next) {
+			t->measured = 1;
+			cost_store(t);
+		}
+		cost_cache_save();
 	}
 
 	ast_cli(fd, "         Translation times between formats (in milliseconds)\n");
@@ -388,14 +650,16 @@ static char show_trans_usage[] =
 "       Displays known codec translators and the cost associated\n"
 "with each conversion.  If the argument 'recalc' is supplied along\n"
 "with optional number of seconds to test a new test will be performed\n"
-"as the chart is being displayed.\n";
+"as the chart is being displayed, and the results are saved in the\n"
+"translator cost cache for the next start.\n";
 
 static struct ast_cli_entry show_trans =
 { { "show", "translation", NULL }, show_translation, "Display translation matrix", show_trans_usage };
 
 int ast_register_translator(struct ast_translator *t)
 {
-	char tmp[80];
+	char tmp[80], stamp[64];
+	struct tr_cost *c;
 	t->srcfmt = powerof(t->srcfmt);
 	t->dstfmt = powerof(t->dstfmt);
 	if (t->srcfmt >= MAX_FORMAT) {
@@ -406,17 +670,48 @@ int ast_register_translator(struct ast_translator *t)
 		ast_log(LOG_WARNING, "Destination format %s is larger than MAX_FORMAT\n", ast_getformatname(t->dstfmt));
 		return -1;
 	}
-	calc_cost(t,1);
-	if (option_verbose > 1)
-		ast_verbose(VERBOSE_PREFIX_2 "Registered translator '%s' from format %s to %s, cost %d\n", term_color(tmp, t->name, COLOR_MAGENTA, COLOR_BLACK, sizeof(tmp)), ast_getformatname(1 << t->srcfmt), ast_getformatname(1 << t->dstfmt), t->cost);
 	ast_mutex_lock(&list_lock);
+	if (!costs_loaded)
+		cost_cache_load();
+	translator_stamp(t, stamp, sizeof(stamp));
+	c = cost_find(t);
+	if (c && !strcmp(c->stamp, stamp)) {
+		t->cost = c->cost;
+		t->measured = 1;
+	} else {
+		/* A different build of it is still a better guess than nothing */
+		t->cost = c ? c->cost : COST_GUESS;
+		t->measured = 0;
+	}
+	if (option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "Registered translator '%s' from format %s to %s, cost %d%s\n", term_color(tmp, t->name, COLOR_MAGENTA, COLOR_BLACK, sizeof(tmp)), ast_getformatname(1 << t->srcfmt), ast_getformatname(1 << t->dstfmt), t->cost, t->measured ? "" : " (to be measured)");
 	if (!added_cli) {
 		ast_cli_register(&show_trans);
 		added_cli++;
 	}
 	t->next = list;
 	list = t;
-	rebuild_matrix(0);
+	matrix_add(t);
+	if (!t->measured) {
+		if (calibrate_thread == AST_PTHREADT_NULL) {
+			pthread_attr_t attr;
+
+			ast_cond_init(&calibrate_cond, NULL);
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			if (ast_pthread_create(&calibrate_thread, &attr, calibrate_run, NULL)) {
+				ast_log(LOG_WARNING, "Unable to start translator calibration thread, measuring '%s' now\n", t->name);
+				calibrate_thread = AST_PTHREADT_NULL;
+				calc_cost(t, 1);
+				t->measured = 1;
+				cost_store(t);
+				cost_cache_save();
+				rebuild_matrix(0);
+			}
+			pthread_attr_destroy(&attr);
+		} else
+			ast_cond_signal(&calibrate_cond);
+	}
 	ast_mutex_unlock(&list_lock);
 	return 0;
 }
@@ -479,6 +479,11 @@ int ast_utils_init(void)
 #undef pthread_create /* For ast_pthread_create function only */
 #endif /* !__linux__ */
 
+size_t ast_thread_stacksize(void)
+{
+	return option_threadstacksize ? option_threadstacksize * 1024 : AST_STACKSIZE;
+}
+
 int ast_pthread_create_stack(pthread_t *thread, pthread_attr_t *attr, void *(*start_routine)(void *), void *data, size_t stacksize)
 {
 	pthread_attr_t lattr;
@@ -500,7 +505,7 @@ int ast_pthread_create_stack(pthread_t *thread, pthread_attr_t *attr, void *(*st
 #endif
 
 	if (!stacksize)
-		stacksize = AST_STACKSIZE;
+		stacksize = ast_thread_stacksize();
 	errno = pthread_attr_setstacksize(attr, stacksize);
 	if (errno)
 		ast_log(LOG_WARNING, "pthread_attr_setstacksize returned non-zero: %s\n", strerror(errno));
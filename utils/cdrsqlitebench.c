@@ -0,0 +1,174 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Measure how many CDRs per second cdr_sqlite.c stores in an SQLite
+ * database on the local disk, through its single record callback
+ * (sqlite_log(), one transaction per record) against its bulk callback
+ * (sqlite_log_batch(), one transaction per batch, used in CDR batch mode).
+ * The backend is built right into this program, so no database server,
+ * network or Asterisk core is involved, and the numbers show what batching
+ * saves on the database side alone.
+ *
+ * Usage: cdrsqlitebench [-n records] [-b records per batch] [-d database directory]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+
+/* The backend itself, with its sqlite_log() and sqlite_log_batch() */
+#include "../cdr/cdr_sqlite.c"
+
+static int records = 2000;
+static int batch = 100;
+
+/* load_module() opens cdr.db in here */
+char ast_config_AST_LOG_DIR[AST_CONFIG_MAX_PATH] = "/tmp";
+
+static double now(void)
+{
+	struct timeval t = ast_tvnow();
+
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+static void fill(struct ast_cdr *cdr, int x)
+{
+	memset(cdr, 0, sizeof(*cdr));
+	snprintf(cdr->clid, sizeof(cdr->clid), "\"Caller %d\" <%d>", x, 1000 + x % 9000);
+	snprintf(cdr->src, sizeof(cdr->src), "%d", 1000 + x % 9000);
+	ast_copy_string(cdr->dst, "5551234", sizeof(cdr->dst));
+	ast_copy_string(cdr->dcontext, "default", sizeof(cdr->dcontext));
+	snprintf(cdr->channel, sizeof(cdr->channel), "SIP/%d-%08x", 1000 + x % 9000, x);
+	snprintf(cdr->dstchannel, sizeof(cdr->dstchannel), "SIP/trunk-%08x", x);
+	ast_copy_string(cdr->lastapp, "Dial", sizeof(cdr->lastapp));
+	ast_copy_string(cdr->lastdata, "SIP/trunk/5551234|30|tT", sizeof(cdr->lastdata));
+	cdr->start.tv_sec = 1136214245 + x;
+	cdr->answer.tv_sec = cdr->start.tv_sec + 4;
+	cdr->end.tv_sec = cdr->start.tv_sec + 65;
+	cdr->duration = 65;
+	cdr->billsec = 61;
+	cdr->disposition = AST_CDR_ANSWERED;
+	cdr->amaflags = AST_CDR_DOCUMENTATION;
+}
+
+static void bench(struct ast_cdr *cdrs, struct ast_cdr **list, int size)
+{
+	double start, elapsed;
+	int x, y, res;
+
+	if (sqlite_exec(db, "DELETE FROM cdr;", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Unable to empty table 'cdr'\n");
+		exit(1);
+	}
+	start = now();
+	for (x = 0; x < records; x += size) {
+		if (size == 1) {
+			res = sqlite_log(&cdrs[x]);
+		} else {
+			for (y = 0; (y < size) && (x + y < records); y++)
+				list[y] = &cdrs[x + y];
+			res = sqlite_log_batch(list, y);
+		}
+		if (res) {
+			fprintf(stderr, "Record %d was not stored\n", x);
+			exit(1);
+		}
+	}
+	elapsed = now() - start;
+	printf("%4d record%s per transaction: %10.0f records/s (%d in %.2f s)\n",
+		size, (size == 1) ? " " : "s", records / elapsed, records, elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ast_cdr *cdrs, **list;
+	char fn[PATH_MAX];
+	int c, x;
+
+	while ((c = getopt(argc, argv, "n:b:d:")) != -1) {
+		switch (c) {
+		case 'n':
+			records = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'd':
+			ast_copy_string(ast_config_AST_LOG_DIR, optarg, sizeof(ast_config_AST_LOG_DIR));
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n records] [-b records per batch] [-d database directory]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if ((records < 1) || (batch < 1)) {
+		fprintf(stderr, "Need at least one record, and at least one record per batch\n");
+		exit(1);
+	}
+	cdrs = calloc(records, sizeof(*cdrs));
+	list = calloc(batch, sizeof(*list));
+	if (!cdrs || !list) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (x = 0; x < records; x++)
+		fill(&cdrs[x], x);
+
+	snprintf(fn, sizeof(fn), "%s/cdr.db", ast_config_AST_LOG_DIR);
+	unlink(fn);
+	if (load_module())
+		exit(1);
+
+	printf("%d records into %s\n", records, fn);
+	bench(cdrs, list, 1);
+	bench(cdrs, list, batch);
+
+	unload_module();
+	unlink(fn);
+	free(list);
+	free(cdrs);
+	return 0;
+}
+
+/* cdr_sqlite.c talks to the core through these */
+void ast_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+int ast_cdr_register_batch(char *bename, char *bedesc, ast_cdrbe be, ast_cdrbe_batch batchbe)
+{
+	return 0;
+}
+
+void ast_cdr_unregister(char *bename)
+{
+}
+
+void ast_register_file_version(const char *file, const char *version)
+{
+}
+
+void ast_unregister_file_version(const char *file)
+{
+}
@@ -0,0 +1,240 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Measure how many RTP sized packets per second one core can move
+ * over loopback UDP, one system call per packet (sendto/recvfrom, as
+ * rtp.c does by default) against batched sendmmsg/recvmmsg (batchio=yes
+ * in rtp.conf).
+ *
+ * Usage: rtpbench [-s sessions] [-k packets per batch] [-t seconds]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Same as RTP_BATCH in rtp.c */
+#define MAX_BATCH	16
+/* 20ms of G.711 plus the RTP header */
+#define PKT_SIZE	(12 + 160)
+
+struct session {
+	int tx;
+	int rx;
+	struct sockaddr_in addr;
+};
+
+static struct session *sessions;
+static int nsessions = 100;
+static int batch = 3;
+static double duration = 2.0;
+
+static double cputime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int udp_socket(struct sockaddr_in *sin)
+{
+	int s, bufsize = 1024 * 1024;
+	socklen_t len = sizeof(*sin);
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0) {
+		perror("socket");
+		exit(1);
+	}
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(s, (struct sockaddr *)sin, sizeof(*sin)) || getsockname(s, (struct sockaddr *)sin, &len)) {
+		perror("bind");
+		exit(1);
+	}
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+	return s;
+}
+
+static void setup(void)
+{
+	struct sockaddr_in sin;
+	int x;
+
+	sessions = calloc(nsessions, sizeof(*sessions));
+	if (!sessions) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (x = 0; x < nsessions; x++) {
+		sessions[x].tx = udp_socket(&sin);
+		sessions[x].rx = udp_socket(&sessions[x].addr);
+	}
+}
+
+/* Send one batch to every session, one packet per system call */
+static int send_single(unsigned char pkt[][PKT_SIZE])
+{
+	int x, y, sent = 0;
+
+	for (x = 0; x < nsessions; x++) {
+		for (y = 0; y < batch; y++) {
+			if (sendto(sessions[x].tx, pkt[y], PKT_SIZE, 0, (struct sockaddr *)&sessions[x].addr, sizeof(sessions[x].addr)) > 0)
+				sent++;
+		}
+	}
+	return sent;
+}
+
+/* Send one batch to every session with a sendmmsg() per session */
+static int send_batch(unsigned char pkt[][PKT_SIZE])
+{
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+	int x, y, res, sent = 0;
+
+	for (x = 0; x < nsessions; x++) {
+		for (y = 0; y < batch; y++) {
+			iov[y].iov_base = pkt[y];
+			iov[y].iov_len = PKT_SIZE;
+			memset(&msgs[y], 0, sizeof(msgs[y]));
+			msgs[y].msg_hdr.msg_iov = &iov[y];
+			msgs[y].msg_hdr.msg_iovlen = 1;
+			msgs[y].msg_hdr.msg_name = &sessions[x].addr;
+			msgs[y].msg_hdr.msg_namelen = sizeof(sessions[x].addr);
+		}
+		res = sendmmsg(sessions[x].tx, msgs, batch, 0);
+		if (res > 0)
+			sent += res;
+	}
+	return sent;
+}
+
+/* Empty every session's socket, one packet per system call */
+static int recv_single(void)
+{
+	unsigned char buf[2048];
+	struct sockaddr_in sin;
+	socklen_t len;
+	int x, got = 0;
+
+	for (x = 0; x < nsessions; x++) {
+		for (;;) {
+			len = sizeof(sin);
+			if (recvfrom(sessions[x].rx, buf, sizeof(buf), 0, (struct sockaddr *)&sin, &len) < 0)
+				break;
+			got++;
+		}
+	}
+	return got;
+}
+
+/* Empty every session's socket with recvmmsg() */
+static int recv_batch(void)
+{
+	static unsigned char buf[MAX_BATCH][2048];
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+	struct sockaddr_in sin[MAX_BATCH];
+	int x, y, res, got = 0;
+
+	for (x = 0; x < nsessions; x++) {
+		do {
+			for (y = 0; y < MAX_BATCH; y++) {
+				iov[y].iov_base = buf[y];
+				iov[y].iov_len = sizeof(buf[y]);
+				memset(&msgs[y], 0, sizeof(msgs[y]));
+				msgs[y].msg_hdr.msg_iov = &iov[y];
+				msgs[y].msg_hdr.msg_iovlen = 1;
+				msgs[y].msg_hdr.msg_name = &sin[y];
+				msgs[y].msg_hdr.msg_namelen = sizeof(sin[y]);
+			}
+			res = recvmmsg(sessions[x].rx, msgs, MAX_BATCH, MSG_DONTWAIT, NULL);
+			if (res > 0)
+				got += res;
+		} while (res == MAX_BATCH);
+	}
+	return got;
+}
+
+static void run(const char *name, int (*sendfn)(unsigned char pkt[][PKT_SIZE]), int (*recvfn)(void))
+{
+	unsigned char pkt[MAX_BATCH][PKT_SIZE];
+	double start, txcpu = 0, rxcpu = 0, end;
+	long long sent = 0, got = 0;
+	int x;
+
+	for (x = 0; x < MAX_BATCH; x++) {
+		memset(pkt[x], 0x7f, PKT_SIZE);
+		pkt[x][0] = 0x80;
+	}
+	end = cputime() + duration;
+	while (cputime() < end) {
+		start = cputime();
+		sent += sendfn(pkt);
+		txcpu += cputime() - start;
+		start = cputime();
+		got += recvfn();
+		rxcpu += cputime() - start;
+	}
+	printf("%-16s send %10.0f pkts/s   receive %10.0f pkts/s   (%lld sent, %lld received)\n", name,
+		txcpu > 0 ? sent / txcpu : 0.0, rxcpu > 0 ? got / rxcpu : 0.0, sent, got);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "s:k:t:")) != -1) {
+		switch (c) {
+		case 's':
+			nsessions = atoi(optarg);
+			break;
+		case 'k':
+			batch = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s sessions] [-k packets per batch] [-t seconds]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if ((nsessions < 1) || (batch < 1) || (batch > MAX_BATCH) || (duration <= 0)) {
+		fprintf(stderr, "Need at least one session, 1 to %d packets per batch and a positive duration\n", MAX_BATCH);
+		exit(1);
+	}
+	setup();
+	printf("%d sessions, %d packets of %d bytes per session per round, %.1f CPU seconds each\n",
+		nsessions, batch, PKT_SIZE, duration);
+	run("sendto/recvfrom", send_single, recv_single);
+	run("sendmmsg/recvmmsg", send_batch, recv_batch);
+	return 0;
+}
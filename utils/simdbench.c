@@ -0,0 +1,219 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Check the vector sample kernels of simd.c against the plain C
+ * ones, then measure how many samples per second each level converts,
+ * sums and scales.
+ *
+ * Usage: simdbench [-n samples per frame] [-t seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "asterisk.h"
+
+#include "asterisk/simd.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+
+#define MAX_FRAME	4096
+
+static int framesize = 160;
+static double duration = 0.5;
+
+static short lin[MAX_FRAME], lin2[MAX_FRAME], out[MAX_FRAME];
+static unsigned char law[MAX_FRAME], lawout[MAX_FRAME];
+
+static double cputime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Compare every possible input with the tables, and sums and gains of
+   random samples with the plain C versions */
+static int check(enum ast_simd_level level)
+{
+	static short all[65536], res[65536], ref[65536], other[65536];
+	static unsigned char codes[65536];
+	int x, y, errors = 0;
+
+	for (x = 0; x < 65536; x++) {
+		all[x] = x - 32768;
+		other[x] = rand();
+		codes[x] = x;
+	}
+
+	ast_simd_init(level);
+	ast_ulaw_encode(codes, all, 65536);
+	for (x = 0; x < 65536; x++)
+		if (codes[x] != AST_LIN2MU(all[x]))
+			errors++;
+	ast_alaw_encode(codes, all, 65536);
+	for (x = 0; x < 65536; x++)
+		if (codes[x] != AST_LIN2A(all[x]))
+			errors++;
+	for (x = 0; x < 65536; x++)
+		codes[x] = x;
+	/* Odd lengths and offsets to exercise the tails */
+	ast_ulaw_decode(res + 1, codes + 1, 65535);
+	for (x = 1; x < 65536; x++)
+		if (res[x] != AST_MULAW(codes[x]))
+			errors++;
+	ast_alaw_decode(res + 1, codes + 1, 65535);
+	for (x = 1; x < 65536; x++)
+		if (res[x] != AST_ALAW(codes[x]))
+			errors++;
+
+	for (y = 0; y < 3; y++) {
+		short factor = y ? rand() % (y == 1 ? 8 : 32767) + 1 : 1;
+
+		memcpy(res, all, sizeof(res));
+		memcpy(ref, all, sizeof(ref));
+		ast_simd_init(level);
+		ast_slinear_sum(res, other, 65535);
+		ast_simd_init(AST_SIMD_SCALAR);
+		ast_slinear_sum(ref, other, 65535);
+		if (memcmp(res, ref, sizeof(res)))
+			errors++;
+
+		ast_simd_init(level);
+		ast_slinear_gain(res, 65533, factor);
+		ast_simd_init(AST_SIMD_SCALAR);
+		ast_slinear_gain(ref, 65533, factor);
+		if (memcmp(res, ref, sizeof(res)))
+			errors++;
+
+		memcpy(res, all, sizeof(res));
+		memcpy(ref, all, sizeof(ref));
+		ast_simd_init(level);
+		ast_slinear_attenuate(res, 65531, factor);
+		ast_simd_init(AST_SIMD_SCALAR);
+		ast_slinear_attenuate(ref, 65531, factor);
+		if (memcmp(res, ref, sizeof(res)))
+			errors++;
+	}
+	return errors;
+}
+
+static void bench(enum ast_simd_level level)
+{
+	double start, end, t[7];
+	long long frames[7];
+	int x;
+
+	ast_simd_init(level);
+	for (x = 0; x < 7; x++) {
+		frames[x] = 0;
+		start = cputime();
+		end = start + duration;
+		do {
+			int y;
+
+			for (y = 0; y < 100; y++) {
+				switch (x) {
+				case 0:
+					ast_ulaw_decode(out, law, framesize);
+					break;
+				case 1:
+					ast_ulaw_encode(lawout, lin, framesize);
+					break;
+				case 2:
+					ast_alaw_decode(out, law, framesize);
+					break;
+				case 3:
+					ast_alaw_encode(lawout, lin, framesize);
+					break;
+				case 4:
+					ast_slinear_sum(out, lin2, framesize);
+					break;
+				case 5:
+					ast_slinear_gain(out, framesize, 2);
+					break;
+				case 6:
+					ast_slinear_attenuate(out, framesize, 2);
+					break;
+				}
+			}
+			frames[x] += 100;
+		} while (cputime() < end);
+		t[x] = cputime() - start;
+	}
+	printf("%-7s", ast_simd_level_name(level));
+	for (x = 0; x < 7; x++)
+		printf(" %9.0f", frames[x] * framesize / t[x] / 1e6);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	enum ast_simd_level best, level;
+	int c, x, errors;
+
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			framesize = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n samples per frame] [-t seconds]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if ((framesize < 1) || (framesize > MAX_FRAME) || (duration <= 0)) {
+		fprintf(stderr, "Need 1 to %d samples per frame and a positive duration\n", MAX_FRAME);
+		exit(1);
+	}
+	ast_ulaw_init();
+	ast_alaw_init();
+	for (x = 0; x < MAX_FRAME; x++) {
+		lin[x] = rand();
+		lin2[x] = rand();
+		law[x] = rand();
+	}
+
+	best = ast_simd_init(AST_SIMD_AVX2);
+	for (level = AST_SIMD_SSE2; level <= best; level++) {
+		errors = check(level);
+		printf("%s: %s\n", ast_simd_level_name(level), errors ? "MISMATCH" : "matches the tables and plain C");
+		if (errors)
+			return 1;
+	}
+
+	printf("\nMillions of samples per second, %d sample frames:\n", framesize);
+	printf("        ulaw-dec  ulaw-enc  alaw-dec  alaw-enc       sum      gain  atten\n");
+	for (level = AST_SIMD_SCALAR; level <= best; level++)
+		bench(level);
+	return 0;
+}
+
+/* simd.c, ulaw.c and alaw.c register their versions with the core */
+void ast_register_file_version(const char *file, const char *version)
+{
+}
+
+void ast_unregister_file_version(const char *file)
+{
+}